@@ -0,0 +1,50 @@
+#!/bin/sh
+
+# Runs every app in touchHLE_apps with --benchmark= and saves the results, one
+# JSON file per app, so that builds of touchHLE or options can be compared on
+# the same workload. Usage:
+#
+#     dev-scripts/benchmark.sh <results directory> [touchHLE options…]
+#
+# For example:
+#
+#     dev-scripts/benchmark.sh bench-baseline
+#     dev-scripts/benchmark.sh bench-perf --jit-profile=performance
+#
+# If an app has a file next to it with the same name plus
+# ".benchmark-input.txt", it is passed as --benchmark-input=.
+#
+# Environment variables:
+# - TOUCHHLE: touchHLE binary to use (default: target/release/touchHLE)
+# - BENCHMARK_FRAMES: number of frames to run each app for (default: 1800)
+
+set -eu
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 <results directory> [touchHLE options…]"
+    exit 1
+fi
+RESULTS_DIR="$1"
+shift
+TOUCHHLE="${TOUCHHLE:-target/release/touchHLE}"
+FRAMES="${BENCHMARK_FRAMES:-1800}"
+
+mkdir -p "$RESULTS_DIR"
+
+for APP in touchHLE_apps/*.ipa touchHLE_apps/*.app; do
+    [ -e "$APP" ] || continue
+    NAME=`basename "$APP"`
+    OUTPUT="$RESULTS_DIR/$NAME.json"
+    INPUT="$APP.benchmark-input.txt"
+    echo "Benchmarking $NAME…"
+    # --fps-limit=off comes first so that it can be overridden.
+    if [ -f "$INPUT" ]; then
+        "$TOUCHHLE" "$APP" --fps-limit=off "$@" --benchmark="$FRAMES" \
+            --benchmark-input="$INPUT" --benchmark-output="$OUTPUT" \
+            || echo "Benchmark of $NAME failed!"
+    else
+        "$TOUCHHLE" "$APP" --fps-limit=off "$@" --benchmark="$FRAMES" \
+            --benchmark-output="$OUTPUT" \
+            || echo "Benchmark of $NAME failed!"
+    fi
+done
@@ -108,6 +108,33 @@ impl GuestFunction {
 /// [GuestFunction::call_without_pushing_stack_frame].
 pub trait CallFromGuest {
     fn call_from_guest(&self, env: &mut Environment);
+
+    /// Whether this is a "leaf" function, see [LeafFunction].
+    fn is_leaf(&self) -> bool {
+        false
+    }
+}
+
+/// Wrapper that marks a host function as a "leaf" function: one that never
+/// calls guest code, never blocks or switches threads, never allocates guest
+/// memory, and doesn't touch the guest CPU state other than to read its
+/// arguments and write its return value. Setting `errno` is fine, since it is
+/// allocated when each thread is created.
+///
+/// Leaf functions can be called while the CPU is still executing, without the
+/// CPU emulation having to be paused and resumed, which is much cheaper. This
+/// matters for small functions called in tight loops, like those in
+/// `libc/math.rs`.
+///
+/// See also [crate::dyld::export_c_func_leaf].
+pub struct LeafFunction<F>(pub F);
+impl<F: CallFromGuest> CallFromGuest for LeafFunction<F> {
+    fn call_from_guest(&self, env: &mut Environment) {
+        self.0.call_from_guest(env)
+    }
+    fn is_leaf(&self) -> bool {
+        true
+    }
 }
 
 macro_rules! impl_CallFromGuest {
@@ -15,7 +15,7 @@
 mod ima4;
 mod symphonia_formats;
 
-pub use ima4::decode_ima4;
+pub use ima4::decode_ima4_buffer;
 pub use touchHLE_openal_soft_wrapper as openal;
 
 use crate::fs::{Fs, GuestPath};
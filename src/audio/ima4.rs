@@ -30,12 +30,117 @@ const STEP_SIZE_TABLE: &[u16] = &[
     10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
 ];
 
-/// Decode a 34-byte IMA4 ADPCM packet to 16-bit signed integer PCM.
+/// [STEP_SIZE_TABLE] combined with the difference calculation from the
+/// reference algorithm: the difference for each step index and magnitude (the
+/// low three bits of a nibble). Looking this up means decoding a sample only
+/// needs a few instructions, which matters because each sample depends on the
+/// previous one, so samples can't be decoded in parallel.
+const DIFFERENCE_TABLE: [[u16; 8]; 89] = {
+    let mut table = [[0; 8]; 89];
+    let mut index = 0;
+    while index < 89 {
+        let step_size = STEP_SIZE_TABLE[index];
+        let mut magnitude = 0;
+        while magnitude < 8 {
+            let mut difference = step_size >> 3;
+            if magnitude & 4 != 0 {
+                difference += step_size;
+            }
+            if magnitude & 2 != 0 {
+                difference += step_size >> 1;
+            }
+            if magnitude & 1 != 0 {
+                difference += step_size >> 2;
+            }
+            table[index][magnitude] = difference;
+            magnitude += 1;
+        }
+        index += 1;
+    }
+    table
+};
+
+/// The next step index for each step index and magnitude. The sign bit of a
+/// nibble doesn't affect this.
+const NEXT_INDEX_TABLE: [[u8; 8]; 89] = {
+    let mut table = [[0; 8]; 89];
+    let mut index = 0;
+    while index < 89 {
+        let mut magnitude = 0;
+        while magnitude < 8 {
+            let next = index as i32 + INDEX_TABLE[magnitude] as i32;
+            table[index][magnitude] = if next < 0 {
+                0
+            } else if next > 88 {
+                88
+            } else {
+                next as u8
+            };
+            magnitude += 1;
+        }
+        index += 1;
+    }
+    table
+};
+
+/// Decode a single packet to 16-bit signed little-endian samples, `stride`
+/// bytes apart in `out_pcm`.
+fn decode_packet(in_packet: &[u8; 34], out_pcm: &mut [u8], stride: usize) {
+    let header = u16::from_be_bytes(in_packet[0..2].try_into().unwrap());
+    let mut index = ((header & 0x7f) as usize).min(STEP_SIZE_TABLE.len() - 1);
+    let mut predicted_sample = i32::from(((header >> 7) << 7) as i16);
+
+    for (byte_idx, &byte) in in_packet[2..].iter().enumerate() {
+        for nibble_idx in 0..2 {
+            let nibble = (byte >> (nibble_idx * 4)) & 0xf;
+            let magnitude = (nibble & 7) as usize;
+
+            let difference = i32::from(DIFFERENCE_TABLE[index][magnitude]);
+            predicted_sample = if nibble & 8 != 0 {
+                predicted_sample - difference
+            } else {
+                predicted_sample + difference
+            }
+            .clamp(i16::MIN.into(), i16::MAX.into());
+            index = NEXT_INDEX_TABLE[index][magnitude].into();
+
+            let sample_idx = byte_idx * 2 + nibble_idx;
+            out_pcm[sample_idx * stride..][..2]
+                .copy_from_slice(&(predicted_sample as i16).to_le_bytes());
+        }
+    }
+}
+
+/// Decode a buffer of 34-byte IMA4 ADPCM packets to interleaved 16-bit signed
+/// little-endian PCM, as used by OpenAL. `out_pcm` must be 128 bytes per
+/// packet.
 ///
-/// The packet is always a single channel. For stereo, the packets alternate
+/// Each packet is always a single channel. For stereo, the packets alternate
 /// between left and right, such that the first packet is for the left channel
 /// and every other packet is for the right channel.
-pub fn decode_ima4(in_packet: &[u8; 34]) -> [i16; 64] {
+pub fn decode_ima4_buffer(in_packets: &[u8], channels: usize, out_pcm: &mut [u8]) {
+    assert!(channels == 1 || channels == 2);
+    assert!(in_packets.len() % (34 * channels) == 0);
+    assert!(out_pcm.len() == (in_packets.len() / 34) * 128);
+
+    for (in_packets, out_pcm) in in_packets
+        .chunks_exact(34 * channels)
+        .zip(out_pcm.chunks_exact_mut(128 * channels))
+    {
+        for (channel, in_packet) in in_packets.chunks_exact(34).enumerate() {
+            decode_packet(
+                in_packet.try_into().unwrap(),
+                &mut out_pcm[channel * 2..],
+                channels * 2,
+            );
+        }
+    }
+}
+
+/// Straightforward implementation of the reference algorithm, which the
+/// table-driven decoder is checked against.
+#[cfg(test)]
+fn decode_ima4_reference(in_packet: &[u8; 34]) -> [i16; 64] {
     let mut out_packet = [0i16; 64];
 
     let header = u16::from_be_bytes(in_packet[0..2].try_into().unwrap());
@@ -77,3 +182,39 @@ pub fn decode_ima4(in_packet: &[u8; 34]) -> [i16; 64] {
 
     out_packet
 }
+
+#[cfg(test)]
+#[test]
+fn test_decode_ima4_buffer() {
+    // Arbitrary but deterministic packets that cover all the step indices,
+    // nibble values and saturation in both directions.
+    let mut state = 0x1234_5678u32;
+    let mut in_packets = Vec::new();
+    for packet_idx in 0..200u16 {
+        let predictor = packet_idx.wrapping_mul(331) & 0x1ff;
+        let step_index = packet_idx % 100; // some are out of range
+        in_packets.extend_from_slice(&((predictor << 7) | step_index).to_be_bytes());
+        for _ in 0..32 {
+            state = state.wrapping_mul(1664525).wrapping_add(1013904223);
+            let byte = (state >> 24) as u8;
+            // Long runs of the same nibble push the sample to its limits.
+            in_packets.push(if packet_idx % 4 == 0 { 0x77 } else { byte });
+        }
+    }
+
+    for channels in [1, 2] {
+        let mut out_pcm = vec![0u8; (in_packets.len() / 34) * 128];
+        decode_ima4_buffer(&in_packets, channels, &mut out_pcm);
+
+        for (packet_idx, in_packet) in in_packets.chunks_exact(34).enumerate() {
+            let expected = decode_ima4_reference(in_packet.try_into().unwrap());
+            let frame_base = (packet_idx / channels) * 64 * channels;
+            let channel = packet_idx % channels;
+            for (sample_idx, &expected) in expected.iter().enumerate() {
+                let offset = (frame_base + sample_idx * channels + channel) * 2;
+                let actual = i16::from_le_bytes([out_pcm[offset], out_pcm[offset + 1]]);
+                assert_eq!(actual, expected);
+            }
+        }
+    }
+}
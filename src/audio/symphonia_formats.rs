@@ -52,7 +52,16 @@ pub fn decode_symphonia_to_pcm(file: Cursor<Vec<u8>>) -> Result<SymphoniaDecoded
         .make(&track.codec_params, &Default::default())
         .map_err(|_| ())?;
 
+    // Reserving the whole output up front avoids repeatedly reallocating and
+    // copying it while decoding, which is slow for long music tracks. The
+    // frame count comes from the file, so it's limited in case it's bogus.
     let mut out_pcm = Vec::<u8>::new();
+    if let (Some(frames), Some(channels)) =
+        (track.codec_params.n_frames, track.codec_params.channels)
+    {
+        let size = frames * channels.count() as u64 * 2;
+        out_pcm.reserve(size.min(1 << 30) as usize);
+    }
     let mut signal_spec: Option<SignalSpec> = None;
     {
         let mut tmp_raw_s16_buf: Option<RawSampleBuffer<i16>> = None;
@@ -91,16 +91,85 @@ extern "C" fn touchHLE_cpu_write_u64(mem: *mut touchHLE_Mem, addr: VAddr, value:
     touchHLE_cpu_write_impl(mem, addr, value)
 }
 
+/// Describe guest memory to the dynarmic wrapper so that its memory access
+/// callbacks can access it directly, only calling into Rust (e.g.
+/// [touchHLE_cpu_read_u32]) for accesses that are going to fail. This is what
+/// makes the callbacks cheap when direct memory access is disabled, or for
+/// pages that the page table doesn't cover (the null segment).
+///
+/// Safety: See [Mem::direct_memory_access_ptr]. The result must only be used
+/// for the duration of a single call into the CPU.
+unsafe fn mem_descriptor(mem: &mut Mem) -> touchHLE_DynarmicWrapper_MemDescriptor {
+    touchHLE_DynarmicWrapper_MemDescriptor {
+        base: mem.direct_memory_access_ptr().cast(),
+        size: 1 << 32,
+        null_segment_size: mem.null_segment_size(),
+    }
+}
+
+/// Amount of physical memory the host has, if known.
+#[cfg(unix)]
+fn host_physical_memory_size() -> Option<u64> {
+    let pages = unsafe { libc::sysconf(libc::_SC_PHYS_PAGES) };
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) };
+    if pages <= 0 || page_size <= 0 {
+        return None;
+    }
+    (pages as u64).checked_mul(page_size as u64)
+}
+#[cfg(not(unix))]
+fn host_physical_memory_size() -> Option<u64> {
+    None
+}
+
+/// Trade-off between debuggability and speed for the JIT. See [Cpu::new].
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum JitProfile {
+    /// Every guest memory access checks whether execution needs to halt, so a
+    /// memory error stops execution at the faulting instruction, with the
+    /// register state at that point. Only optimizations that preserve exact
+    /// Arm semantics are used. This is always used when debugging with GDB.
+    Debug,
+    /// Memory accesses don't check for halts, so execution only stops at the
+    /// end of the block containing a memory error. By then, later
+    /// instructions in the block have run using a dummy value, so the reported
+    /// register state is less useful, but well-behaved apps are unaffected.
+    /// Unsafe floating-point optimizations are also used: fused multiply-add
+    /// may be split into separately-rounded operations, and NaN results may
+    /// have different payloads than on real hardware. A larger code cache is
+    /// allowed by default to make full flushes rarer.
+    Performance,
+}
+impl JitProfile {
+    /// Convert from short name used for command-line arguments. Returns [Err]
+    /// if name is not recognized.
+    pub fn from_short_name(name: &str) -> Result<Self, ()> {
+        match name {
+            "debug" => Ok(Self::Debug),
+            "performance" => Ok(Self::Performance),
+            _ => Err(()),
+        }
+    }
+}
+
 pub struct Cpu {
     dynarmic_wrapper: *mut touchHLE_DynarmicWrapper,
     /// Copy of the direct memory access pointer used to check it has not
     /// changed. If this is null, direct memory access is not in use.
     direct_memory_access_ptr: *const std::ffi::c_void,
+    /// Context object that the current state is saved into when switching to
+    /// another context, see [Self::swap_context]. Null until first needed.
+    spare_context: *mut Dynarmic_A32_Context,
 }
 
 impl Drop for Cpu {
     fn drop(&mut self) {
-        unsafe { touchHLE_DynarmicWrapper_delete(self.dynarmic_wrapper) }
+        unsafe {
+            if !self.spare_context.is_null() {
+                touchHLE_DynarmicWrapper_Context_delete(self.spare_context)
+            }
+            touchHLE_DynarmicWrapper_delete(self.dynarmic_wrapper)
+        }
     }
 }
 
@@ -121,6 +190,20 @@ impl Drop for CpuContext {
     }
 }
 
+/// How the CPU should handle an SVC, see [crate::dyld::Dyld::classify_svc].
+/// Keep in sync with `SvcKind` in lib.cpp.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+#[repr(u8)]
+pub enum SvcKind {
+    /// Execution must halt so the SVC can be handled.
+    Ordinary = 1,
+    /// Leaf host function, see [crate::abi::LeafFunction].
+    Leaf = 2,
+    /// `objc_msgSend`, which can be handled without halting if the method is
+    /// in the method cache (see [crate::objc::ObjC::method_cache_ptr]).
+    ObjCMsgSend = 3,
+}
+
 /// Why CPU execution ended.
 #[derive(Debug)]
 pub enum CpuState {
@@ -159,11 +242,44 @@ impl Cpu {
     /// When this bit is set in CPSR, the CPU is in user mode.
     pub const CPSR_USER_MODE: u32 = 0x00000010;
 
+    /// How long a tick lasts when wall-clock preemption is used. This is
+    /// roughly how long an instruction takes on a typical host, so that
+    /// quanta have a similar length in either mode.
+    const WALL_CLOCK_NS_PER_TICK: u32 = 10;
+
     /// Construct a new CPU instance. If a mutable reference to a [Mem] instance
     /// is provided, direct memory access is enabled, and the CPU instance
     /// becomes bound to that [Mem] instance (subsequent calls must use the same
     /// one).
-    pub fn new(direct_memory_access: Option<&mut Mem>) -> Cpu {
+    ///
+    /// If `fastmem` is [true] and the [Mem] instance supports it (see
+    /// [Mem::supports_fastmem]), direct memory access will use dynarmic's
+    /// fastmem mode rather than a page table. If `track_code_writes` is also
+    /// [true], writes to code that has been compiled are detected, so it is
+    /// invalidated automatically (see [Self::invalidate_cache_range]). This
+    /// works by write-protecting the host pages holding that code. Writes to
+    /// them by Rust code are caught, but writes by the host OS, e.g. when
+    /// `read()` is given a pointer into guest memory, fail with `EFAULT`
+    /// instead, so this is off by default.
+    ///
+    /// See [JitProfile] for `jit_profile`.
+    ///
+    /// `code_cache_size` is the size of the JIT's code cache in bytes. If it's
+    /// [None], the size is chosen based on the host's memory, see
+    /// [Self::default_code_cache_size].
+    ///
+    /// If `wall_clock_preemption` is [true], the `ticks` passed to
+    /// [Self::run_or_step] are a wall-clock time limit rather than a count of
+    /// instructions. The JIT then doesn't need to count cycles in every block,
+    /// and a separate host thread interrupts execution when time runs out.
+    pub fn new(
+        direct_memory_access: Option<&mut Mem>,
+        fastmem: bool,
+        track_code_writes: bool,
+        jit_profile: JitProfile,
+        code_cache_size: Option<u32>,
+        wall_clock_preemption: bool,
+    ) -> Cpu {
         // Null page count is in pages rather than bytes. Mem ensures it is
         // page aligned.
         let null_page_count: usize = direct_memory_access
@@ -171,6 +287,19 @@ impl Cpu {
             .map_or(0, |mem| mem.null_segment_size() / 0x1000)
             .try_into()
             .unwrap();
+        let fastmem = fastmem
+            && direct_memory_access
+                .as_ref()
+                .is_some_and(|mem| mem.supports_fastmem());
+        let code_cache_size =
+            code_cache_size.unwrap_or_else(|| Self::default_code_cache_size(jit_profile));
+        log_dbg!(
+            "CPU fastmem mode: {}, JIT profile: {:?}, code cache size: {}MiB, wall-clock preemption: {}",
+            fastmem,
+            jit_profile,
+            code_cache_size / (1024 * 1024),
+            wall_clock_preemption
+        );
         // Safety: the direct memory access pointer will be retained directly by
         // the dynarmic wrapper and indirectly by cached JIT code, so we must
         // ensure we only execute the CPU while holding a &mut on the Mem object
@@ -179,14 +308,47 @@ impl Cpu {
             .map_or(std::ptr::null_mut(), |mem| unsafe {
                 mem.direct_memory_access_ptr()
             });
-        let dynarmic_wrapper =
-            unsafe { touchHLE_DynarmicWrapper_new(direct_memory_access_ptr, null_page_count) };
+        let config = touchHLE_DynarmicWrapper_Config {
+            direct_memory_access_ptr,
+            null_page_count,
+            fastmem,
+            track_code_writes: fastmem && track_code_writes,
+            check_halt_on_memory_access: jit_profile == JitProfile::Debug,
+            unsafe_optimizations: jit_profile == JitProfile::Performance,
+            block_linking: true,
+            fast_dispatch: true,
+            interpreter: true,
+            code_cache_size,
+            wall_clock_ns_per_tick: if wall_clock_preemption {
+                Self::WALL_CLOCK_NS_PER_TICK
+            } else {
+                0
+            },
+        };
+        let dynarmic_wrapper = unsafe { touchHLE_DynarmicWrapper_new(&config) };
         Cpu {
             dynarmic_wrapper,
             direct_memory_access_ptr,
+            spare_context: std::ptr::null_mut(),
         }
     }
 
+    /// Code cache size to use if none was specified: 1/32 of the host's
+    /// physical memory, within limits. dynarmic flushes the whole cache when
+    /// it fills up, so a small cache makes for hitches when an app has a lot
+    /// of hot code, but the cache is also a significant share of the memory
+    /// on low-end devices.
+    pub fn default_code_cache_size(jit_profile: JitProfile) -> u32 {
+        const MIB: u64 = 1024 * 1024;
+        let max = match jit_profile {
+            JitProfile::Debug => 128 * MIB,
+            JitProfile::Performance => 256 * MIB,
+        };
+        let size = host_physical_memory_size().map_or(max, |size| (size / 32).clamp(32 * MIB, max));
+        // Round down to a whole number of MiB.
+        (size - size % MIB).try_into().unwrap()
+    }
+
     pub fn regs(&self) -> &[u32; 16] {
         unsafe {
             let ptr = touchHLE_DynarmicWrapper_regs_const(self.dynarmic_wrapper);
@@ -231,7 +393,20 @@ impl Cpu {
     /// Swap the current state of the CPU (registers etc) with the state stored
     /// in the context object.
     pub fn swap_context(&mut self, context: &mut CpuContext) {
-        unsafe { touchHLE_DynarmicWrapper_swap_context(self.dynarmic_wrapper, context.context) }
+        // Rather than using a temporary, the current state is saved into a
+        // spare context, which then takes the place of the loaded one, whose
+        // old contents become the next spare.
+        unsafe {
+            if self.spare_context.is_null() {
+                self.spare_context = touchHLE_DynarmicWrapper_Context_new();
+            }
+            touchHLE_DynarmicWrapper_switch_context(
+                self.dynarmic_wrapper,
+                self.spare_context,
+                context.context,
+            );
+        }
+        std::mem::swap(&mut self.spare_context, &mut context.context);
     }
 
     /// Get PC with the Thumb bit appropriately set.
@@ -266,36 +441,134 @@ impl Cpu {
     /// Clear dynarmic's instruction cache for some range of addresses.
     /// This is of interest to the dynamic linker, which will sometimes rewrite
     /// code.
+    ///
+    /// This takes effect before the CPU next runs, together with any other
+    /// invalidations since, so it's cheap to call for many small ranges. When
+    /// code writes are tracked (see [Self::new]), writes to compiled code are
+    /// detected and invalidated without this, but it is still needed
+    /// otherwise.
     pub fn invalidate_cache_range(&mut self, base: VAddr, size: GuestUSize) {
         unsafe {
             touchHLE_DynarmicWrapper_invalidate_cache_range(self.dynarmic_wrapper, base, size)
         }
     }
 
+    /// Provide the method cache table (see
+    /// [crate::objc::ObjC::method_cache_ptr]). It must remain valid for as long
+    /// as the CPU is executed.
+    pub fn set_method_cache(&mut self, method_cache: *const std::ffi::c_void) {
+        unsafe { touchHLE_DynarmicWrapper_set_method_cache(self.dynarmic_wrapper, method_cache) }
+    }
+
+    /// Enable or disable recording of the entry points of blocks compiled by
+    /// the JIT (see [Self::recorded_blocks]).
+    pub fn set_block_recording(&mut self, enabled: bool) {
+        unsafe { touchHLE_DynarmicWrapper_set_block_recording(self.dynarmic_wrapper, enabled) }
+    }
+
+    /// Entry points of the blocks compiled while recording was enabled, in the
+    /// order they were compiled, each with the Thumb bit set appropriately.
+    /// There are no duplicates.
+    pub fn recorded_blocks(&self) -> &[u32] {
+        unsafe {
+            let mut count = 0;
+            let ptr = touchHLE_DynarmicWrapper_recorded_blocks(self.dynarmic_wrapper, &mut count);
+            if count == 0 {
+                return &[];
+            }
+            std::slice::from_raw_parts(ptr, count)
+        }
+    }
+
+    /// Counters kept by the CPU, and the number of times each SVC was executed,
+    /// indexed by SVC number.
+    pub fn stats(&self) -> (&touchHLE_DynarmicWrapper_Stats, &[u64]) {
+        unsafe {
+            let mut svc_calls = std::ptr::null();
+            let mut count = 0;
+            let stats =
+                touchHLE_DynarmicWrapper_stats(self.dynarmic_wrapper, &mut svc_calls, &mut count);
+            let svc_calls = if count == 0 {
+                &[]
+            } else {
+                std::slice::from_raw_parts(svc_calls, count)
+            };
+            (&*stats, svc_calls)
+        }
+    }
+
+    /// Compile the blocks at some entry points (with the Thumb bit set
+    /// appropriately) without executing them, so that the first execution of
+    /// these blocks is faster. The CPU state is unaffected.
+    pub fn precompile_blocks(&mut self, mem: &mut Mem, entries: &[u32]) {
+        // See ::new() for why this is done.
+        if !self.direct_memory_access_ptr.is_null() {
+            assert!(self.direct_memory_access_ptr == unsafe { mem.direct_memory_access_ptr() });
+        }
+
+        unsafe {
+            let mem_descriptor = mem_descriptor(mem);
+            touchHLE_DynarmicWrapper_precompile(
+                self.dynarmic_wrapper,
+                mem as *mut Mem as *mut touchHLE_Mem,
+                &mem_descriptor,
+                entries.as_ptr(),
+                entries.len(),
+            )
+        }
+    }
+
     /// Start CPU execution.
     ///
     /// If `ticks` is [Some], it is used as an abstract time limit. The value
     /// will be reduced proportionately with the amount of ticks expended.
+    /// See [Self::new] for what a tick is.
     ///
     /// If `ticks` is [None], the CPU executes only a single instruction. This
     /// is also known as "stepping".
     ///
     /// This will return either because the CPU ran out of time, or because
     /// something else happened which requires attention from the host.
+    ///
+    /// If `svc_context` is not null, the CPU tries to handle some SVCs without
+    /// halting: it classifies them with `touchHLE_cpu_classify_svc` and then
+    /// calls leaf functions with `touchHLE_cpu_call_leaf_svc`, passing that
+    /// pointer to both, and looks up `objc_msgSend` calls in the method cache
+    /// (see [Self::set_method_cache]). Stepping never does this.
+    ///
+    /// This takes raw pointers rather than references so that the leaf
+    /// function callback can access the CPU and memory (through
+    /// `svc_context`) without aliasing a reference that is live for the whole
+    /// call.
+    ///
+    /// Safety: `cpu` and `mem` must be valid, and if `svc_context` is not
+    /// null, no references to the CPU, memory or whatever `svc_context` points
+    /// to may be live for the duration of the call.
     #[must_use]
-    pub fn run_or_step(&mut self, mem: &mut Mem, ticks: Option<&mut u64>) -> CpuState {
-        // See ::new() for why this is done.
-        if !self.direct_memory_access_ptr.is_null() {
-            assert!(self.direct_memory_access_ptr == unsafe { mem.direct_memory_access_ptr() });
+    pub unsafe fn run_or_step(
+        cpu: *mut Cpu,
+        mem: *mut Mem,
+        ticks: Option<&mut u64>,
+        svc_context: *mut std::ffi::c_void,
+    ) -> CpuState {
+        // Copy the fields out so that no reference to the CPU outlives this.
+        let dynarmic_wrapper = (*cpu).dynarmic_wrapper;
+        let direct_memory_access_ptr = (*cpu).direct_memory_access_ptr;
+
+        // See ::new() for why this is done. The references created here and
+        // for the memory descriptor end before execution starts.
+        if !direct_memory_access_ptr.is_null() {
+            assert!(direct_memory_access_ptr == (*mem).direct_memory_access_ptr());
         }
+        let mem_descriptor = mem_descriptor(&mut *mem);
 
-        let res = unsafe {
-            touchHLE_DynarmicWrapper_run_or_step(
-                self.dynarmic_wrapper,
-                mem as *mut Mem as *mut touchHLE_Mem,
-                ticks,
-            )
-        };
+        let res = touchHLE_DynarmicWrapper_run_or_step(
+            dynarmic_wrapper,
+            mem.cast::<touchHLE_Mem>(),
+            &mem_descriptor,
+            ticks,
+            svc_context,
+        );
         match res {
             -1 => CpuState::Normal,
             -2 => CpuState::Error(CpuError::MemoryError),
@@ -0,0 +1,412 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Benchmarks for the dynarmic wrapper, using small synthetic guest programs.
+//! Run with `cargo bench -p touchHLE_dynarmic_wrapper`, optionally followed by
+//! `-- <filter>` to only run benchmarks whose names contain `<filter>`.
+//!
+//! Each result is printed to stdout as a single line of JSON, so the output can
+//! be collected and compared by other tools.
+//!
+//! The wrapper calls back into the main crate for memory accesses and SVCs, so
+//! this file provides its own versions of those functions, backed by a plain
+//! buffer rather than touchHLE's `Mem`.
+
+use std::ffi::c_void;
+use std::hint::black_box;
+use std::ops::Range;
+use std::time::{Duration, Instant};
+use touchHLE_dynarmic_wrapper::*;
+
+/// Minimum time to spend measuring each benchmark, after warming up.
+const MEASURE_TIME: Duration = Duration::from_millis(500);
+
+/// Size of the guest address space that is backed by memory. Only the start of
+/// it is used, but it needs to be big enough to be realistic for the
+/// page-table-based accesses.
+const MEM_SIZE: usize = 16 * 1024 * 1024;
+/// Accesses below this address fail, as with touchHLE's null segment.
+const NULL_SEGMENT_SIZE: u32 = 0x1000;
+const CODE_ADDR: u32 = 0x10000;
+const DATA_ADDR: u32 = 0x20000;
+
+const CPSR_THUMB: u32 = 0x00000020;
+const CPSR_USER_MODE: u32 = 0x00000010;
+
+// Keep in sync with SvcKind in src/cpu.rs.
+const SVC_KIND_ORDINARY: u8 = 1;
+const SVC_KIND_LEAF: u8 = 2;
+/// SVC that marks the end of a synthetic program.
+const SVC_EXIT: u32 = 0;
+/// SVC that is classified as a leaf function and handled without halting.
+const SVC_LEAF: u32 = 1;
+
+struct Memory {
+    bytes: Vec<u8>,
+}
+
+impl Memory {
+    fn range(&self, addr: u32, size: usize) -> Option<Range<usize>> {
+        let start = addr as usize;
+        if addr < NULL_SEGMENT_SIZE || start + size > self.bytes.len() {
+            None
+        } else {
+            Some(start..start + size)
+        }
+    }
+}
+
+macro_rules! mem_callbacks {
+    ($read:ident, $write:ident, $type:ty) => {
+        #[no_mangle]
+        extern "C" fn $read(mem: *mut touchHLE_Mem, addr: u32, error: *mut bool) -> $type {
+            let mem = unsafe { &*(mem as *const Memory) };
+            let range = mem.range(addr, std::mem::size_of::<$type>());
+            unsafe { error.write(range.is_none()) };
+            range.map_or(0, |range| {
+                <$type>::from_le_bytes(mem.bytes[range].try_into().unwrap())
+            })
+        }
+        #[no_mangle]
+        extern "C" fn $write(mem: *mut touchHLE_Mem, addr: u32, value: $type) -> bool {
+            let mem = unsafe { &mut *(mem as *mut Memory) };
+            let Some(range) = mem.range(addr, std::mem::size_of::<$type>()) else {
+                return false;
+            };
+            mem.bytes[range].copy_from_slice(&value.to_le_bytes());
+            true
+        }
+    };
+}
+mem_callbacks!(touchHLE_cpu_read_u8, touchHLE_cpu_write_u8, u8);
+mem_callbacks!(touchHLE_cpu_read_u16, touchHLE_cpu_write_u16, u16);
+mem_callbacks!(touchHLE_cpu_read_u32, touchHLE_cpu_write_u32, u32);
+mem_callbacks!(touchHLE_cpu_read_u64, touchHLE_cpu_write_u64, u64);
+
+#[no_mangle]
+extern "C" fn touchHLE_cpu_classify_svc(_svc_context: *mut c_void, svc: u32) -> u8 {
+    if svc == SVC_LEAF {
+        SVC_KIND_LEAF
+    } else {
+        SVC_KIND_ORDINARY
+    }
+}
+#[no_mangle]
+extern "C" fn touchHLE_cpu_call_leaf_svc(svc_context: *mut c_void, _svc: u32) -> bool {
+    // The context is a counter of leaf calls.
+    unsafe { *(svc_context as *mut u64) += 1 };
+    true
+}
+
+/// How the JIT accesses guest memory.
+#[derive(Copy, Clone)]
+enum MemAccess {
+    /// Using a page table, like touchHLE does with direct memory access.
+    PageTable,
+    /// Using memory callbacks, which access the buffer directly without
+    /// calling into Rust.
+    Callbacks,
+    /// Using memory callbacks that always call into Rust, which is what
+    /// happens for accesses that are going to fail.
+    RustCallbacks,
+}
+
+/// A CPU and its guest memory, with a program loaded at [CODE_ADDR].
+struct Guest {
+    cpu: *mut touchHLE_DynarmicWrapper,
+    memory: Box<Memory>,
+    access: MemAccess,
+    thumb: bool,
+}
+
+impl Guest {
+    fn new(access: MemAccess, thumb: bool, code: &[u8]) -> Guest {
+        let mut memory = Box::new(Memory {
+            bytes: vec![0u8; MEM_SIZE],
+        });
+        let code_start = CODE_ADDR as usize;
+        memory.bytes[code_start..code_start + code.len()].copy_from_slice(code);
+
+        let direct_memory_access_ptr = match access {
+            MemAccess::PageTable => memory.bytes.as_mut_ptr().cast(),
+            MemAccess::Callbacks | MemAccess::RustCallbacks => std::ptr::null_mut(),
+        };
+        // Similar to JitProfile::Performance in src/cpu.rs.
+        let config = touchHLE_DynarmicWrapper_Config {
+            direct_memory_access_ptr,
+            null_page_count: (NULL_SEGMENT_SIZE / 0x1000) as usize,
+            fastmem: false,
+            track_code_writes: false,
+            check_halt_on_memory_access: false,
+            unsafe_optimizations: true,
+            block_linking: true,
+            fast_dispatch: true,
+            interpreter: true,
+            code_cache_size: 0,
+            wall_clock_ns_per_tick: 0,
+        };
+        let cpu = unsafe { touchHLE_DynarmicWrapper_new(&config) };
+        let mut guest = Guest {
+            cpu,
+            memory,
+            access,
+            thumb,
+        };
+        guest.reset(0);
+        guest
+    }
+
+    /// Jump to the start of the program, with `r0` set to `r0`.
+    fn reset(&mut self, r0: u32) {
+        unsafe {
+            let regs = touchHLE_DynarmicWrapper_regs_mut(self.cpu);
+            *regs = r0;
+            *regs.add(1) = DATA_ADDR;
+            *regs.add(15) = CODE_ADDR;
+            let thumb = if self.thumb { CPSR_THUMB } else { 0 };
+            touchHLE_DynarmicWrapper_set_cpsr(self.cpu, CPSR_USER_MODE | thumb);
+        }
+    }
+
+    /// Run until the next SVC that halts execution, and return its number.
+    fn run(&mut self, svc_context: *mut c_void) -> i32 {
+        let descriptor = touchHLE_DynarmicWrapper_MemDescriptor {
+            base: self.memory.bytes.as_mut_ptr(),
+            size: MEM_SIZE as u64,
+            null_segment_size: NULL_SEGMENT_SIZE,
+        };
+        let descriptor_ptr: *const _ = match self.access {
+            MemAccess::PageTable | MemAccess::Callbacks => &descriptor,
+            MemAccess::RustCallbacks => std::ptr::null(),
+        };
+        let mut ticks = u64::MAX / 2;
+        let mem: *mut Memory = &mut *self.memory;
+        let res = unsafe {
+            touchHLE_DynarmicWrapper_run_or_step(
+                self.cpu,
+                mem.cast(),
+                descriptor_ptr,
+                Some(&mut ticks),
+                svc_context,
+            )
+        };
+        assert!(res >= 0, "Unexpected result from run_or_step: {}", res);
+        res
+    }
+
+    /// Run the program from the start until it exits.
+    fn run_program(&mut self, r0: u32, svc_context: *mut c_void) {
+        self.reset(r0);
+        assert_eq!(self.run(svc_context), SVC_EXIT as i32);
+    }
+}
+
+impl Drop for Guest {
+    fn drop(&mut self) {
+        unsafe { touchHLE_DynarmicWrapper_delete(self.cpu) }
+    }
+}
+
+fn arm(instructions: &[u32]) -> Vec<u8> {
+    instructions.iter().flat_map(|i| i.to_le_bytes()).collect()
+}
+fn thumb(instructions: &[u16]) -> Vec<u8> {
+    instructions.iter().flat_map(|i| i.to_le_bytes()).collect()
+}
+
+// ARM encodings
+const ARM_ADD_R1_1: u32 = 0xE2811001; // add r1, r1, #1
+const ARM_SUBS_R0_1: u32 = 0xE2500001; // subs r0, r0, #1
+const ARM_LDR_R2_R1: u32 = 0xE5912000; // ldr r2, [r1]
+const ARM_ADD_R2_1: u32 = 0xE2822001; // add r2, r2, #1
+const ARM_STR_R2_R1: u32 = 0xE5812000; // str r2, [r1]
+const ARM_SVC: u32 = 0xEF000000; // svc #0
+/// `bne` to the instruction `distance` instructions before this one.
+fn arm_bne_back(distance: u32) -> u32 {
+    0x1A000000 | ((!(distance + 2) + 1) & 0x00FFFFFF)
+}
+/// `b` to the instruction `distance` instructions before this one.
+fn arm_b_back(distance: u32) -> u32 {
+    0xEA000000 | ((!(distance + 2) + 1) & 0x00FFFFFF)
+}
+
+// Thumb encodings
+const THUMB_ADDS_R1_1: u16 = 0x3101; // adds r1, #1
+const THUMB_SUBS_R0_1: u16 = 0x3801; // subs r0, #1
+const THUMB_SVC: u16 = 0xDF00; // svc #0
+/// `bne` to the instruction `distance` instructions before this one.
+fn thumb_bne_back(distance: u16) -> u16 {
+    0xD100 | ((!(distance + 2) + 1) & 0x00FF)
+}
+
+/// Number of iterations of a loop per run of the program.
+const LOOP_ITERATIONS: u32 = 100_000;
+/// Number of `add`s in the body of the loops for measuring throughput.
+const LOOP_BODY_SIZE: usize = 8;
+
+/// A loop of `add`s, counting down from `r0`, then an exit.
+fn arm_loop(body_size: usize) -> Vec<u8> {
+    let mut code = vec![ARM_ADD_R1_1; body_size];
+    code.push(ARM_SUBS_R0_1);
+    code.push(arm_bne_back(body_size as u32 + 1));
+    code.push(ARM_SVC | SVC_EXIT);
+    arm(&code)
+}
+fn thumb_loop(body_size: usize) -> Vec<u8> {
+    let mut code = vec![THUMB_ADDS_R1_1; body_size];
+    code.push(THUMB_SUBS_R0_1);
+    code.push(thumb_bne_back(body_size as u16 + 1));
+    code.push(THUMB_SVC | SVC_EXIT as u16);
+    thumb(&code)
+}
+
+struct Bench {
+    filters: Vec<String>,
+}
+
+impl Bench {
+    fn new() -> Bench {
+        // Cargo passes "--bench", which isn't a filter.
+        let filters = std::env::args()
+            .skip(1)
+            .filter(|arg| !arg.starts_with("--"))
+            .collect();
+        Bench { filters }
+    }
+
+    fn enabled(&self, name: &str) -> bool {
+        self.filters.is_empty() || self.filters.iter().any(|f| name.contains(f))
+    }
+
+    /// Measure `f`, which does `operations` of something on each iteration.
+    /// The throughput is reported in millions of operations per second, with
+    /// the unit `unit`.
+    fn run<F: FnMut()>(&self, name: &str, unit: &str, operations: u64, mut f: F) {
+        if !self.enabled(name) {
+            return;
+        }
+        f();
+        let mut iterations = 0u64;
+        let start = Instant::now();
+        let mut batch = 1;
+        while start.elapsed() < MEASURE_TIME {
+            for _ in 0..batch {
+                f();
+            }
+            iterations += batch;
+            batch *= 2;
+        }
+        let elapsed = start.elapsed();
+        let ns_per_iteration = elapsed.as_nanos() as f64 / iterations as f64;
+        let throughput = (operations * iterations) as f64 / elapsed.as_secs_f64() / 1e6;
+        println!(
+            "{{\"name\":\"{}\",\"iterations\":{},\"ns_per_iteration\":{:.1},\"throughput\":{:.2},\"unit\":\"{}\"}}",
+            name, iterations, ns_per_iteration, throughput, unit
+        );
+    }
+}
+
+fn bench_loops(bench: &Bench) {
+    // Each iteration is the body plus the subs and the bne.
+    let instructions = LOOP_ITERATIONS as u64 * (LOOP_BODY_SIZE as u64 + 2);
+    for (name, thumb, code) in [
+        ("run_or_step/arm_loop", false, arm_loop(LOOP_BODY_SIZE)),
+        ("run_or_step/thumb_loop", true, thumb_loop(LOOP_BODY_SIZE)),
+    ] {
+        let mut guest = Guest::new(MemAccess::PageTable, thumb, &code);
+        bench.run(name, "Minstr/s", instructions, || {
+            guest.run_program(LOOP_ITERATIONS, std::ptr::null_mut())
+        });
+    }
+}
+
+fn bench_svcs(bench: &Bench) {
+    // Without an SVC context, even leaf SVCs halt. Every run stops at the SVC
+    // and the next one continues after it.
+    let code = arm(&[ARM_SVC | SVC_LEAF, arm_b_back(1)]);
+    let mut guest = Guest::new(MemAccess::PageTable, false, &code);
+    bench.run("svc/halting", "Msvc/s", 1, || {
+        black_box(guest.run(std::ptr::null_mut()));
+    });
+
+    let code = arm(&[
+        ARM_SVC | SVC_LEAF,
+        ARM_SUBS_R0_1,
+        arm_bne_back(2),
+        ARM_SVC | SVC_EXIT,
+    ]);
+    let mut guest = Guest::new(MemAccess::PageTable, false, &code);
+    let mut leaf_calls = 0u64;
+    let svc_context: *mut u64 = &mut leaf_calls;
+    bench.run("svc/leaf", "Msvc/s", LOOP_ITERATIONS.into(), || {
+        guest.run_program(LOOP_ITERATIONS, svc_context.cast())
+    });
+}
+
+fn bench_switch_context(bench: &Bench) {
+    let guest = Guest::new(MemAccess::PageTable, false, &arm(&[ARM_SVC]));
+    let mut contexts = unsafe {
+        [
+            touchHLE_DynarmicWrapper_Context_new(),
+            touchHLE_DynarmicWrapper_Context_new(),
+        ]
+    };
+    bench.run("switch_context", "Mswitch/s", 1, || {
+        unsafe { touchHLE_DynarmicWrapper_switch_context(guest.cpu, contexts[0], contexts[1]) };
+        contexts.swap(0, 1);
+    });
+    for context in contexts {
+        unsafe { touchHLE_DynarmicWrapper_Context_delete(context) };
+    }
+}
+
+fn bench_memory_access(bench: &Bench) {
+    let code = arm(&[
+        ARM_LDR_R2_R1,
+        ARM_ADD_R2_1,
+        ARM_STR_R2_R1,
+        ARM_SUBS_R0_1,
+        arm_bne_back(4),
+        ARM_SVC | SVC_EXIT,
+    ]);
+    // One load and one store per iteration.
+    let accesses = LOOP_ITERATIONS as u64 * 2;
+    for (name, access) in [
+        ("memory/page_table", MemAccess::PageTable),
+        ("memory/callbacks", MemAccess::Callbacks),
+        ("memory/rust_callbacks", MemAccess::RustCallbacks),
+    ] {
+        let mut guest = Guest::new(access, false, &code);
+        bench.run(name, "Maccess/s", accesses, || {
+            guest.run_program(LOOP_ITERATIONS, std::ptr::null_mut())
+        });
+    }
+}
+
+fn bench_invalidate(bench: &Bench) {
+    // A long block, run only once, so the cost is dominated by compiling it.
+    let body_size = 256;
+    let code = arm_loop(body_size);
+    let mut guest = Guest::new(MemAccess::PageTable, false, &code);
+    // Baseline for comparison, without recompiling.
+    bench.run("invalidate_cache_range/none", "Mrun/s", 1, || {
+        guest.run_program(1, std::ptr::null_mut())
+    });
+    bench.run("invalidate_cache_range/recompile", "Mrun/s", 1, || {
+        unsafe {
+            touchHLE_DynarmicWrapper_invalidate_cache_range(guest.cpu, CODE_ADDR, code.len() as u32)
+        };
+        guest.run_program(1, std::ptr::null_mut())
+    });
+}
+
+fn main() {
+    let bench = Bench::new();
+    bench_loops(&bench);
+    bench_svcs(&bench);
+    bench_switch_context(&bench);
+    bench_memory_access(&bench);
+    bench_invalidate(&bench);
+}
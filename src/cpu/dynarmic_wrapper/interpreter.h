@@ -0,0 +1,847 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+// A small interpreter for the most common A32 and Thumb instructions: data
+// processing, loads and stores, and branches. Stepping through code with it
+// is much faster than with Jit::Step(), which compiles a block for each
+// instruction it steps, and it doesn't fill the code cache with those blocks.
+//
+// Anything it doesn't implement (coprocessor and VFP instructions, SVCs,
+// multiplies, most 32-bit Thumb instructions, IT blocks, etc) is reported as
+// unsupported without any side effects, and the caller is expected to fall
+// back to dynarmic. References are to the ARMv7-A/R Architecture Reference
+// Manual.
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace touchHLE::cpu {
+
+enum class InterpreterResult {
+  Executed,
+  // Nothing was done, the instruction must be executed some other way.
+  Unsupported,
+  // A memory access failed. Only the accesses before it have taken effect.
+  MemoryAbort,
+};
+
+// Memory must have these methods, which return false if the access fails:
+//
+//   template <typename T> bool read_memory(std::uint32_t addr, T &value);
+//   template <typename T> bool write_memory(std::uint32_t addr, T value);
+//
+// where T is std::uint8_t, std::uint16_t or std::uint32_t.
+template <typename Memory> class Interpreter {
+  using u32 = std::uint32_t;
+
+  static const u32 CPSR_N = 1u << 31;
+  static const u32 CPSR_Z = 1u << 30;
+  static const u32 CPSR_C = 1u << 29;
+  static const u32 CPSR_V = 1u << 28;
+  static const u32 CPSR_T = 1u << 5;
+  static const u32 CPSR_IT = 0x0600FC00;
+
+  struct ShiftResult {
+    u32 value;
+    bool carry;
+  };
+  struct AddResult {
+    u32 value;
+    bool carry;
+    bool overflow;
+  };
+
+  Memory &memory;
+  // Address of the instruction being executed.
+  u32 pc;
+  bool pc_written = false;
+
+public:
+  // The state is only modified, and should only be written back, if step()
+  // returns Executed.
+  std::array<u32, 16> regs;
+  u32 cpsr;
+
+  Interpreter(Memory &memory_, const std::array<u32, 16> &regs_, u32 cpsr_)
+      : memory(memory_), pc(regs_[15]), regs(regs_), cpsr(cpsr_) {}
+
+  InterpreterResult step() {
+    if (cpsr & CPSR_T) {
+      if (cpsr & CPSR_IT) {
+        return InterpreterResult::Unsupported;
+      }
+      std::uint16_t instr;
+      if (!memory.read_memory(pc, instr)) {
+        return InterpreterResult::Unsupported;
+      }
+      InterpreterResult res;
+      if ((instr >> 11) >= 0b11101) {
+        std::uint16_t instr2;
+        if (!memory.read_memory(pc + 2, instr2)) {
+          return InterpreterResult::Unsupported;
+        }
+        res = step_thumb32(instr, instr2);
+      } else {
+        res = step_thumb16(instr);
+      }
+      if (res == InterpreterResult::Executed && !pc_written) {
+        regs[15] = pc + ((instr >> 11) >= 0b11101 ? 4 : 2);
+      }
+      return res;
+    }
+
+    u32 instr;
+    if (!memory.read_memory(pc, instr)) {
+      return InterpreterResult::Unsupported;
+    }
+    InterpreterResult res = step_arm(instr);
+    if (res == InterpreterResult::Executed && !pc_written) {
+      regs[15] = pc + 4;
+    }
+    return res;
+  }
+
+private:
+  bool thumb() const { return cpsr & CPSR_T; }
+  bool carry() const { return cpsr & CPSR_C; }
+
+  // Reading PC gives the address of the current instruction plus 8 (A32) or
+  // 4 (Thumb).
+  u32 reg(unsigned n) const {
+    return n == 15 ? pc + (thumb() ? 4 : 8) : regs[n];
+  }
+
+  void set_flag(u32 flag, bool value) {
+    cpsr = value ? (cpsr | flag) : (cpsr & ~flag);
+  }
+  void set_nz(u32 result) {
+    set_flag(CPSR_N, result >> 31);
+    set_flag(CPSR_Z, result == 0);
+  }
+  void set_nzcv(const AddResult &result) {
+    set_nz(result.value);
+    set_flag(CPSR_C, result.carry);
+    set_flag(CPSR_V, result.overflow);
+  }
+
+  // See BranchWritePC, BXWritePC and ALUWritePC in the manual. LoadWritePC
+  // is the same as BXWritePC.
+  void branch_write_pc(u32 addr) {
+    regs[15] = addr & (thumb() ? ~1u : ~3u);
+    pc_written = true;
+  }
+  void bx_write_pc(u32 addr) {
+    set_flag(CPSR_T, addr & 1);
+    regs[15] = addr & (thumb() ? ~1u : ~3u);
+    pc_written = true;
+  }
+  void alu_write_pc(u32 addr) {
+    if (thumb()) {
+      branch_write_pc(addr);
+    } else {
+      bx_write_pc(addr);
+    }
+  }
+
+  bool condition_passed(unsigned cond) const {
+    bool n = cpsr & CPSR_N, z = cpsr & CPSR_Z, c = cpsr & CPSR_C,
+         v = cpsr & CPSR_V;
+    bool result;
+    switch (cond >> 1) {
+    case 0:
+      result = z;
+      break;
+    case 1:
+      result = c;
+      break;
+    case 2:
+      result = n;
+      break;
+    case 3:
+      result = v;
+      break;
+    case 4:
+      result = c && !z;
+      break;
+    case 5:
+      result = n == v;
+      break;
+    case 6:
+      result = n == v && !z;
+      break;
+    default:
+      return true;
+    }
+    return (cond & 1) ? !result : result;
+  }
+
+  static u32 sign_extend(u32 value, unsigned bits) {
+    u32 sign = 1u << (bits - 1);
+    return (value ^ sign) - sign;
+  }
+
+  // Shift_C() in the manual, with type 0 to 3 meaning LSL, LSR, ASR and ROR.
+  static ShiftResult shift_c(u32 value, unsigned type, unsigned amount,
+                             bool carry_in) {
+    if (amount == 0) {
+      return {value, carry_in};
+    }
+    switch (type) {
+    case 0:
+      if (amount < 32) {
+        return {value << amount, bool((value >> (32 - amount)) & 1)};
+      }
+      return {0, amount == 32 && (value & 1)};
+    case 1:
+      if (amount < 32) {
+        return {value >> amount, bool((value >> (amount - 1)) & 1)};
+      }
+      return {0, amount == 32 && (value >> 31)};
+    case 2:
+      if (amount < 32) {
+        return {u32(std::int32_t(value) >> amount),
+                bool((value >> (amount - 1)) & 1)};
+      }
+      return {u32(std::int32_t(value) >> 31), bool(value >> 31)};
+    default: {
+      amount %= 32;
+      u32 result =
+          amount ? (value >> amount) | (value << (32 - amount)) : value;
+      return {result, bool(result >> 31)};
+    }
+    }
+  }
+  // A shift by an immediate, including DecodeImmShift().
+  ShiftResult shift_imm(u32 value, unsigned type, unsigned imm5) const {
+    if (type == 3 && imm5 == 0) {
+      // RRX
+      return {(u32(carry()) << 31) | (value >> 1), bool(value & 1)};
+    }
+    if ((type == 1 || type == 2) && imm5 == 0) {
+      imm5 = 32;
+    }
+    return shift_c(value, type, imm5, carry());
+  }
+
+  static AddResult add_with_carry(u32 x, u32 y, bool carry_in) {
+    std::uint64_t unsigned_sum = std::uint64_t(x) + y + carry_in;
+    u32 result = u32(unsigned_sum);
+    return {result, bool(unsigned_sum >> 32),
+            bool(((x ^ result) & (y ^ result)) >> 31)};
+  }
+
+  template <typename T> bool load(u32 addr, u32 &value) {
+    T narrow;
+    if (!memory.read_memory(addr, narrow)) {
+      return false;
+    }
+    value = narrow;
+    return true;
+  }
+  template <typename T> bool store(u32 addr, u32 value) {
+    return memory.write_memory(addr, T(value));
+  }
+
+  // Shared by the A32 and Thumb load/store multiple instructions. Registers
+  // are loaded in ascending order from ascending addresses starting at addr.
+  // If a load fails, no registers are modified.
+  bool load_multiple(u32 addr, std::uint16_t list) {
+    std::array<u32, 16> values;
+    for (unsigned i = 0; i < 16; i++) {
+      if ((list >> i) & 1) {
+        if (!memory.read_memory(addr, values[i])) {
+          return false;
+        }
+        addr += 4;
+      }
+    }
+    for (unsigned i = 0; i < 15; i++) {
+      if ((list >> i) & 1) {
+        regs[i] = values[i];
+      }
+    }
+    if ((list >> 15) & 1) {
+      bx_write_pc(values[15]);
+    }
+    return true;
+  }
+  bool store_multiple(u32 addr, std::uint16_t list) {
+    for (unsigned i = 0; i < 16; i++) {
+      if ((list >> i) & 1) {
+        if (!memory.write_memory(addr, reg(i))) {
+          return false;
+        }
+        addr += 4;
+      }
+    }
+    return true;
+  }
+
+  // Data processing for A32 (A5.2) and the Thumb instructions that are
+  // equivalent to it. The result is written to rd unless it's a comparison.
+  // Returns false if the instruction is unsupported.
+  bool data_processing(unsigned opcode, bool set_flags, unsigned rd, u32 n,
+                       ShiftResult shifted) {
+    u32 m = shifted.value;
+    bool logical = true;
+    AddResult arith = {};
+    u32 result;
+    switch (opcode) {
+    case 0x0: // AND
+    case 0x8: // TST
+      result = n & m;
+      break;
+    case 0x1: // EOR
+    case 0x9: // TEQ
+      result = n ^ m;
+      break;
+    case 0x2: // SUB
+    case 0xA: // CMP
+      logical = false;
+      arith = add_with_carry(n, ~m, true);
+      break;
+    case 0x3: // RSB
+      logical = false;
+      arith = add_with_carry(~n, m, true);
+      break;
+    case 0x4: // ADD
+    case 0xB: // CMN
+      logical = false;
+      arith = add_with_carry(n, m, false);
+      break;
+    case 0x5: // ADC
+      logical = false;
+      arith = add_with_carry(n, m, carry());
+      break;
+    case 0x6: // SBC
+      logical = false;
+      arith = add_with_carry(n, ~m, carry());
+      break;
+    case 0x7: // RSC
+      logical = false;
+      arith = add_with_carry(~n, m, carry());
+      break;
+    case 0xC: // ORR
+      result = n | m;
+      break;
+    case 0xD: // MOV
+      result = m;
+      break;
+    case 0xE: // BIC
+      result = n & ~m;
+      break;
+    default: // MVN
+      result = ~m;
+      break;
+    }
+    if (!logical) {
+      result = arith.value;
+    }
+
+    bool comparison = opcode >= 0x8 && opcode <= 0xB;
+    if (!comparison && rd == 15) {
+      // With flags, this is an exception return.
+      if (set_flags) {
+        return false;
+      }
+      alu_write_pc(result);
+      return true;
+    }
+    if (!comparison) {
+      regs[rd] = result;
+    }
+    if (set_flags) {
+      if (logical) {
+        set_nz(result);
+        set_flag(CPSR_C, shifted.carry);
+      } else {
+        set_nzcv(arith);
+      }
+    }
+    return true;
+  }
+
+  InterpreterResult step_arm(u32 instr) {
+    const auto executed = InterpreterResult::Executed;
+    const auto unsupported = InterpreterResult::Unsupported;
+    const auto abort = InterpreterResult::MemoryAbort;
+
+    unsigned cond = instr >> 28;
+    if (cond == 0xF) {
+      // BLX (immediate)
+      if ((instr & 0x0E000000) == 0x0A000000) {
+        u32 imm32 = sign_extend(
+            ((instr & 0xFFFFFF) << 2) | (((instr >> 24) & 1) << 1), 26);
+        regs[14] = pc + 4;
+        set_flag(CPSR_T, true);
+        branch_write_pc(pc + 8 + imm32);
+        return executed;
+      }
+      return unsupported;
+    }
+    // Only the encoding is checked before this, so unsupported instructions
+    // are left to dynarmic even when the condition fails.
+    InterpreterResult res = unsupported;
+    unsigned rn = (instr >> 16) & 0xF;
+    unsigned rd = (instr >> 12) & 0xF;
+    unsigned rm = instr & 0xF;
+
+    switch ((instr >> 25) & 7) {
+    case 0b000:
+    case 0b001: {
+      bool imm = (instr >> 25) & 1;
+      unsigned opcode = (instr >> 21) & 0xF;
+      bool set_flags = (instr >> 20) & 1;
+      bool misc = !set_flags && (opcode >> 2) == 0b10;
+      if (!imm && (instr & 0x90) == 0x90) {
+        // Multiplies, extra loads and stores, synchronization primitives
+        return unsupported;
+      }
+      if (misc && !imm) {
+        // BX and BLX (register)
+        if ((instr & 0x0FFFFFD0) != 0x012FFF10 ||
+            (((instr >> 5) & 1) && rm == 15)) {
+          return unsupported;
+        }
+        if (!condition_passed(cond)) {
+          return executed;
+        }
+        u32 target = reg(rm);
+        if ((instr >> 5) & 1) {
+          regs[14] = pc + 4;
+        }
+        bx_write_pc(target);
+        return executed;
+      }
+      if (misc) {
+        // MOVW and MOVT
+        if ((opcode != 0x8 && opcode != 0xA) || rd == 15) {
+          return unsupported;
+        }
+        if (!condition_passed(cond)) {
+          return executed;
+        }
+        u32 imm16 = ((instr >> 4) & 0xF000) | (instr & 0xFFF);
+        regs[rd] = opcode == 0x8 ? imm16 : (imm16 << 16) | (regs[rd] & 0xFFFF);
+        return executed;
+      }
+      if (rd == 15 && set_flags && !(opcode >= 0x8 && opcode <= 0xB)) {
+        return unsupported;
+      }
+      ShiftResult shifted;
+      if (imm) {
+        unsigned rotation = ((instr >> 8) & 0xF) * 2;
+        u32 value = shift_c(instr & 0xFF, 3, rotation, carry()).value;
+        shifted = {value, rotation ? bool(value >> 31) : carry()};
+      } else if ((instr >> 4) & 1) {
+        // Register-shifted register
+        unsigned rs = (instr >> 8) & 0xF;
+        if (rd == 15 || rn == 15 || rm == 15 || rs == 15) {
+          return unsupported;
+        }
+        shifted =
+            shift_c(regs[rm], (instr >> 5) & 3, regs[rs] & 0xFF, carry());
+      } else {
+        shifted = shift_imm(reg(rm), (instr >> 5) & 3, (instr >> 7) & 0x1F);
+      }
+      if (!condition_passed(cond)) {
+        return executed;
+      }
+      return data_processing(opcode, set_flags, rd, reg(rn), shifted)
+                 ? executed
+                 : unsupported;
+    }
+    case 0b010:
+    case 0b011: {
+      // Load/store word and unsigned byte (A5.3)
+      bool reg_offset = (instr >> 25) & 1;
+      bool p = (instr >> 24) & 1, u = (instr >> 23) & 1,
+           byte = (instr >> 22) & 1, w = (instr >> 21) & 1,
+           l = (instr >> 20) & 1;
+      bool wback = !p || w;
+      if ((reg_offset && ((instr >> 4) & 1)) || (!p && w) ||
+          (reg_offset && rm == 15) || (wback && (rn == 15 || rn == rd)) ||
+          (byte && rd == 15)) {
+        // Media instructions, unprivileged loads and stores, and
+        // unpredictable cases
+        return unsupported;
+      }
+      if (!condition_passed(cond)) {
+        return executed;
+      }
+      u32 offset = reg_offset ? shift_imm(regs[rm], (instr >> 5) & 3,
+                                          (instr >> 7) & 0x1F)
+                                    .value
+                              : instr & 0xFFF;
+      u32 base = rn == 15 ? (pc + 8) & ~3u : regs[rn];
+      u32 offset_addr = u ? base + offset : base - offset;
+      u32 addr = p ? offset_addr : base;
+      if (l) {
+        u32 value;
+        if (!(byte ? load<std::uint8_t>(addr, value)
+                   : load<std::uint32_t>(addr, value))) {
+          return abort;
+        }
+        if (rd == 15) {
+          bx_write_pc(value);
+        } else {
+          regs[rd] = value;
+        }
+      } else {
+        u32 value = reg(rd);
+        if (!(byte ? store<std::uint8_t>(addr, value)
+                   : store<std::uint32_t>(addr, value))) {
+          return abort;
+        }
+      }
+      if (wback) {
+        regs[rn] = offset_addr;
+      }
+      return executed;
+    }
+    case 0b100: {
+      // Load/store multiple
+      bool p = (instr >> 24) & 1, u = (instr >> 23) & 1,
+           s = (instr >> 22) & 1, w = (instr >> 21) & 1,
+           l = (instr >> 20) & 1;
+      std::uint16_t list = instr & 0xFFFF;
+      if (s || list == 0 || rn == 15 || (l && w && ((list >> rn) & 1))) {
+        return unsupported;
+      }
+      if (!condition_passed(cond)) {
+        return executed;
+      }
+      u32 size = 4 * u32(__builtin_popcount(list));
+      u32 base = regs[rn];
+      u32 addr = u ? base + (p ? 4 : 0) : base - size + (p ? 0 : 4);
+      if (!(l ? load_multiple(addr, list) : store_multiple(addr, list))) {
+        return abort;
+      }
+      if (w) {
+        regs[rn] = u ? base + size : base - size;
+      }
+      return executed;
+    }
+    case 0b101: {
+      // B and BL
+      if (!condition_passed(cond)) {
+        return executed;
+      }
+      if ((instr >> 24) & 1) {
+        regs[14] = pc + 4;
+      }
+      branch_write_pc(pc + 8 + sign_extend((instr & 0xFFFFFF) << 2, 26));
+      return executed;
+    }
+    default:
+      // Coprocessor instructions and SVC
+      return res;
+    }
+  }
+
+  InterpreterResult step_thumb16(std::uint16_t instr) {
+    const auto executed = InterpreterResult::Executed;
+    const auto unsupported = InterpreterResult::Unsupported;
+    const auto abort = InterpreterResult::MemoryAbort;
+
+    unsigned r0 = instr & 7, r3 = (instr >> 3) & 7, r6 = (instr >> 6) & 7,
+             r8 = (instr >> 8) & 7;
+    u32 imm8 = instr & 0xFF;
+
+    if ((instr >> 14) == 0b00) {
+      // Shift (immediate), add, subtract, move, and compare (A6.2.1)
+      unsigned op = (instr >> 11) & 7;
+      if (op < 3) {
+        // LSL, LSR, ASR (immediate)
+        ShiftResult shifted = shift_imm(regs[r3], op, (instr >> 6) & 0x1F);
+        data_processing(0xD, true, r0, 0, shifted);
+      } else if (op == 3) {
+        // ADD and SUB (register or 3-bit immediate)
+        u32 m = ((instr >> 10) & 1) ? r6 : regs[r6];
+        data_processing(((instr >> 9) & 1) ? 0x2 : 0x4, true, r0, regs[r3],
+                        {m, carry()});
+      } else {
+        // MOV, CMP, ADD, SUB (8-bit immediate)
+        static const unsigned opcodes[] = {0xD, 0xA, 0x4, 0x2};
+        data_processing(opcodes[op - 4], true, r8, regs[r8], {imm8, carry()});
+      }
+      return executed;
+    }
+    if ((instr >> 10) == 0b010000) {
+      // Data processing (A6.2.2)
+      unsigned op = (instr >> 6) & 0xF;
+      u32 n = regs[r0], m = regs[r3];
+      switch (op) {
+      case 0x2: // LSL
+      case 0x3: // LSR
+      case 0x4: // ASR
+      case 0x7: // ROR
+      {
+        static const unsigned types[] = {0, 0, 0, 1, 2, 0, 0, 3};
+        data_processing(0xD, true, r0, 0,
+                        shift_c(n, types[op], m & 0xFF, carry()));
+        break;
+      }
+      case 0x9: // RSB (immediate #0)
+        data_processing(0x3, true, r0, m, {0, carry()});
+        break;
+      case 0xD: // MUL
+        regs[r0] = n * m;
+        set_nz(regs[r0]);
+        break;
+      default: {
+        // The rest have the same opcodes as their A32 equivalents.
+        static const unsigned opcodes[] = {0x0, 0x1, 0,   0,   0,   0x5,
+                                           0x6, 0,   0x8, 0,   0xA, 0xB,
+                                           0xC, 0,   0xE, 0xF};
+        data_processing(opcodes[op], true, r0, n, {m, carry()});
+        break;
+      }
+      }
+      return executed;
+    }
+    if ((instr >> 10) == 0b010001) {
+      // Special data instructions and branch and exchange (A6.2.3)
+      unsigned rdn = ((instr >> 4) & 8) | r0;
+      unsigned rm = (instr >> 3) & 0xF;
+      switch ((instr >> 8) & 3) {
+      case 0: // ADD (register)
+        if (rdn == 15 && rm == 15) {
+          return unsupported;
+        }
+        data_processing(0x4, false, rdn, reg(rdn), {reg(rm), carry()});
+        return executed;
+      case 1: // CMP (register)
+        if (rdn == 15 || rm == 15) {
+          return unsupported;
+        }
+        data_processing(0xA, true, rdn, regs[rdn], {regs[rm], carry()});
+        return executed;
+      case 2: // MOV (register)
+        data_processing(0xD, false, rdn, 0, {reg(rm), carry()});
+        return executed;
+      default: { // BX and BLX (register)
+        bool link = (instr >> 7) & 1;
+        if (link && rm == 15) {
+          return unsupported;
+        }
+        u32 target = reg(rm);
+        if (link) {
+          regs[14] = (pc + 2) | 1;
+        }
+        bx_write_pc(target);
+        return executed;
+      }
+      }
+    }
+    if ((instr >> 11) == 0b01001) {
+      // LDR (literal)
+      u32 value;
+      if (!load<std::uint32_t>(((pc + 4) & ~3u) + imm8 * 4, value)) {
+        return abort;
+      }
+      regs[r8] = value;
+      return executed;
+    }
+    if ((instr >> 12) == 0b0101 || (instr >> 13) == 0b011 ||
+        (instr >> 12) == 0b1000 || (instr >> 12) == 0b1001) {
+      // Load/store single data item (A6.2.4)
+      u32 addr;
+      unsigned op;
+      unsigned rt = r0;
+      if ((instr >> 12) == 0b0101) {
+        // Register offset: STR, STRH, STRB, LDRSB, LDR, LDRH, LDRB, LDRSH
+        addr = regs[r3] + regs[r6];
+        op = (instr >> 9) & 7;
+      } else {
+        u32 imm5 = (instr >> 6) & 0x1F;
+        bool l = (instr >> 11) & 1;
+        if ((instr >> 12) == 0b0110) {
+          addr = regs[r3] + imm5 * 4;
+          op = l ? 4 : 0;
+        } else if ((instr >> 12) == 0b0111) {
+          addr = regs[r3] + imm5;
+          op = l ? 6 : 2;
+        } else if ((instr >> 12) == 0b1000) {
+          addr = regs[r3] + imm5 * 2;
+          op = l ? 5 : 1;
+        } else {
+          // SP-relative
+          addr = regs[13] + imm8 * 4;
+          op = l ? 4 : 0;
+          rt = r8;
+        }
+      }
+      u32 value = regs[rt];
+      bool ok;
+      switch (op) {
+      case 0:
+        ok = store<std::uint32_t>(addr, value);
+        break;
+      case 1:
+        ok = store<std::uint16_t>(addr, value);
+        break;
+      case 2:
+        ok = store<std::uint8_t>(addr, value);
+        break;
+      case 3:
+        ok = load<std::uint8_t>(addr, value);
+        value = sign_extend(value, 8);
+        break;
+      case 4:
+        ok = load<std::uint32_t>(addr, value);
+        break;
+      case 5:
+        ok = load<std::uint16_t>(addr, value);
+        break;
+      case 6:
+        ok = load<std::uint8_t>(addr, value);
+        break;
+      default:
+        ok = load<std::uint16_t>(addr, value);
+        value = sign_extend(value, 16);
+        break;
+      }
+      if (!ok) {
+        return abort;
+      }
+      if (op >= 3) {
+        regs[rt] = value;
+      }
+      return executed;
+    }
+    if ((instr >> 12) == 0b1010) {
+      // ADR and ADD (SP plus immediate)
+      u32 base = ((instr >> 11) & 1) ? regs[13] : (pc + 4) & ~3u;
+      regs[r8] = base + imm8 * 4;
+      return executed;
+    }
+    if ((instr >> 12) == 0b1011) {
+      // Miscellaneous 16-bit instructions (A6.2.5)
+      if ((instr >> 8) == 0b10110000) {
+        // ADD and SUB (SP minus immediate)
+        u32 imm = (instr & 0x7F) * 4;
+        regs[13] = ((instr >> 7) & 1) ? regs[13] - imm : regs[13] + imm;
+        return executed;
+      }
+      if ((instr & 0x0500) == 0x0100) {
+        // CBZ and CBNZ
+        bool nonzero = (instr >> 11) & 1;
+        if ((regs[r0] != 0) == nonzero) {
+          branch_write_pc(pc + 4 + ((((instr >> 9) & 1) << 6) |
+                                    ((instr >> 2) & 0x3E)));
+        }
+        return executed;
+      }
+      if ((instr >> 8) == 0b10110010) {
+        // SXTH, SXTB, UXTH, UXTB
+        u32 m = regs[r3];
+        switch ((instr >> 6) & 3) {
+        case 0:
+          regs[r0] = sign_extend(m & 0xFFFF, 16);
+          break;
+        case 1:
+          regs[r0] = sign_extend(m & 0xFF, 8);
+          break;
+        case 2:
+          regs[r0] = m & 0xFFFF;
+          break;
+        default:
+          regs[r0] = m & 0xFF;
+          break;
+        }
+        return executed;
+      }
+      if ((instr >> 9) == 0b1011010) {
+        // PUSH
+        std::uint16_t list = imm8 | (((instr >> 8) & 1) << 14);
+        if (list == 0) {
+          return unsupported;
+        }
+        u32 addr = regs[13] - 4 * u32(__builtin_popcount(list));
+        if (!store_multiple(addr, list)) {
+          return abort;
+        }
+        regs[13] = addr;
+        return executed;
+      }
+      if ((instr >> 9) == 0b1011110) {
+        // POP
+        std::uint16_t list = imm8 | (((instr >> 8) & 1) << 15);
+        if (list == 0) {
+          return unsupported;
+        }
+        u32 sp = regs[13];
+        if (!load_multiple(sp, list)) {
+          return abort;
+        }
+        regs[13] = sp + 4 * u32(__builtin_popcount(list));
+        return executed;
+      }
+      // IT, BKPT, REV, CPS, hints, etc
+      return unsupported;
+    }
+    if ((instr >> 12) == 0b1100) {
+      // STM and LDM, which always increment after and write back unless the
+      // base register is loaded.
+      std::uint16_t list = imm8;
+      bool l = (instr >> 11) & 1;
+      if (list == 0) {
+        return unsupported;
+      }
+      u32 base = regs[r8];
+      if (!(l ? load_multiple(base, list) : store_multiple(base, list))) {
+        return abort;
+      }
+      if (!l || !((list >> r8) & 1)) {
+        regs[r8] = base + 4 * u32(__builtin_popcount(list));
+      }
+      return executed;
+    }
+    if ((instr >> 12) == 0b1101) {
+      // Conditional branch, UDF and SVC
+      unsigned cond = (instr >> 8) & 0xF;
+      if (cond >= 0xE) {
+        return unsupported;
+      }
+      if (condition_passed(cond)) {
+        branch_write_pc(pc + 4 + sign_extend(imm8 << 1, 9));
+      }
+      return executed;
+    }
+    if ((instr >> 11) == 0b11100) {
+      // Unconditional branch
+      branch_write_pc(pc + 4 + sign_extend((instr & 0x7FF) << 1, 12));
+      return executed;
+    }
+    return unsupported;
+  }
+
+  InterpreterResult step_thumb32(std::uint16_t hw1, std::uint16_t hw2) {
+    // Only BL and BLX (immediate).
+    bool link_exchange = !((hw2 >> 12) & 1);
+    if ((hw1 >> 11) != 0b11110 || (hw2 >> 14) != 0b11 ||
+        ((hw2 >> 12) & 5) == 0 || (link_exchange && (hw2 & 1))) {
+      return InterpreterResult::Unsupported;
+    }
+    u32 s = (hw1 >> 10) & 1;
+    u32 i1 = !(((hw2 >> 13) & 1) ^ s);
+    u32 i2 = !(((hw2 >> 11) & 1) ^ s);
+    u32 imm32 = sign_extend((s << 24) | (i1 << 23) | (i2 << 22) |
+                                ((hw1 & 0x3FF) << 12) | ((hw2 & 0x7FF) << 1),
+                            25);
+    regs[14] = (pc + 4) | 1;
+    if (link_exchange) {
+      set_flag(CPSR_T, false);
+      branch_write_pc(((pc + 4) & ~3u) + imm32);
+    } else {
+      branch_write_pc(pc + 4 + imm32);
+    }
+    return InterpreterResult::Executed;
+  }
+};
+
+} // namespace touchHLE::cpu
@@ -3,13 +3,34 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define TOUCHHLE_CODE_WRITE_TRACKING 1
+#endif
 
 #include "dynarmic/interface/A32/a32.h"
 #include "dynarmic/interface/A32/config.h"
 #include "dynarmic/interface/A32/context.h"
 
+#include "interpreter.h"
+
 namespace touchHLE::cpu {
 
 using VAddr = std::uint32_t;
@@ -25,47 +46,711 @@ bool touchHLE_cpu_write_u8(touchHLE_Mem *mem, VAddr addr, std::uint8_t value);
 bool touchHLE_cpu_write_u16(touchHLE_Mem *mem, VAddr addr, std::uint16_t value);
 bool touchHLE_cpu_write_u32(touchHLE_Mem *mem, VAddr addr, std::uint32_t value);
 bool touchHLE_cpu_write_u64(touchHLE_Mem *mem, VAddr addr, std::uint64_t value);
+std::uint8_t touchHLE_cpu_classify_svc(void *svc_context, std::uint32_t svc);
+bool touchHLE_cpu_call_leaf_svc(void *svc_context, std::uint32_t svc);
+}
+
+// Keep in sync with SvcKind in src/cpu.rs.
+enum class SvcKind : std::uint8_t {
+  // Not yet classified by touchHLE_cpu_classify_svc.
+  Unknown = 0,
+  Ordinary = 1,
+  Leaf = 2,
+  ObjCMsgSend = 3,
+};
+
+// Keep in sync with src/objc/method_cache.rs.
+const std::uint32_t METHOD_CACHE_BITS = 12;
+struct MethodCacheEntry {
+  std::uint32_t class_;
+  std::uint32_t sel;
+  std::uint32_t imp;
+};
+static size_t method_cache_index(std::uint32_t class_, std::uint32_t sel) {
+  std::uint32_t hash = (class_ ^ ((sel << 16) | (sel >> 16))) * 0x9E3779B1u;
+  return hash >> (32 - METHOD_CACHE_BITS);
 }
 
+// Keep in sync with touchHLE_DynarmicWrapper_MemDescriptor in lib.rs.
+struct MemDescriptor {
+  std::uint8_t *base;
+  std::uint64_t size;
+  VAddr null_segment_size;
+};
+
+// Keep in sync with touchHLE_DynarmicWrapper_Config in lib.rs.
+struct DynarmicWrapperConfig {
+  void *direct_memory_access_ptr;
+  size_t null_page_count;
+  bool fastmem;
+  // Only has an effect in fastmem mode, see CodeWriteTracker.
+  bool track_code_writes;
+  bool check_halt_on_memory_access;
+  bool unsafe_optimizations;
+  bool block_linking;
+  bool fast_dispatch;
+  // Whether single steps may use the Interpreter. Only turned off by tests.
+  bool interpreter;
+  // 0 means dynarmic's default.
+  std::uint32_t code_cache_size;
+  // If this is not 0, cycle counting is disabled and a Watchdog preempts
+  // execution instead, treating each tick as this many nanoseconds.
+  std::uint32_t wall_clock_ns_per_tick;
+};
+
+// Counters for finding out why and how often execution leaves the JIT. They
+// are always kept, since they're cheap compared to what they count. Keep in
+// sync with touchHLE_DynarmicWrapper_Stats in lib.rs.
+struct Stats {
+  // Results of run_or_step, see there.
+  std::uint64_t halts_svc;
+  std::uint64_t halts_memory_abort;
+  std::uint64_t halts_undefined_instruction;
+  std::uint64_t halts_breakpoint;
+  // Ran out of ticks, or was preempted by the watchdog.
+  std::uint64_t halts_out_of_ticks;
+  std::uint64_t steps;
+  // Steps done by the interpreter rather than dynarmic, see interpreter.h.
+  std::uint64_t interpreted_steps;
+  // SVCs handled without halting.
+  std::uint64_t leaf_svcs;
+  std::uint64_t cached_msg_sends;
+  // Memory callback invocations (accesses not done through the page table or
+  // fastmem), indexed by log2 of the access size in bytes.
+  std::uint64_t memory_reads[4];
+  std::uint64_t memory_writes[4];
+  // Invalidation requests, and how many times the queued requests were
+  // applied (see InvalidationQueue).
+  std::uint64_t invalidations;
+  std::uint64_t bytes_invalidated;
+  std::uint64_t invalidation_flushes;
+  // Writes to pages containing compiled code, see CodeWriteTracker.
+  std::uint64_t code_write_faults;
+  // See CodeCacheTracker. Unlike the rest, code_cache_guest_bytes is a
+  // current value rather than a count.
+  std::uint64_t blocks_compiled;
+  std::uint64_t blocks_recompiled;
+  std::uint64_t code_cache_flushes;
+  std::uint64_t code_cache_guest_bytes;
+  std::uint64_t context_switches;
+};
+
 const auto HaltReasonSvc = Dynarmic::HaltReason::UserDefined1;
 const auto HaltReasonUndefinedInstruction = Dynarmic::HaltReason::UserDefined2;
 const auto HaltReasonBreakpoint = Dynarmic::HaltReason::UserDefined3;
+const auto HaltReasonPrecompile = Dynarmic::HaltReason::UserDefined4;
+const auto HaltReasonPreempt = Dynarmic::HaltReason::UserDefined5;
+
+// Host thread that halts execution once a deadline passes. This is an
+// alternative to dynarmic's cycle counting, which adds some bookkeeping to
+// every block. Jit::HaltExecution is safe to call from another thread.
+class Watchdog {
+  std::mutex mutex;
+  std::condition_variable condvar;
+  Dynarmic::A32::Jit *armed_jit = nullptr;
+  std::chrono::steady_clock::time_point deadline;
+  bool stopping = false;
+  // This must be initialized last, since it uses the other members.
+  std::thread thread;
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+      if (!armed_jit) {
+        condvar.wait(lock);
+      } else if (std::chrono::steady_clock::now() >= deadline) {
+        armed_jit->HaltExecution(HaltReasonPreempt);
+        armed_jit = nullptr;
+      } else {
+        condvar.wait_until(lock, deadline);
+      }
+    }
+  }
+
+public:
+  Watchdog() : thread([this] { run(); }) {}
+  ~Watchdog() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    condvar.notify_one();
+    thread.join();
+  }
+
+  void arm(Dynarmic::A32::Jit *jit,
+           std::chrono::steady_clock::time_point new_deadline) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      armed_jit = jit;
+      deadline = new_deadline;
+    }
+    condvar.notify_one();
+  }
+  // After this returns, the watchdog won't halt the Jit that was armed, but it
+  // may have done so just before.
+  void disarm() {
+    std::lock_guard<std::mutex> lock(mutex);
+    armed_jit = nullptr;
+  }
+};
+
+using PageTable =
+    std::array<std::uint8_t *,
+               Dynarmic::A32::UserConfig::NUM_PAGE_TABLE_ENTRIES>;
+const size_t GUEST_PAGE_SIZE = 1 << Dynarmic::A32::UserConfig::PAGE_BITS;
+const std::uint64_t GUEST_MEMORY_SIZE = std::uint64_t(1) << 32;
+
+// The SVC numbers touchHLE uses are small (see dyld.rs), but the immediate is
+// 24 bits and controlled by guest code, so the per-SVC counts only cover this
+// range to keep their size bounded.
+const std::uint32_t MAX_COUNTED_SVC = 1 << 16;
+
+// Ranges of guest code waiting to be invalidated. Invalidating is deferred
+// until execution next resumes, so that ranges requested in the meantime can
+// be merged, and so that it is safe to request from CodeWriteTracker's fault
+// handler. The lock is a spinlock for the same reason; nothing that holds it
+// writes to guest memory, so the fault handler can't deadlock on it.
+class InvalidationQueue {
+  std::atomic_flag lock = ATOMIC_FLAG_INIT;
+  std::array<std::pair<VAddr, std::uint32_t>, 256> ranges;
+  size_t count = 0;
+  // Set if there were too many ranges, in which case everything is
+  // invalidated.
+  bool overflowed = false;
+
+public:
+  void push(VAddr start, std::uint32_t size) {
+    while (lock.test_and_set(std::memory_order_acquire)) {
+    }
+    if (count < ranges.size()) {
+      ranges[count++] = {start, size};
+    } else {
+      overflowed = true;
+    }
+    lock.clear(std::memory_order_release);
+  }
+
+  // Move the queued ranges into out, sorted and with overlapping or adjacent
+  // ranges merged. Returns false if everything must be invalidated instead.
+  bool take(std::vector<std::pair<VAddr, std::uint32_t>> &out) {
+    out.clear();
+    while (lock.test_and_set(std::memory_order_acquire)) {
+    }
+    out.insert(out.end(), ranges.begin(), ranges.begin() + count);
+    bool ok = !overflowed;
+    count = 0;
+    overflowed = false;
+    lock.clear(std::memory_order_release);
+
+    std::sort(out.begin(), out.end());
+    size_t merged = 0;
+    for (const auto &range : out) {
+      if (merged != 0) {
+        auto &last = out[merged - 1];
+        std::uint64_t last_end = std::uint64_t(last.first) + last.second;
+        if (range.first <= last_end) {
+          std::uint64_t end = std::max(last_end, std::uint64_t(range.first) +
+                                                     range.second);
+          last.second = std::uint32_t(
+              std::min(end - last.first, std::uint64_t(UINT32_MAX)));
+          continue;
+        }
+      }
+      out[merged++] = range;
+    }
+    out.resize(merged);
+    return ok;
+  }
+};
+
+#ifdef TOUCHHLE_CODE_WRITE_TRACKING
+// Finds out when compiled code is modified, whether by the guest or by the
+// host (e.g. the dynamic linker), so it never has to be invalidated by hand.
+//
+// Pages that blocks have been compiled from are write-protected on the host.
+// A write to one faults, and the fault handler makes the page writable again
+// and queues it for invalidation before the write is retried. The page is
+// protected again once code is next compiled from it.
+//
+// JIT fastmem writes fault directly. Other writes go through the page table,
+// which would point at protected memory, so the page's entries are cleared
+// while it's protected. The write then goes through a memory callback, which
+// faults outside the JIT. This way dynarmic's own fault handler (which
+// expects faults in the JIT to be fastmem failures) never sees anything but
+// a fastmem failure.
+//
+// Guest memory must come from src/mem/host_memory.rs, since other memory
+// can't necessarily be protected, so this is only used in fastmem mode.
+class CodeWriteTracker {
+  std::uint8_t *base;
+  PageTable *page_table;
+  InvalidationQueue *queue;
+  // Pages below this may overlap the null segment, which is protected
+  // separately.
+  VAddr min_addr;
+  // Protection is per host page, which can be larger than a guest page.
+  size_t page_size;
+  std::unique_ptr<std::atomic<bool>[]> protected_pages;
+  std::atomic<std::uint64_t> write_faults{0};
+
+  // Only one instance can be active, since the fault handler is global. In
+  // practice there is only ever one guest memory.
+  static std::atomic<CodeWriteTracker *> active;
+  static struct sigaction previous_segv_action;
+  static struct sigaction previous_bus_action;
+
+  void set_page_table_entries(size_t page, std::uint8_t *entry) {
+    size_t entries_per_page = page_size / GUEST_PAGE_SIZE;
+    std::fill_n(page_table->begin() + page * entries_per_page,
+                entries_per_page, entry);
+  }
+
+  // Returns false if the fault should be handled by someone else.
+  bool handle_write_fault(void *fault_addr) {
+    std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(fault_addr);
+    std::uintptr_t base_addr = reinterpret_cast<std::uintptr_t>(base);
+    if (addr < base_addr || addr - base_addr >= GUEST_MEMORY_SIZE) {
+      return false;
+    }
+    size_t page = (addr - base_addr) / page_size;
+    if (!protected_pages[page].exchange(false)) {
+      return false;
+    }
+    std::uint8_t *page_ptr = base + page * page_size;
+    if (mprotect(page_ptr, page_size, PROT_READ | PROT_WRITE) != 0) {
+      return false;
+    }
+    set_page_table_entries(page, base);
+    queue->push(VAddr(page * page_size), std::uint32_t(page_size));
+    write_faults.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  static void handle_signal(int sig, siginfo_t *info, void *context) {
+    CodeWriteTracker *tracker = active.load(std::memory_order_acquire);
+    if (tracker && tracker->handle_write_fault(info->si_addr)) {
+      return;
+    }
+    const struct sigaction &previous =
+        sig == SIGBUS ? previous_bus_action : previous_segv_action;
+    if (previous.sa_flags & SA_SIGINFO) {
+      previous.sa_sigaction(sig, info, context);
+    } else if (previous.sa_handler == SIG_DFL ||
+               previous.sa_handler == SIG_IGN) {
+      // Returning retries the access, which faults again and now gets the
+      // default behaviour.
+      signal(sig, SIG_DFL);
+    } else {
+      previous.sa_handler(sig);
+    }
+  }
+
+  static void install_signal_handler() {
+    // This must happen after a Jit has been created, so that this handler
+    // comes before dynarmic's and can chain to it.
+    static std::once_flag once;
+    std::call_once(once, [] {
+      struct sigaction action = {};
+      action.sa_sigaction = handle_signal;
+      action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGSEGV, &action, &previous_segv_action);
+      // Apple platforms report protection faults as SIGBUS.
+      sigaction(SIGBUS, &action, &previous_bus_action);
+    });
+  }
+
+public:
+  CodeWriteTracker(std::uint8_t *base_, PageTable *page_table_,
+                   InvalidationQueue *queue_, VAddr null_segment_size)
+      : base(base_), page_table(page_table_), queue(queue_) {
+    page_size = std::max(size_t(sysconf(_SC_PAGESIZE)), GUEST_PAGE_SIZE);
+    min_addr = VAddr((null_segment_size + page_size - 1) / page_size *
+                     page_size);
+    protected_pages = std::make_unique<std::atomic<bool>[]>(
+        size_t(GUEST_MEMORY_SIZE / page_size));
+    CodeWriteTracker *expected = nullptr;
+    if (!active.compare_exchange_strong(expected, this)) {
+      printf("Only one CPU can track code writes at a time.\n");
+      abort();
+    }
+  }
+  ~CodeWriteTracker() {
+    active.store(nullptr, std::memory_order_release);
+    // The guest memory may be reused, e.g. by another CPU.
+    for (size_t page = 0; page < GUEST_MEMORY_SIZE / page_size; page++) {
+      if (protected_pages[page].exchange(false)) {
+        mprotect(base + page * page_size, page_size, PROT_READ | PROT_WRITE);
+        set_page_table_entries(page, base);
+      }
+    }
+  }
+
+  // Call when code is read from vaddr in order to compile it.
+  void track_code_page(VAddr vaddr) {
+    size_t page = vaddr / page_size;
+    if (vaddr < min_addr ||
+        protected_pages[page].load(std::memory_order_relaxed)) {
+      return;
+    }
+    install_signal_handler();
+    set_page_table_entries(page, nullptr);
+    protected_pages[page].store(true);
+    if (mprotect(base + page * page_size, page_size, PROT_READ) != 0) {
+      protected_pages[page].store(false);
+      set_page_table_entries(page, base);
+    }
+  }
+
+  std::uint64_t take_write_fault_count() { return write_faults.exchange(0); }
+};
+std::atomic<CodeWriteTracker *> CodeWriteTracker::active{nullptr};
+struct sigaction CodeWriteTracker::previous_segv_action;
+struct sigaction CodeWriteTracker::previous_bus_action;
+#endif
+
+// dynarmic doesn't report how full its code cache is, or when it flushes the
+// whole cache because it has filled up, so this keeps track of which blocks
+// should be in an instance's cache. Compiling a block that should already be
+// there means the cache must have been flushed. This is only an estimate:
+// dynarmic also recompiles a block after a fastmem access in it faults, which
+// looks the same, and the size of the host code isn't known, only the size of
+// the guest code it was compiled from.
+class CodeCacheTracker {
+  // Entry points (with the Thumb bit) of blocks, and the number of bytes of
+  // guest code each was compiled from, starting at the word with the entry.
+  std::map<std::uint32_t, std::uint32_t> blocks;
+  std::uint64_t guest_bytes = 0;
+  std::uint32_t max_block_size = 0;
+  // Thumb instructions are read a word at a time, so the same word can be
+  // read twice in a row.
+  VAddr last_read = 0;
+  bool have_last_read = false;
+  // Blocks compiled again while still in blocks, since the last invalidation
+  // or inferred flush, and how many of those came one after another.
+  std::vector<std::uint32_t> recompiled;
+  std::uint32_t recompiled_in_a_row = 0;
+
+  // A block can be compiled again without the cache having been flushed, e.g.
+  // after a fastmem fault or when Jit::Step() starts at its entry. So a flush
+  // is only inferred once this many recompiles happen in a row, or once at
+  // least half of the blocks (and at least MIN_RECOMPILES_FOR_FLUSH) have
+  // been recompiled since the last invalidation.
+  static constexpr std::uint32_t RECOMPILES_IN_A_ROW_FOR_FLUSH = 16;
+  static constexpr std::size_t MIN_RECOMPILES_FOR_FLUSH = 4;
+
+  void reset_recompiled() {
+    recompiled.clear();
+    recompiled_in_a_row = 0;
+  }
+
+  void remove_bytes(std::uint64_t bytes, Stats &stats) {
+    stats.code_cache_guest_bytes -= bytes;
+    guest_bytes -= bytes;
+  }
+
+  // Drop every block other than the recompiled ones, which are what the
+  // flushed cache holds now.
+  void infer_flush(Stats &stats) {
+    stats.code_cache_flushes++;
+    std::map<std::uint32_t, std::uint32_t> kept;
+    for (std::uint32_t entry : recompiled) {
+      auto it = blocks.find(entry);
+      if (it != blocks.end()) {
+        kept.insert(*it);
+      }
+    }
+    remove_bytes(guest_bytes, stats);
+    blocks.swap(kept);
+    for (const auto &block : blocks) {
+      guest_bytes += block.second;
+      stats.code_cache_guest_bytes += block.second;
+    }
+    reset_recompiled();
+  }
+
+public:
+  // Call when dynarmic reads code. dynarmic only does that when compiling a
+  // block, and PC is the start of that block while it does so.
+  // single_step should be true while Jit::Step() is compiling, since its
+  // one-instruction blocks are kept separately from the others.
+  void code_read(std::uint32_t pc, bool thumb, VAddr vaddr, bool single_step,
+                 Stats &stats) {
+    if (have_last_read && vaddr == last_read) {
+      return;
+    }
+    last_read = vaddr;
+    have_last_read = true;
+    std::uint32_t entry = pc | (thumb ? 1 : 0);
+    if ((pc & ~3u) == vaddr) {
+      stats.blocks_compiled++;
+      if (single_step) {
+        return;
+      }
+      auto it = blocks.find(entry);
+      if (it == blocks.end()) {
+        blocks.emplace(entry, 0);
+        recompiled_in_a_row = 0;
+      } else {
+        stats.blocks_recompiled++;
+        // Its size is counted again as it's read.
+        remove_bytes(it->second, stats);
+        it->second = 0;
+        recompiled.push_back(entry);
+        recompiled_in_a_row++;
+        if (recompiled_in_a_row >= RECOMPILES_IN_A_ROW_FOR_FLUSH ||
+            (recompiled.size() >= MIN_RECOMPILES_FOR_FLUSH &&
+             recompiled.size() * 2 >= blocks.size())) {
+          infer_flush(stats);
+        }
+      }
+    } else if (single_step) {
+      return;
+    }
+    auto it = blocks.find(entry);
+    if (it == blocks.end()) {
+      return;
+    }
+    it->second += 4;
+    max_block_size = std::max(max_block_size, it->second);
+    guest_bytes += 4;
+    stats.code_cache_guest_bytes += 4;
+  }
+
+  // Call when the cache is cleared other than by dynarmic itself.
+  void clear(Stats &stats) {
+    stats.code_cache_guest_bytes -= guest_bytes;
+    guest_bytes = 0;
+    blocks.clear();
+    have_last_read = false;
+    reset_recompiled();
+  }
+
+  // Call when a range is invalidated. Like dynarmic, this removes all blocks
+  // that overlap it.
+  void invalidate(VAddr start, std::uint32_t size, Stats &stats) {
+    std::uint64_t end = std::uint64_t(start) + size;
+    auto it = blocks.lower_bound(start > max_block_size ? start - max_block_size
+                                                        : 0);
+    while (it != blocks.end() && (it->first & ~3u) < end) {
+      if ((it->first & ~3u) + std::uint64_t(it->second) > start) {
+        remove_bytes(it->second, stats);
+        it = blocks.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    have_last_read = false;
+    reset_recompiled();
+  }
+};
+
+// State of a DynarmicWrapper that its Environment also needs.
+struct SharedState {
+  DynarmicWrapperConfig config;
+  PageTable page_table;
+  InvalidationQueue invalidation_queue;
+  // Reused by flush_invalidations to avoid allocating each time.
+  std::vector<std::pair<VAddr, std::uint32_t>> invalidation_ranges;
+#ifdef TOUCHHLE_CODE_WRITE_TRACKING
+  // Null unless code writes are being tracked. This must be destroyed before
+  // the page table, which it modifies.
+  std::unique_ptr<CodeWriteTracker> code_write_tracker;
+#endif
+  // See src/objc/method_cache.rs.
+  const MethodCacheEntry *method_cache = nullptr;
+  // Entry points (with the Thumb bit) of blocks compiled while recording was
+  // enabled, in the order they were compiled.
+  bool record_blocks = false;
+  std::vector<std::uint32_t> recorded_blocks;
+  std::unordered_set<std::uint32_t> recorded_blocks_set;
+  // Null unless wall-clock preemption is in use.
+  std::unique_ptr<Watchdog> watchdog;
+  Stats stats = {};
+  // Number of times each SVC was executed, indexed by SVC number, for SVC
+  // numbers below MAX_COUNTED_SVC.
+  std::vector<std::uint64_t> svc_calls;
+};
 
 class Environment final : public Dynarmic::A32::UserCallbacks {
 public:
   Dynarmic::A32::Jit *cpu = nullptr;
   touchHLE_Mem *mem = nullptr;
+  // Used to access guest memory without calling into Rust, unless the access
+  // is going to fail, in which case touchHLE_cpu_read_u8 etc will report it.
+  const MemDescriptor *mem_descriptor = nullptr;
+  // If this is not null, SVCs for leaf host functions and objc_msgSend are
+  // handled without halting execution where possible. See
+  // touchHLE_cpu_classify_svc and touchHLE_cpu_call_leaf_svc in Rust.
+  void *svc_context = nullptr;
+  SharedState *shared = nullptr;
   std::uint64_t ticks_remaining;
   uint32_t halting_svc;
+  CodeCacheTracker code_cache;
+  // Set while Jit::Step() is running, see CodeCacheTracker::code_read.
+  bool single_stepping = false;
+
+  // Memory access for Interpreter. Unlike the callbacks used by dynarmic,
+  // these report a failed access rather than halting execution.
+  template <typename T> bool read_memory(VAddr vaddr, T &value) {
+    if (try_read_directly(vaddr, value)) {
+      return true;
+    }
+    bool error;
+    if constexpr (sizeof(T) == 1) {
+      value = touchHLE_cpu_read_u8(mem, vaddr, &error);
+    } else if constexpr (sizeof(T) == 2) {
+      value = touchHLE_cpu_read_u16(mem, vaddr, &error);
+    } else {
+      value = touchHLE_cpu_read_u32(mem, vaddr, &error);
+    }
+    return !error;
+  }
+  template <typename T> bool write_memory(VAddr vaddr, T value) {
+    if (try_write_directly(vaddr, value)) {
+      return true;
+    }
+    if constexpr (sizeof(T) == 1) {
+      return !touchHLE_cpu_write_u8(mem, vaddr, value);
+    } else if constexpr (sizeof(T) == 2) {
+      return !touchHLE_cpu_write_u16(mem, vaddr, value);
+    } else {
+      return !touchHLE_cpu_write_u32(mem, vaddr, value);
+    }
+  }
+
+  // Execute the instruction at PC with the interpreter. The CPU state is only
+  // updated if it was executed.
+  InterpreterResult interpret() {
+    Interpreter<Environment> interpreter(*this, cpu->Regs(), cpu->Cpsr());
+    InterpreterResult res = interpreter.step();
+    if (res == InterpreterResult::Executed) {
+      cpu->Regs() = interpreter.regs;
+      cpu->SetCpsr(interpreter.cpsr);
+    }
+    return res;
+  }
 
 private:
+  template <typename T> bool can_access_directly(VAddr vaddr) const {
+    return mem_descriptor && vaddr >= mem_descriptor->null_segment_size &&
+           std::uint64_t(vaddr) + sizeof(T) <= mem_descriptor->size;
+  }
+  template <typename T> bool try_read_directly(VAddr vaddr, T &value) const {
+    if (!can_access_directly<T>(vaddr)) {
+      return false;
+    }
+    std::memcpy(&value, mem_descriptor->base + vaddr, sizeof(T));
+    return true;
+  }
+  template <typename T> bool try_write_directly(VAddr vaddr, T value) const {
+    if (!can_access_directly<T>(vaddr)) {
+      return false;
+    }
+    std::memcpy(mem_descriptor->base + vaddr, &value, sizeof(T));
+    return true;
+  }
+  // Indexed by SVC number.
+  std::vector<SvcKind> svc_kinds;
+
+  SvcKind classify_svc(std::uint32_t svc) {
+    if (svc >= svc_kinds.size()) {
+      svc_kinds.resize(svc + 1, SvcKind::Unknown);
+    }
+    if (svc_kinds[svc] == SvcKind::Unknown) {
+      svc_kinds[svc] = SvcKind(touchHLE_cpu_classify_svc(svc_context, svc));
+    }
+    return svc_kinds[svc];
+  }
+
+  // Try to handle objc_msgSend using the method cache. On a hit, this
+  // tail-calls the method: LR still has the return address of the call to
+  // objc_msgSend, so the method will return directly to the caller.
+  bool try_cached_msg_send() {
+    const MethodCacheEntry *method_cache = shared->method_cache;
+    if (!method_cache) {
+      return false;
+    }
+    std::uint32_t receiver = cpu->Regs()[0];
+    std::uint32_t sel = cpu->Regs()[1];
+    if (receiver == 0) {
+      return false;
+    }
+    std::uint32_t isa;
+    if (!try_read_directly(receiver, isa)) {
+      return false;
+    }
+    const MethodCacheEntry &entry = method_cache[method_cache_index(isa, sel)];
+    if (entry.class_ != isa || entry.sel != sel) {
+      return false;
+    }
+    cpu->Regs()[15] = entry.imp & ~1u;
+    cpu->SetCpsr((cpu->Cpsr() & ~0x20u) | ((entry.imp & 1) ? 0x20 : 0));
+    return true;
+  }
+
+  void record_block(VAddr vaddr) {
+    // dynarmic only reads code when compiling a block, and PC is the start of
+    // that block while it does so. The first word it reads contains the first
+    // instruction.
+    std::uint32_t pc = cpu->Regs()[15];
+    if ((pc & ~3u) != vaddr) {
+      return;
+    }
+    std::uint32_t entry = pc | ((cpu->Cpsr() & 0x20) ? 1 : 0);
+    if (shared->recorded_blocks_set.insert(entry).second) {
+      shared->recorded_blocks.push_back(entry);
+    }
+  }
+
   std::uint8_t MemoryRead8(VAddr vaddr) override {
+    shared->stats.memory_reads[0]++;
+    std::uint8_t value;
+    if (try_read_directly(vaddr, value)) {
+      return value;
+    }
     bool error;
-    auto value = touchHLE_cpu_read_u8(mem, vaddr, &error);
+    value = touchHLE_cpu_read_u8(mem, vaddr, &error);
     if (error) {
       cpu->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
     }
     return value;
   }
   std::uint16_t MemoryRead16(VAddr vaddr) override {
+    shared->stats.memory_reads[1]++;
+    std::uint16_t value;
+    if (try_read_directly(vaddr, value)) {
+      return value;
+    }
     bool error;
-    auto value = touchHLE_cpu_read_u16(mem, vaddr, &error);
+    value = touchHLE_cpu_read_u16(mem, vaddr, &error);
     if (error) {
       cpu->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
     }
     return value;
   }
   std::uint32_t MemoryRead32(VAddr vaddr) override {
+    shared->stats.memory_reads[2]++;
+    std::uint32_t value;
+    if (try_read_directly(vaddr, value)) {
+      return value;
+    }
     bool error;
-    auto value = touchHLE_cpu_read_u32(mem, vaddr, &error);
+    value = touchHLE_cpu_read_u32(mem, vaddr, &error);
     if (error) {
       cpu->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
     }
     return value;
   }
   std::uint64_t MemoryRead64(VAddr vaddr) override {
+    shared->stats.memory_reads[3]++;
+    std::uint64_t value;
+    if (try_read_directly(vaddr, value)) {
+      return value;
+    }
     bool error;
-    auto value = touchHLE_cpu_read_u64(mem, vaddr, &error);
+    value = touchHLE_cpu_read_u64(mem, vaddr, &error);
     if (error) {
       cpu->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
     }
@@ -73,8 +758,22 @@ private:
   }
 
   std::optional<std::uint32_t> MemoryReadCode(VAddr vaddr) override {
+    if (shared->record_blocks) {
+      record_block(vaddr);
+    }
+    code_cache.code_read(cpu->Regs()[15], cpu->Cpsr() & 0x20, vaddr,
+                         single_stepping, shared->stats);
+    std::uint32_t value;
+    if (try_read_directly(vaddr, value)) {
+#ifdef TOUCHHLE_CODE_WRITE_TRACKING
+      if (shared->code_write_tracker) {
+        shared->code_write_tracker->track_code_page(vaddr);
+      }
+#endif
+      return value;
+    }
     bool error;
-    auto value = touchHLE_cpu_read_u32(mem, vaddr, &error);
+    value = touchHLE_cpu_read_u32(mem, vaddr, &error);
     if (error) {
       return std::nullopt;
     } else {
@@ -83,30 +782,84 @@ private:
   }
 
   void MemoryWrite8(VAddr vaddr, std::uint8_t value) override {
+    shared->stats.memory_writes[0]++;
+    if (try_write_directly(vaddr, value)) {
+      return;
+    }
     if (touchHLE_cpu_write_u8(mem, vaddr, value)) {
       cpu->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
     }
   }
   void MemoryWrite16(VAddr vaddr, std::uint16_t value) override {
+    shared->stats.memory_writes[1]++;
+    if (try_write_directly(vaddr, value)) {
+      return;
+    }
     if (touchHLE_cpu_write_u16(mem, vaddr, value)) {
       cpu->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
     }
   }
   void MemoryWrite32(VAddr vaddr, std::uint32_t value) override {
+    shared->stats.memory_writes[2]++;
+    if (try_write_directly(vaddr, value)) {
+      return;
+    }
     if (touchHLE_cpu_write_u32(mem, vaddr, value)) {
       cpu->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
     }
   }
   void MemoryWrite64(VAddr vaddr, std::uint64_t value) override {
+    shared->stats.memory_writes[3]++;
+    if (try_write_directly(vaddr, value)) {
+      return;
+    }
     if (touchHLE_cpu_write_u64(mem, vaddr, value)) {
       cpu->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
     }
   }
 
-  void InterpreterFallback(std::uint32_t, size_t) override {
-    abort(); // TODO
+  void InterpreterFallback(VAddr pc, size_t num_instructions) override {
+    cpu->Regs()[15] = pc;
+    for (size_t i = 0; i < num_instructions; i++) {
+      switch (interpret()) {
+      case InterpreterResult::Executed:
+        break;
+      case InterpreterResult::MemoryAbort:
+        cpu->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
+        return;
+      case InterpreterResult::Unsupported:
+        printf("Instruction at %#x is not supported by dynarmic or the "
+               "interpreter\n",
+               cpu->Regs()[15]);
+        abort();
+      }
+    }
   }
   void CallSVC(std::uint32_t svc) override {
+    if (svc < MAX_COUNTED_SVC) {
+      if (svc >= shared->svc_calls.size()) {
+        shared->svc_calls.resize(svc + 1, 0);
+      }
+      shared->svc_calls[svc]++;
+    }
+    if (svc_context) {
+      switch (classify_svc(svc)) {
+      case SvcKind::Leaf:
+        if (touchHLE_cpu_call_leaf_svc(svc_context, svc)) {
+          shared->stats.leaf_svcs++;
+          return;
+        }
+        break;
+      case SvcKind::ObjCMsgSend:
+        if (try_cached_msg_send()) {
+          shared->stats.cached_msg_sends++;
+          return;
+        }
+        break;
+      default:
+        break;
+      }
+    }
     halting_svc = svc;
     cpu->HaltExecution(HaltReasonSvc);
   }
@@ -135,41 +888,104 @@ private:
 };
 
 class DynarmicWrapper {
+  // This must outlive the Jit, which refers to the page table.
+  std::unique_ptr<SharedState> shared;
   Environment env;
   std::unique_ptr<Dynarmic::A32::Jit> cpu;
-  std::array<std::uint8_t *, Dynarmic::A32::UserConfig::NUM_PAGE_TABLE_ENTRIES>
-      page_table;
 
-public:
-  DynarmicWrapper(void *direct_memory_access_ptr, size_t null_page_count) {
-    Dynarmic::A32::UserConfig user_config;
-    user_config.callbacks = &env;
-    // TODO: only do this in debug builds? it's probably expensive
-    user_config.check_halt_on_memory_access = true;
+  static std::unique_ptr<SharedState>
+  new_shared_state(const DynarmicWrapperConfig &config) {
+    auto shared = std::make_unique<SharedState>();
+    shared->config = config;
+
+    void *direct_memory_access_ptr = config.direct_memory_access_ptr;
+    size_t null_page_count = config.null_page_count;
     if (direct_memory_access_ptr) {
       // Allow fast accesses to all pages other than the null page, which will
       // fall back to a memory callback, which will then abort execution.
-      // TODO: Eventually we should use dynarmic's true fastmem mode, but that
-      // requires using mmap/mprotect/etc on the host OS so we can still catch
-      // null pointer accesses.
-      page_table.fill((std::uint8_t *)direct_memory_access_ptr);
+      shared->page_table.fill((std::uint8_t *)direct_memory_access_ptr);
       // Note that the null page size is also defined in src/mem.rs.
       static_assert(1 << Dynarmic::A32::UserConfig::PAGE_BITS == 0x1000);
 
-      if (null_page_count > page_table.size()) {
+      if (null_page_count > shared->page_table.size()) {
         printf("Too many null pages, %zu requested but maximum is %zu.",
-               null_page_count, page_table.size());
+               null_page_count, shared->page_table.size());
         abort();
       }
       for (size_t i = 0; i < null_page_count; i++) {
-        page_table[i] = nullptr;
+        shared->page_table[i] = nullptr;
       }
-      user_config.page_table = &page_table;
+    }
+
+    if (config.wall_clock_ns_per_tick) {
+      shared->watchdog = std::make_unique<Watchdog>();
+    }
+#ifdef TOUCHHLE_CODE_WRITE_TRACKING
+    if (direct_memory_access_ptr && config.fastmem &&
+        config.track_code_writes) {
+      shared->code_write_tracker = std::make_unique<CodeWriteTracker>(
+          (std::uint8_t *)direct_memory_access_ptr, &shared->page_table,
+          &shared->invalidation_queue, VAddr(null_page_count * 0x1000));
+    }
+#endif
+    return shared;
+  }
+
+public:
+  DynarmicWrapper(const DynarmicWrapperConfig &config)
+      : shared(new_shared_state(config)) {
+    void *direct_memory_access_ptr = config.direct_memory_access_ptr;
+
+    Dynarmic::A32::UserConfig user_config;
+    user_config.callbacks = &env;
+    // This makes memory errors halt execution at the faulting instruction,
+    // rather than at the end of the block, but it's probably expensive.
+    user_config.check_halt_on_memory_access =
+        config.check_halt_on_memory_access;
+    if (!config.block_linking) {
+      user_config.optimizations =
+          user_config.optimizations & ~Dynarmic::OptimizationFlag::BlockLinking;
+    }
+    if (!config.fast_dispatch) {
+      user_config.optimizations =
+          user_config.optimizations & ~Dynarmic::OptimizationFlag::FastDispatch;
+    }
+    if (config.unsafe_optimizations) {
+      // These only affect the precision of floating-point results and the
+      // exact bit patterns of NaNs, not control flow.
+      user_config.unsafe_optimizations = true;
+      user_config.optimizations =
+          user_config.optimizations |
+          Dynarmic::OptimizationFlag::Unsafe_UnfuseFMA |
+          Dynarmic::OptimizationFlag::Unsafe_InaccurateNaN;
+    }
+    if (config.code_cache_size) {
+      user_config.code_cache_size = config.code_cache_size;
+    }
+    if (config.wall_clock_ns_per_tick) {
+      // AddTicks and GetTicksRemaining won't be called.
+      user_config.enable_cycle_counting = false;
+    }
+    if (direct_memory_access_ptr) {
+      user_config.page_table = &shared->page_table;
       user_config.absolute_offset_page_table = true;
     }
+    if (direct_memory_access_ptr && config.fastmem) {
+      // In fastmem mode, guest memory accesses are plain host memory accesses
+      // with no page table lookup. The null segment is protected by the host
+      // OS (see src/mem/host_memory.rs), so accessing it faults. dynarmic's
+      // fault handler then recompiles the offending block so that the access
+      // uses the page table above, which in turn falls back to a memory
+      // callback for the null page, which aborts execution.
+      user_config.fastmem_pointer =
+          reinterpret_cast<std::uintptr_t>(direct_memory_access_ptr);
+      user_config.recompile_on_fastmem_failure = true;
+    }
     cpu = std::make_unique<Dynarmic::A32::Jit>(user_config);
     env.cpu = cpu.get();
+    env.shared = shared.get();
   }
+  ~DynarmicWrapper() { env.code_cache.clear(shared->stats); }
 
   const std::uint32_t *regs() const { return &cpu->Regs().front(); }
   std::uint32_t *regs() { return &cpu->Regs().front(); }
@@ -177,41 +993,175 @@ public:
   std::uint32_t cpsr() const { return cpu->Cpsr(); }
   void set_cpsr(std::uint32_t cpsr) { cpu->SetCpsr(cpsr); }
 
+  // The invalidation happens before execution next resumes, see
+  // InvalidationQueue.
   void invalidate_cache_range(VAddr start, std::uint32_t size) {
-    cpu->InvalidateCacheRange(start, size);
+    shared->stats.invalidations++;
+    shared->stats.bytes_invalidated += size;
+    shared->invalidation_queue.push(start, size);
+  }
+
+  void flush_invalidations() {
+    Stats &stats = shared->stats;
+#ifdef TOUCHHLE_CODE_WRITE_TRACKING
+    if (shared->code_write_tracker) {
+      std::uint64_t faults =
+          shared->code_write_tracker->take_write_fault_count();
+      stats.code_write_faults += faults;
+      stats.invalidations += faults;
+    }
+#endif
+    auto &ranges = shared->invalidation_ranges;
+    bool ok = shared->invalidation_queue.take(ranges);
+    if (ok && ranges.empty()) {
+      return;
+    }
+    stats.invalidation_flushes++;
+    if (!ok) {
+      cpu->ClearCache();
+      env.code_cache.clear(stats);
+      return;
+    }
+    for (const auto &range : ranges) {
+      cpu->InvalidateCacheRange(range.first, range.second);
+      env.code_cache.invalidate(range.first, range.second, stats);
+    }
+  }
+
+  // Save the current state directly into out_context and load in_context,
+  // without going through a temporary. If both contexts were saved from this
+  // Jit and its code cache hasn't been invalidated since, dynarmic keeps its
+  // return stack buffer, so threads that alternate lose nothing here.
+  void switch_context(void *out_context, const void *in_context) {
+    shared->stats.context_switches++;
+    cpu->SaveContext(*(Dynarmic::A32::Context *)out_context);
+    cpu->LoadContext(*(const Dynarmic::A32::Context *)in_context);
+    // A real kernel clears the exclusive monitor on a context switch, so that
+    // a STREX can't succeed using another thread's LDREX.
+    cpu->ClearExclusiveState();
   }
 
-  void swap_context(void *context) {
-    Dynarmic::A32::Context tmp = cpu->SaveContext();
-    cpu->LoadContext(*(Dynarmic::A32::Context *)context);
-    *(Dynarmic::A32::Context *)context = tmp;
+  void set_method_cache(const void *method_cache) {
+    shared->method_cache = (const MethodCacheEntry *)method_cache;
   }
 
-  std::int32_t run_or_step(touchHLE_Mem *mem, std::uint64_t *ticks) {
+  void set_block_recording(bool enabled) { shared->record_blocks = enabled; }
+  const std::vector<std::uint32_t> &recorded_blocks() const {
+    return shared->recorded_blocks;
+  }
+
+  const Stats &stats() const { return shared->stats; }
+  const std::vector<std::uint64_t> &svc_calls() const {
+    return shared->svc_calls;
+  }
+
+  void precompile(touchHLE_Mem *mem, const MemDescriptor *mem_descriptor,
+                  const std::uint32_t *entries, size_t count) {
+    flush_invalidations();
+    env.mem = mem;
+    env.mem_descriptor = mem_descriptor;
+    env.ticks_remaining = 1;
+    Dynarmic::A32::Context context = cpu->SaveContext();
+    for (size_t i = 0; i < count; i++) {
+      cpu->Regs()[15] = entries[i] & ~1u;
+      cpu->SetCpsr((cpu->Cpsr() & ~0x20u) | ((entries[i] & 1) ? 0x20 : 0));
+      // Run() compiles the block at PC before it checks for a pending halt,
+      // so this compiles the block without executing any of it.
+      cpu->HaltExecution(HaltReasonPrecompile);
+      cpu->Run();
+      cpu->ClearHalt(HaltReasonPrecompile);
+    }
+    cpu->LoadContext(context);
+    env.mem = nullptr;
+    env.mem_descriptor = nullptr;
+  }
+
+  // Run with the tick budget converted to a wall-clock time slice.
+  Dynarmic::HaltReason run_with_watchdog(std::uint64_t ticks) {
+    using namespace std::chrono;
+    const nanoseconds slice(ticks * shared->config.wall_clock_ns_per_tick);
+    const auto start = steady_clock::now();
+    shared->watchdog->arm(cpu.get(), start + slice);
+    Dynarmic::HaltReason hr = cpu->Run();
+    shared->watchdog->disarm();
+    // The watchdog may have fired after execution halted for another reason.
+    cpu->ClearHalt(HaltReasonPreempt);
+
+    const auto elapsed = steady_clock::now() - start;
+    if (Dynarmic::Has(hr, HaltReasonPreempt) || elapsed >= slice) {
+      env.ticks_remaining = 0;
+    } else {
+      env.ticks_remaining = std::uint64_t((slice - elapsed).count()) /
+                            shared->config.wall_clock_ns_per_tick;
+    }
+    return hr;
+  }
+
+  // Single-step using the interpreter if possible, since Jit::Step() has to
+  // compile a block for each instruction. Instructions the interpreter
+  // doesn't support, including all that can halt for other reasons (SVCs,
+  // breakpoints, etc), are left to dynarmic.
+  Dynarmic::HaltReason step() {
+    switch (shared->config.interpreter ? env.interpret()
+                                       : InterpreterResult::Unsupported) {
+    case InterpreterResult::Executed:
+      shared->stats.interpreted_steps++;
+      return Dynarmic::HaltReason::Step;
+    case InterpreterResult::MemoryAbort:
+      return Dynarmic::HaltReason::MemoryAbort;
+    default: {
+      env.single_stepping = true;
+      Dynarmic::HaltReason hr = cpu->Step();
+      env.single_stepping = false;
+      return hr;
+    }
+    }
+  }
+
+  std::int32_t run_or_step(touchHLE_Mem *mem,
+                           const MemDescriptor *mem_descriptor,
+                           std::uint64_t *ticks, void *svc_context) {
+    flush_invalidations();
     env.mem = mem;
+    env.mem_descriptor = mem_descriptor;
+    // SVCs must always halt when stepping, e.g. so a debugger can see them.
+    env.svc_context = ticks ? svc_context : nullptr;
     Dynarmic::HaltReason hr;
-    if (ticks) {
+    if (ticks && shared->watchdog) {
+      hr = run_with_watchdog(*ticks);
+    } else if (ticks) {
       env.ticks_remaining = *ticks;
       hr = cpu->Run();
     } else {
-      hr = cpu->Step();
+      hr = step();
     }
     std::int32_t res;
-    if ((!hr && ticks) || (hr == Dynarmic::HaltReason::Step && !ticks)) {
+    Stats &stats = shared->stats;
+    if ((!hr && ticks) || (hr == HaltReasonPreempt && ticks)) {
+      res = -1;
+      stats.halts_out_of_ticks++;
+    } else if (hr == Dynarmic::HaltReason::Step && !ticks) {
       res = -1;
+      stats.steps++;
     } else if (Dynarmic::Has(hr, Dynarmic::HaltReason::MemoryAbort)) {
       res = -2;
+      stats.halts_memory_abort++;
     } else if (Dynarmic::Has(hr, HaltReasonUndefinedInstruction)) {
       res = -3;
+      stats.halts_undefined_instruction++;
     } else if (Dynarmic::Has(hr, HaltReasonBreakpoint)) {
       res = -4;
+      stats.halts_breakpoint++;
     } else if (Dynarmic::Has(hr, HaltReasonSvc)) {
       res = std::int32_t(env.halting_svc);
+      stats.halts_svc++;
     } else {
       printf("unhandled halt reason %u\n", unsigned(hr));
       abort();
     }
     env.mem = nullptr;
+    env.mem_descriptor = nullptr;
+    env.svc_context = nullptr;
     if (ticks) {
       *ticks = env.ticks_remaining;
     }
@@ -221,9 +1171,9 @@ public:
 
 extern "C" {
 
-DynarmicWrapper *touchHLE_DynarmicWrapper_new(void *direct_memory_access_ptr,
-                                              size_t null_page_count) {
-  return new DynarmicWrapper(direct_memory_access_ptr, null_page_count);
+DynarmicWrapper *
+touchHLE_DynarmicWrapper_new(const DynarmicWrapperConfig *config) {
+  return new DynarmicWrapper(*config);
 }
 void touchHLE_DynarmicWrapper_delete(DynarmicWrapper *cpu) { delete cpu; }
 
@@ -243,9 +1193,10 @@ void touchHLE_DynarmicWrapper_set_cpsr(DynarmicWrapper *cpu,
   cpu->set_cpsr(cpsr);
 }
 
-void touchHLE_DynarmicWrapper_swap_context(DynarmicWrapper *cpu,
-                                           void *context) {
-  cpu->swap_context(context);
+void touchHLE_DynarmicWrapper_switch_context(DynarmicWrapper *cpu,
+                                             void *out_context,
+                                             const void *in_context) {
+  cpu->switch_context(out_context, in_context);
 }
 
 void touchHLE_DynarmicWrapper_invalidate_cache_range(DynarmicWrapper *cpu,
@@ -254,10 +1205,42 @@ void touchHLE_DynarmicWrapper_invalidate_cache_range(DynarmicWrapper *cpu,
   cpu->invalidate_cache_range(start, size);
 }
 
-std::int32_t touchHLE_DynarmicWrapper_run_or_step(DynarmicWrapper *cpu,
-                                                  touchHLE_Mem *mem,
-                                                  std::uint64_t *ticks) {
-  return cpu->run_or_step(mem, ticks);
+std::int32_t
+touchHLE_DynarmicWrapper_run_or_step(DynarmicWrapper *cpu, touchHLE_Mem *mem,
+                                     const MemDescriptor *mem_descriptor,
+                                     std::uint64_t *ticks, void *svc_context) {
+  return cpu->run_or_step(mem, mem_descriptor, ticks, svc_context);
+}
+
+void touchHLE_DynarmicWrapper_set_method_cache(DynarmicWrapper *cpu,
+                                               const void *method_cache) {
+  cpu->set_method_cache(method_cache);
+}
+
+void touchHLE_DynarmicWrapper_set_block_recording(DynarmicWrapper *cpu,
+                                                  bool enabled) {
+  cpu->set_block_recording(enabled);
+}
+const std::uint32_t *
+touchHLE_DynarmicWrapper_recorded_blocks(const DynarmicWrapper *cpu,
+                                         size_t *count) {
+  *count = cpu->recorded_blocks().size();
+  return cpu->recorded_blocks().data();
+}
+// The results remain valid until the next call that runs the CPU.
+const Stats *touchHLE_DynarmicWrapper_stats(const DynarmicWrapper *cpu,
+                                            const std::uint64_t **svc_calls,
+                                            size_t *svc_call_count) {
+  *svc_calls = cpu->svc_calls().data();
+  *svc_call_count = cpu->svc_calls().size();
+  return &cpu->stats();
+}
+void touchHLE_DynarmicWrapper_precompile(DynarmicWrapper *cpu,
+                                         touchHLE_Mem *mem,
+                                         const MemDescriptor *mem_descriptor,
+                                         const std::uint32_t *entries,
+                                         size_t count) {
+  cpu->precompile(mem, mem_descriptor, entries, count);
 }
 
 void *touchHLE_DynarmicWrapper_Context_new() {
@@ -23,31 +23,151 @@ pub type Dynarmic_A32_Context = std::ffi::c_void;
 
 type VAddr = u32;
 
+/// Where guest memory is, so the wrapper can access it directly without calling
+/// back into Rust, except for accesses that may fail. Keep in sync with
+/// `MemDescriptor` in lib.cpp.
+#[allow(non_camel_case_types)]
+#[repr(C)]
+pub struct touchHLE_DynarmicWrapper_MemDescriptor {
+    pub base: *mut u8,
+    /// Size of the guest address space in bytes.
+    pub size: u64,
+    /// Accesses below this address always fail.
+    pub null_segment_size: u32,
+}
+
+/// Options for [touchHLE_DynarmicWrapper_new]. Keep in sync with
+/// `DynarmicWrapperConfig` in lib.cpp.
+#[allow(non_camel_case_types)]
+#[repr(C)]
+pub struct touchHLE_DynarmicWrapper_Config {
+    /// Null if direct memory access is not in use.
+    pub direct_memory_access_ptr: *mut std::ffi::c_void,
+    pub null_page_count: usize,
+    pub fastmem: bool,
+    /// Write-protect pages containing compiled code on the host, so that
+    /// writes to them are detected and the code invalidated automatically.
+    /// Only has an effect in fastmem mode on POSIX hosts, see
+    /// `CodeWriteTracker` in lib.cpp.
+    pub track_code_writes: bool,
+    pub check_halt_on_memory_access: bool,
+    pub unsafe_optimizations: bool,
+    pub block_linking: bool,
+    pub fast_dispatch: bool,
+    /// Whether single steps are done by the wrapper's interpreter where it
+    /// supports the instruction. This is only turned off to test the
+    /// interpreter against dynarmic.
+    pub interpreter: bool,
+    /// In bytes. 0 means dynarmic's default.
+    pub code_cache_size: u32,
+    /// If this is not 0, dynarmic's cycle counting is disabled, and instead a
+    /// host thread halts execution once the ticks passed to
+    /// [touchHLE_DynarmicWrapper_run_or_step] have elapsed in wall-clock time,
+    /// with each tick lasting this many nanoseconds.
+    pub wall_clock_ns_per_tick: u32,
+}
+
+/// Counters kept by the wrapper, see [touchHLE_DynarmicWrapper_stats]. Keep in
+/// sync with `Stats` in lib.cpp.
+#[allow(non_camel_case_types)]
+#[repr(C)]
+#[derive(Copy, Clone, Debug, Default)]
+pub struct touchHLE_DynarmicWrapper_Stats {
+    /// Results of [touchHLE_DynarmicWrapper_run_or_step].
+    pub halts_svc: u64,
+    pub halts_memory_abort: u64,
+    pub halts_undefined_instruction: u64,
+    pub halts_breakpoint: u64,
+    /// Ran out of ticks, or was preempted by the host thread.
+    pub halts_out_of_ticks: u64,
+    pub steps: u64,
+    /// Steps done by the wrapper's interpreter rather than by dynarmic.
+    pub interpreted_steps: u64,
+    /// SVCs for leaf functions that were handled without halting.
+    pub leaf_svcs: u64,
+    /// `objc_msgSend` calls that were handled by the method cache without
+    /// halting.
+    pub cached_msg_sends: u64,
+    /// Memory callback invocations (accesses not done through the page table
+    /// or fastmem), indexed by log2 of the access size in bytes.
+    pub memory_reads: [u64; 4],
+    pub memory_writes: [u64; 4],
+    /// Invalidation requests, and how many times the queued requests were
+    /// applied. Requests are applied together before execution next resumes.
+    pub invalidations: u64,
+    pub bytes_invalidated: u64,
+    pub invalidation_flushes: u64,
+    /// Writes to pages containing compiled code, which each cause an
+    /// invalidation (see [touchHLE_DynarmicWrapper_Config::track_code_writes]).
+    pub code_write_faults: u64,
+    /// Blocks compiled, how many of those were compiled again while still
+    /// cached as far as the wrapper can tell (e.g. after a fastmem fault), and
+    /// how many times the code cache was flushed because it was full.
+    /// dynarmic doesn't report flushes, so they're inferred from many blocks
+    /// being compiled again.
+    pub blocks_compiled: u64,
+    pub blocks_recompiled: u64,
+    pub code_cache_flushes: u64,
+    /// Size of the guest code the blocks currently in the code caches were
+    /// compiled from. This is a current value rather than a count.
+    pub code_cache_guest_bytes: u64,
+    pub context_switches: u64,
+}
+
 // Import functions from lib.cpp, see build.rs. Note that lib.cpp depends on
 // some functions being exported from Rust, but those are in the main crate.
 extern "C" {
     pub fn touchHLE_DynarmicWrapper_new(
-        dynamic_memory_access_ptr: *mut std::ffi::c_void,
-        null_page_count: usize,
+        config: *const touchHLE_DynarmicWrapper_Config,
     ) -> *mut touchHLE_DynarmicWrapper;
     pub fn touchHLE_DynarmicWrapper_delete(cpu: *mut touchHLE_DynarmicWrapper);
     pub fn touchHLE_DynarmicWrapper_regs_const(cpu: *const touchHLE_DynarmicWrapper) -> *const u32;
     pub fn touchHLE_DynarmicWrapper_regs_mut(cpu: *mut touchHLE_DynarmicWrapper) -> *mut u32;
     pub fn touchHLE_DynarmicWrapper_cpsr(cpu: *const touchHLE_DynarmicWrapper) -> u32;
     pub fn touchHLE_DynarmicWrapper_set_cpsr(cpu: *mut touchHLE_DynarmicWrapper, cpsr: u32);
-    pub fn touchHLE_DynarmicWrapper_swap_context(
+    pub fn touchHLE_DynarmicWrapper_switch_context(
         cpu: *mut touchHLE_DynarmicWrapper,
-        context: *mut Dynarmic_A32_Context,
+        out_context: *mut Dynarmic_A32_Context,
+        in_context: *const Dynarmic_A32_Context,
     );
     pub fn touchHLE_DynarmicWrapper_invalidate_cache_range(
         cpu: *mut touchHLE_DynarmicWrapper,
         start: VAddr,
         size: u32,
     );
+    pub fn touchHLE_DynarmicWrapper_set_method_cache(
+        cpu: *mut touchHLE_DynarmicWrapper,
+        method_cache: *const std::ffi::c_void,
+    );
+    pub fn touchHLE_DynarmicWrapper_set_block_recording(
+        cpu: *mut touchHLE_DynarmicWrapper,
+        enabled: bool,
+    );
+    pub fn touchHLE_DynarmicWrapper_recorded_blocks(
+        cpu: *const touchHLE_DynarmicWrapper,
+        count: *mut usize,
+    ) -> *const u32;
+    /// Get the counters, and the number of times each SVC was executed
+    /// (indexed by SVC number). The results remain valid until the next call
+    /// that runs the CPU.
+    pub fn touchHLE_DynarmicWrapper_stats(
+        cpu: *const touchHLE_DynarmicWrapper,
+        svc_calls: *mut *const u64,
+        svc_call_count: *mut usize,
+    ) -> *const touchHLE_DynarmicWrapper_Stats;
+    pub fn touchHLE_DynarmicWrapper_precompile(
+        cpu: *mut touchHLE_DynarmicWrapper,
+        mem: *mut touchHLE_Mem,
+        mem_descriptor: *const touchHLE_DynarmicWrapper_MemDescriptor,
+        entries: *const u32,
+        count: usize,
+    );
     pub fn touchHLE_DynarmicWrapper_run_or_step(
         cpu: *mut touchHLE_DynarmicWrapper,
         mem: *mut touchHLE_Mem,
+        mem_descriptor: *const touchHLE_DynarmicWrapper_MemDescriptor,
         ticks: Option<&mut u64>,
+        svc_context: *mut std::ffi::c_void,
     ) -> i32;
 
     pub fn touchHLE_DynarmicWrapper_Context_new() -> *mut Dynarmic_A32_Context;
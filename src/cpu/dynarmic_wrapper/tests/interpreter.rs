@@ -0,0 +1,794 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Differential tests of the wrapper's interpreter (interpreter.h) against
+//! dynarmic. Each case is a single instruction, which is stepped once by a CPU
+//! that uses the interpreter and once by a CPU that always uses
+//! `Jit::Step()`, and the resulting registers, CPSR and memory must match.
+//! Run with `cargo test -p touchHLE_dynarmic_wrapper`.
+//!
+//! As in the benchmarks, the wrapper's calls into the main crate are provided
+//! by this file, backed by a plain buffer rather than touchHLE's `Mem`.
+
+use std::ffi::c_void;
+use std::ops::Range;
+use touchHLE_dynarmic_wrapper::*;
+
+/// Size of the guest address space that is backed by memory. Accesses beyond
+/// it fail, so instructions with arbitrary addresses are safe to step.
+const MEM_SIZE: usize = 256 * 1024;
+/// Accesses below this address fail, as with touchHLE's null segment.
+const NULL_SEGMENT_SIZE: u32 = 0x1000;
+/// Where each case's code is loaded. The region is cleared first.
+const CODE_ADDR: u32 = 0x10000;
+const CODE_SIZE: usize = 0x100;
+/// Memory that the default registers point into, which is filled with
+/// [data_pattern] before each step.
+const DATA_ADDR: u32 = 0x20000;
+const DATA_SIZE: usize = 0x1000;
+const STACK_ADDR: u32 = DATA_ADDR + 0x800;
+
+const CPSR_N: u32 = 1 << 31;
+const CPSR_Z: u32 = 1 << 30;
+const CPSR_C: u32 = 1 << 29;
+const CPSR_V: u32 = 1 << 28;
+const CPSR_THUMB: u32 = 0x00000020;
+const CPSR_USER_MODE: u32 = 0x00000010;
+
+/// Every combination of the NZCV flags.
+fn all_flags() -> impl Iterator<Item = u32> {
+    (0..16).map(|i| i << 28)
+}
+
+fn data_pattern(offset: usize) -> u8 {
+    (offset as u32).wrapping_mul(0x9D).wrapping_add(0x37) as u8
+}
+
+struct Memory {
+    bytes: Vec<u8>,
+}
+
+impl Memory {
+    fn range(&self, addr: u32, size: usize) -> Option<Range<usize>> {
+        let start = addr as usize;
+        if addr < NULL_SEGMENT_SIZE || start + size > self.bytes.len() {
+            None
+        } else {
+            Some(start..start + size)
+        }
+    }
+}
+
+macro_rules! mem_callbacks {
+    ($read:ident, $write:ident, $type:ty) => {
+        #[no_mangle]
+        extern "C" fn $read(mem: *mut touchHLE_Mem, addr: u32, error: *mut bool) -> $type {
+            let mem = unsafe { &*(mem as *const Memory) };
+            let range = mem.range(addr, std::mem::size_of::<$type>());
+            unsafe { error.write(range.is_none()) };
+            range.map_or(0, |range| {
+                <$type>::from_le_bytes(mem.bytes[range].try_into().unwrap())
+            })
+        }
+        #[no_mangle]
+        extern "C" fn $write(mem: *mut touchHLE_Mem, addr: u32, value: $type) -> bool {
+            let mem = unsafe { &mut *(mem as *mut Memory) };
+            let Some(range) = mem.range(addr, std::mem::size_of::<$type>()) else {
+                return false;
+            };
+            mem.bytes[range].copy_from_slice(&value.to_le_bytes());
+            true
+        }
+    };
+}
+mem_callbacks!(touchHLE_cpu_read_u8, touchHLE_cpu_write_u8, u8);
+mem_callbacks!(touchHLE_cpu_read_u16, touchHLE_cpu_write_u16, u16);
+mem_callbacks!(touchHLE_cpu_read_u32, touchHLE_cpu_write_u32, u32);
+mem_callbacks!(touchHLE_cpu_read_u64, touchHLE_cpu_write_u64, u64);
+
+// SVCs always halt when stepping, so these are never called.
+#[no_mangle]
+extern "C" fn touchHLE_cpu_classify_svc(_svc_context: *mut c_void, _svc: u32) -> u8 {
+    unreachable!()
+}
+#[no_mangle]
+extern "C" fn touchHLE_cpu_call_leaf_svc(_svc_context: *mut c_void, _svc: u32) -> bool {
+    unreachable!()
+}
+
+/// An instruction to step, and the state to step it from.
+#[derive(Clone, Debug)]
+struct Case {
+    thumb: bool,
+    /// A32 words or Thumb halfwords, loaded at [CODE_ADDR].
+    code: Vec<u32>,
+    pc: u32,
+    /// `r0` to `r14`.
+    regs: [u32; 15],
+    /// NZCV flags, in their CPSR positions.
+    flags: u32,
+    /// Words to write over the data pattern, as (address, value) pairs.
+    words: Vec<(u32, u32)>,
+}
+
+impl Case {
+    fn new(thumb: bool, code: Vec<u32>) -> Case {
+        let mut regs = [0; 15];
+        for (i, reg) in regs.iter_mut().enumerate().take(13) {
+            *reg = DATA_ADDR + 0x100 + 0x10 * i as u32;
+        }
+        regs[13] = STACK_ADDR;
+        regs[14] = CODE_ADDR + 0x201;
+        Case {
+            thumb,
+            code,
+            pc: CODE_ADDR,
+            regs,
+            flags: 0,
+            words: Vec::new(),
+        }
+    }
+    fn arm(instr: u32) -> Case {
+        Case::new(false, vec![instr])
+    }
+    fn thumb(instrs: &[u16]) -> Case {
+        Case::new(true, instrs.iter().map(|&i| i.into()).collect())
+    }
+
+    fn reg(mut self, n: usize, value: u32) -> Case {
+        self.regs[n] = value;
+        self
+    }
+    fn flags(mut self, flags: u32) -> Case {
+        self.flags = flags;
+        self
+    }
+    fn word(mut self, addr: u32, value: u32) -> Case {
+        self.words.push((addr, value));
+        self
+    }
+    fn pc(mut self, pc: u32) -> Case {
+        self.pc = pc;
+        self
+    }
+
+    fn code_bytes(&self) -> Vec<u8> {
+        if self.thumb {
+            self.code
+                .iter()
+                .flat_map(|&i| (i as u16).to_le_bytes())
+                .collect()
+        } else {
+            self.code.iter().flat_map(|i| i.to_le_bytes()).collect()
+        }
+    }
+}
+
+/// A CPU and its guest memory.
+struct Guest {
+    cpu: *mut touchHLE_DynarmicWrapper,
+    memory: Box<Memory>,
+}
+
+impl Guest {
+    fn new(interpreter: bool) -> Guest {
+        let memory = Box::new(Memory {
+            bytes: vec![0u8; MEM_SIZE],
+        });
+        // Memory callbacks are used rather than a page table, because the page
+        // table would cover the whole address space, not just the buffer.
+        let config = touchHLE_DynarmicWrapper_Config {
+            direct_memory_access_ptr: std::ptr::null_mut(),
+            null_page_count: (NULL_SEGMENT_SIZE / 0x1000) as usize,
+            fastmem: false,
+            track_code_writes: false,
+            check_halt_on_memory_access: true,
+            unsafe_optimizations: false,
+            block_linking: true,
+            fast_dispatch: true,
+            interpreter,
+            code_cache_size: 0,
+            wall_clock_ns_per_tick: 0,
+        };
+        let cpu = unsafe { touchHLE_DynarmicWrapper_new(&config) };
+        Guest { cpu, memory }
+    }
+
+    fn load(&mut self, case: &Case) {
+        let code = case.code_bytes();
+        let bytes = &mut self.memory.bytes;
+        let code_region = &mut bytes[CODE_ADDR as usize..][..CODE_SIZE];
+        code_region.fill(0);
+        code_region[..code.len()].copy_from_slice(&code);
+        let data_region = &mut bytes[DATA_ADDR as usize..][..DATA_SIZE];
+        for (i, byte) in data_region.iter_mut().enumerate() {
+            *byte = data_pattern(i);
+        }
+        for &(addr, value) in &case.words {
+            bytes[addr as usize..][..4].copy_from_slice(&value.to_le_bytes());
+        }
+
+        unsafe {
+            // The previous case's code is probably still compiled.
+            touchHLE_DynarmicWrapper_invalidate_cache_range(self.cpu, CODE_ADDR, CODE_SIZE as u32);
+            let regs = touchHLE_DynarmicWrapper_regs_mut(self.cpu);
+            for (i, &value) in case.regs.iter().enumerate() {
+                *regs.add(i) = value;
+            }
+            *regs.add(15) = case.pc;
+            let thumb = if case.thumb { CPSR_THUMB } else { 0 };
+            touchHLE_DynarmicWrapper_set_cpsr(self.cpu, CPSR_USER_MODE | thumb | case.flags);
+        }
+    }
+
+    fn step(&mut self) -> i32 {
+        let descriptor = touchHLE_DynarmicWrapper_MemDescriptor {
+            base: self.memory.bytes.as_mut_ptr(),
+            size: MEM_SIZE as u64,
+            null_segment_size: NULL_SEGMENT_SIZE,
+        };
+        let mem: *mut Memory = &mut *self.memory;
+        unsafe {
+            touchHLE_DynarmicWrapper_run_or_step(
+                self.cpu,
+                mem.cast(),
+                &descriptor,
+                None,
+                std::ptr::null_mut(),
+            )
+        }
+    }
+
+    fn regs(&self) -> [u32; 16] {
+        let regs = unsafe { touchHLE_DynarmicWrapper_regs_const(self.cpu) };
+        std::array::from_fn(|i| unsafe { *regs.add(i) })
+    }
+    fn cpsr(&self) -> u32 {
+        unsafe { touchHLE_DynarmicWrapper_cpsr(self.cpu) }
+    }
+    fn interpreted_steps(&self) -> u64 {
+        let mut svc_calls = std::ptr::null();
+        let mut svc_call_count = 0;
+        unsafe {
+            (*touchHLE_DynarmicWrapper_stats(self.cpu, &mut svc_calls, &mut svc_call_count))
+                .interpreted_steps
+        }
+    }
+}
+
+impl Drop for Guest {
+    fn drop(&mut self) {
+        unsafe { touchHLE_DynarmicWrapper_delete(self.cpu) }
+    }
+}
+
+/// A CPU that uses the interpreter and one that doesn't.
+struct Pair {
+    interpreter: Guest,
+    jit: Guest,
+}
+
+impl Pair {
+    fn new() -> Pair {
+        Pair {
+            interpreter: Guest::new(true),
+            jit: Guest::new(false),
+        }
+    }
+
+    /// Step both CPUs and compare the results. Returns whether the interpreter
+    /// executed the instruction, rather than leaving it to dynarmic.
+    ///
+    /// When an access fails, the state afterwards can differ (dynarmic may
+    /// have done the rest of the instruction), so only the result is compared.
+    fn check(&mut self, case: &Case) -> bool {
+        self.interpreter.load(case);
+        self.jit.load(case);
+        let steps_before = self.interpreter.interpreted_steps();
+        let res = self.interpreter.step();
+        let interpreted = self.interpreter.interpreted_steps() != steps_before;
+        let expected = self.jit.step();
+        assert_eq!(res, expected, "Result differs for {:#x?}", case);
+        if res == -2 {
+            return false;
+        }
+
+        assert_eq!(
+            self.interpreter.regs(),
+            self.jit.regs(),
+            "Registers differ for {:#x?}",
+            case
+        );
+        assert_eq!(
+            self.interpreter.cpsr(),
+            self.jit.cpsr(),
+            "CPSR differs for {:#x?}",
+            case
+        );
+        let a = &self.interpreter.memory.bytes;
+        let b = &self.jit.memory.bytes;
+        if let Some(addr) = a.iter().zip(b.iter()).position(|(a, b)| a != b) {
+            panic!("Memory at {:#x} differs for {:#x?}", addr, case);
+        }
+        interpreted
+    }
+
+    /// [Pair::check] for an instruction the interpreter is meant to support.
+    fn check_interpreted(&mut self, case: Case) {
+        assert!(self.check(&case), "Not interpreted: {:#x?}", case);
+    }
+}
+
+/// xorshift64, so the random cases are the same on every run.
+struct Rng(u64);
+
+impl Rng {
+    fn next_u32(&mut self) -> u32 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        (self.0 >> 32) as u32
+    }
+    fn below(&mut self, n: u32) -> u32 {
+        self.next_u32() % n
+    }
+    /// A register value, which is often one that's an edge case for shifts or
+    /// arithmetic.
+    fn value(&mut self) -> u32 {
+        const INTERESTING: [u32; 12] = [
+            0,
+            1,
+            2,
+            31,
+            32,
+            33,
+            255,
+            256,
+            0x7FFF_FFFF,
+            0x8000_0000,
+            0x8000_0001,
+            0xFFFF_FFFF,
+        ];
+        if self.below(2) == 0 {
+            INTERESTING[self.below(INTERESTING.len() as u32) as usize]
+        } else {
+            self.next_u32()
+        }
+    }
+    fn case(&mut self, mut case: Case) -> Case {
+        for reg in &mut case.regs {
+            *reg = self.value();
+        }
+        case.flags(self.below(16) << 28)
+    }
+}
+
+/// Change the condition of an A32 instruction.
+fn arm_cond(cond: u32, instr: u32) -> u32 {
+    (instr & 0x0FFF_FFFF) | (cond << 28)
+}
+/// A32 `b` or `bl`. As with all of these, `imm32` is relative to the value
+/// read from PC.
+fn arm_b(link: bool, imm32: i32) -> u32 {
+    0xEA00_0000 | (u32::from(link) << 24) | ((imm32 >> 2) as u32 & 0x00FF_FFFF)
+}
+/// A32 `blx` (immediate).
+fn arm_blx(imm32: i32) -> u32 {
+    0xFA00_0000 | ((((imm32 >> 1) & 1) as u32) << 24) | ((imm32 >> 2) as u32 & 0x00FF_FFFF)
+}
+/// Thumb `bl` or `blx` (immediate). For `blx`, PC is aligned down to 4 first.
+fn thumb_bl(exchange: bool, imm32: i32) -> [u16; 2] {
+    let imm = imm32 as u32;
+    let s = (imm >> 24) & 1;
+    let j1 = (((imm >> 23) & 1) ^ 1) ^ s;
+    let j2 = (((imm >> 22) & 1) ^ 1) ^ s;
+    let hw1 = 0xF000 | (s << 10) | ((imm >> 12) & 0x3FF);
+    let hw2 =
+        0xC000 | (j1 << 13) | (u32::from(!exchange) << 12) | (j2 << 11) | ((imm >> 1) & 0x7FF);
+    [hw1 as u16, hw2 as u16]
+}
+
+#[test]
+fn arm_data_processing_shifts() {
+    let mut pair = Pair::new();
+    for shift_type in 0..4 {
+        for value in [0x8000_0001, 0x7FFF_FFFE, 1] {
+            for carry in [0, CPSR_C] {
+                // An immediate of 0 means a shift by 32 for LSR and ASR, and
+                // RRX for ROR.
+                for imm5 in [0, 1, 2, 31] {
+                    let shift = (imm5 << 7) | (shift_type << 5);
+                    for instr in [
+                        0xE1B0_0001, // movs r0, r1, <shift> #imm5
+                        0xE1A0_0001, // mov r0, r1, <shift> #imm5
+                        0xE0B3_0001, // adcs r0, r3, r1, <shift> #imm5
+                    ] {
+                        let case = Case::arm(instr | shift).reg(1, value);
+                        pair.check_interpreted(case.flags(carry));
+                    }
+                }
+                for amount in [0, 1, 31, 32, 33, 255, 256] {
+                    let shift = shift_type << 5;
+                    for instr in [
+                        0xE1B0_0211, // movs r0, r1, <shift> r2
+                        0xE083_0211, // add r0, r3, r1, <shift> r2
+                        0xE1F0_0211, // mvns r0, r1, <shift> r2
+                    ] {
+                        let case = Case::arm(instr | shift).reg(1, value);
+                        pair.check_interpreted(case.reg(2, amount).flags(carry));
+                    }
+                }
+            }
+        }
+    }
+}
+
+#[test]
+fn arm_data_processing_immediate() {
+    let mut pair = Pair::new();
+    for value in [0, 1, 0x7FFF_FFFF, 0x8000_0000, 0xFFFF_FFFF] {
+        for flags in all_flags() {
+            for instr in [
+                0xE3B0_0102, // movs r0, #0x80000000
+                0xE3B0_00FF, // movs r0, #255
+                0xE251_0001, // subs r0, r1, #1
+                0xE271_0000, // rsbs r0, r1, #0
+                0xE2D1_0001, // sbcs r0, r1, #1
+                0xE2F1_0000, // rscs r0, r1, #0
+                0xE2B1_0001, // adcs r0, r1, #1
+                0xE351_0001, // cmp r1, #1
+                0xE371_0001, // cmn r1, #1
+                0xE331_0102, // teq r1, #0x80000000
+                0xE311_0001, // tst r1, #1
+                0xE3D1_00FF, // bics r0, r1, #255
+                0xE211_0102, // ands r0, r1, #0x80000000
+                0xE231_00FF, // eors r0, r1, #255
+                0xE391_0001, // orrs r0, r1, #1
+                0xE3F0_0000, // mvns r0, #0
+                0xE301_0234, // movw r0, #0x1234
+                0xE34A_1BCD, // movt r1, #0xABCD
+            ] {
+                pair.check_interpreted(Case::arm(instr).reg(1, value).flags(flags));
+            }
+        }
+    }
+}
+
+#[test]
+fn arm_data_processing_pc() {
+    let mut pair = Pair::new();
+    for target in [CODE_ADDR + 0x100, CODE_ADDR + 0x101] {
+        // mov pc, lr
+        pair.check_interpreted(Case::arm(0xE1A0_F00E).reg(14, target));
+    }
+    for index in 0..4 {
+        // add pc, pc, r0, lsl #2
+        pair.check_interpreted(Case::arm(0xE08F_F100).reg(0, index));
+    }
+    pair.check_interpreted(Case::arm(0xE28F_0004)); // add r0, pc, #4
+    pair.check_interpreted(Case::arm(0xE1A0_000F)); // mov r0, pc
+    pair.check_interpreted(Case::arm(0xE041_008F)); // sub r0, r1, pc, lsl #1
+}
+
+#[test]
+fn arm_data_processing_random() {
+    let mut rng = Rng(0x2545_F491_4F6C_DD1D);
+    let mut pair = Pair::new();
+    let count = 20000;
+    let mut interpreted = 0;
+    for _ in 0..count {
+        let mut instr = (rng.below(15) << 28) | (rng.next_u32() & 0x03FF_FFFF);
+        if (instr >> 25) & 1 == 0 && instr & 0x90 == 0x90 {
+            // Make it a register-shifted register rather than a multiply etc.
+            instr &= !0x80;
+        }
+        let opcode = (instr >> 21) & 0xF;
+        if (0x8..=0xB).contains(&opcode) {
+            // Comparisons always set flags (the encodings that don't are
+            // other instructions), and Rd should be 0.
+            instr = (instr | (1 << 20)) & !0xF000;
+        } else if (instr >> 12) & 0xF == 15 {
+            // Writing to PC is only tested for well-defined targets, see
+            // arm_data_processing_pc.
+            instr &= !0x1000;
+        }
+        if opcode == 0xD || opcode == 0xF {
+            // Rn should be 0 for MOV and MVN.
+            instr &= !0xF_0000;
+        }
+        if pair.check(&rng.case(Case::arm(instr))) {
+            interpreted += 1;
+        }
+    }
+    // Register-shifted register instructions using PC are unsupported.
+    assert!(
+        interpreted > count * 3 / 4,
+        "Only {} interpreted",
+        interpreted
+    );
+}
+
+#[test]
+fn thumb_data_processing() {
+    let mut pair = Pair::new();
+    for value in [0x8000_0001, 0x7FFF_FFFE, 1, 0] {
+        for carry in [0, CPSR_C] {
+            for op in 0..3 {
+                for imm5 in [0, 1, 2, 31] {
+                    // lsls/lsrs/asrs r0, r1, #imm5
+                    let instr = (op << 11) | (imm5 << 6) | (1 << 3);
+                    let case = Case::thumb(&[instr]).reg(1, value);
+                    pair.check_interpreted(case.flags(carry));
+                }
+            }
+            for op in [0x2, 0x3, 0x4, 0x7] {
+                for amount in [0, 1, 31, 32, 33, 255, 256] {
+                    // lsls/lsrs/asrs/rors r0, r1
+                    let instr = 0x4000 | (op << 6) | (1 << 3);
+                    let case = Case::thumb(&[instr]).reg(0, value);
+                    pair.check_interpreted(case.reg(1, amount).flags(carry));
+                }
+            }
+        }
+    }
+
+    for value in [0, 1, 0x7FFF_FFFF, 0x8000_0000, 0xFFFF_FFFF, 0x1234_8765] {
+        for flags in all_flags() {
+            for instr in [
+                0x1888, // adds r0, r1, r2
+                0x1FC8, // subs r0, r1, #7
+                0x28FF, // cmp r0, #255
+                0x4148, // adcs r0, r1
+                0x4188, // sbcs r0, r1
+                0x4248, // rsbs r0, r1, #0
+                0x4348, // muls r0, r1
+                0x43C8, // mvns r0, r1
+                0x42C8, // cmn r0, r1
+                0x4208, // tst r0, r1
+                0x4480, // add r8, r0
+                0x4478, // add r0, pc
+                0x4678, // mov r0, pc
+                0x4580, // cmp r8, r0
+                0xB208, // sxth r0, r1
+                0xB248, // sxtb r0, r1
+                0xB288, // uxth r0, r1
+                0xB2C8, // uxtb r0, r1
+                0xA002, // adr r0, #8
+                0xA802, // add r0, sp, #8
+                0xB004, // add sp, #16
+                0xB084, // sub sp, #16
+            ] {
+                let case = Case::thumb(&[instr]).reg(1, value).reg(8, !value);
+                pair.check_interpreted(case.reg(0, value ^ 0x8000).flags(flags));
+            }
+        }
+    }
+
+    // add pc, r0
+    pair.check_interpreted(Case::thumb(&[0x4487]).reg(0, 0x100));
+    for target in [CODE_ADDR + 0x100, CODE_ADDR + 0x101] {
+        // mov pc, lr
+        pair.check_interpreted(Case::thumb(&[0x46F7]).reg(14, target));
+    }
+}
+
+#[test]
+fn thumb_data_processing_random() {
+    let mut rng = Rng(0x9E37_79B9_7F4A_7C15);
+    let mut pair = Pair::new();
+    for _ in 0..20000 {
+        // Shift (immediate), add, subtract, move, and compare, or data
+        // processing (A6.2.1 and A6.2.2)
+        let instr = if rng.below(4) == 0 {
+            0x4000 | (rng.next_u32() & 0x3FF)
+        } else {
+            rng.next_u32() & 0x3FFF
+        };
+        pair.check_interpreted(rng.case(Case::thumb(&[instr as u16])));
+    }
+}
+
+#[test]
+fn arm_load_store() {
+    let mut pair = Pair::new();
+    for instr in [
+        0xE5B1_0004, // ldr r0, [r1, #4]!
+        0xE451_0001, // ldrb r0, [r1], #-1
+        0xE781_0102, // str r0, [r1, r2, lsl #2]
+        0xE541_0003, // strb r0, [r1, #-3]
+        0xE51F_0004, // ldr r0, [pc, #-4]
+    ] {
+        pair.check_interpreted(Case::arm(instr).reg(2, 3));
+    }
+    for target in [CODE_ADDR + 0x100, CODE_ADDR + 0x101] {
+        // ldr pc, [sp], #4
+        let case = Case::arm(0xE49D_F004).word(STACK_ADDR, target);
+        pair.check_interpreted(case);
+    }
+    // Failing accesses
+    for addr in [0, NULL_SEGMENT_SIZE - 4, MEM_SIZE as u32 - 2] {
+        pair.check(&Case::arm(0xE591_0000).reg(1, addr)); // ldr r0, [r1]
+        pair.check(&Case::arm(0xE581_0000).reg(1, addr)); // str r0, [r1]
+    }
+}
+
+#[test]
+fn thumb_load_store() {
+    let mut pair = Pair::new();
+    for instr in [
+        0x4802, // ldr r0, [pc, #8]
+        0x684A, // ldr r2, [r1, #4]
+        0x80C8, // strh r0, [r1, #6]
+        0x5688, // ldrsb r0, [r1, r2]
+        0x5E88, // ldrsh r0, [r1, r2]
+        0x9001, // str r0, [sp, #4]
+        0x7FCB, // ldrb r3, [r1, #31]
+    ] {
+        // Make the offsets different for the register offset forms.
+        for offset in [0, 1, 0x83] {
+            pair.check_interpreted(Case::thumb(&[instr]).reg(2, offset));
+        }
+    }
+    for addr in [0, MEM_SIZE as u32 - 2] {
+        pair.check(&Case::thumb(&[0x6808]).reg(1, addr)); // ldr r0, [r1]
+        pair.check(&Case::thumb(&[0x6008]).reg(1, addr)); // str r0, [r1]
+    }
+}
+
+#[test]
+fn arm_load_store_multiple() {
+    let mut pair = Pair::new();
+    let base = DATA_ADDR + 0x100;
+    for target in [CODE_ADDR + 0x100, CODE_ADDR + 0x101] {
+        for case in [
+            Case::arm(0xE92D_4010),                              // stmdb sp!, {r4, lr}
+            Case::arm(0xE8BD_8010).word(STACK_ADDR + 4, target), // ldmia sp!, {r4, pc}
+            Case::arm(0xE880_000E),                              // stmia r0, {r1, r2, r3}
+            Case::arm(0xE9A0_8002),                              // stmib r0!, {r1, pc}
+            Case::arm(0xE9B0_0006),                              // ldmib r0!, {r1, r2}
+            Case::arm(0xE810_0006),                              // ldmda r0, {r1, r2}
+            Case::arm(0xE820_000E),                              // stmda r0!, {r1, r2, r3}
+            Case::arm(0xE890_0003),                              // ldmia r0, {r0, r1}
+            Case::arm(0xE910_8002).word(base - 4, target),       // ldmdb r0, {r1, pc}
+            // ldmia r0!, {r2-r12, pc}
+            Case::arm(0xE8B0_9FFC).word(base + 11 * 4, target),
+        ] {
+            pair.check_interpreted(case.reg(0, base));
+        }
+    }
+    // Failing accesses, including one part of the way through.
+    for addr in [0, MEM_SIZE as u32 - 8] {
+        pair.check(&Case::arm(0xE890_000E).reg(0, addr)); // ldmia r0, {r1-r3}
+        pair.check(&Case::arm(0xE880_000E).reg(0, addr)); // stmia r0, {r1-r3}
+    }
+}
+
+#[test]
+fn thumb_load_store_multiple() {
+    let mut pair = Pair::new();
+    for target in [CODE_ADDR + 0x100, CODE_ADDR + 0x101] {
+        for case in [
+            Case::thumb(&[0xB510]),                              // push {r4, lr}
+            Case::thumb(&[0xB5FF]),                              // push {r0-r7, lr}
+            Case::thumb(&[0xB401]),                              // push {r0}
+            Case::thumb(&[0xBD10]).word(STACK_ADDR + 4, target), // pop {r4, pc}
+            Case::thumb(&[0xBCFF]),                              // pop {r0-r7}
+            Case::thumb(&[0xC006]),                              // stmia r0!, {r1, r2}
+            Case::thumb(&[0xC806]),                              // ldmia r0!, {r1, r2}
+            Case::thumb(&[0xC803]),                              // ldmia r0, {r0, r1}
+            Case::thumb(&[0xC9FD]),                              // ldmia r1!, {r0, r2-r7}
+        ] {
+            pair.check_interpreted(case);
+        }
+    }
+    for sp in [NULL_SEGMENT_SIZE + 4, MEM_SIZE as u32 - 4] {
+        pair.check(&Case::thumb(&[0xB5FF]).reg(13, sp)); // push {r0-r7, lr}
+        pair.check(&Case::thumb(&[0xBD10]).reg(13, sp)); // pop {r4, pc}
+    }
+}
+
+#[test]
+fn thumb_cbz_cbnz() {
+    let mut pair = Pair::new();
+    for value in [0, 1, 0x8000_0000] {
+        for instr in [
+            0xB120, // cbz r0, #8
+            0xB3F8, // cbz r0, #126
+            0xB920, // cbnz r0, #8
+            0xBB07, // cbnz r7, #64
+        ] {
+            pair.check_interpreted(Case::thumb(&[instr]).reg(0, value).reg(7, value));
+        }
+    }
+}
+
+#[test]
+fn arm_branches() {
+    let mut pair = Pair::new();
+    for link in [false, true] {
+        for imm32 in [0x100, -0x1000, 0x7F_FFFC, -0x80_0000] {
+            pair.check_interpreted(Case::arm(arm_b(link, imm32)));
+        }
+    }
+    for imm32 in [0x100, 0x102, -0x1002, 0x1FF_FFFE, -0x200_0000] {
+        pair.check_interpreted(Case::arm(arm_blx(imm32)));
+    }
+    for target in [CODE_ADDR + 0x100, CODE_ADDR + 0x101] {
+        pair.check_interpreted(Case::arm(0xE12F_FF1E).reg(14, target)); // bx lr
+        pair.check_interpreted(Case::arm(0xE12F_FF32).reg(2, target)); // blx r2
+    }
+}
+
+#[test]
+fn thumb_branches() {
+    let mut pair = Pair::new();
+    for imm32 in [
+        0x1000,
+        -0x2000,
+        0x40_0000,
+        -0x40_0000,
+        0xFF_FFFE,
+        -0x100_0000,
+    ] {
+        pair.check_interpreted(Case::thumb(&thumb_bl(false, imm32)));
+    }
+    for imm32 in [0x1000, -0x2004, 0xFF_FFFC, -0x100_0000] {
+        pair.check_interpreted(Case::thumb(&thumb_bl(true, imm32)));
+        // With PC not aligned to 4, after a nop.
+        let [hw1, hw2] = thumb_bl(true, imm32);
+        let case = Case::thumb(&[0xBF00, hw1, hw2]).pc(CODE_ADDR + 2);
+        pair.check_interpreted(case);
+    }
+    pair.check_interpreted(Case::thumb(&[0xE080])); // b #0x100
+    pair.check_interpreted(Case::thumb(&[0xE400])); // b #-0x800
+    for target in [CODE_ADDR + 0x100, CODE_ADDR + 0x101] {
+        pair.check_interpreted(Case::thumb(&[0x4770]).reg(14, target)); // bx lr
+        pair.check_interpreted(Case::thumb(&[0x4790]).reg(2, target)); // blx r2
+    }
+}
+
+/// Instructions whose condition fails still need PC to be advanced.
+#[test]
+fn arm_conditions() {
+    let mut pair = Pair::new();
+    let target = CODE_ADDR + 0x101;
+    for cond in 0..15 {
+        for flags in all_flags() {
+            for case in [
+                Case::arm(arm_b(false, 0x100)),
+                Case::arm(arm_b(true, 0x100)),
+                Case::arm(0xE290_0001), // adds r0, r0, #1
+                Case::arm(0xE1B0_0211), // movs r0, r1, lsl r2
+                Case::arm(0xE301_0234), // movw r0, #0x1234
+                Case::arm(0xE591_0000), // ldr r0, [r1]
+                Case::arm(0xE92D_000F), // stmdb sp!, {r0-r3}
+                Case::arm(0xE8BD_8010).word(STACK_ADDR + 4, target), // ldmia sp!, {r4, pc}
+                Case::arm(0xE12F_FF1E), // bx lr
+            ] {
+                let mut case = case.flags(flags);
+                case.code[0] = arm_cond(cond, case.code[0]);
+                pair.check_interpreted(case);
+            }
+        }
+    }
+}
+
+#[test]
+fn thumb_conditions() {
+    let mut pair = Pair::new();
+    for cond in 0..14 {
+        for flags in all_flags() {
+            for imm8 in [0x10, 0xF0] {
+                // b<cond> #imm8*2
+                let instr = 0xD000 | (cond << 8) | imm8;
+                pair.check_interpreted(Case::thumb(&[instr]).flags(flags));
+            }
+        }
+    }
+    // The flags set by the comparisons are the ones the conditions use.
+    for flags in [CPSR_N, CPSR_Z, CPSR_C, CPSR_V] {
+        pair.check_interpreted(Case::thumb(&[0x4288]).flags(flags)); // cmp r0, r1
+    }
+}
@@ -24,7 +24,7 @@ mod constant_lists;
 mod function_lists;
 
 use crate::abi::{CallFromGuest, GuestFunction};
-use crate::cpu::Cpu;
+use crate::cpu::{Cpu, SvcKind};
 use crate::frameworks::foundation::ns_string;
 use crate::mach_o::{MachO, SectionType};
 use crate::mem::{ConstVoidPtr, GuestUSize, Mem, MutPtr, Ptr};
@@ -104,6 +104,20 @@ macro_rules! export_c_func_aliased {
 }
 pub use crate::export_c_func_aliased; // #[macro_export] is weird...
 
+/// Variant of [export_c_func] for "leaf" functions, which can be called without
+/// pausing CPU emulation. See [crate::abi::LeafFunction] for the requirements
+/// such functions must meet.
+#[macro_export]
+macro_rules! export_c_func_leaf {
+    ($name:ident ($($_:ty),*)) => {
+        (
+            concat!("_", stringify!($name)),
+            &$crate::abi::LeafFunction($name as fn(&mut $crate::Environment, $($_),*) -> _)
+        )
+    };
+}
+pub use crate::export_c_func_leaf; // #[macro_export] is weird...
+
 /// Type for describing a constant (C `extern const` symbol) that will be
 /// created by the linker if the guest app references it. See [ConstantExports].
 pub enum HostConstant {
@@ -212,8 +226,15 @@ impl Dyld {
     }
 
     /// Do linking-related tasks that need doing right after loading the
-    /// binaries.
-    pub fn do_initial_linking(&mut self, bins: &[MachO], mem: &mut Mem, objc: &mut ObjC) {
+    /// binaries. If `link_eagerly` is [true], function stubs are linked now
+    /// rather than lazily, see [Self::link_stubs_eagerly].
+    pub fn do_initial_linking(
+        &mut self,
+        bins: &[MachO],
+        mem: &mut Mem,
+        objc: &mut ObjC,
+        link_eagerly: bool,
+    ) {
         assert!(self.return_to_host_routine.is_none());
         assert!(self.thread_exit_routine.is_none());
         self.return_to_host_routine =
@@ -232,6 +253,23 @@ impl Dyld {
             self.do_non_lazy_linking(bin, bins, mem, objc);
         }
 
+        // This must happen after non-lazy linking, so that stubs for host
+        // functions can reuse the functions created there, like the lazy
+        // linker does. There is no CPU yet, so there is no code to invalidate.
+        if link_eagerly {
+            let (mut linked, mut left) = (0, 0);
+            for bin in bins {
+                let (bin_linked, bin_left) = self.link_stubs_eagerly(bin, bins, mem);
+                linked += bin_linked;
+                left += bin_left;
+            }
+            log!(
+                "Linked {} function stubs eagerly, {} left to be linked lazily",
+                linked,
+                left
+            );
+        }
+
         objc.register_bin_classes(&bins[0], mem);
         objc.register_bin_categories(&bins[0], mem);
 
@@ -485,13 +523,48 @@ impl Dyld {
         cpu: &mut Cpu,
         svc_pc: u32,
     ) -> Option<HostFunction> {
+        let stubs = bins
+            .iter()
+            .flat_map(|bin| bin.get_section(SectionType::SymbolStubs))
+            .find(|stubs| (stubs.addr..(stubs.addr + stubs.size)).contains(&svc_pc))
+            .unwrap();
+
+        let info = stubs.dyld_indirect_symbol_info.as_ref().unwrap();
+
+        let offset = svc_pc - stubs.addr;
+        assert!(offset % info.entry_size == 0);
+        let idx = (offset / info.entry_size) as usize;
+
+        let symbol = info.indirect_undef_symbols[idx].as_deref().unwrap();
+
+        let Ok(host_function) = self.link_stub(bins, mem, svc_pc, info.entry_size, symbol) else {
+            panic!("Call to unimplemented function {}", symbol);
+        };
+        cpu.invalidate_cache_range(svc_pc, info.entry_size);
+        // If there's a host function, return it so that we can call it now
+        // that we're done. Otherwise, the caller needs to restart execution at
+        // svc_pc.
+        host_function
+    }
+
+    /// Link the stub function at `stub_pc`, which is for `symbol`. Returns
+    /// [Err] if there's nothing to link it to. If it was linked to a host
+    /// function, that function is returned. The caller is responsible for
+    /// invalidating the CPU's cache for the stub.
+    fn link_stub(
+        &mut self,
+        bins: &[MachO],
+        mem: &mut Mem,
+        stub_pc: u32,
+        entry_size: u32,
+        symbol: &str,
+    ) -> Result<Option<HostFunction>, ()> {
         // Links by restoring the original stub function, then updating
         // __la_symbol_ptr to the appropriate function.
         fn link_by_restoring_stub(
             mem: &mut Mem,
-            cpu: &mut Cpu,
             linked_function: u32,
-            svc_pc: u32,
+            stub_pc: u32,
             entry_size: u32,
         ) -> (MutPtr<u32>, MutPtr<u32>) {
             let original_instructions = match entry_size {
@@ -502,13 +575,11 @@ impl Dyld {
             let instruction_count: GuestUSize = original_instructions.len().try_into().unwrap();
 
             // Restore the original stub, which calls the __la_symbol_ptr
-            let stub_function_ptr: MutPtr<u32> = Ptr::from_bits(svc_pc);
+            let stub_function_ptr: MutPtr<u32> = Ptr::from_bits(stub_pc);
             for (i, &instr) in original_instructions.iter().enumerate() {
                 mem.write(stub_function_ptr + i.try_into().unwrap(), instr)
             }
 
-            cpu.invalidate_cache_range(stub_function_ptr.to_bits(), instruction_count * 4);
-
             // Update the __la_symbol_ptr
             let la_symbol_ptr: MutPtr<u32> = if entry_size == 12 {
                 // Normal stub: absolute address
@@ -524,30 +595,11 @@ impl Dyld {
             (stub_function_ptr, la_symbol_ptr)
         }
 
-        let stubs = bins
-            .iter()
-            .flat_map(|bin| bin.get_section(SectionType::SymbolStubs))
-            .find(|stubs| (stubs.addr..(stubs.addr + stubs.size)).contains(&svc_pc))
-            .unwrap();
-
-        let info = stubs.dyld_indirect_symbol_info.as_ref().unwrap();
-
-        let offset = svc_pc - stubs.addr;
-        assert!(offset % info.entry_size == 0);
-        let idx = (offset / info.entry_size) as usize;
-
-        let symbol = info.indirect_undef_symbols[idx].as_deref().unwrap();
-
         if let Some(&addr) = self.non_lazy_host_functions.get(symbol) {
             // The host function was already linked non-lazily, point the
             // stub and __la_symbol_ptr to the function.
-            let (stub_function_ptr, la_symbol_ptr) = link_by_restoring_stub(
-                mem,
-                cpu,
-                addr.addr_with_thumb_bit(),
-                svc_pc,
-                info.entry_size,
-            );
+            let (stub_function_ptr, la_symbol_ptr) =
+                link_by_restoring_stub(mem, addr.addr_with_thumb_bit(), stub_pc, entry_size);
             log_dbg!(
                 "Linked host function {} at {:?}/{:?} to existing stub ({:?}).",
                 symbol,
@@ -557,7 +609,7 @@ impl Dyld {
             );
             // The stub jumps to the non-lazy function, which calls the
             // host function.
-            return None;
+            return Ok(None);
         }
 
         if let Some(&(symbol, f)) = search_lists(function_lists::FUNCTION_LISTS, symbol) {
@@ -567,27 +619,22 @@ impl Dyld {
             self.linked_host_functions.push((symbol, f));
 
             // Rewrite stub function to call this host function
-            let stub_function_ptr: MutPtr<u32> = Ptr::from_bits(svc_pc);
+            let stub_function_ptr: MutPtr<u32> = Ptr::from_bits(stub_pc);
             mem.write(stub_function_ptr, encode_a32_svc(svc));
             assert!(mem.read(stub_function_ptr + 1) == encode_a32_ret());
 
-            cpu.invalidate_cache_range(stub_function_ptr.to_bits(), 4);
-
             log_dbg!(
                 "Linked {} at {:?} to host implementation",
                 symbol,
                 stub_function_ptr
             );
-
-            // Return the host function so that we can call it now that we're
-            // done.
-            return Some(f);
+            return Ok(Some(f));
         }
 
         for dylib in bins.iter() {
             if let Some(&addr) = dylib.exported_symbols.get(symbol) {
                 let (stub_function_ptr, la_symbol_ptr) =
-                    link_by_restoring_stub(mem, cpu, addr, svc_pc, info.entry_size);
+                    link_by_restoring_stub(mem, addr, stub_pc, entry_size);
                 log_dbg!(
                     "Linked {} at {:?}/{:?} to {:#x} from {}",
                     symbol,
@@ -596,12 +643,39 @@ impl Dyld {
                     addr,
                     dylib.name
                 );
-                // Tell the caller it needs to restart execution at svc_pc.
-                return None;
+                return Ok(None);
             }
         }
 
-        panic!("Call to unimplemented function {}", symbol);
+        Err(())
+    }
+
+    /// Link all the stub functions in a loaded binary now, rather than when
+    /// each is first called (see [Self::setup_lazy_linking]). Lazy linking
+    /// has to stop the CPU and recompile the caller's code, which can cause
+    /// stutters when an app calls many functions for the first time.
+    ///
+    /// Stubs for functions that aren't implemented are left to the lazy
+    /// linker, so it's only an error if they are called. Returns the number of
+    /// stubs that were linked and the number left.
+    fn link_stubs_eagerly(&mut self, bin: &MachO, bins: &[MachO], mem: &mut Mem) -> (u32, u32) {
+        let Some(stubs) = bin.get_section(SectionType::SymbolStubs) else {
+            return (0, 0);
+        };
+        let info = stubs.dyld_indirect_symbol_info.as_ref().unwrap();
+
+        let (mut linked, mut left) = (0, 0);
+        for i in 0..(stubs.size / info.entry_size) {
+            let Some(symbol) = info.indirect_undef_symbols[i as usize].as_deref() else {
+                continue;
+            };
+            let stub_pc = stubs.addr + i * info.entry_size;
+            match self.link_stub(bins, mem, stub_pc, info.entry_size, symbol) {
+                Ok(_) => linked += 1,
+                Err(()) => left += 1,
+            }
+        }
+        (linked, left)
     }
 
     /// Creates a guest function that will call a host function with the name
@@ -640,6 +714,40 @@ impl Dyld {
         Ok(function_ptr)
     }
 
+    /// Tell the CPU how to handle an SVC. The result for a particular SVC
+    /// number never changes, so the CPU can cache it.
+    pub fn classify_svc(&self, svc: u32) -> SvcKind {
+        let Some(idx) = svc.checked_sub(Self::SVC_LINKED_FUNCTIONS_BASE) else {
+            return SvcKind::Ordinary;
+        };
+        match self.linked_host_functions.get(idx as usize) {
+            Some(&("_objc_msgSend", _)) => SvcKind::ObjCMsgSend,
+            Some(&(_, f)) if f.is_leaf() => SvcKind::Leaf,
+            _ => SvcKind::Ordinary,
+        }
+    }
+
+    /// Name of what an SVC calls, for debugging.
+    pub fn svc_name(&self, svc: u32) -> Option<&'static str> {
+        match svc {
+            Self::SVC_LAZY_LINK => Some("(lazy linker)"),
+            Self::SVC_THREAD_EXIT => Some("(thread exit)"),
+            Self::SVC_RETURN_TO_HOST => Some("(return to host)"),
+            Self::SVC_LINKED_FUNCTIONS_BASE.. => self
+                .linked_host_functions
+                .get((svc - Self::SVC_LINKED_FUNCTIONS_BASE) as usize)
+                .map(|&(symbol, _)| symbol),
+        }
+    }
+
+    /// Look up the host function for an SVC, but only if it is a leaf function
+    /// (see [crate::abi::LeafFunction]) that has already been linked.
+    pub fn get_leaf_svc_handler(&self, svc: u32) -> Option<HostFunction> {
+        let idx = svc.checked_sub(Self::SVC_LINKED_FUNCTIONS_BASE)?;
+        let &(_symbol, f) = self.linked_host_functions.get(idx as usize)?;
+        f.is_leaf().then_some(f)
+    }
+
     pub fn create_guest_function(
         &mut self,
         mem: &mut Mem,
@@ -8,7 +8,12 @@
 //! Unlike its siblings, this module should be considered private and only used
 //! via the re-exports one level up.
 
+mod benchmark;
+mod jit_stats;
+mod jit_warm_up;
 mod mutex;
+mod profiler;
+pub mod quantum;
 
 use crate::abi::{CallFromHost, GuestRet};
 use crate::libc::semaphore::sem_t;
@@ -58,20 +63,36 @@ pub struct Thread {
     in_host_function: bool,
     /// Context object containing the CPU state for this thread.
     ///
-    /// There should always be `(threads.len() - 1)` contexts in existence.
-    /// When a thread is currently executing, its state is stored directly in
-    /// the CPU, rather than in a context object. In that case, this field is
-    /// None. See also: [std::mem::take] and [cpu::Cpu::swap_context].
+    /// There should always be a context for each thread that is active and not
+    /// currently executing. When a thread is currently executing, its state is
+    /// stored directly in the CPU, rather than in a context object. In that
+    /// case, this field is None. See also: [std::mem::take] and
+    /// [cpu::Cpu::swap_context].
     context: Option<cpu::CpuContext>,
     /// Address range of this thread's stack, used to check if addresses are in
     /// range while producing a stack trace.
     stack: Option<std::ops::RangeInclusive<u32>>,
+    /// Scheduling state, see [quantum].
+    pub quantum: quantum::ThreadQuantum,
 }
 
 impl Thread {
     fn is_blocked(&self) -> bool {
         !matches!(self.blocked_by, ThreadBlock::NotBlocked)
     }
+
+    /// Whether the scheduler could switch to this thread now: it isn't
+    /// blocked, or it has finished sleeping. Threads waiting for a mutex etc
+    /// aren't counted, even if what they wait for happens to be available.
+    fn is_ready(&self, now: Instant) -> bool {
+        self.active
+            && !self.in_host_function
+            && match self.blocked_by {
+                ThreadBlock::NotBlocked => true,
+                ThreadBlock::Sleeping(until) => until <= now,
+                _ => false,
+            }
+    }
 }
 
 /// The struct containing the entire emulator state. Methods are provided for
@@ -97,6 +118,14 @@ pub struct Environment {
     pub mutex_state: mutex::MutexState,
     pub options: options::Options,
     gdb_server: Option<gdb::GdbServer>,
+    jit_warm_up: Option<jit_warm_up::JitWarmUp>,
+    jit_stats: Option<jit_stats::JitStats>,
+    profiler: Option<profiler::Profiler>,
+    benchmark: Option<benchmark::Benchmark>,
+    scheduler: quantum::Scheduler,
+    /// Panic caught during a leaf host function call, see
+    /// [touchHLE_cpu_call_leaf_svc].
+    leaf_call_panic: Option<Box<dyn std::any::Any + Send>>,
     pub env_vars: HashMap<Vec<u8>, MutPtr<u8>>,
 }
 
@@ -131,6 +160,59 @@ pub enum ThreadBlock {
     DeferredReturn,
 }
 
+/// Called by the CPU the first time it encounters a particular SVC number while
+/// executing, see [dyld::Dyld::classify_svc].
+#[no_mangle]
+extern "C" fn touchHLE_cpu_classify_svc(env: *mut std::ffi::c_void, svc: u32) -> u8 {
+    // Safety: see touchHLE_cpu_call_leaf_svc.
+    let env = unsafe { &*env.cast::<Environment>() };
+    env.dyld.classify_svc(svc) as u8
+}
+
+/// Called by the CPU when it encounters an SVC while executing, so that leaf
+/// host functions (see [abi::LeafFunction]) can be called without halting
+/// execution. Returns [false] if the SVC is not for a leaf function and
+/// execution must halt so that [Environment::handle_cpu_state] can handle it.
+#[no_mangle]
+extern "C" fn touchHLE_cpu_call_leaf_svc(env: *mut std::ffi::c_void, svc: u32) -> bool {
+    // Safety: the pointer comes from Environment::run_inner, which passes the
+    // CPU and memory to Cpu::run_or_step as raw pointers derived from this one
+    // and holds no reference to the environment while the CPU is executing,
+    // so this is the only live reference. The CPU isn't holding on to any
+    // Rust data either, since it accesses memory through the descriptor or
+    // callbacks that don't outlive a single access. Leaf functions don't touch
+    // the CPU state other than the registers, which dynarmic allows while it
+    // is executing, as the callback is made between guest instructions.
+    let env = unsafe { &mut *env.cast::<Environment>() };
+    let Some(f) = env.dyld.get_leaf_svc_handler(svc) else {
+        return false;
+    };
+    let res = std::panic::catch_unwind(std::panic::AssertUnwindSafe(|| {
+        let was_in_host_function = env.threads[env.current_thread].in_host_function;
+        env.threads[env.current_thread].in_host_function = true;
+        // The profiler walks the guest stack, which only reads the registers
+        // and memory, so it can use the reference created above too.
+        env.with_profiler(|profiler, info, dyld| {
+            profiler.left_guest(info);
+            profiler.entering_host_function(dyld.svc_name(svc).unwrap_or("unknown"), info);
+        });
+        f.call_from_guest(env);
+        env.with_profiler(|profiler, _, _| profiler.left_host_function());
+        env.threads[env.current_thread].in_host_function = was_in_host_function;
+        debug_assert!(!env.threads[env.current_thread].is_blocked());
+    }));
+    // The panic can't keep unwinding into the CPU's C++ stack frames. Instead,
+    // execution is halted as if this were an ordinary SVC, and then the panic
+    // is resumed by Environment::run_inner before it would handle the SVC.
+    match res {
+        Ok(()) => true,
+        Err(panic) => {
+            env.leaf_call_panic = Some(panic);
+            false
+        }
+    }
+}
+
 impl Environment {
     /// Loads the binary and sets up the emulator.
     ///
@@ -148,6 +230,13 @@ impl Environment {
     ) -> Result<Environment, String> {
         let startup_time = Instant::now();
 
+        if let Some(size_limit) = options.texture_cache {
+            image::texture_cache::init(size_limit);
+        }
+        if let Some(ref path) = options.trace_path {
+            crate::trace::init(path);
+        }
+
         // Extract things to salvage from the old environment, and then drop it.
         // This needs to be done before creating a new window, because SDL2 only
         // allows one window at once.
@@ -208,8 +297,14 @@ impl Environment {
             mem::Mem::new()
         };
 
-        let executable = mach_o::MachO::load_from_file(bundle.executable_path(), &fs, &mut mem)
-            .map_err(|e| format!("Could not load executable: {}", e))?;
+        // The hash is only needed to identify the JIT warm-up profile.
+        let executable = mach_o::MachO::load_from_file(
+            bundle.executable_path(),
+            &fs,
+            &mut mem,
+            options.jit_warm_up,
+        )
+        .map_err(|e| format!("Could not load executable: {}", e))?;
 
         let mut dylibs = Vec::new();
         for dylib in &executable.dynamic_libraries {
@@ -221,8 +316,9 @@ impl Environment {
             // There are some Free Software libraries bundled with touchHLE and
             // exposed via the guest file system (see Fs::new()).
             if fs.is_file(fs::GuestPath::new(dylib)) {
-                let dylib = mach_o::MachO::load_from_file(fs::GuestPath::new(dylib), &fs, &mut mem)
-                    .map_err(|e| format!("Could not load bundled dylib: {}", e))?;
+                let dylib =
+                    mach_o::MachO::load_from_file(fs::GuestPath::new(dylib), &fs, &mut mem, false)
+                        .map_err(|e| format!("Could not load bundled dylib: {}", e))?;
                 dylibs.push(dylib);
             } else {
                 // System frameworks will have host implementations.
@@ -251,12 +347,28 @@ impl Environment {
         let mut objc = objc::ObjC::new();
 
         let mut dyld = dyld::Dyld::new();
-        dyld.do_initial_linking(&bins, &mut mem, &mut objc);
+        dyld.do_initial_linking(&bins, &mut mem, &mut objc, options.eager_linking);
 
-        let cpu = cpu::Cpu::new(match options.direct_memory_access {
-            true => Some(&mut mem),
-            false => None,
-        });
+        let jit_profile = if options.gdb_listen_addrs.is_some() {
+            if options.jit_profile != cpu::JitProfile::Debug {
+                log!("Using the debug JIT profile because GDB debugging is enabled.");
+            }
+            cpu::JitProfile::Debug
+        } else {
+            options.jit_profile
+        };
+
+        let cpu = cpu::Cpu::new(
+            match options.direct_memory_access {
+                true => Some(&mut mem),
+                false => None,
+            },
+            options.fastmem,
+            options.track_code_writes,
+            jit_profile,
+            options.jit_code_cache,
+            options.wall_clock_preemption,
+        );
 
         let main_thread = Thread {
             active: true,
@@ -266,6 +378,7 @@ impl Environment {
             in_host_function: false,
             context: None,
             stack: Some(mem::Mem::MAIN_THREAD_STACK_LOW_END..=0u32.wrapping_sub(1)),
+            quantum: Default::default(),
         };
 
         let mut env = Environment {
@@ -285,9 +398,19 @@ impl Environment {
             framework_state: Default::default(),
             options,
             gdb_server: None,
+            jit_warm_up: None,
+            jit_stats: None,
+            profiler: None,
+            benchmark: None,
+            scheduler: quantum::Scheduler::new(),
+            leaf_call_panic: None,
             env_vars: Default::default(),
         };
 
+        env.cpu.set_method_cache(env.objc.method_cache_ptr());
+
+        env.libc_state.errno.init_for_thread(&mut env.mem, 0);
+
         env.set_up_initial_env_vars();
 
         dyld::Dyld::do_late_linking(&mut env);
@@ -321,6 +444,35 @@ impl Environment {
 
         env.cpu.set_cpsr(cpu::Cpu::CPSR_USER_MODE);
 
+        if env.options.jit_warm_up {
+            env.jit_warm_up = Some(jit_warm_up::JitWarmUp::new(
+                &env.bins,
+                &mut env.cpu,
+                &mut env.mem,
+            ));
+        }
+
+        if env.options.jit_stats {
+            env.jit_stats = Some(jit_stats::JitStats::new());
+        }
+        if let Some(path) = env.options.profile_path.clone() {
+            env.profiler = Some(profiler::Profiler::new(path));
+        }
+        if let Some(frames) = env.options.benchmark_frames {
+            // Ticks are wall-clock time rather than instructions in that mode,
+            // and the slices would not be fixed-size.
+            if env.options.wall_clock_preemption {
+                return Err("--benchmark= can't be used with --wall-clock-preemption".to_string());
+            }
+            env.benchmark = Some(benchmark::Benchmark::new(
+                frames,
+                env.options.benchmark_input_path.as_deref(),
+                env.options.benchmark_output_path.clone(),
+                startup_time,
+            )?);
+            env.scheduler.use_fixed_quantum();
+        }
+
         if let Some(addrs) = env.options.gdb_listen_addrs.take() {
             let listener = TcpListener::bind(addrs.as_slice())
                 .map_err(|e| format!("Could not bind to {:?}: {}", addrs, e))?;
@@ -416,10 +568,19 @@ impl Environment {
         let mut dyld = dyld::Dyld::new();
         dyld.do_initial_linking_with_no_bins(&mut mem, &mut objc);
 
-        let cpu = cpu::Cpu::new(match options.direct_memory_access {
-            true => Some(&mut mem),
-            false => None,
-        });
+        let jit_profile = options.jit_profile;
+
+        let cpu = cpu::Cpu::new(
+            match options.direct_memory_access {
+                true => Some(&mut mem),
+                false => None,
+            },
+            options.fastmem,
+            options.track_code_writes,
+            jit_profile,
+            options.jit_code_cache,
+            options.wall_clock_preemption,
+        );
 
         let main_thread = Thread {
             active: true,
@@ -429,6 +590,7 @@ impl Environment {
             in_host_function: false,
             context: None,
             stack: Some(mem::Mem::MAIN_THREAD_STACK_LOW_END..=0u32.wrapping_sub(1)),
+            quantum: Default::default(),
         };
 
         let mut env = Environment {
@@ -448,9 +610,19 @@ impl Environment {
             framework_state: Default::default(),
             options,
             gdb_server: None,
+            jit_warm_up: None,
+            jit_stats: None,
+            profiler: None,
+            benchmark: None,
+            scheduler: quantum::Scheduler::new(),
+            leaf_call_panic: None,
             env_vars: Default::default(),
         };
 
+        env.cpu.set_method_cache(env.objc.method_cache_ptr());
+
+        env.libc_state.errno.init_for_thread(&mut env.mem, 0);
+
         env.set_up_initial_env_vars();
 
         // Dyld::do_late_linking() would be called here, but it doesn't do
@@ -489,6 +661,35 @@ impl Environment {
         )
     }
 
+    /// Save the profile (see [profiler::Profiler]), which is otherwise only
+    /// saved every few seconds. This must be called before touchHLE exits with
+    /// [std::process::exit], since that doesn't run destructors.
+    pub fn save_before_exit(&mut self) {
+        if let Some(ref mut profiler) = self.profiler {
+            profiler.save(&self.bins);
+        }
+    }
+
+    /// Call `f` with the profiler, if profiling is enabled (see
+    /// [profiler::Profiler]).
+    fn with_profiler<F>(&mut self, f: F)
+    where
+        F: FnOnce(&mut profiler::Profiler, &profiler::GuestStackInfo, &dyld::Dyld),
+    {
+        let Some(profiler) = self.profiler.as_mut() else {
+            return;
+        };
+        let info = profiler::GuestStackInfo {
+            cpu: &self.cpu,
+            mem: &self.mem,
+            thread: self.current_thread,
+            stack_range: self.threads[self.current_thread].stack.clone(),
+            return_to_host_routine: self.dyld.return_to_host_routine().addr_with_thumb_bit(),
+            thread_exit_routine: self.dyld.thread_exit_routine().addr_with_thumb_bit(),
+        };
+        f(profiler, &info, &self.dyld);
+    }
+
     fn stack_trace(&self) {
         if self.current_thread == 0 {
             echo!("Attempting to produce stack trace for main thread:");
@@ -557,8 +758,12 @@ impl Environment {
             in_host_function: false,
             context: Some(cpu::CpuContext::new()),
             stack: Some(stack_alloc.to_bits()..=(stack_high_addr - 1)),
+            quantum: Default::default(),
         });
         let new_thread_id = self.threads.len() - 1;
+        self.libc_state
+            .errno
+            .init_for_thread(&mut self.mem, new_thread_id);
 
         log_dbg!("Created new thread {} with stack {:#x}–{:#x}, will execute function {:?} with data {:?}", new_thread_id, stack_alloc.to_bits(), (stack_high_addr - 1), start_routine, user_data);
 
@@ -757,10 +962,17 @@ impl Environment {
         );
 
         let mut context = self.threads[new_thread].context.take().unwrap();
+        let switch_start = Instant::now();
         self.cpu.swap_context(&mut context);
+        self.scheduler.note_context_switch(switch_start.elapsed());
         assert!(self.threads[self.current_thread].context.is_none());
-        self.threads[self.current_thread].context = Some(context);
+        // A finished thread will never run again, so its context can be freed.
+        // This matters especially if it contains a whole CPU instance.
+        if self.threads[self.current_thread].active {
+            self.threads[self.current_thread].context = Some(context);
+        }
         self.current_thread = new_thread;
+        crate::trace::set_current_thread(new_thread);
     }
 
     #[cold]
@@ -890,7 +1102,17 @@ impl Environment {
                             let was_in_host_function =
                                 self.threads[self.current_thread].in_host_function;
                             self.threads[self.current_thread].in_host_function = true;
+                            self.with_profiler(|profiler, info, dyld| {
+                                let name = dyld.svc_name(svc).unwrap_or("unknown");
+                                profiler.entering_host_function(name, info);
+                            });
+                            let span = crate::trace::span(
+                                "host",
+                                self.dyld.svc_name(svc).unwrap_or("unknown"),
+                            );
                             f.call_from_guest(self);
+                            drop(span);
+                            self.with_profiler(|profiler, _, _| profiler.left_host_function());
                             self.threads[self.current_thread].in_host_function =
                                 was_in_host_function;
                             // Host function might have put the thread to sleep.
@@ -913,34 +1135,93 @@ impl Environment {
         }
     }
 
+    /// Update a thread's quantum after it ran for a slice (see
+    /// [Self::run_inner]).
+    fn end_slice(
+        &mut self,
+        thread: ThreadId,
+        ticks_given: u64,
+        ticks_left: u64,
+        slice_start: Instant,
+    ) {
+        // Nothing ran if the thread was blocked to begin with.
+        if ticks_given == 0 {
+            return;
+        }
+        assert!(thread == self.current_thread);
+        if crate::trace::enabled() {
+            let args = format!("{{\"ticks\":{}}}", ticks_given - ticks_left);
+            crate::trace::complete("scheduler", "slice", thread, slice_start, Some(args));
+        }
+        let end_pc = self.cpu.regs()[cpu::Cpu::PC];
+        let now = Instant::now();
+        let others_ready = self
+            .threads
+            .iter()
+            .enumerate()
+            .any(|(i, other)| i != thread && other.is_ready(now));
+        self.scheduler.end_slice(
+            &mut self.threads[thread].quantum,
+            ticks_given,
+            ticks_left,
+            slice_start.elapsed(),
+            end_pc,
+            others_ready,
+        );
+        self.scheduler.log_stats_if_needed(
+            self.threads
+                .iter()
+                .enumerate()
+                .map(|(i, thread)| (i, thread.active, &thread.quantum)),
+        );
+    }
+
     fn run_inner(&mut self, root: bool) {
         let initial_thread = self.current_thread;
         assert!(self.threads[initial_thread].active);
         assert!(self.threads[initial_thread].context.is_none());
 
         loop {
-            // 100,000 ticks is an arbitrary number. It needs to be reasonably
-            // large so we aren't jumping in and out of dynarmic or trying to
-            // poll for events too often. At the same time, very large values
-            // are bad for responsiveness.
+            // The quantum needs to be reasonably large so we aren't jumping in
+            // and out of dynarmic or trying to poll for events too often. At
+            // the same time, very large values are bad for responsiveness.
+            // See the quantum module for how it's chosen.
             let mut ticks = if self.threads[self.current_thread].is_blocked() {
                 // The current thread might be asleep, in which case we want to
                 // immediately switch to another thread. This only happens when
                 // called from Self::sleep().
                 0
             } else {
-                100_000
+                let last_poll = self.window.as_ref().map(|w| w.last_polled());
+                self.scheduler
+                    .quantum_for(&self.threads[self.current_thread].quantum, last_poll)
             };
+            let ticks_given = ticks;
+            let slice_thread = self.current_thread;
+            let slice_start = Instant::now();
             let mut step_and_debug = false;
             while ticks > 0 {
-                let state = self.cpu.run_or_step(
-                    &mut self.mem,
-                    if step_and_debug {
-                        None
-                    } else {
-                        Some(&mut ticks)
-                    },
-                );
+                self.with_profiler(|profiler, _, _| profiler.entering_guest());
+                // Everything the CPU is given is derived from one raw pointer,
+                // and no reference to the environment is live while it runs,
+                // so touchHLE_cpu_call_leaf_svc can safely create one.
+                let env_ptr: *mut Environment = self;
+                let state = unsafe {
+                    cpu::Cpu::run_or_step(
+                        std::ptr::addr_of_mut!((*env_ptr).cpu),
+                        std::ptr::addr_of_mut!((*env_ptr).mem),
+                        if step_and_debug {
+                            None
+                        } else {
+                            Some(&mut ticks)
+                        },
+                        env_ptr.cast(),
+                    )
+                };
+                self.with_profiler(|profiler, info, _| profiler.left_guest(info));
+                if let Some(panic) = self.leaf_call_panic.take() {
+                    std::panic::resume_unwind(panic);
+                }
                 match self.handle_cpu_state(state, initial_thread, root) {
                     ThreadNextAction::Continue => {
                         if step_and_debug {
@@ -952,13 +1233,22 @@ impl Environment {
                         }
                     }
                     ThreadNextAction::Yield => break,
-                    ThreadNextAction::ReturnToHost => return,
+                    ThreadNextAction::ReturnToHost => {
+                        self.end_slice(slice_thread, ticks_given, ticks, slice_start);
+                        return;
+                    }
                     ThreadNextAction::DebugCpuError(e) => {
                         step_and_debug = self.debug_cpu_error(e);
                     }
                 }
             }
 
+            self.end_slice(slice_thread, ticks_given, ticks, slice_start);
+            if crate::trace::enabled() && self.threads[slice_thread].is_blocked() {
+                let reason = format!("{:?}", self.threads[slice_thread].blocked_by);
+                crate::trace::thread_blocked(slice_thread, reason);
+            }
+
             // To maintain responsiveness when moving the window and so on, we
             // need to poll for events occasionally, even if the app isn't
             // actively processing them.
@@ -969,6 +1259,16 @@ impl Environment {
                 window.poll_for_events(&self.options);
             }
 
+            if let Some(ref mut jit_warm_up) = self.jit_warm_up {
+                jit_warm_up.save_if_needed(&self.cpu);
+            }
+            if let Some(ref mut jit_stats) = self.jit_stats {
+                jit_stats.log_if_needed(&self.cpu, &self.dyld);
+            }
+            if let Some(ref mut profiler) = self.profiler {
+                profiler.save_if_needed(&self.bins);
+            }
+
             loop {
                 // Try to find a new thread to execute, starting with the thread
                 // following the one currently executing.
@@ -1072,6 +1372,7 @@ impl Environment {
                             if i == initial_thread {
                                 log_dbg!("Thread {} is now able to return, returning", i);
                                 self.threads[i].blocked_by = ThreadBlock::NotBlocked;
+                                crate::trace::thread_unblocked(i);
                                 // Thread is now top of call stack, should
                                 // return
                                 self.switch_thread(i);
@@ -1087,6 +1388,7 @@ impl Environment {
 
                 // There's a suitable thread we can switch to immediately.
                 if let Some(suitable_thread) = suitable_thread {
+                    crate::trace::thread_unblocked(suitable_thread);
                     if suitable_thread != self.current_thread {
                         self.switch_thread(suitable_thread);
                     }
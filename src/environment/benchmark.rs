@@ -0,0 +1,350 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Benchmark mode (`--benchmark=`), for getting repeatable performance numbers
+//! for an app, e.g. to compare builds of touchHLE or options.
+//!
+//! The app is run until it has presented a fixed number of frames. To make
+//! runs more alike:
+//!
+//! - Frames aren't actually presented to the window (see
+//!   [crate::gles::present]), so the host's display and v-sync don't matter.
+//! - Threads are given a fixed quantum (see [super::quantum]), rather than one
+//!   that adapts to how fast the host is.
+//! - Touch input can be scripted by frame number (`--benchmark-input=`),
+//!   rather than depending on when someone clicks.
+//!
+//! The app's own timers still follow the wall clock, so runs are not entirely
+//! deterministic.
+//!
+//! Once enough frames have been presented, the results are written as a JSON
+//! object to a file (`--benchmark-output=`) or the console, and touchHLE
+//! exits.
+
+use super::Environment;
+use crate::gles::present::FpsCounter;
+use crate::window::{Event, FingerId};
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::path::{Path, PathBuf};
+use std::time::Instant;
+
+#[derive(Copy, Clone, Debug, PartialEq)]
+enum TouchKind {
+    Down,
+    Move,
+    Up,
+}
+
+/// A line of a `--benchmark-input=` file, see [parse_input_script].
+#[derive(Debug, PartialEq)]
+struct ScriptedTouch {
+    frame: u32,
+    kind: TouchKind,
+    coords: (f32, f32),
+}
+
+/// Parse a `--benchmark-input=` file. Each line is a frame number, `down`,
+/// `move` or `up`, and the x and y co-ordinates of the touch in points,
+/// separated by whitespace. `#` starts a comment. The result is sorted by frame
+/// number.
+fn parse_input_script(text: &str) -> Result<Vec<ScriptedTouch>, String> {
+    let mut touches = Vec::new();
+    for (line_no, line) in text.lines().enumerate() {
+        // Line numbering usually starts from 1
+        let line_no = line_no + 1;
+
+        let line = line.split_once('#').map_or(line, |(rest, _)| rest).trim();
+        if line.is_empty() {
+            continue;
+        }
+
+        let values: Vec<&str> = line.split_whitespace().collect();
+        let &[frame, kind, x, y] = &values[..] else {
+            return Err(format!("Line {} does not have four values", line_no));
+        };
+        let frame = frame
+            .parse()
+            .map_err(|_| format!("Invalid frame number on line {}", line_no))?;
+        let kind = match kind {
+            "down" => TouchKind::Down,
+            "move" => TouchKind::Move,
+            "up" => TouchKind::Up,
+            _ => {
+                return Err(format!(
+                    "Invalid touch kind on line {}, expected down, move or up",
+                    line_no
+                ))
+            }
+        };
+        let x = x
+            .parse()
+            .map_err(|_| format!("Invalid X co-ordinate on line {}", line_no))?;
+        let y = y
+            .parse()
+            .map_err(|_| format!("Invalid Y co-ordinate on line {}", line_no))?;
+        touches.push(ScriptedTouch {
+            frame,
+            kind,
+            coords: (x, y),
+        });
+    }
+    // This is a stable sort, so touches for the same frame stay in order.
+    touches.sort_by_key(|touch| touch.frame);
+    Ok(touches)
+}
+
+pub struct Benchmark {
+    frames_wanted: u32,
+    frames: u32,
+    start: Instant,
+    first_frame: Option<Instant>,
+    fps_counter: FpsCounter,
+    /// Frame rate over each second, from [FpsCounter::count_frame_silently].
+    fps_samples: Vec<f32>,
+    touches: Vec<ScriptedTouch>,
+    next_touch: usize,
+    output_path: Option<PathBuf>,
+}
+
+impl Benchmark {
+    /// Prepare to run a benchmark. `start` should be when touchHLE started
+    /// launching the app.
+    pub fn new(
+        frames_wanted: u32,
+        input_path: Option<&Path>,
+        output_path: Option<PathBuf>,
+        start: Instant,
+    ) -> Result<Benchmark, String> {
+        let touches = if let Some(path) = input_path {
+            let text = std::fs::read_to_string(path)
+                .map_err(|e| format!("Could not read benchmark input {:?}: {}", path, e))?;
+            parse_input_script(&text)
+                .map_err(|e| format!("Invalid benchmark input {:?}: {}", path, e))?
+        } else {
+            Vec::new()
+        };
+        log!(
+            "Benchmarking: running until {} frames have been presented, with {} scripted touches.",
+            frames_wanted,
+            touches.len()
+        );
+        Ok(Benchmark {
+            frames_wanted,
+            frames: 0,
+            start,
+            first_frame: None,
+            fps_counter: FpsCounter::start(),
+            fps_samples: Vec::new(),
+            touches,
+            next_touch: 0,
+            output_path,
+        })
+    }
+}
+
+/// Peak resident set size of the touchHLE process in bytes, if known.
+#[cfg(unix)]
+fn peak_rss() -> Option<u64> {
+    let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+    if unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) } != 0 {
+        return None;
+    }
+    let max_rss = u64::try_from(usage.ru_maxrss).ok()?;
+    // This is in bytes on Apple platforms, but in KiB elsewhere.
+    Some(if cfg!(target_vendor = "apple") {
+        max_rss
+    } else {
+        max_rss * 1024
+    })
+}
+#[cfg(not(unix))]
+fn peak_rss() -> Option<u64> {
+    None
+}
+
+impl Environment {
+    /// Whether frames should actually be presented to the window. This is
+    /// [false] when benchmarking.
+    pub fn presenting_frames(&self) -> bool {
+        self.benchmark.is_none()
+    }
+
+    /// Note that a frame has been presented, or would have been if not for
+    /// [Self::presenting_frames]. When benchmarking, this delivers any scripted
+    /// input due, and ends the benchmark once enough frames have been
+    /// presented.
+    pub fn frame_presented(&mut self) {
+        let Some(ref mut benchmark) = self.benchmark else {
+            return;
+        };
+
+        benchmark.frames += 1;
+        benchmark.first_frame.get_or_insert_with(Instant::now);
+        if let Some(fps) = benchmark.fps_counter.count_frame_silently() {
+            benchmark.fps_samples.push(fps);
+        }
+
+        while let Some(touch) = benchmark.touches.get(benchmark.next_touch) {
+            if touch.frame > benchmark.frames {
+                break;
+            }
+            benchmark.next_touch += 1;
+            let map = HashMap::from([(FingerId::Scripted, touch.coords)]);
+            let event = match touch.kind {
+                TouchKind::Down => Event::TouchesDown(map),
+                TouchKind::Move => Event::TouchesMove(map),
+                TouchKind::Up => Event::TouchesUp(map),
+            };
+            if let Some(ref mut window) = self.window {
+                window.push_event(event);
+            }
+        }
+
+        if benchmark.frames >= benchmark.frames_wanted {
+            self.finish_benchmark();
+        }
+    }
+
+    fn finish_benchmark(&mut self) -> ! {
+        let benchmark = self.benchmark.take().unwrap();
+        let now = Instant::now();
+        let first_frame = benchmark.first_frame.unwrap();
+
+        let seconds = now.duration_since(benchmark.start).as_secs_f64();
+        let seconds_to_first_frame = first_frame.duration_since(benchmark.start).as_secs_f64();
+        // The first frame marks the start of the interval, so it's not counted.
+        let fps = f64::from(benchmark.frames - 1) / now.duration_since(first_frame).as_secs_f64();
+        let min_fps = benchmark
+            .fps_samples
+            .iter()
+            .copied()
+            .reduce(f32::min)
+            .map_or("null".to_string(), |fps| format!("{:.2}", fps));
+        let instructions = self.scheduler.total_ticks();
+        let (stats, _) = self.cpu.stats();
+        let peak_rss = peak_rss().map_or("null".to_string(), |rss| rss.to_string());
+
+        let mut json = String::new();
+        writeln!(json, "{{").unwrap();
+        writeln!(json, "  \"frames\": {},", benchmark.frames).unwrap();
+        writeln!(json, "  \"seconds\": {:.3},", seconds).unwrap();
+        writeln!(
+            json,
+            "  \"seconds_to_first_frame\": {:.3},",
+            seconds_to_first_frame
+        )
+        .unwrap();
+        writeln!(json, "  \"fps\": {:.2},", fps).unwrap();
+        writeln!(json, "  \"min_fps\": {},", min_fps).unwrap();
+        writeln!(json, "  \"guest_instructions\": {},", instructions).unwrap();
+        writeln!(
+            json,
+            "  \"guest_instructions_per_second\": {:.0},",
+            instructions as f64 / seconds
+        )
+        .unwrap();
+        writeln!(
+            json,
+            "  \"jit_exits\": {{\"svc\": {}, \"out_of_ticks\": {}, \"memory_abort\": {}, \"undefined_instruction\": {}, \"breakpoint\": {}}},",
+            stats.halts_svc,
+            stats.halts_out_of_ticks,
+            stats.halts_memory_abort,
+            stats.halts_undefined_instruction,
+            stats.halts_breakpoint,
+        )
+        .unwrap();
+        writeln!(
+            json,
+            "  \"texture_decode_seconds\": {:.3},",
+            crate::image::decode_time().as_secs_f64()
+        )
+        .unwrap();
+        if let Some(cache) = crate::image::texture_cache::stats() {
+            writeln!(
+                json,
+                "  \"texture_cache\": {{\"hits\": {}, \"misses\": {}, \"evictions\": {}, \"size_bytes\": {}}},",
+                cache.hits, cache.misses, cache.evictions, cache.size,
+            )
+            .unwrap();
+        } else {
+            writeln!(json, "  \"texture_cache\": null,").unwrap();
+        }
+        let glyphs = crate::frameworks::uikit::ui_font::glyph_cache_stats(self);
+        let glyph_lookups = glyphs.hits + glyphs.misses;
+        writeln!(
+            json,
+            "  \"glyph_cache\": {{\"hits\": {}, \"misses\": {}, \"hit_rate\": {}, \"flushes\": {}, \"glyphs\": {}, \"atlas_pixels\": {}}},",
+            glyphs.hits,
+            glyphs.misses,
+            if glyph_lookups == 0 {
+                "null".to_string()
+            } else {
+                format!("{:.3}", glyphs.hits as f64 / glyph_lookups as f64)
+            },
+            glyphs.flushes,
+            glyphs.glyphs,
+            glyphs.atlas_pixels,
+        )
+        .unwrap();
+        writeln!(json, "  \"peak_rss_bytes\": {}", peak_rss).unwrap();
+        writeln!(json, "}}").unwrap();
+
+        if let Some(path) = benchmark.output_path {
+            match std::fs::write(&path, &json) {
+                Ok(()) => log!("Benchmark finished, results written to {:?}", path),
+                Err(e) => {
+                    log!("Couldn't write benchmark results to {:?}: {}", path, e);
+                    echo!("{}", json);
+                }
+            }
+        } else {
+            log!("Benchmark finished, results:");
+            echo!("{}", json);
+        }
+        self.save_before_exit();
+        std::process::exit(0);
+    }
+}
+
+#[cfg(test)]
+#[test]
+fn test_parse_input_script() {
+    let script = "
+        # Tap the middle of the screen, then swipe.
+        300 down 160 240
+        302 up 160 240
+        10 down 0.5 10 # out of order
+        11 move 100.5 10
+    ";
+    let touches = parse_input_script(script).unwrap();
+    assert_eq!(
+        touches,
+        [
+            ScriptedTouch {
+                frame: 10,
+                kind: TouchKind::Down,
+                coords: (0.5, 10.0),
+            },
+            ScriptedTouch {
+                frame: 11,
+                kind: TouchKind::Move,
+                coords: (100.5, 10.0),
+            },
+            ScriptedTouch {
+                frame: 300,
+                kind: TouchKind::Down,
+                coords: (160.0, 240.0),
+            },
+            ScriptedTouch {
+                frame: 302,
+                kind: TouchKind::Up,
+                coords: (160.0, 240.0),
+            },
+        ]
+    );
+    assert!(parse_input_script("1 tap 0 0").is_err());
+    assert!(parse_input_script("1 down 0").is_err());
+}
@@ -0,0 +1,136 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Periodic logging of the CPU's counters (`--jit-stats`), to find out why
+//! and how often execution leaves the JIT, and which host functions are
+//! responsible.
+
+use crate::cpu::Cpu;
+use crate::dyld::Dyld;
+use std::time::{Duration, Instant};
+use touchHLE_dynarmic_wrapper::touchHLE_DynarmicWrapper_Stats as Stats;
+
+/// How often the counters are logged.
+const LOG_INTERVAL: Duration = Duration::from_secs(5);
+/// How many of the most frequently executed SVCs are logged.
+const TOP_SVC_COUNT: usize = 10;
+
+pub struct JitStats {
+    last_log: Instant,
+    /// Counters as of the last log, so that only the changes since then are
+    /// logged.
+    last_stats: Stats,
+    last_svc_calls: Vec<u64>,
+}
+
+/// Difference between two snapshots of the counters. Current values are taken
+/// from the newer snapshot.
+fn stats_since(now: &Stats, then: &Stats) -> Stats {
+    Stats {
+        halts_svc: now.halts_svc - then.halts_svc,
+        halts_memory_abort: now.halts_memory_abort - then.halts_memory_abort,
+        halts_undefined_instruction: now.halts_undefined_instruction
+            - then.halts_undefined_instruction,
+        halts_breakpoint: now.halts_breakpoint - then.halts_breakpoint,
+        halts_out_of_ticks: now.halts_out_of_ticks - then.halts_out_of_ticks,
+        steps: now.steps - then.steps,
+        interpreted_steps: now.interpreted_steps - then.interpreted_steps,
+        leaf_svcs: now.leaf_svcs - then.leaf_svcs,
+        cached_msg_sends: now.cached_msg_sends - then.cached_msg_sends,
+        memory_reads: std::array::from_fn(|i| now.memory_reads[i] - then.memory_reads[i]),
+        memory_writes: std::array::from_fn(|i| now.memory_writes[i] - then.memory_writes[i]),
+        invalidations: now.invalidations - then.invalidations,
+        bytes_invalidated: now.bytes_invalidated - then.bytes_invalidated,
+        invalidation_flushes: now.invalidation_flushes - then.invalidation_flushes,
+        code_write_faults: now.code_write_faults - then.code_write_faults,
+        blocks_compiled: now.blocks_compiled - then.blocks_compiled,
+        blocks_recompiled: now.blocks_recompiled - then.blocks_recompiled,
+        code_cache_flushes: now.code_cache_flushes - then.code_cache_flushes,
+        code_cache_guest_bytes: now.code_cache_guest_bytes,
+        context_switches: now.context_switches - then.context_switches,
+    }
+}
+
+impl JitStats {
+    pub fn new() -> JitStats {
+        JitStats {
+            last_log: Instant::now(),
+            last_stats: Default::default(),
+            last_svc_calls: Vec::new(),
+        }
+    }
+
+    /// Log the changes in the counters every so often.
+    pub fn log_if_needed(&mut self, cpu: &Cpu, dyld: &Dyld) {
+        if self.last_log.elapsed() < LOG_INTERVAL {
+            return;
+        }
+        let interval = self.last_log.elapsed();
+        self.last_log = Instant::now();
+
+        let (stats, svc_calls) = cpu.stats();
+        let delta = stats_since(stats, &self.last_stats);
+        self.last_stats = *stats;
+        let halts = delta.halts_svc
+            + delta.halts_memory_abort
+            + delta.halts_undefined_instruction
+            + delta.halts_breakpoint
+            + delta.halts_out_of_ticks;
+        log!(
+            "JIT stats for the last {:?}: {} halts ({:.0}/s): {} SVC, {} out of ticks, {} memory abort, {} undefined instruction, {} breakpoint; {} steps ({} interpreted)",
+            interval,
+            halts,
+            halts as f64 / interval.as_secs_f64(),
+            delta.halts_svc,
+            delta.halts_out_of_ticks,
+            delta.halts_memory_abort,
+            delta.halts_undefined_instruction,
+            delta.halts_breakpoint,
+            delta.steps,
+            delta.interpreted_steps,
+        );
+        log!(
+            "JIT stats: {} leaf SVCs and {} objc_msgSend calls without halting; memory callbacks (8/16/32/64-bit): {:?} reads, {:?} writes; {} invalidations ({} bytes, {} from code writes) in {} flushes; {} context switches",
+            delta.leaf_svcs,
+            delta.cached_msg_sends,
+            delta.memory_reads,
+            delta.memory_writes,
+            delta.invalidations,
+            delta.bytes_invalidated,
+            delta.code_write_faults,
+            delta.invalidation_flushes,
+            delta.context_switches,
+        );
+        log!(
+            "JIT stats: {} blocks compiled ({} again while still cached); code caches hold {:#x} bytes of guest code; {} full code cache flushes",
+            delta.blocks_compiled,
+            delta.blocks_recompiled,
+            delta.code_cache_guest_bytes,
+            delta.code_cache_flushes,
+        );
+
+        let mut top_svcs: Vec<(u32, u64)> = svc_calls
+            .iter()
+            .enumerate()
+            .map(|(svc, &calls)| {
+                let last_calls = self.last_svc_calls.get(svc).copied().unwrap_or(0);
+                (svc as u32, calls - last_calls)
+            })
+            .filter(|&(_svc, calls)| calls != 0)
+            .collect();
+        self.last_svc_calls.clear();
+        self.last_svc_calls.extend_from_slice(svc_calls);
+        top_svcs.sort_by_key(|&(svc, calls)| (std::cmp::Reverse(calls), svc));
+        top_svcs.truncate(TOP_SVC_COUNT);
+        for (svc, calls) in top_svcs {
+            log!(
+                "JIT stats: SVC #{} ({}): {} calls",
+                svc,
+                dyld.svc_name(svc).unwrap_or("unknown"),
+                calls
+            );
+        }
+    }
+}
@@ -0,0 +1,173 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Persistent JIT warm-up profiles (`--jit-warm-up`).
+//!
+//! dynarmic compiles each block of guest code the first time it is executed,
+//! which causes a lot of stuttering soon after an app is launched. To avoid
+//! this, we record the entry points of the blocks that get compiled and save
+//! them to a file identified by the hash of the app binary. On the next launch,
+//! those blocks are compiled before the app starts running.
+//!
+//! The file is plain text with one entry point per line, in hexadecimal, with
+//! the Thumb bit set for Thumb code. Blocks are listed in the order they were
+//! first compiled, so the blocks needed earliest are compiled first.
+
+use crate::cpu::Cpu;
+use crate::mach_o::MachO;
+use crate::mem::Mem;
+use crate::paths;
+use std::path::PathBuf;
+use std::time::{Duration, Instant};
+
+/// How often to save the profile, if new blocks have been compiled. Apps are
+/// usually exited by closing the window or by the OS killing the process, so
+/// we can't rely on getting a chance to save it at exit.
+const SAVE_INTERVAL: Duration = Duration::from_secs(10);
+
+pub struct JitWarmUp {
+    path: PathBuf,
+    /// Address ranges containing the code sections of the loaded binaries.
+    /// Blocks elsewhere (e.g. in stubs rewritten by the dynamic linker) aren't
+    /// worth saving, and entries outside these ranges in a loaded profile must
+    /// be stale.
+    code_ranges: Vec<std::ops::Range<u32>>,
+    /// How many of the CPU's recorded blocks were included in the last save.
+    saved_count: usize,
+    last_save: Instant,
+}
+
+impl JitWarmUp {
+    /// Load the profile for the app (if there is one), compile the blocks it
+    /// lists, and start recording newly compiled blocks.
+    pub fn new(bins: &[MachO], cpu: &mut Cpu, mem: &mut Mem) -> JitWarmUp {
+        // The executable is always loaded with its hash when warm-up is
+        // enabled.
+        let hash: String = bins[0]
+            .content_hash
+            .unwrap()
+            .iter()
+            .map(|byte| format!("{:02x}", byte))
+            .collect();
+        let path = paths::user_data_base_path()
+            .join(paths::JIT_PROFILES_DIR)
+            .join(format!("{}.txt", hash));
+
+        let code_ranges = bins
+            .iter()
+            .flat_map(|bin| bin.sections.iter())
+            .filter(|section| section.name == "__text")
+            .map(|section| section.addr..(section.addr + section.size))
+            .collect();
+
+        let mut warm_up = JitWarmUp {
+            path,
+            code_ranges,
+            saved_count: 0,
+            last_save: Instant::now(),
+        };
+
+        // Recording must be enabled first, so that the precompiled blocks are
+        // included when the profile is next saved.
+        cpu.set_block_recording(true);
+
+        let entries = match std::fs::read_to_string(&warm_up.path) {
+            Ok(text) => warm_up.parse(&text),
+            Err(e) if e.kind() == std::io::ErrorKind::NotFound => {
+                log!(
+                    "No JIT warm-up profile found at {:?}, one will be created.",
+                    warm_up.path
+                );
+                Vec::new()
+            }
+            Err(e) => {
+                log!(
+                    "Warning: couldn't read JIT warm-up profile {:?}: {}",
+                    warm_up.path,
+                    e
+                );
+                Vec::new()
+            }
+        };
+
+        if !entries.is_empty() {
+            let start = Instant::now();
+            cpu.precompile_blocks(mem, &entries);
+            log!(
+                "Precompiled {} blocks from JIT warm-up profile in {:?}.",
+                entries.len(),
+                start.elapsed()
+            );
+            // Nothing new to save yet.
+            warm_up.saved_count = cpu.recorded_blocks().len();
+        }
+
+        warm_up
+    }
+
+    fn is_in_code_range(&self, entry: u32) -> bool {
+        let addr = entry & !1;
+        self.code_ranges.iter().any(|range| range.contains(&addr))
+    }
+
+    fn parse(&self, text: &str) -> Vec<u32> {
+        let mut entries = Vec::new();
+        for line in text.lines() {
+            let Ok(entry) = u32::from_str_radix(line.trim(), 16) else {
+                log!(
+                    "Warning: JIT warm-up profile {:?} is malformed, ignoring it.",
+                    self.path
+                );
+                return Vec::new();
+            };
+            if self.is_in_code_range(entry) {
+                entries.push(entry);
+            }
+        }
+        entries
+    }
+
+    /// Save the profile if it's been a while since the last save and new
+    /// blocks have been compiled since then.
+    pub fn save_if_needed(&mut self, cpu: &Cpu) {
+        if self.last_save.elapsed() < SAVE_INTERVAL {
+            return;
+        }
+        self.last_save = Instant::now();
+
+        let recorded = cpu.recorded_blocks();
+        if recorded.len() == self.saved_count {
+            return;
+        }
+
+        let mut text = String::new();
+        for &entry in recorded {
+            if self.is_in_code_range(entry) {
+                use std::fmt::Write;
+                writeln!(&mut text, "{:x}", entry).unwrap();
+            }
+        }
+
+        let res = std::fs::create_dir_all(self.path.parent().unwrap())
+            .and_then(|_| std::fs::write(&self.path, text));
+        match res {
+            Ok(()) => {
+                log_dbg!(
+                    "Saved {} blocks to JIT warm-up profile {:?}",
+                    recorded.len(),
+                    self.path
+                );
+                self.saved_count = recorded.len();
+            }
+            Err(e) => {
+                log!(
+                    "Warning: couldn't save JIT warm-up profile {:?}: {}",
+                    self.path,
+                    e
+                );
+            }
+        }
+    }
+}
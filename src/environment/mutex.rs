@@ -178,6 +178,14 @@ impl Environment {
         // subtracted in relock_unblocked_mutex.
         mutex.waiting_count += 1;
 
+        if crate::trace::enabled() {
+            let args = format!(
+                "{{\"mutex\":{},\"locked_by\":{}}}",
+                mutex_id, locking_thread
+            );
+            crate::trace::instant("mutex", "contended mutex", Some(args));
+        }
+
         // Mutex is already locked, block thread until it isn't.
         self.block_on_mutex(mutex_id);
         // Lock count is always 1 after a thread-blocking lock.
@@ -0,0 +1,246 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Guest profiler (`--profile=`), for finding out whether an app is slow in
+//! its own code or in touchHLE's implementation of something.
+//!
+//! Rather than interrupting execution on a timer, this makes use of the points
+//! where execution already leaves the JIT: SVCs, the end of each slice (see
+//! [super::quantum]), and so on. Wall-clock time is divided at these points,
+//! and each interval is attributed to a stack:
+//!
+//! - Time spent in the JIT is attributed to the guest stack at the point it
+//!   returned, found by walking frame pointers. Since slices are short, this
+//!   is effectively sampling.
+//! - Time spent in a host function is attributed to the guest stack at the
+//!   point it was called, followed by the host function's name. Guest code
+//!   called by a host function is nested below it.
+//! - Any other time is attributed to `[touchHLE]` (scheduling, event polling,
+//!   etc).
+//!
+//! The result is saved periodically in the "collapsed stack" format used by
+//! [FlameGraph](https://github.com/brendangregg/FlameGraph) and compatible
+//! tools, with times in microseconds. Guest addresses are symbolized using
+//! the binaries' symbol tables.
+
+use crate::abi;
+use crate::cpu::Cpu;
+use crate::mach_o::MachO;
+use crate::mem::{ConstPtr, GuestUSize, Mem, Ptr};
+use std::collections::HashMap;
+use std::ops::RangeInclusive;
+use std::path::PathBuf;
+use std::time::{Duration, Instant};
+
+/// How often the profile is saved.
+const SAVE_INTERVAL: Duration = Duration::from_secs(5);
+/// Maximum number of guest frames recorded per stack. Deeper frames are
+/// usually not interesting and walking them would slow things down.
+const MAX_GUEST_FRAMES: usize = 16;
+
+#[derive(Clone, Debug, PartialEq, Eq, Hash)]
+enum Frame {
+    Thread(usize),
+    /// Address in guest code (PC or a return address).
+    Guest(u32),
+    Host(&'static str),
+    Other(&'static str),
+}
+
+/// Things that are needed to walk the guest stack.
+pub struct GuestStackInfo<'a> {
+    pub cpu: &'a Cpu,
+    pub mem: &'a Mem,
+    pub thread: usize,
+    pub stack_range: Option<RangeInclusive<GuestUSize>>,
+    pub return_to_host_routine: u32,
+    pub thread_exit_routine: u32,
+}
+
+pub struct Profiler {
+    path: PathBuf,
+    last_save: Instant,
+    /// When the last interval ended.
+    last_event: Instant,
+    /// Threads and stacks (up to and including the host function) of the host
+    /// functions currently being called, innermost last.
+    host_calls: Vec<(usize, Vec<Frame>)>,
+    samples: HashMap<Vec<Frame>, Duration>,
+}
+
+impl Profiler {
+    pub fn new(path: PathBuf) -> Profiler {
+        log!("Profiling enabled, results will be saved to {:?}", path);
+        Profiler {
+            path,
+            last_save: Instant::now(),
+            last_event: Instant::now(),
+            host_calls: Vec::new(),
+            samples: HashMap::new(),
+        }
+    }
+
+    fn end_interval(&mut self, stack: Vec<Frame>) {
+        let now = Instant::now();
+        let elapsed = now - self.last_event;
+        self.last_event = now;
+        *self.samples.entry(stack).or_default() += elapsed;
+    }
+
+    fn host_stack(&self) -> Vec<Frame> {
+        match self.host_calls.last() {
+            Some((_thread, stack)) => stack.clone(),
+            None => vec![Frame::Other("[touchHLE]")],
+        }
+    }
+
+    fn guest_stack(&self, info: &GuestStackInfo) -> Vec<Frame> {
+        // The outermost frames are where the thread's innermost host function
+        // called into the guest, so they're already in that function's stack.
+        let mut stack = self
+            .host_calls
+            .iter()
+            .rev()
+            .find(|&&(thread, _)| thread == info.thread)
+            .map_or_else(
+                || vec![Frame::Thread(info.thread)],
+                |(_, stack)| stack.clone(),
+            );
+        let start = stack.len();
+
+        let regs = info.cpu.regs();
+        stack.push(Frame::Guest(regs[Cpu::PC]));
+        let mut fp: ConstPtr<u8> = Ptr::from_bits(regs[abi::FRAME_POINTER]);
+        let mut lr = regs[Cpu::LR];
+        let frame_lr = |fp: ConstPtr<u8>| -> Option<u32> {
+            let stack_range = info.stack_range.as_ref()?;
+            let frame_end = fp.to_bits().checked_add(7)?;
+            if fp.to_bits() % 4 != 0
+                || !stack_range.contains(&fp.to_bits())
+                || !stack_range.contains(&frame_end)
+            {
+                return None;
+            }
+            Some(info.mem.read((fp + 4).cast()))
+        };
+        // The LR is only useful if the current function hasn't saved it in a
+        // frame yet, which is the case if it doesn't match the frame's.
+        if frame_lr(fp) == Some(lr) {
+            lr = 0;
+        }
+        loop {
+            if lr == info.return_to_host_routine || lr == info.thread_exit_routine {
+                break;
+            }
+            if lr != 0 {
+                stack.push(Frame::Guest(lr));
+            }
+            if stack.len() - start >= MAX_GUEST_FRAMES {
+                break;
+            }
+            let Some(next_lr) = frame_lr(fp) else {
+                break;
+            };
+            lr = next_lr;
+            fp = info.mem.read(fp.cast());
+        }
+
+        stack[start..].reverse();
+        stack
+    }
+
+    /// Call when the CPU is about to start executing.
+    pub fn entering_guest(&mut self) {
+        let stack = self.host_stack();
+        self.end_interval(stack);
+    }
+
+    /// Call when the CPU has stopped executing.
+    pub fn left_guest(&mut self, info: &GuestStackInfo) {
+        let stack = self.guest_stack(info);
+        self.end_interval(stack);
+    }
+
+    /// Call when a host function is about to be called from the guest. If the
+    /// CPU is still executing (a leaf function), [Self::left_guest] should be
+    /// called first.
+    pub fn entering_host_function(&mut self, name: &'static str, info: &GuestStackInfo) {
+        let stack = self.host_stack();
+        self.end_interval(stack);
+        let mut stack = self.guest_stack(info);
+        stack.push(Frame::Host(name));
+        self.host_calls.push((info.thread, stack));
+    }
+
+    /// Call when a host function called from the guest has returned.
+    pub fn left_host_function(&mut self) {
+        let stack = self.host_stack();
+        self.end_interval(stack);
+        self.host_calls.pop();
+    }
+
+    /// Save the profile if it's been a while since the last save.
+    pub fn save_if_needed(&mut self, bins: &[MachO]) {
+        if self.last_save.elapsed() < SAVE_INTERVAL {
+            return;
+        }
+        self.save(bins);
+    }
+
+    /// Save the profile now, e.g. because touchHLE is about to exit.
+    pub fn save(&mut self, bins: &[MachO]) {
+        self.last_save = Instant::now();
+
+        let mut symbol_cache: HashMap<u32, String> = HashMap::new();
+        let mut symbolize = |addr: u32| -> String {
+            symbol_cache
+                .entry(addr)
+                .or_insert_with(|| {
+                    bins.iter()
+                        .find_map(|bin| bin.symbolize(addr))
+                        .map_or_else(|| format!("{:#x}", addr), |name| name.replace(';', ":"))
+                })
+                .clone()
+        };
+
+        let mut lines: Vec<(String, u128)> = self
+            .samples
+            .iter()
+            .map(|(stack, &time)| {
+                let frames: Vec<String> = stack
+                    .iter()
+                    .map(|frame| match *frame {
+                        Frame::Thread(0) => "[main thread]".to_string(),
+                        Frame::Thread(i) => format!("[thread {}]", i),
+                        Frame::Guest(addr) => symbolize(addr),
+                        Frame::Host(name) => format!("[host] {}", name),
+                        Frame::Other(name) => name.to_string(),
+                    })
+                    .collect();
+                (frames.join(";"), time.as_micros())
+            })
+            .filter(|&(_, micros)| micros != 0)
+            .collect();
+        // Separate stacks can become identical after symbolization.
+        lines.sort();
+        lines.dedup_by(|next, prev| {
+            if next.0 == prev.0 {
+                prev.1 += next.1;
+                true
+            } else {
+                false
+            }
+        });
+
+        let mut text = String::new();
+        for (stack, micros) in lines {
+            use std::fmt::Write;
+            writeln!(&mut text, "{} {}", stack, micros).unwrap();
+        }
+        if let Err(e) = std::fs::write(&self.path, text) {
+            log!("Warning: couldn't save profile to {:?}: {}", self.path, e);
+        }
+    }
+}
@@ -0,0 +1,308 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Adaptive scheduler quanta (the number of ticks a thread runs for before
+//! [super::Environment::run_inner] considers switching to another one).
+//!
+//! A single fixed quantum is a poor fit for apps that have both threads doing
+//! useful work and threads that spin waiting for something to happen, and it
+//! ties the rate of event polling to the guest's instruction count rather than
+//! to wall time. Instead, each thread's quantum is adjusted after every slice:
+//!
+//! - Threads that look like they're spinning while another thread is ready to
+//!   run have their quantum halved, down to [MIN_QUANTUM], leaving more time
+//!   for the other threads. A thread that is alone is left alone, since a
+//!   compute-bound loop looks the same as a busy-wait.
+//! - Threads that use their whole quantum productively have it grown back
+//!   towards a target determined by their priority.
+//! - Regardless of the above, a quantum is capped so that the slice should end
+//!   around the time events are next due to be polled.
+//!
+//! When benchmarking, every slice is [BASE_QUANTUM] instead (see
+//! [Scheduler::use_fixed_quantum]), so that scheduling doesn't depend on
+//! timing.
+
+use std::time::{Duration, Instant};
+
+/// Priority a thread has if none is set, matching the default for
+/// `SCHED_OTHER` on Apple platforms.
+pub const DEFAULT_PRIORITY: i32 = 31;
+/// Highest priority that can be set with `pthread_setschedparam`.
+pub const MAX_PRIORITY: i32 = 47;
+/// Lowest priority that can be set with `pthread_setschedparam`.
+pub const MIN_PRIORITY: i32 = 15;
+
+/// Target quantum for a thread with [DEFAULT_PRIORITY]. This used to be the
+/// fixed quantum for all threads.
+const BASE_QUANTUM: u64 = 100_000;
+/// It's not worth entering dynarmic for less than this.
+const MIN_QUANTUM: u64 = 10_000;
+/// How often events should be polled. Keep in sync with
+/// [crate::window::Window::poll_for_events].
+const POLL_INTERVAL: Duration = Duration::from_nanos(1_000_000_000 / 120);
+/// How many consecutive slices ending at nearby addresses mean a thread is
+/// probably stuck in a loop waiting for something.
+const SPIN_THRESHOLD: u32 = 3;
+/// How close (in bytes) the PCs at the end of two slices must be to be
+/// considered as being in the same loop.
+const SPIN_PC_DISTANCE: u32 = 64;
+/// How often the per-thread statistics are logged.
+const STATS_LOG_INTERVAL: Duration = Duration::from_secs(5);
+
+/// Per-thread quantum state and statistics.
+#[derive(Debug)]
+pub struct ThreadQuantum {
+    /// Set by `pthread_setschedparam`.
+    pub priority: i32,
+    quantum: u64,
+    /// PC at the end of the last slice that used the whole quantum.
+    last_end_pc: Option<u32>,
+    /// Number of consecutive full slices ending near [Self::last_end_pc].
+    spin_count: u32,
+    slices: u64,
+    ticks_used: u64,
+    /// Number of slices ended early by the thread blocking or yielding.
+    early_yields: u64,
+    /// Number of slices in which the thread was considered to be spinning.
+    spinning_slices: u64,
+}
+
+impl Default for ThreadQuantum {
+    fn default() -> Self {
+        ThreadQuantum {
+            priority: DEFAULT_PRIORITY,
+            quantum: BASE_QUANTUM,
+            last_end_pc: None,
+            spin_count: 0,
+            slices: 0,
+            ticks_used: 0,
+            early_yields: 0,
+            spinning_slices: 0,
+        }
+    }
+}
+
+impl ThreadQuantum {
+    fn target(&self) -> u64 {
+        // Scale linearly so that the highest priority gets twice the base
+        // quantum and the lowest gets half of it.
+        let priority = self.priority.clamp(MIN_PRIORITY, MAX_PRIORITY);
+        let range = (MAX_PRIORITY - DEFAULT_PRIORITY) as u64;
+        if priority >= DEFAULT_PRIORITY {
+            BASE_QUANTUM + BASE_QUANTUM * (priority - DEFAULT_PRIORITY) as u64 / range
+        } else {
+            BASE_QUANTUM - BASE_QUANTUM / 2 * (DEFAULT_PRIORITY - priority) as u64 / range
+        }
+    }
+}
+
+pub struct Scheduler {
+    /// Moving average of the tick rate, used to estimate how many ticks can be
+    /// run before the next event poll.
+    ticks_per_second: Option<f64>,
+    last_stats_log: Instant,
+    /// Context switches since the statistics were last logged, and how long
+    /// they took in total.
+    context_switches: u64,
+    context_switch_time: Duration,
+    fixed_quantum: bool,
+    /// Ticks used by all threads so far.
+    total_ticks: u64,
+}
+
+impl Scheduler {
+    pub fn new() -> Scheduler {
+        Scheduler {
+            ticks_per_second: None,
+            last_stats_log: Instant::now(),
+            context_switches: 0,
+            context_switch_time: Duration::ZERO,
+            fixed_quantum: false,
+            total_ticks: 0,
+        }
+    }
+
+    /// Give every thread the same quantum, regardless of priority, behavior or
+    /// wall-clock time.
+    pub fn use_fixed_quantum(&mut self) {
+        self.fixed_quantum = true;
+    }
+
+    /// The number of ticks (roughly, guest instructions) used so far.
+    pub fn total_ticks(&self) -> u64 {
+        self.total_ticks
+    }
+
+    /// Get the number of ticks the thread should run for in its next slice.
+    /// `last_poll` is when events were last polled, if there's a window.
+    pub fn quantum_for(&self, thread: &ThreadQuantum, last_poll: Option<Instant>) -> u64 {
+        if self.fixed_quantum {
+            return BASE_QUANTUM;
+        }
+        let (Some(ticks_per_second), Some(last_poll)) = (self.ticks_per_second, last_poll) else {
+            return thread.quantum;
+        };
+        let until_poll = (last_poll + POLL_INTERVAL).saturating_duration_since(Instant::now());
+        let poll_cap = (ticks_per_second * until_poll.as_secs_f64()) as u64;
+        thread.quantum.min(poll_cap).max(MIN_QUANTUM)
+    }
+
+    /// Update the thread's quantum after it ran a slice. `ticks_left` is
+    /// non-zero if the slice ended early. `others_ready` is whether any other
+    /// thread could run now.
+    pub fn end_slice(
+        &mut self,
+        thread: &mut ThreadQuantum,
+        ticks_given: u64,
+        ticks_left: u64,
+        elapsed: Duration,
+        end_pc: u32,
+        others_ready: bool,
+    ) {
+        let ticks_used = ticks_given - ticks_left;
+        thread.slices += 1;
+        thread.ticks_used += ticks_used;
+        self.total_ticks += ticks_used;
+        if self.fixed_quantum {
+            return;
+        }
+
+        if ticks_used > 0 && !elapsed.is_zero() {
+            let rate = ticks_used as f64 / elapsed.as_secs_f64();
+            self.ticks_per_second = Some(match self.ticks_per_second {
+                Some(average) => average * 0.75 + rate * 0.25,
+                None => rate,
+            });
+        }
+
+        if ticks_left > 0 {
+            // The thread blocked or yielded. If it did so very quickly, it's
+            // probably polling for something using sleep or sched_yield, and
+            // won't miss a longer quantum.
+            thread.early_yields += 1;
+            thread.last_end_pc = None;
+            thread.spin_count = 0;
+            if ticks_used < MIN_QUANTUM {
+                thread.quantum = (thread.quantum / 2).max(MIN_QUANTUM);
+            }
+            return;
+        }
+
+        // The thread used its whole quantum. If it keeps ending up in the same
+        // small range of code, it's probably stuck in a busy-wait loop, or
+        // it's just a long loop. Shrinking the quantum only helps in the first
+        // case, and costs context switches, so it's only done when another
+        // thread could use the time.
+        let near_last_end = thread
+            .last_end_pc
+            .is_some_and(|last| last.abs_diff(end_pc) <= SPIN_PC_DISTANCE);
+        thread.spin_count = if near_last_end {
+            thread.spin_count + 1
+        } else {
+            0
+        };
+        thread.last_end_pc = Some(end_pc);
+
+        if thread.spin_count >= SPIN_THRESHOLD && others_ready {
+            thread.spinning_slices += 1;
+            thread.quantum = (thread.quantum / 2).max(MIN_QUANTUM);
+        } else {
+            thread.quantum = (thread.quantum * 2).min(thread.target());
+        }
+    }
+
+    /// Record that switching the CPU to another thread's context took `cost`.
+    pub fn note_context_switch(&mut self, cost: Duration) {
+        self.context_switches += 1;
+        self.context_switch_time += cost;
+    }
+
+    /// Log each thread's statistics every so often, if debug logging is enabled
+    /// for this module.
+    pub fn log_stats_if_needed<'a>(
+        &mut self,
+        threads: impl Iterator<Item = (usize, bool, &'a ThreadQuantum)>,
+    ) {
+        if self.last_stats_log.elapsed() < STATS_LOG_INTERVAL {
+            return;
+        }
+        let interval = self.last_stats_log.elapsed();
+        self.last_stats_log = Instant::now();
+        log_dbg!(
+            "{} context switches in the last {:?} ({:.0}/s), average cost {:?}",
+            self.context_switches,
+            interval,
+            self.context_switches as f64 / interval.as_secs_f64(),
+            self.context_switch_time
+                .checked_div(self.context_switches.try_into().unwrap_or(u32::MAX))
+                .unwrap_or_default(),
+        );
+        self.context_switches = 0;
+        self.context_switch_time = Duration::ZERO;
+        for (i, active, thread) in threads {
+            if !active {
+                continue;
+            }
+            log_dbg!(
+                "Thread {}: priority {}, quantum {}, {} slices, {} ticks, average {} ticks per slice, {} early yields, {} spinning slices",
+                i,
+                thread.priority,
+                thread.quantum,
+                thread.slices,
+                thread.ticks_used,
+                thread.ticks_used.checked_div(thread.slices).unwrap_or(0),
+                thread.early_yields,
+                thread.spinning_slices,
+            );
+        }
+    }
+}
+
+#[cfg(test)]
+#[test]
+fn test_quantum_adapts() {
+    let mut scheduler = Scheduler::new();
+    let elapsed = Duration::from_millis(1);
+
+    // A thread that keeps ending its slices in the same loop is left alone if
+    // there's nothing else to run...
+    let mut spinner = ThreadQuantum::default();
+    for _ in 0..20 {
+        let given = scheduler.quantum_for(&spinner, None);
+        scheduler.end_slice(&mut spinner, given, 0, elapsed, 0x1000, false);
+    }
+    assert_eq!(spinner.quantum, BASE_QUANTUM);
+
+    // ...shrinks if there is...
+    for _ in 0..20 {
+        let given = scheduler.quantum_for(&spinner, None);
+        scheduler.end_slice(&mut spinner, given, 0, elapsed, 0x1000, true);
+    }
+    assert_eq!(spinner.quantum, MIN_QUANTUM);
+
+    // ...but grows back once it starts doing something else.
+    for i in 0..20 {
+        let given = scheduler.quantum_for(&spinner, None);
+        scheduler.end_slice(&mut spinner, given, 0, elapsed, 0x1000 + i * 0x100, true);
+    }
+    assert_eq!(spinner.quantum, BASE_QUANTUM);
+
+    let mut high_priority = ThreadQuantum {
+        priority: MAX_PRIORITY,
+        ..Default::default()
+    };
+    for i in 0..20 {
+        let given = scheduler.quantum_for(&high_priority, None);
+        scheduler.end_slice(&mut high_priority, given, 0, elapsed, i * 0x100, true);
+    }
+    assert_eq!(high_priority.quantum, BASE_QUANTUM * 2);
+
+    // Polling being overdue limits the quantum.
+    let long_ago = Instant::now() - Duration::from_secs(1);
+    assert_eq!(
+        scheduler.quantum_for(&high_priority, Some(long_ago)),
+        MIN_QUANTUM
+    );
+}
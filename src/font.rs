@@ -12,13 +12,19 @@
 //! code has its own, not particularly good implementation. We might want to
 //! switch to something like cosmic-text in future, but that has a _lot_ more
 //! dependencies.
+//!
+//! Rasterized glyphs are cached per font (see [GlyphCache]), because apps
+//! often redraw the same text (score counters, HUDs, etc) every frame.
 
 use crate::paths;
 use rusttype::{Point, Scale};
+use std::cell::RefCell;
+use std::collections::HashMap;
 use std::io::Read;
 
 pub struct Font {
     font: rusttype::Font<'static>,
+    glyph_cache: RefCell<GlyphCache>,
 }
 
 pub enum TextAlignment {
@@ -40,6 +46,108 @@ fn scale(font_size: f32) -> Scale {
     Scale::uniform(font_size * 1.125)
 }
 
+/// Maximum number of coverage values (pixels) in a font's glyph atlas. This is
+/// 4MiB per font, enough for thousands of glyphs at typical sizes. When it's
+/// full, the whole cache is emptied: apps tend to use a small, stable set of
+/// glyphs, so this rarely happens and isn't worth a smarter eviction policy.
+const GLYPH_ATLAS_MAX_PIXELS: usize = 1 << 20;
+
+/// Glyph cache hit/miss statistics, see [Font::glyph_cache_stats].
+#[derive(Copy, Clone, Debug, Default)]
+pub struct GlyphCacheStats {
+    pub hits: u64,
+    pub misses: u64,
+    /// Number of times the cache was emptied because the atlas was full.
+    pub flushes: u64,
+    /// Current number of cached glyphs.
+    pub glyphs: usize,
+    /// Current number of pixels used in the atlas.
+    pub atlas_pixels: usize,
+}
+impl std::ops::AddAssign for GlyphCacheStats {
+    fn add_assign(&mut self, other: Self) {
+        self.hits += other.hits;
+        self.misses += other.misses;
+        self.flushes += other.flushes;
+        self.glyphs += other.glyphs;
+        self.atlas_pixels += other.atlas_pixels;
+    }
+}
+
+/// Identifies a rasterized glyph. The fractional part of the glyph's position
+/// is included because it affects the rasterization, so text looks the same
+/// with the cache as without it.
+#[derive(Copy, Clone, PartialEq, Eq, Hash)]
+struct GlyphKey {
+    id: u16,
+    scale: (u32, u32),
+    subpixel_offset: (u32, u32),
+}
+
+struct CachedGlyph {
+    /// Top-left corner of the bounding box, relative to the integer part of
+    /// the glyph's position.
+    min: (i32, i32),
+    dimensions: (usize, usize),
+    /// Start of the glyph's coverage bitmap within [GlyphCache::atlas].
+    atlas_offset: usize,
+}
+
+/// Cache of rasterized glyphs for a single font.
+#[derive(Default)]
+struct GlyphCache {
+    /// [None] for glyphs with nothing to draw, e.g. spaces.
+    glyphs: HashMap<GlyphKey, Option<CachedGlyph>>,
+    /// Coverage bitmaps of all the cached glyphs, one after another. Glyphs are
+    /// never removed individually, so this is simply appended to.
+    atlas: Vec<f32>,
+    stats: GlyphCacheStats,
+}
+
+impl GlyphCache {
+    /// Get a glyph from the cache, rasterizing and adding it if necessary.
+    fn get_or_rasterize(
+        &mut self,
+        key: GlyphKey,
+        glyph: impl FnOnce() -> rusttype::PositionedGlyph<'static>,
+    ) -> Option<(&CachedGlyph, &[f32])> {
+        if self.glyphs.contains_key(&key) {
+            self.stats.hits += 1;
+        } else {
+            self.stats.misses += 1;
+            let glyph = glyph();
+            let cached = glyph.pixel_bounding_box().map(|bounds| {
+                let dimensions = (bounds.width() as usize, bounds.height() as usize);
+                let size = dimensions.0 * dimensions.1;
+                if self.atlas.len() + size > GLYPH_ATLAS_MAX_PIXELS {
+                    self.stats.flushes += 1;
+                    log_dbg!("Glyph atlas full, emptying cache: {:?}", self.stats);
+                    self.glyphs.clear();
+                    self.atlas.clear();
+                }
+                let atlas_offset = self.atlas.len();
+                self.atlas.resize(atlas_offset + size, 0.0);
+                let bitmap = &mut self.atlas[atlas_offset..];
+                glyph.draw(|x, y, coverage| {
+                    bitmap[y as usize * dimensions.0 + x as usize] = coverage;
+                });
+                CachedGlyph {
+                    min: (bounds.min.x, bounds.min.y),
+                    dimensions,
+                    atlas_offset,
+                }
+            });
+            self.glyphs.insert(key, cached);
+            self.stats.glyphs = self.glyphs.len();
+            self.stats.atlas_pixels = self.atlas.len();
+        }
+
+        let cached = self.glyphs[&key].as_ref()?;
+        let size = cached.dimensions.0 * cached.dimensions.1;
+        Some((cached, &self.atlas[cached.atlas_offset..][..size]))
+    }
+}
+
 /// Helper for [Font::draw], used for the `draw_glyph` callback.
 pub struct RasterGlyph<'a> {
     origin: (f32, f32),
@@ -83,7 +191,10 @@ impl Font {
             panic!("Couldn't parse bundled font file {:?}. This probably means the file is corrupt. Try re-downloading it.", path);
         };
 
-        Font { font }
+        Font {
+            font,
+            glyph_cache: Default::default(),
+        }
     }
 
     pub fn mono_regular() -> Font {
@@ -129,6 +240,11 @@ impl Font {
         Self::from_resource_file("NotoSansJP-Bold.otf")
     }
 
+    /// Get the statistics for this font's glyph cache.
+    pub fn glyph_cache_stats(&self) -> GlyphCacheStats {
+        self.glyph_cache.borrow().stats
+    }
+
     fn line_height_and_gap(&self, font_size: f32) -> (f32, f32) {
         let v_metrics = self.font.v_metrics(scale(font_size));
         (v_metrics.ascent - v_metrics.descent, v_metrics.line_gap)
@@ -326,13 +442,13 @@ impl Font {
         // each pixel in the glyph's bounding box, in left-to-right
         // top-to-bottom order. This is unfortunately incompatible with
         // touchHLE's code which needs to be able to sample the pixels in any
-        // order in order to support rotation. This is worked around by creating
-        // a temporary bitmap for the glyph, and then the caller of this
-        // function can provide a "draw glyph" callback that can do whatever it
-        // wants with this bitmap.
+        // order in order to support rotation. This is worked around by drawing
+        // the glyph into a bitmap in the glyph cache's atlas, and then the
+        // caller of this function can provide a "draw glyph" callback that can
+        // do whatever it wants with this bitmap.
         // TODO: Do we need to increase the font size when scale transforms are
         //       used, to avoid blurry text?
-        let mut glyph_bitmap: Vec<f32> = Vec::new();
+        let mut glyph_cache = self.glyph_cache.borrow_mut();
 
         for (line_width, line_text) in lines {
             let line_x_offset = match alignment {
@@ -348,19 +464,39 @@ impl Font {
                     y: 0.0,
                 },
             ) {
-                let Some(glyph_bounds) = glyph.pixel_bounding_box() else {
+                // Only the fractional part of the position affects how the
+                // glyph is rasterized, so the glyph is rasterized at that
+                // position and then moved by the integer part.
+                let position = glyph.position();
+                let (int_x, int_y) = (position.x.floor(), position.y.floor());
+                let subpixel_offset = Point {
+                    x: position.x - int_x,
+                    y: position.y - int_y,
+                };
+                let glyph_scale = glyph.scale();
+                let key = GlyphKey {
+                    id: glyph.id().0,
+                    scale: (glyph_scale.x.to_bits(), glyph_scale.y.to_bits()),
+                    subpixel_offset: (subpixel_offset.x.to_bits(), subpixel_offset.y.to_bits()),
+                };
+                let Some((cached, pixels)) = glyph_cache.get_or_rasterize(key, || {
+                    glyph.unpositioned().clone().positioned(subpixel_offset)
+                }) else {
                     continue;
                 };
+                let min_x = cached.min.0 + int_x as i32;
+                let min_y = cached.min.1 + int_y as i32;
+                let (width, height) = cached.dimensions;
+
                 // y needs to be flipped to point up
-                let glyph_height = glyph_bounds.height();
-                let x_offset = glyph_bounds.min.x;
-                let y_offset = ((origin.1 + line_y).round() as i32) + glyph_bounds.max.y;
+                let x_offset = min_x;
+                let y_offset = ((origin.1 + line_y).round() as i32) + min_y + height as i32;
 
                 // TODO: Refactor this method to support y clipping too.
                 // It's not mandatory since the caller can do it, but it would
                 // be more efficient.
                 if let Some((wrap_width, _)) = wrap {
-                    if glyph_bounds.min.x as f32 > origin.0 + wrap_width {
+                    if min_x as f32 > origin.0 + wrap_width {
                         // Avoid wasting effort on glyphs that are entirely
                         // clipped. Partial clipping is the responsibility of
                         // the draw_glyph implementation.
@@ -368,21 +504,10 @@ impl Font {
                     }
                 }
 
-                let glyph_bitmap_bounds = (
-                    glyph_bounds.width() as usize,
-                    glyph_bounds.height() as usize,
-                );
-                glyph_bitmap.clear();
-                glyph_bitmap.resize(glyph_bitmap_bounds.0 * glyph_bitmap_bounds.1, 0.0);
-
-                glyph.draw(|x, y, coverage| {
-                    glyph_bitmap[y as usize * glyph_bitmap_bounds.0 + x as usize] = coverage;
-                });
-
                 let raster_glyph = RasterGlyph {
-                    origin: (x_offset as f32, y_offset as f32 - glyph_height as f32),
-                    dimensions: (glyph_bitmap_bounds.0 as _, glyph_bitmap_bounds.1 as _),
-                    pixels: &glyph_bitmap,
+                    origin: (x_offset as f32, y_offset as f32 - height as f32),
+                    dimensions: (width as _, height as _),
+                    pixels,
                 };
 
                 draw_glyph(raster_glyph);
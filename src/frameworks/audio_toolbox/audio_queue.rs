@@ -9,7 +9,7 @@
 //! Apple's implementation probably uses Core Audio instead.
 
 use crate::abi::{CallFromHost, GuestFunction};
-use crate::audio::decode_ima4;
+use crate::audio::decode_ima4_buffer;
 use crate::audio::openal as al;
 use crate::audio::openal::al_types::*;
 use crate::dyld::{export_c_func, FunctionExports};
@@ -490,38 +490,15 @@ pub fn decode_buffer(
     match format.format_id {
         kAudioFormatAppleIMA4 => {
             assert!(data_slice.len() % 34 == 0);
-            let mut out_pcm = Vec::<u8>::with_capacity((data_slice.len() / 34) * 64 * 2);
-            let packets = data_slice.chunks(34);
-
-            if format.channels_per_frame == 1 {
-                for packet in packets {
-                    let pcm_packet: [i16; 64] = decode_ima4(packet.try_into().unwrap());
-                    let pcm_bytes: &[u8] = unsafe {
-                        std::slice::from_raw_parts(pcm_packet.as_ptr() as *const u8, 128)
-                    };
-                    out_pcm.extend_from_slice(pcm_bytes);
-                }
+            let mut out_pcm = vec![0u8; (data_slice.len() / 34) * 64 * 2];
+            decode_ima4_buffer(data_slice, format.channels_per_frame as usize, &mut out_pcm);
 
-                (al::AL_FORMAT_MONO16, format.sample_rate as ALsizei, out_pcm)
+            let f = if format.channels_per_frame == 1 {
+                al::AL_FORMAT_MONO16
             } else {
-                let mut peekable_packets = packets.peekable();
-                while peekable_packets.peek().is_some() {
-                    let left = peekable_packets.next().unwrap();
-                    let left_pcm_packet: [i16; 64] = decode_ima4(left.try_into().unwrap());
-                    let right = peekable_packets.next().unwrap();
-                    let right_pcm_packet: [i16; 64] = decode_ima4(right.try_into().unwrap());
-                    for (l, r) in left_pcm_packet.iter().zip(right_pcm_packet.iter()) {
-                        out_pcm.extend_from_slice(&l.to_le_bytes());
-                        out_pcm.extend_from_slice(&r.to_le_bytes());
-                    }
-                }
-
-                (
-                    al::AL_FORMAT_STEREO16,
-                    format.sample_rate as ALsizei,
-                    out_pcm,
-                )
-            }
+                al::AL_FORMAT_STEREO16
+            };
+            (f, format.sample_rate as ALsizei, out_pcm)
         }
         kAudioFormatLinearPCM => {
             // The end of the data might be misaligned (this happens in Crash
@@ -119,6 +119,7 @@ pub fn recomposite_if_necessary(env: &mut Environment) -> Option<Instant> {
         env.window().rotation_matrix(),
         env.window().virtual_cursor_visible_at(),
     );
+    let presenting_frames = env.presenting_frames();
 
     // TODO: draw status bar if it's not hidden
 
@@ -233,17 +234,21 @@ pub fn recomposite_if_necessary(env: &mut Environment) -> Option<Instant> {
 
     // Present our rendered frame (bound to TEXTURE_2D). This copies it to the
     // default framebuffer (0) so we need to unbind our internal framebuffer.
-    unsafe {
-        gles.BindTexture(gles11::TEXTURE_2D, texture);
-        gles.BindFramebufferOES(gles11::FRAMEBUFFER_OES, 0);
-        present_frame(
-            gles,
-            present_frame_args.0,
-            present_frame_args.1,
-            present_frame_args.2,
-        );
+    // When benchmarking, composition still happens but presentation doesn't.
+    if presenting_frames {
+        unsafe {
+            gles.BindTexture(gles11::TEXTURE_2D, texture);
+            gles.BindFramebufferOES(gles11::FRAMEBUFFER_OES, 0);
+            present_frame(
+                gles,
+                present_frame_args.0,
+                present_frame_args.1,
+                present_frame_args.2,
+            );
+        }
+        env.window().swap_window();
     }
-    env.window().swap_window();
+    env.frame_presented();
 
     new_recomposite_next
 }
@@ -106,7 +106,7 @@ pub const CLASSES: ClassExports = objc_classes! {
     }
     let path = to_rust_string(env, path);
     log_dbg!("[(NSData*){:?} initWithContentsOfFile:{:?}]", this, path);
-    let Ok(bytes) = env.fs.read(GuestPath::new(&path)) else {
+    let Ok(bytes) = env.fs.read_mapped(GuestPath::new(&path)) else {
         release(env, this);
         return nil;
     };
@@ -272,11 +272,15 @@ pub const CLASSES: ClassExports = objc_classes! {
             drawable,
             renderbuffer,
         );
-        // re-borrow
-        let gles = super::sync_context(&mut env.framework_state.opengles, &mut env.objc, env.window.as_mut().unwrap(), env.current_thread);
-        unsafe {
-            present_renderbuffer(gles, env.window.as_mut().unwrap());
+        // When benchmarking, the frame is only counted.
+        if env.presenting_frames() {
+            // re-borrow
+            let gles = super::sync_context(&mut env.framework_state.opengles, &mut env.objc, env.window.as_mut().unwrap(), env.current_thread);
+            unsafe {
+                present_renderbuffer(gles, env.window.as_mut().unwrap());
+            }
         }
+        env.frame_presented();
     } else {
         if fullscreen_layer != nil {
             // If there's a single layer that covers the screen, and this isn't
@@ -347,6 +347,7 @@ pub(super) fn exit(env: &mut Environment) {
         let _: () = msg![env; pool drain];
     };
 
+    env.save_before_exit();
     std::process::exit(0);
 }
 
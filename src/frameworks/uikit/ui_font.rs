@@ -6,7 +6,7 @@
 //! `UIFont`.
 
 use super::ui_graphics::UIGraphicsGetCurrentContext;
-use crate::font::{Font, TextAlignment, WrapMode};
+use crate::font::{Font, GlyphCacheStats, TextAlignment, WrapMode};
 use crate::frameworks::core_graphics::cg_bitmap_context::CGBitmapContextDrawer;
 use crate::frameworks::core_graphics::{CGFloat, CGPoint, CGRect, CGSize};
 use crate::frameworks::foundation::ns_string::to_rust_string;
@@ -43,6 +43,21 @@ impl State {
     }
 }
 
+/// Get the combined glyph cache statistics of all the fonts loaded so far.
+pub fn glyph_cache_stats(env: &Environment) -> GlyphCacheStats {
+    let state = &env.framework_state.uikit.ui_font;
+    let mut total = GlyphCacheStats::default();
+    for font in state
+        .fonts
+        .values()
+        .chain(state.sans_regular_ja.iter())
+        .chain(state.sans_bold_ja.iter())
+    {
+        total += font.glyph_cache_stats();
+    }
+    total
+}
+
 #[derive(Copy, Clone, PartialEq, Eq, Hash)]
 enum FontKind {
     MonoRegular,
@@ -77,7 +77,7 @@ pub const CLASSES: ClassExports = objc_classes! {
 
 - (id)initWithContentsOfFile:(id)path { // NSString*
     let path = ns_string::to_rust_string(env, path); // TODO: avoid copy
-    let Ok(bytes) = env.fs.read(GuestPath::new(&path)) else {
+    let Ok(bytes) = env.fs.read_mapped(GuestPath::new(&path)) else {
         log!("Warning: couldn't read image file at {:?}, returning nil", path);
         release(env, this);
         return nil;
@@ -25,10 +25,13 @@
 //! See also [crate::paths], which has paths for host files used by touchHLE.
 
 mod bundle;
+mod mapped_file;
 
 pub use bundle::BundleData;
+pub use mapped_file::FileContents;
 
 use crate::fs::bundle::{IpaFile, IpaFileRef};
+use crate::fs::mapped_file::MappedFile;
 use crate::paths;
 use std::collections::HashMap;
 use std::fs;
@@ -753,6 +756,32 @@ impl Fs {
         Ok(result)
     }
 
+    /// Like [Self::read], but maps the file rather than reading it where
+    /// possible: for host files and files stored without compression in an
+    /// IPA. This avoids copying the whole file into memory first when only
+    /// parts of it are needed, or when it's going to be copied elsewhere
+    /// anyway.
+    pub fn read_mapped<P: AsRef<GuestPath>>(&self, path: P) -> Result<FileContents, ()> {
+        let node = self.lookup_node(path.as_ref()).ok_or(())?;
+        let FsNode::File { location, .. } = node else {
+            return Err(());
+        };
+        match location {
+            FileLocation::Path(host_path) => {
+                let host_file = handle_open_err(File::open(host_path), host_path);
+                MappedFile::from_file(&host_file)
+                    .map(FileContents::Mapped)
+                    .or_else(|_| FileContents::read_from(host_file))
+                    .map_err(|_| ())
+            }
+            FileLocation::IpaFileRef(file) => Ok(file.contents()),
+            FileLocation::ResourceFilePath(name) => {
+                let mut resource_file = handle_open_err(paths::ResourceFile::open(name), name);
+                FileContents::read_from(resource_file.get()).map_err(|_| ())
+            }
+        }
+    }
+
     /// Like [std::fs::write] but for the guest filesystem.
     pub fn write<P: AsRef<GuestPath>>(&mut self, path: P, data: &[u8]) -> Result<(), ()> {
         let mut options = GuestOpenOptions::new();
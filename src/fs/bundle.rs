@@ -5,15 +5,17 @@
  */
 //! IPA file format support, allowing it to be used as part of the guest
 //! filesystem.
+use crate::fs::mapped_file::{FileContents, MappedFile};
 use crate::fs::{FsNode, GuestPath};
 use std::cell::RefCell;
 use std::collections::HashMap;
 use std::fmt::Debug;
 use std::io::{Cursor, Read};
+use std::ops::Range;
 use std::path::{Path, PathBuf};
 use std::rc::Rc;
 use zip::result::ZipError;
-use zip::ZipArchive;
+use zip::{CompressionMethod, ZipArchive};
 
 /// A helper struct to build an FsNode with files and directories coming in
 /// arbitrary order. This is required, because ZIP files are allowed to store
@@ -71,6 +73,9 @@ pub enum BundleData {
     HostDirectory(PathBuf),
     Zip {
         zip: ZipArchive<std::fs::File>,
+        /// Mapping of the whole IPA file, if possible, so that files stored in
+        /// it without compression can be used directly.
+        mapping: Option<MappedFile>,
         /// Path to the app bundle inside the zip file.
         /// It should be `"Payload/<app name>.app"` (no trailing slash!).
         bundle_path: String,
@@ -116,10 +121,21 @@ impl BundleData {
     pub fn open_ipa(path: &Path) -> Result<BundleData, String> {
         let file =
             std::fs::File::open(path).map_err(|e| format!("Could not open IPA file: {e}"))?;
+        let mapping = match MappedFile::from_file(&file) {
+            Ok(mapping) => Some(mapping),
+            Err(e) => {
+                log!("Warning: couldn't map IPA file, all of its files will be extracted into memory: {e}");
+                None
+            }
+        };
         let mut zip =
             ZipArchive::new(file).map_err(|e| format!("Could not open IPA archive: {e}"))?;
         let bundle_path = Self::find_bundle_path_in_archive(&mut zip)?;
-        Ok(BundleData::Zip { zip, bundle_path })
+        Ok(BundleData::Zip {
+            zip,
+            mapping,
+            bundle_path,
+        })
     }
 
     pub fn open_any(path: &Path) -> Result<BundleData, String> {
@@ -143,8 +159,13 @@ impl BundleData {
     pub(super) fn into_fs_node(self) -> FsNode {
         match self {
             BundleData::HostDirectory(path) => FsNode::from_host_dir(&path, false),
-            BundleData::Zip { zip, bundle_path } => {
+            BundleData::Zip {
+                zip,
+                mapping,
+                bundle_path,
+            } => {
                 let archive = Rc::new(RefCell::new(zip));
+                let mapping = mapping.map(Rc::new);
                 let archive_cache = Rc::new(RefCell::new(HashMap::new()));
 
                 let mut archive_guard = (*archive).borrow_mut();
@@ -162,6 +183,7 @@ impl BundleData {
                                 path,
                                 FsNode::bundle_zip_file(IpaFileRef {
                                     archive: archive.clone(),
+                                    mapping: mapping.clone(),
                                     archive_files_cache: archive_cache.clone(),
                                     index: i,
                                 }),
@@ -181,7 +203,9 @@ impl BundleData {
                     format!("Could not read Info.plist from the app bundle directory: {e}")
                 })
             }
-            BundleData::Zip { zip, bundle_path } => {
+            BundleData::Zip {
+                zip, bundle_path, ..
+            } => {
                 let mut file = zip
                     .by_name(&format!("{bundle_path}/Info.plist"))
                     .map_err(|e| format!("Could not open Info.plist from the IPA archive: {e}"))?;
@@ -194,23 +218,39 @@ impl BundleData {
     }
 }
 
-/// Shared (refcounted) copy of the decompressed version of a file in an IPA.
-///
-/// Seeking in compressed files is hard, so the simple solution is to read the
-/// whole file into memory. This is shared so having multiple copies of the same
-/// file open won't waste memory.
-type DecompressedFile = Rc<[u8]>;
+/// Where the contents of a file in an IPA can be found, once it's been opened.
+#[derive(Clone, Debug)]
+enum IpaFileData {
+    /// Shared (refcounted) copy of the decompressed version of the file.
+    ///
+    /// Seeking in compressed files is hard, so the simple solution is to read
+    /// the whole file into memory. This is shared so having multiple copies of
+    /// the same file open won't waste memory.
+    Decompressed(Rc<[u8]>),
+    /// Range of the IPA's mapping containing the file, which is stored without
+    /// compression. Most files that are already compressed (PNGs, MP3s, etc)
+    /// are stored like this, and they're often the largest ones.
+    Stored(Range<usize>),
+}
 
 /// Represents a file inside an IPA bundle that can be opened.
 #[derive(Debug)]
 pub struct IpaFileRef {
     archive: Rc<RefCell<ZipArchive<std::fs::File>>>,
-    archive_files_cache: Rc<RefCell<HashMap<usize, DecompressedFile>>>,
+    mapping: Option<Rc<MappedFile>>,
+    archive_files_cache: Rc<RefCell<HashMap<usize, IpaFileData>>>,
     index: usize,
 }
 
 impl IpaFileRef {
     pub fn open(&self) -> IpaFile {
+        IpaFile {
+            file: Cursor::new(self.contents()),
+        }
+    }
+
+    /// Get the contents of the file without copying them, if possible.
+    pub fn contents(&self) -> FileContents {
         // Some games, like THPS2, use a single resource bundle file which is
         // opened each time a new game resource is being read.
         // As IPA is basically an archive, this pattern requires unzipping to be
@@ -231,20 +271,34 @@ impl IpaFileRef {
                 // always have a valid index
                 Err(e) => panic!("BUG: could not open file from IPA bundle: {e}"),
             };
+            if let Some(ref mapping) = self.mapping {
+                if file.compression() == CompressionMethod::Stored {
+                    let start: usize = file.data_start().try_into().unwrap();
+                    let size: usize = file.size().try_into().unwrap();
+                    if start
+                        .checked_add(size)
+                        .is_some_and(|end| end <= mapping.len())
+                    {
+                        return IpaFileData::Stored(start..(start + size));
+                    }
+                }
+            }
             let mut buf = Vec::new();
             file.read_to_end(&mut buf).unwrap();
-            Rc::from(buf)
+            IpaFileData::Decompressed(Rc::from(buf))
         });
-        let cached_file = Rc::clone(archive_cache.get(&self.index).unwrap());
-        IpaFile {
-            file: Cursor::new(cached_file),
+        match archive_cache.get(&self.index).unwrap().clone() {
+            IpaFileData::Decompressed(bytes) => FileContents::Shared(bytes),
+            IpaFileData::Stored(range) => {
+                FileContents::MappedRange(self.mapping.clone().unwrap(), range)
+            }
         }
     }
 }
 
 /// Represents an opened file in an IPA bundle.
 pub struct IpaFile {
-    file: Cursor<DecompressedFile>,
+    file: Cursor<FileContents>,
 }
 
 impl Debug for IpaFile {
@@ -0,0 +1,135 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Read-only memory mappings of whole host files.
+//!
+//! Mapping a file rather than reading it means its contents don't need to be
+//! copied into a buffer first, and the host OS only needs to load the parts
+//! that are actually used. Files are expected not to change while they're
+//! mapped: long-lived mappings are only used for the app bundle, which
+//! touchHLE never modifies, and other files are only mapped briefly.
+//!
+//! On hosts where mapping isn't supported, the file is read into memory
+//! instead.
+
+use std::fs::File;
+use std::io::Read;
+use std::ops::Deref;
+
+pub struct MappedFile {
+    #[cfg(unix)]
+    ptr: *const u8,
+    #[cfg(unix)]
+    len: usize,
+    #[cfg(not(unix))]
+    bytes: Vec<u8>,
+}
+
+impl MappedFile {
+    #[cfg(unix)]
+    pub fn from_file(file: &File) -> std::io::Result<MappedFile> {
+        use std::os::unix::io::AsRawFd;
+
+        let len: usize = file.metadata()?.len().try_into().unwrap();
+        if len == 0 {
+            // Empty mappings aren't allowed.
+            return Ok(MappedFile {
+                ptr: std::ptr::NonNull::dangling().as_ptr(),
+                len: 0,
+            });
+        }
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error());
+        }
+        Ok(MappedFile {
+            ptr: ptr.cast_const().cast(),
+            len,
+        })
+    }
+    #[cfg(not(unix))]
+    pub fn from_file(mut file: &File) -> std::io::Result<MappedFile> {
+        let mut bytes = Vec::new();
+        file.read_to_end(&mut bytes)?;
+        Ok(MappedFile { bytes })
+    }
+}
+
+impl Deref for MappedFile {
+    type Target = [u8];
+
+    #[cfg(unix)]
+    fn deref(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+    #[cfg(not(unix))]
+    fn deref(&self) -> &[u8] {
+        &self.bytes
+    }
+}
+
+#[cfg(unix)]
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        if self.len != 0 {
+            let res = unsafe { libc::munmap(self.ptr.cast_mut().cast(), self.len) };
+            assert_eq!(res, 0);
+        }
+    }
+}
+
+impl std::fmt::Debug for MappedFile {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("MappedFile")
+            .field("len", &self.len())
+            .finish()
+    }
+}
+
+/// Contents of a guest file, see [super::Fs::read_mapped].
+pub enum FileContents {
+    Mapped(MappedFile),
+    /// A part of a mapping, e.g. a file stored uncompressed in an IPA.
+    MappedRange(std::rc::Rc<MappedFile>, std::ops::Range<usize>),
+    /// Shared copy of a file extracted from an IPA.
+    Shared(std::rc::Rc<[u8]>),
+    Owned(Vec<u8>),
+}
+
+impl FileContents {
+    pub fn read_from(mut reader: impl Read) -> std::io::Result<FileContents> {
+        let mut bytes = Vec::new();
+        reader.read_to_end(&mut bytes)?;
+        Ok(FileContents::Owned(bytes))
+    }
+}
+
+impl Deref for FileContents {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            FileContents::Mapped(file) => file,
+            FileContents::MappedRange(file, range) => &file[range.clone()],
+            FileContents::Shared(bytes) => bytes,
+            FileContents::Owned(bytes) => bytes,
+        }
+    }
+}
+
+impl AsRef<[u8]> for FileContents {
+    fn as_ref(&self) -> &[u8] {
+        self
+    }
+}
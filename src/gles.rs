@@ -61,6 +61,7 @@
 //!   - [EXT_texture_filter_anisotropic](https://registry.khronos.org/OpenGL/extensions/EXT/EXT_texture_filter_anisotropic.txt)
 //!   - [EXT_texture_lod_bias](https://registry.khronos.org/OpenGL/extensions/EXT/EXT_texture_lod_bias.txt)
 
+mod async_decode;
 pub mod gles1_native;
 pub mod gles1_on_gl2;
 mod gles_generic;
@@ -70,6 +71,7 @@ mod util;
 use touchHLE_gl_bindings::gl21compat as gl21compat_raw;
 pub use touchHLE_gl_bindings::gles11 as gles11_raw;
 
+pub use async_decode::AsyncTextureDecode;
 use gles1_native::GLES1Native;
 use gles1_on_gl2::GLES1OnGL2;
 pub use gles_generic::GLES;
@@ -102,13 +104,17 @@ impl GLESImplementation {
         }
     }
     /// See [GLES::new].
-    pub fn construct(self, window: &mut crate::window::Window) -> Result<Box<dyn GLES>, String> {
+    pub fn construct(
+        self,
+        window: &mut crate::window::Window,
+        options: &crate::options::Options,
+    ) -> Result<Box<dyn GLES>, String> {
         fn boxer<T: GLES + 'static>(ctx: T) -> Box<dyn GLES> {
             Box::new(ctx)
         }
         match self {
-            Self::GLES1Native => GLES1Native::new(window).map(boxer),
-            Self::GLES1OnGL2 => GLES1OnGL2::new(window).map(boxer),
+            Self::GLES1Native => GLES1Native::new(window, options).map(boxer),
+            Self::GLES1OnGL2 => GLES1OnGL2::new(window, options).map(boxer),
         }
     }
 }
@@ -128,7 +134,7 @@ pub fn create_gles1_ctx(
     let mut gles1_ctx = None;
     for implementation in list {
         log!("Trying: {}", implementation.description());
-        match implementation.construct(window) {
+        match implementation.construct(window, options) {
             Ok(ctx) => {
                 log!("=> Success!");
                 gles1_ctx = Some(ctx);
@@ -0,0 +1,227 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Asynchronous decoding of PVRTC textures (`--async-texture-decode=`).
+//!
+//! Decoding a PVRTC texture in `glCompressedTexImage2D` blocks the app until
+//! it's done, which makes loading screens that upload many textures slow. With
+//! an [AsyncDecoder], the decoding is instead done by a pool of worker threads
+//! and `glCompressedTexImage2D` returns immediately. The decoded data is
+//! uploaded later, on the thread that owns the context:
+//!
+//! - Before the next draw call, because the texture might be sampled. Textures
+//!   that aren't ready yet are either waited for, or, with
+//!   [AsyncTextureDecode::Placeholder], temporarily replaced by an
+//!   uninitialized texture of the same size.
+//! - Before any other operation that reads or modifies textures (e.g.
+//!   `glTexSubImage2D` or `glDeleteTextures`), always waiting, so that the
+//!   app can't observe the difference.
+//!
+//! The [super::GLES] implementations own the decoder and do the uploads, since
+//! only they can call the host driver directly.
+
+use super::gles11_raw::types::{GLenum, GLint, GLsizei, GLuint};
+use super::util::ConvertedPvrtc;
+use std::sync::mpsc::{self, Receiver, Sender, TryRecvError};
+use std::sync::{Arc, Mutex};
+
+/// What to do when a texture is needed for drawing before it has been decoded.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum AsyncTextureDecode {
+    /// Wait for it to be decoded.
+    Wait,
+    /// Upload an uninitialized texture of the same size in its place, and draw
+    /// without waiting.
+    Placeholder,
+}
+impl AsyncTextureDecode {
+    /// Convert from short name used for command-line arguments. Returns [Err]
+    /// if name is not recognized.
+    pub fn from_short_name(name: &str) -> Result<Self, ()> {
+        match name {
+            "wait" => Ok(Self::Wait),
+            "placeholder" => Ok(Self::Placeholder),
+            _ => Err(()),
+        }
+    }
+}
+
+type Job = Box<dyn FnOnce() + Send>;
+
+/// A texture upload the [AsyncDecoder] is ready to do. `data` is [None] if a
+/// placeholder should be uploaded.
+pub struct Upload<'a> {
+    pub texture: GLuint,
+    pub target: GLenum,
+    pub level: GLint,
+    pub width: GLsizei,
+    pub height: GLsizei,
+    pub data: Option<&'a ConvertedPvrtc>,
+}
+
+struct Pending {
+    texture: GLuint,
+    target: GLenum,
+    level: GLint,
+    width: GLsizei,
+    height: GLsizei,
+    result: Receiver<ConvertedPvrtc>,
+    has_placeholder: bool,
+}
+
+pub struct AsyncDecoder {
+    mode: AsyncTextureDecode,
+    /// Created on first use, so contexts that never decode anything don't get
+    /// worker threads.
+    job_sender: Option<Sender<Job>>,
+    /// In the order they were submitted, which is the order the uploads must
+    /// happen in.
+    pending: Vec<Pending>,
+}
+
+impl AsyncDecoder {
+    pub fn new(mode: AsyncTextureDecode) -> AsyncDecoder {
+        AsyncDecoder {
+            mode,
+            job_sender: None,
+            pending: Vec::new(),
+        }
+    }
+
+    fn job_sender(&mut self) -> &Sender<Job> {
+        self.job_sender.get_or_insert_with(|| {
+            // The PVRTC decoder uses several threads for large textures
+            // already, so there's no point in having lots of workers.
+            let count = std::thread::available_parallelism()
+                .map_or(1, |n| n.get() / 2)
+                .clamp(1, 4);
+            let (sender, receiver) = mpsc::channel::<Job>();
+            let receiver = Arc::new(Mutex::new(receiver));
+            for i in 0..count {
+                let receiver = receiver.clone();
+                std::thread::Builder::new()
+                    .name(format!("touchHLE texture decoder {}", i))
+                    .spawn(move || loop {
+                        // The lock guard must be dropped before running the
+                        // job, so that other workers can take jobs meanwhile.
+                        let job = receiver.lock().unwrap().recv();
+                        match job {
+                            Ok(job) => job(),
+                            // The decoder was dropped.
+                            Err(_) => break,
+                        }
+                    })
+                    .unwrap();
+            }
+            log_dbg!("Started {} texture decoder threads", count);
+            sender
+        })
+    }
+
+    /// Decode a texture on a worker thread using `decode`, and upload the
+    /// result to `level` of `texture` later.
+    pub fn submit<F>(
+        &mut self,
+        texture: GLuint,
+        target: GLenum,
+        level: GLint,
+        width: GLsizei,
+        height: GLsizei,
+        decode: F,
+    ) where
+        F: FnOnce() -> ConvertedPvrtc + Send + 'static,
+    {
+        let (result_sender, result) = mpsc::channel();
+        self.job_sender()
+            .send(Box::new(move || {
+                // If the receiver is gone, the result isn't needed anymore.
+                let _ = result_sender.send(decode());
+            }))
+            .unwrap();
+        self.pending.push(Pending {
+            texture,
+            target,
+            level,
+            width,
+            height,
+            result,
+            has_placeholder: false,
+        });
+    }
+
+    /// Do the uploads that are needed before drawing, using `upload`. The
+    /// context must be current.
+    pub fn finish_for_draw<F>(&mut self, upload: F)
+    where
+        F: FnMut(Upload),
+    {
+        self.finish(self.mode == AsyncTextureDecode::Wait, upload)
+    }
+
+    /// Wait for all pending decodes and upload the results, using `upload`.
+    /// The context must be current.
+    pub fn finish_all<F>(&mut self, upload: F)
+    where
+        F: FnMut(Upload),
+    {
+        self.finish(true, upload)
+    }
+
+    fn finish<F>(&mut self, wait: bool, mut upload: F)
+    where
+        F: FnMut(Upload),
+    {
+        if self.pending.is_empty() {
+            return;
+        }
+        let mut still_pending = Vec::new();
+        for mut pending in self.pending.drain(..) {
+            // A later upload to the same texture mustn't overtake an earlier
+            // one, so once one texture is still pending, so are later uploads
+            // for it.
+            let blocked = still_pending
+                .iter()
+                .any(|other: &Pending| other.texture == pending.texture);
+            let result = if blocked {
+                None
+            } else if wait {
+                Some(pending.result.recv().unwrap())
+            } else {
+                match pending.result.try_recv() {
+                    Ok(result) => Some(result),
+                    Err(TryRecvError::Empty) => None,
+                    Err(TryRecvError::Disconnected) => panic!("Texture decoding failed"),
+                }
+            };
+            let mut upload_with = |data| {
+                upload(Upload {
+                    texture: pending.texture,
+                    target: pending.target,
+                    level: pending.level,
+                    width: pending.width,
+                    height: pending.height,
+                    data,
+                })
+            };
+            match result {
+                Some(result) => upload_with(Some(&result)),
+                None => {
+                    if !pending.has_placeholder {
+                        upload_with(None);
+                        pending.has_placeholder = true;
+                    }
+                    still_pending.push(pending);
+                }
+            }
+        }
+        if !still_pending.is_empty() {
+            log_dbg!(
+                "{} textures still being decoded, using placeholders",
+                still_pending.len()
+            );
+        }
+        self.pending = still_pending;
+    }
+}
@@ -12,24 +12,33 @@
 //! In such cases, we should reject vendor-specific things unless we've made
 //! sure we can emulate them on all host platforms for touchHLE.
 
+use super::async_decode::Upload;
 use super::gles11_raw as gles11;
 use super::gles11_raw::types::*;
-use super::util::{try_decode_pvrtc, PalettedTextureFormat};
+use super::util::{ConvertedPvrtc, PalettedTextureFormat, PvrtcHostFns, PvrtcUploader};
 use super::GLES;
+use crate::options::Options;
 use crate::window::{GLContext, GLVersion, Window};
 use std::ffi::CStr;
 
 pub struct GLES1Native {
     gl_ctx: GLContext,
+    pvrtc: PvrtcUploader,
+}
+impl GLES1Native {
+    unsafe fn finish_async_uploads(&mut self, for_draw: bool) {
+        self.pvrtc.finish(for_draw)
+    }
 }
 impl GLES for GLES1Native {
     fn description() -> &'static str {
         "Native OpenGL ES 1.1"
     }
 
-    fn new(window: &mut Window) -> Result<Self, String> {
+    fn new(window: &mut Window, options: &Options) -> Result<Self, String> {
         Ok(Self {
             gl_ctx: window.create_gl_context(GLVersion::GLES11)?,
+            pvrtc: PvrtcUploader::new(PVRTC_HOST_FNS, options),
         })
     }
 
@@ -99,6 +108,7 @@ impl GLES for GLES1Native {
         gles11::Hint(target, mode)
     }
     unsafe fn Finish(&mut self) {
+        self.finish_async_uploads(false);
         gles11::Finish()
     }
     unsafe fn Flush(&mut self) {
@@ -330,6 +340,7 @@ impl GLES for GLES1Native {
 
     // Drawing
     unsafe fn DrawArrays(&mut self, mode: GLenum, first: GLint, count: GLsizei) {
+        self.finish_async_uploads(true);
         gles11::DrawArrays(mode, first, count)
     }
     unsafe fn DrawElements(
@@ -339,6 +350,7 @@ impl GLES for GLES1Native {
         type_: GLenum,
         indices: *const GLvoid,
     ) {
+        self.finish_async_uploads(true);
         gles11::DrawElements(mode, count, type_, indices)
     }
 
@@ -394,6 +406,7 @@ impl GLES for GLES1Native {
         gles11::GenTextures(n, textures)
     }
     unsafe fn DeleteTextures(&mut self, n: GLsizei, textures: *const GLuint) {
+        self.finish_async_uploads(false);
         gles11::DeleteTextures(n, textures)
     }
     unsafe fn ActiveTexture(&mut self, texture: GLenum) {
@@ -435,6 +448,7 @@ impl GLES for GLES1Native {
         type_: GLenum,
         pixels: *const GLvoid,
     ) {
+        self.finish_async_uploads(false);
         if format == gles11::BGRA_EXT {
             // This is needed in order to avoid white screen issue on Android!
             // As per BGRA extension specs
@@ -469,6 +483,7 @@ impl GLES for GLES1Native {
         type_: GLenum,
         pixels: *const GLvoid,
     ) {
+        self.finish_async_uploads(false);
         gles11::TexSubImage2D(
             target, level, xoffset, yoffset, width, height, format, type_, pixels,
         )
@@ -486,22 +501,13 @@ impl GLES for GLES1Native {
     ) {
         let data = unsafe { std::slice::from_raw_parts(data.cast::<u8>(), image_size as usize) };
         // IMG_texture_compression_pvrtc (only on Imagination/Apple GPUs)
-        // TODO: It would be more efficient to use hardware decoding where
-        // available (I just don't have a suitable device to try this on)
-        if try_decode_pvrtc(
-            self,
-            target,
-            level,
-            internalformat,
-            width,
-            height,
-            border,
-            data,
-        ) {
-            log_dbg!("Decoded PVRTC");
+        if self
+            .pvrtc
+            .try_upload(target, level, internalformat, width, height, border, data)
+        {
             return;
         }
-
+        self.finish_async_uploads(false);
         // OES_compressed_paletted_texture is in the common profile of OpenGL ES
         // 1.1, so we can reasonably assume it's supported.
         if PalettedTextureFormat::get_info(internalformat).is_none() {
@@ -530,6 +536,7 @@ impl GLES for GLES1Native {
         height: GLsizei,
         border: GLint,
     ) {
+        self.finish_async_uploads(false);
         gles11::CopyTexImage2D(target, level, internalformat, x, y, width, height, border)
     }
     unsafe fn CopyTexSubImage2D(
@@ -543,6 +550,7 @@ impl GLES for GLES1Native {
         width: GLsizei,
         height: GLsizei,
     ) {
+        self.finish_async_uploads(false);
         gles11::CopyTexSubImage2D(target, level, xoffset, yoffset, x, y, width, height)
     }
     unsafe fn TexEnvf(&mut self, target: GLenum, pname: GLenum, param: GLfloat) {
@@ -691,6 +699,7 @@ impl GLES for GLES1Native {
         texture: GLuint,
         level: i32,
     ) {
+        self.finish_async_uploads(false);
         gles11::FramebufferTexture2DOES(target, attachment, textarget, texture, level)
     }
     unsafe fn GetFramebufferAttachmentParameterivOES(
@@ -720,6 +729,7 @@ impl GLES for GLES1Native {
         gles11::DeleteRenderbuffersOES(n, renderbuffers)
     }
     unsafe fn GenerateMipmapOES(&mut self, target: GLenum) {
+        self.finish_async_uploads(false);
         gles11::GenerateMipmapOES(target)
     }
     unsafe fn GetBufferParameteriv(&mut self, target: GLenum, pname: GLenum, params: *mut GLint) {
@@ -732,3 +742,47 @@ impl GLES for GLES1Native {
         gles11::UnmapBufferOES(target)
     }
 }
+
+const PVRTC_HOST_FNS: PvrtcHostFns = PvrtcHostFns {
+    get_string: gles11::GetString,
+    get_integerv: gles11::GetIntegerv,
+    compressed_tex_image_2d: gles11::CompressedTexImage2D,
+    upload_deferred,
+};
+
+/// Upload a texture for [PvrtcUploader].
+unsafe fn upload_deferred(upload: Upload) {
+    let mut old_texture = 0;
+    gles11::GetIntegerv(gles11::TEXTURE_BINDING_2D, &mut old_texture);
+    gles11::BindTexture(upload.target, upload.texture);
+    match upload.data {
+        Some(ConvertedPvrtc::Compressed(format, data)) => gles11::CompressedTexImage2D(
+            upload.target,
+            upload.level,
+            *format,
+            upload.width,
+            upload.height,
+            0,
+            data.len().try_into().unwrap(),
+            data.as_ptr() as *const _,
+        ),
+        data => {
+            let pixels = match data {
+                Some(ConvertedPvrtc::Rgba(pixels)) => pixels.as_ptr() as *const _,
+                _ => std::ptr::null(),
+            };
+            gles11::TexImage2D(
+                upload.target,
+                upload.level,
+                gles11::RGBA as _,
+                upload.width,
+                upload.height,
+                0,
+                gles11::RGBA,
+                gles11::UNSIGNED_BYTE,
+                pixels,
+            )
+        }
+    }
+    gles11::BindTexture(upload.target, old_texture as _);
+}
@@ -18,14 +18,16 @@
 //! on macOS. It's also a version supported on various other OSes.
 //! It is therefore a convenient target for our implementation.
 
+use super::async_decode::Upload;
 use super::gl21compat_raw as gl21;
 use super::gl21compat_raw::types::*;
 use super::gles11_raw as gles11; // constants only
 use super::util::{
-    fixed_to_float, matrix_fixed_to_float, try_decode_pvrtc, PalettedTextureFormat, ParamTable,
-    ParamType,
+    fixed_to_float, fixed_vectors_to_float, matrix_fixed_to_float, ConvertedPvrtc,
+    PalettedTextureFormat, ParamTable, ParamType, PvrtcHostFns, PvrtcUploader,
 };
 use super::GLES;
+use crate::options::Options;
 use crate::window::{GLContext, GLVersion, Window};
 use std::collections::HashSet;
 use std::ffi::CStr;
@@ -371,8 +373,13 @@ pub struct GLES1OnGL2 {
     pointer_is_fixed_point: [bool; ARRAYS.len()],
     fixed_point_texture_units: HashSet<GLenum>,
     fixed_point_translation_buffers: [Vec<GLfloat>; ARRAYS.len()],
+    pvrtc: PvrtcUploader,
 }
 impl GLES1OnGL2 {
+    unsafe fn finish_async_uploads(&mut self, for_draw: bool) {
+        self.pvrtc.finish(for_draw)
+    }
+
     /// If any arrays with fixed-point data are in use at the time of a draw
     /// call, this function will convert the data to floating-point and
     /// replace the pointers. [Self::restore_fixed_point_arrays] can be called
@@ -465,9 +472,15 @@ impl GLES1OnGL2 {
                 stride
             };
 
+            // The buffer is indexed the same way as the original array, but
+            // only the vectors used by this draw call are converted. It's kept
+            // between draw calls, so it only needs to grow occasionally, and
+            // what's already in it doesn't need to be cleared.
             let buffer = &mut self.fixed_point_translation_buffers[i];
-            buffer.clear();
-            buffer.resize(((first + count) * size).try_into().unwrap(), 0.0);
+            let buffer_len: usize = ((first + count) * size).try_into().unwrap();
+            if buffer.len() < buffer_len {
+                buffer.resize(buffer_len, 0.0);
+            }
 
             {
                 assert!(first >= 0 && count >= 0 && size >= 0 && stride >= 0);
@@ -475,13 +488,13 @@ impl GLES1OnGL2 {
                 let count = count as usize;
                 let size = size as usize;
                 let stride = stride as usize;
-                for j in first..(first + count) {
-                    let vector_ptr: *const GLvoid = pointer.add(j * stride);
-                    let vector_ptr: *const GLfixed = vector_ptr.cast();
-                    for k in 0..size {
-                        buffer[j * size + k] = fixed_to_float(vector_ptr.add(k).read_unaligned());
-                    }
-                }
+                fixed_vectors_to_float(
+                    pointer.add(first * stride).cast(),
+                    stride,
+                    size,
+                    count,
+                    &mut buffer[first * size..],
+                );
             }
 
             let buffer_ptr: *const GLfloat = buffer.as_ptr();
@@ -557,12 +570,13 @@ impl GLES for GLES1OnGL2 {
         "OpenGL ES 1.1 via touchHLE GLES1-on-GL2 layer"
     }
 
-    fn new(window: &mut Window) -> Result<Self, String> {
+    fn new(window: &mut Window, options: &Options) -> Result<Self, String> {
         Ok(Self {
             gl_ctx: window.create_gl_context(GLVersion::GL21Compat)?,
             pointer_is_fixed_point: [false; ARRAYS.len()],
             fixed_point_texture_units: HashSet::new(),
             fixed_point_translation_buffers: [Vec::new(), Vec::new(), Vec::new(), Vec::new()],
+            pvrtc: PvrtcUploader::new(PVRTC_HOST_FNS, options),
         })
     }
 
@@ -692,6 +706,7 @@ impl GLES for GLES1OnGL2 {
         gl21::Hint(target, mode);
     }
     unsafe fn Finish(&mut self) {
+        self.finish_async_uploads(false);
         gl21::Finish();
     }
     unsafe fn Flush(&mut self) {
@@ -1123,6 +1138,7 @@ impl GLES for GLES1OnGL2 {
 
     // Drawing
     unsafe fn DrawArrays(&mut self, mode: GLenum, first: GLint, count: GLsizei) {
+        self.finish_async_uploads(true);
         assert!([
             gl21::POINTS,
             gl21::LINE_STRIP,
@@ -1147,6 +1163,7 @@ impl GLES for GLES1OnGL2 {
         type_: GLenum,
         indices: *const GLvoid,
     ) {
+        self.finish_async_uploads(true);
         assert!([
             gl21::POINTS,
             gl21::LINE_STRIP,
@@ -1287,6 +1304,7 @@ impl GLES for GLES1OnGL2 {
         gl21::GenTextures(n, textures)
     }
     unsafe fn DeleteTextures(&mut self, n: GLsizei, textures: *const GLuint) {
+        self.finish_async_uploads(false);
         gl21::DeleteTextures(n, textures)
     }
     unsafe fn ActiveTexture(&mut self, texture: GLenum) {
@@ -1349,6 +1367,7 @@ impl GLES for GLES1OnGL2 {
         type_: GLenum,
         pixels: *const GLvoid,
     ) {
+        self.finish_async_uploads(false);
         assert!(target == gl21::TEXTURE_2D);
         assert!(level >= 0);
         assert!(
@@ -1397,6 +1416,7 @@ impl GLES for GLES1OnGL2 {
         type_: GLenum,
         pixels: *const GLvoid,
     ) {
+        self.finish_async_uploads(false);
         assert!(target == gl21::TEXTURE_2D);
         assert!(level >= 0);
         assert!(
@@ -1429,22 +1449,16 @@ impl GLES for GLES1OnGL2 {
     ) {
         let data = unsafe { std::slice::from_raw_parts(data.cast::<u8>(), image_size as usize) };
         // IMG_texture_compression_pvrtc (only on Imagination/Apple GPUs)
-        // TODO: It would be more efficient to use hardware decoding where
-        // available (I just don't have a suitable device to try this on)
-        if try_decode_pvrtc(
-            self,
-            target,
-            level,
-            internalformat,
-            width,
-            height,
-            border,
-            data,
-        ) {
-            log_dbg!("Decoded PVRTC");
+        if self
+            .pvrtc
+            .try_upload(target, level, internalformat, width, height, border, data)
+        {
+            return;
+        }
+        self.finish_async_uploads(false);
         // OES_compressed_paletted_texture is only in OpenGL ES, so we'll need
         // to decompress those formats.
-        } else if let Some(PalettedTextureFormat {
+        if let Some(PalettedTextureFormat {
             index_is_nibble,
             palette_entry_format,
             palette_entry_type,
@@ -1521,6 +1535,7 @@ impl GLES for GLES1OnGL2 {
         height: GLsizei,
         border: GLint,
     ) {
+        self.finish_async_uploads(false);
         assert!(target == gl21::TEXTURE_2D);
         assert!(level >= 0);
         assert!(
@@ -1544,6 +1559,7 @@ impl GLES for GLES1OnGL2 {
         width: GLsizei,
         height: GLsizei,
     ) {
+        self.finish_async_uploads(false);
         assert!(target == gl21::TEXTURE_2D);
         assert!(level >= 0);
         gl21::CopyTexSubImage2D(target, level, xoffset, yoffset, x, y, width, height)
@@ -1840,6 +1856,7 @@ impl GLES for GLES1OnGL2 {
         texture: GLuint,
         level: i32,
     ) {
+        self.finish_async_uploads(false);
         gl21::FramebufferTexture2DEXT(target, attachment, textarget, texture, level)
     }
     unsafe fn GetFramebufferAttachmentParameterivOES(
@@ -1869,6 +1886,7 @@ impl GLES for GLES1OnGL2 {
         gl21::DeleteRenderbuffersEXT(n, renderbuffers)
     }
     unsafe fn GenerateMipmapOES(&mut self, target: GLenum) {
+        self.finish_async_uploads(false);
         gl21::GenerateMipmapEXT(target)
     }
     unsafe fn GetBufferParameteriv(&mut self, target: GLenum, pname: GLenum, params: *mut GLint) {
@@ -1881,3 +1899,47 @@ impl GLES for GLES1OnGL2 {
         gl21::UnmapBuffer(target)
     }
 }
+
+const PVRTC_HOST_FNS: PvrtcHostFns = PvrtcHostFns {
+    get_string: gl21::GetString,
+    get_integerv: gl21::GetIntegerv,
+    compressed_tex_image_2d: gl21::CompressedTexImage2D,
+    upload_deferred,
+};
+
+/// Upload a texture for [PvrtcUploader].
+unsafe fn upload_deferred(upload: Upload) {
+    let mut old_texture = 0;
+    gl21::GetIntegerv(gl21::TEXTURE_BINDING_2D, &mut old_texture);
+    gl21::BindTexture(upload.target, upload.texture);
+    match upload.data {
+        Some(ConvertedPvrtc::Compressed(format, data)) => gl21::CompressedTexImage2D(
+            upload.target,
+            upload.level,
+            *format,
+            upload.width,
+            upload.height,
+            0,
+            data.len().try_into().unwrap(),
+            data.as_ptr() as *const _,
+        ),
+        data => {
+            let pixels = match data {
+                Some(ConvertedPvrtc::Rgba(pixels)) => pixels.as_ptr() as *const _,
+                _ => std::ptr::null(),
+            };
+            gl21::TexImage2D(
+                upload.target,
+                upload.level,
+                gl21::RGBA as _,
+                upload.width,
+                upload.height,
+                0,
+                gl21::RGBA,
+                gl21::UNSIGNED_BYTE,
+                pixels,
+            )
+        }
+    }
+    gl21::BindTexture(upload.target, old_texture as _);
+}
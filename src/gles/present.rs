@@ -23,17 +23,24 @@ impl FpsCounter {
         }
     }
 
-    pub fn count_frame(&mut self, label: std::fmt::Arguments<'_>) {
+    /// Count a frame. Once a second has passed, the frame rate over that
+    /// second is returned.
+    pub fn count_frame_silently(&mut self) -> Option<f32> {
         self.frames += 1;
         let now = Instant::now();
         let duration = now - self.time;
         if duration >= Duration::from_secs(1) {
             self.time = now;
-            echo!(
-                "touchHLE: {} FPS: {:.2}",
-                label,
-                std::mem::take(&mut self.frames) as f32 / duration.as_secs_f32()
-            );
+            Some(std::mem::take(&mut self.frames) as f32 / duration.as_secs_f32())
+        } else {
+            None
+        }
+    }
+
+    /// Count a frame, and log the frame rate once per second.
+    pub fn count_frame(&mut self, label: std::fmt::Arguments<'_>) {
+        if let Some(fps) = self.count_frame_silently() {
+            echo!("touchHLE: {} FPS: {:.2}", label, fps);
         }
     }
 }
@@ -57,6 +64,8 @@ pub unsafe fn present_frame(
 
     use gles11::types::*;
 
+    let _span = crate::trace::span("gles", "present_frame");
+
     // Draw the quad
     gles.Viewport(
         viewport.0 as _,
@@ -5,9 +5,13 @@
  */
 //! Shared utilities.
 
+use super::async_decode::{AsyncDecoder, Upload};
 use super::gles11_raw as gles11; // constants only
-use super::gles11_raw::types::{GLenum, GLfixed, GLfloat, GLint, GLsizei};
-use super::GLES;
+use super::gles11_raw::types::{GLenum, GLfixed, GLfloat, GLint, GLsizei, GLubyte, GLuint, GLvoid};
+use crate::image::texture_cache::TextureData;
+use crate::options::Options;
+use std::borrow::Cow;
+use std::ffi::CStr;
 
 /// Convert a fixed-point scalar to a floating-point scalar.
 ///
@@ -17,15 +21,92 @@ pub fn fixed_to_float(fixed: GLfixed) -> GLfloat {
     ((fixed as f64) / ((1 << 16) as f64)) as f32
 }
 
+/// Convert four fixed-point values, which don't need to be aligned, to
+/// floating-point, using SIMD where available. The results are the same as
+/// with [fixed_to_float]: converting to [f32] first and then scaling gives the
+/// same rounding, because scaling by a power of two is exact.
+#[inline(always)]
+unsafe fn fixed_to_float_x4(src: *const GLfixed, dst: *mut GLfloat) {
+    #[cfg(target_arch = "x86_64")]
+    {
+        use std::arch::x86_64::*;
+        let fixed = _mm_loadu_si128(src.cast());
+        let float = _mm_mul_ps(_mm_cvtepi32_ps(fixed), _mm_set1_ps(1.0 / 65536.0));
+        _mm_storeu_ps(dst, float);
+    }
+    #[cfg(target_arch = "aarch64")]
+    {
+        use std::arch::aarch64::*;
+        // Loading bytes avoids any alignment requirement.
+        let fixed = vreinterpretq_s32_u8(vld1q_u8(src.cast()));
+        let float = vcvtq_n_f32_s32::<16>(fixed);
+        vst1q_u8(dst.cast(), vreinterpretq_u8_f32(float));
+    }
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    for i in 0..4 {
+        dst.add(i)
+            .write_unaligned(fixed_to_float(src.add(i).read_unaligned()));
+    }
+}
+
 /// Convert a fixed-point 4-by-4 matrix to floating-point.
 pub unsafe fn matrix_fixed_to_float(m: *const GLfixed) -> [GLfloat; 16] {
     let mut matrix = [0f32; 16];
-    for (i, cell) in matrix.iter_mut().enumerate() {
-        *cell = fixed_to_float(m.add(i).read_unaligned());
+    for i in (0..16).step_by(4) {
+        fixed_to_float_x4(m.add(i), matrix.as_mut_ptr().add(i));
     }
     matrix
 }
 
+/// Convert an array of fixed-point vectors with `size` components each to a
+/// tightly-packed floating-point array. `src` points to the first vector and
+/// successive vectors are `stride` bytes apart. `dst` must have room for
+/// `count` vectors. Nothing needs to be aligned.
+pub unsafe fn fixed_vectors_to_float(
+    src: *const GLfixed,
+    stride: usize,
+    size: usize,
+    count: usize,
+    dst: &mut [GLfloat],
+) {
+    assert!(dst.len() >= count * size);
+    let dst_ptr = dst.as_mut_ptr();
+    if stride == size * 4 {
+        // Tightly packed, so this is just one long run of values.
+        let total = count * size;
+        let mut i = 0;
+        while i + 4 <= total {
+            fixed_to_float_x4(src.add(i), dst_ptr.add(i));
+            i += 4;
+        }
+        for i in i..total {
+            *dst_ptr.add(i) = fixed_to_float(src.add(i).read_unaligned());
+        }
+        return;
+    }
+    // Vectors with fewer than four components can still be converted four
+    // values at a time if they're followed by another vector, as long as the
+    // extra values read and written are then within the arrays. The extra
+    // values written are overwritten by the next vector.
+    let simd_count = if size == 4 {
+        count
+    } else if size >= 2 && stride + size * 4 >= 16 {
+        count.saturating_sub(1)
+    } else {
+        0
+    };
+    for j in 0..count {
+        let vector: *const GLfixed = src.cast::<u8>().add(j * stride).cast();
+        if j < simd_count {
+            fixed_to_float_x4(vector, dst_ptr.add(j * size));
+        } else {
+            for k in 0..size {
+                *dst_ptr.add(j * size + k) = fixed_to_float(vector.add(k).read_unaligned());
+            }
+        }
+    }
+}
+
 /// Type of a parameter, used in [ParamTable].
 #[derive(Copy, Clone, Eq, PartialEq)]
 pub enum ParamType {
@@ -136,49 +217,382 @@ impl ParamTable {
     }
 }
 
-/// Helper for implementing `glCompressedTexImage2D`: if `internalformat` is
-/// one of the `IMG_texture_compression_pvrtc` formats, decode it and call
-/// `glTexImage2D`. Returns `true` if this is done.
+/// If `internalformat` is one of the `IMG_texture_compression_pvrtc` formats,
+/// returns [Some] with whether it is a 2-bit-per-pixel format, or [None]
+/// otherwise.
+pub fn pvrtc_is_2bit(internalformat: GLenum) -> Option<bool> {
+    match internalformat {
+        gles11::COMPRESSED_RGB_PVRTC_4BPPV1_IMG | gles11::COMPRESSED_RGBA_PVRTC_4BPPV1_IMG => {
+            Some(false)
+        }
+        gles11::COMPRESSED_RGB_PVRTC_2BPPV1_IMG | gles11::COMPRESSED_RGBA_PVRTC_2BPPV1_IMG => {
+            Some(true)
+        }
+        _ => None,
+    }
+}
+
+// From EXT_texture_compression_s3tc, which isn't in either set of bindings.
+const COMPRESSED_RGB_S3TC_DXT1_EXT: GLenum = 0x83F0;
+const COMPRESSED_RGBA_S3TC_DXT5_EXT: GLenum = 0x83F3;
+
+/// How PVRTC textures are given to the host driver. See
+/// [try_keep_pvrtc_compressed] and [PendingPvrtcLevels].
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+enum PvrtcStrategy {
+    /// Decode to RGBA. This always works, but uses 8 to 16 times the memory.
+    Decode,
+    /// Upload the data unchanged, because the host supports
+    /// `IMG_texture_compression_pvrtc`.
+    Passthrough,
+    /// Transcode to BC1 or BC3, because the host supports
+    /// `EXT_texture_compression_s3tc`.
+    TranscodeToBc,
+}
+impl PvrtcStrategy {
+    /// Choose a strategy based on the `--keep-textures-compressed` option and
+    /// the extensions the host driver supports. The context must be current.
+    unsafe fn choose(host: &PvrtcHostFns, keep_textures_compressed: bool) -> Self {
+        let strategy = if keep_textures_compressed {
+            let extensions = (host.get_string)(gles11::EXTENSIONS);
+            let extensions = if extensions.is_null() {
+                Cow::Borrowed("")
+            } else {
+                CStr::from_ptr(extensions as *const _).to_string_lossy()
+            };
+            let has = |name: &str| extensions.split(' ').any(|ext| ext == name);
+            if has("GL_IMG_texture_compression_pvrtc") {
+                PvrtcStrategy::Passthrough
+            } else if has("GL_EXT_texture_compression_s3tc") {
+                PvrtcStrategy::TranscodeToBc
+            } else {
+                PvrtcStrategy::Decode
+            }
+        } else {
+            PvrtcStrategy::Decode
+        };
+        log!("PVRTC texture strategy: {:?}", strategy);
+        strategy
+    }
+}
+
+/// A PVRTC texture converted into something the host can use, see
+/// [convert_pvrtc].
+pub enum ConvertedPvrtc {
+    /// Data for `glTexImage2D` with `GL_RGBA` and `GL_UNSIGNED_BYTE`.
+    Rgba(TextureData),
+    /// Data for `glCompressedTexImage2D` with the given format.
+    Compressed(GLenum, TextureData),
+}
+
+/// Decode or transcode a PVRTC texture as `strategy` requires. This doesn't
+/// need a context, so it can be done on any thread.
+///
+/// Panics if `internalformat` isn't one of the `IMG_texture_compression_pvrtc`
+/// formats or `strategy` is [PvrtcStrategy::Passthrough].
+fn convert_pvrtc(
+    strategy: PvrtcStrategy,
+    internalformat: GLenum,
+    width: GLsizei,
+    height: GLsizei,
+    pvrtc_data: &[u8],
+) -> ConvertedPvrtc {
+    let is_2bit = pvrtc_is_2bit(internalformat).unwrap();
+    let width = width.try_into().unwrap();
+    let height = height.try_into().unwrap();
+    match strategy {
+        PvrtcStrategy::Decode => ConvertedPvrtc::Rgba(crate::image::decode_pvrtc(
+            pvrtc_data, is_2bit, width, height,
+        )),
+        PvrtcStrategy::Passthrough => unreachable!(),
+        PvrtcStrategy::TranscodeToBc => {
+            let with_alpha = matches!(
+                internalformat,
+                gles11::COMPRESSED_RGBA_PVRTC_4BPPV1_IMG | gles11::COMPRESSED_RGBA_PVRTC_2BPPV1_IMG
+            );
+            let bc_data =
+                crate::image::transcode_pvrtc_to_bc(pvrtc_data, is_2bit, width, height, with_alpha);
+            let format = if with_alpha {
+                COMPRESSED_RGBA_S3TC_DXT5_EXT
+            } else {
+                COMPRESSED_RGB_S3TC_DXT1_EXT
+            };
+            ConvertedPvrtc::Compressed(format, bc_data)
+        }
+    }
+}
+
+/// If `internalformat` is one of the `IMG_texture_compression_pvrtc` formats
+/// and the strategy isn't [PvrtcStrategy::Decode], call `upload` with the
+/// format and data that should be passed to the host's
+/// `glCompressedTexImage2D`. Returns `true` if this is done.
 ///
 /// Note that this panics rather than create GL errors for invalid use (TODO?)
 #[allow(clippy::too_many_arguments)]
-pub fn try_decode_pvrtc(
-    gles: &mut dyn GLES,
-    target: GLenum,
-    level: GLint,
+fn try_keep_pvrtc_compressed<F>(
+    strategy: PvrtcStrategy,
     internalformat: GLenum,
     width: GLsizei,
     height: GLsizei,
     border: GLint,
     pvrtc_data: &[u8],
-) -> bool {
-    let is_2bit = match internalformat {
-        gles11::COMPRESSED_RGB_PVRTC_4BPPV1_IMG | gles11::COMPRESSED_RGBA_PVRTC_4BPPV1_IMG => false,
-        gles11::COMPRESSED_RGB_PVRTC_2BPPV1_IMG | gles11::COMPRESSED_RGBA_PVRTC_2BPPV1_IMG => true,
-        _ => return false,
+    upload: F,
+) -> bool
+where
+    F: FnOnce(GLenum, &[u8]),
+{
+    if pvrtc_is_2bit(internalformat).is_none() || strategy == PvrtcStrategy::Decode {
+        return false;
+    }
+    assert!(border == 0);
+    if strategy == PvrtcStrategy::Passthrough {
+        upload(internalformat, pvrtc_data);
+        return true;
+    }
+    let ConvertedPvrtc::Compressed(format, data) =
+        convert_pvrtc(strategy, internalformat, width, height, pvrtc_data)
+    else {
+        unreachable!();
     };
+    upload(format, &data);
+    true
+}
 
-    assert!(border == 0);
-    let pixels = crate::image::decode_pvrtc(
-        pvrtc_data,
-        is_2bit,
-        width.try_into().unwrap(),
-        height.try_into().unwrap(),
-    );
-    unsafe {
-        gles.TexImage2D(
-            target,
+struct PendingPvrtcLevel {
+    level: GLint,
+    is_2bit: bool,
+    width: GLsizei,
+    height: GLsizei,
+    data: Vec<u8>,
+}
+
+/// PVRTC mipmap levels waiting to be decoded with [PvrtcStrategy::Decode].
+///
+/// Apps upload a mipmap chain one level at a time, but decoding the levels
+/// together with [crate::image::decode_pvrtc_batch] is much faster, so
+/// consecutive levels for the same texture are collected here. They must be
+/// uploaded with [Self::finish] at the same points as for an
+/// [super::async_decode::AsyncDecoder], i.e. before anything that could read
+/// or modify textures.
+#[derive(Default)]
+struct PendingPvrtcLevels {
+    texture: GLuint,
+    target: GLenum,
+    levels: Vec<PendingPvrtcLevel>,
+}
+impl PendingPvrtcLevels {
+    /// Add a level of `texture` to be decoded. If the pending levels are for
+    /// another texture, or this isn't the next level, they are uploaded first
+    /// with `upload`.
+    ///
+    /// Note that this panics rather than create GL errors for invalid use
+    /// (TODO?)
+    #[allow(clippy::too_many_arguments)]
+    fn push<F>(
+        &mut self,
+        texture: GLuint,
+        target: GLenum,
+        level: GLint,
+        internalformat: GLenum,
+        width: GLsizei,
+        height: GLsizei,
+        border: GLint,
+        pvrtc_data: &[u8],
+        upload: F,
+    ) where
+        F: FnMut(Upload),
+    {
+        assert!(border == 0);
+        let follows = self.levels.last().is_some_and(|last| {
+            self.texture == texture && self.target == target && last.level + 1 == level
+        });
+        if !follows {
+            self.finish(upload);
+            self.texture = texture;
+            self.target = target;
+        }
+        self.levels.push(PendingPvrtcLevel {
             level,
-            gles11::RGBA as _,
+            is_2bit: pvrtc_is_2bit(internalformat).unwrap(),
+            width,
+            height,
+            data: pvrtc_data.to_vec(),
+        });
+    }
+
+    /// Decode all the pending levels and upload them using `upload`.
+    fn finish<F>(&mut self, mut upload: F)
+    where
+        F: FnMut(Upload),
+    {
+        if self.levels.is_empty() {
+            return;
+        }
+        let decoded = {
+            let inputs: Vec<_> = self
+                .levels
+                .iter()
+                .map(|level| crate::image::PvrtcBatchInput {
+                    data: &level.data,
+                    is_2bit: level.is_2bit,
+                    width: level.width.try_into().unwrap(),
+                    height: level.height.try_into().unwrap(),
+                })
+                .collect();
+            crate::image::decode_pvrtc_batch(&inputs)
+        };
+        log_dbg!("Decoded {} PVRTC levels", decoded.len());
+        for (level, pixels) in self.levels.drain(..).zip(decoded) {
+            upload(Upload {
+                texture: self.texture,
+                target: self.target,
+                level: level.level,
+                width: level.width,
+                height: level.height,
+                data: Some(&ConvertedPvrtc::Rgba(pixels)),
+            });
+        }
+    }
+}
+
+/// The host driver's functions needed by [PvrtcUploader]. These have the same
+/// signatures in the OpenGL ES 1.1 and OpenGL 2.1 bindings.
+pub struct PvrtcHostFns {
+    pub get_string: unsafe fn(GLenum) -> *const GLubyte,
+    pub get_integerv: unsafe fn(GLenum, *mut GLint),
+    pub compressed_tex_image_2d:
+        unsafe fn(GLenum, GLint, GLenum, GLsizei, GLsizei, GLint, GLsizei, *const GLvoid),
+    /// Upload a texture for [AsyncDecoder] or [PendingPvrtcLevels]. This must
+    /// leave the texture binding as it was.
+    pub upload_deferred: unsafe fn(Upload),
+}
+
+/// `IMG_texture_compression_pvrtc` support shared by the GLES
+/// implementations. Textures are decoded, transcoded or passed through
+/// depending on what the host supports, and the decoding may be deferred, so
+/// [Self::finish] must be called before anything that could read or modify
+/// textures.
+pub struct PvrtcUploader {
+    host: PvrtcHostFns,
+    keep_textures_compressed: bool,
+    /// Chosen on first use, since the context must be current.
+    strategy: Option<PvrtcStrategy>,
+    async_decoder: Option<AsyncDecoder>,
+    pending_levels: PendingPvrtcLevels,
+}
+impl PvrtcUploader {
+    pub fn new(host: PvrtcHostFns, options: &Options) -> Self {
+        PvrtcUploader {
+            host,
+            keep_textures_compressed: options.keep_textures_compressed,
+            strategy: None,
+            async_decoder: options.async_texture_decode.map(AsyncDecoder::new),
+            pending_levels: PendingPvrtcLevels::default(),
+        }
+    }
+
+    /// Do the deferred uploads. If `for_draw` is [true], only those that
+    /// [AsyncDecoder::finish_for_draw] requires are done. The context must be
+    /// current.
+    pub unsafe fn finish(&mut self, for_draw: bool) {
+        let upload_deferred = self.host.upload_deferred;
+        self.pending_levels.finish(|upload| upload_deferred(upload));
+        let Some(ref mut decoder) = self.async_decoder else {
+            return;
+        };
+        if for_draw {
+            decoder.finish_for_draw(|upload| upload_deferred(upload))
+        } else {
+            decoder.finish_all(|upload| upload_deferred(upload))
+        }
+    }
+
+    /// Helper for implementing `glCompressedTexImage2D`: if `internalformat`
+    /// is one of the `IMG_texture_compression_pvrtc` formats, upload the
+    /// texture to the currently bound texture (possibly later, see
+    /// [Self::finish]) and return `true`. Otherwise, return `false`.
+    ///
+    /// Note that this panics rather than create GL errors for invalid use
+    /// (TODO?)
+    #[allow(clippy::too_many_arguments)]
+    pub unsafe fn try_upload(
+        &mut self,
+        target: GLenum,
+        level: GLint,
+        internalformat: GLenum,
+        width: GLsizei,
+        height: GLsizei,
+        border: GLint,
+        data: &[u8],
+    ) -> bool {
+        if pvrtc_is_2bit(internalformat).is_none() {
+            return false;
+        }
+        let strategy = match self.strategy {
+            Some(strategy) => strategy,
+            None => {
+                let strategy = PvrtcStrategy::choose(&self.host, self.keep_textures_compressed);
+                self.strategy = Some(strategy);
+                strategy
+            }
+        };
+        if strategy != PvrtcStrategy::Passthrough && self.async_decoder.is_some() {
+            assert!(border == 0);
+            let texture = self.bound_texture();
+            let pvrtc_data = data.to_vec();
+            let decoder = self.async_decoder.as_mut().unwrap();
+            decoder.submit(texture, target, level, width, height, move || {
+                convert_pvrtc(strategy, internalformat, width, height, &pvrtc_data)
+            });
+            log_dbg!("Decoding PVRTC asynchronously");
+            return true;
+        }
+        if strategy == PvrtcStrategy::Decode {
+            let texture = self.bound_texture();
+            let upload_deferred = self.host.upload_deferred;
+            self.pending_levels.push(
+                texture,
+                target,
+                level,
+                internalformat,
+                width,
+                height,
+                border,
+                data,
+                |upload| upload_deferred(upload),
+            );
+            return true;
+        }
+        self.finish(false);
+        let compressed_tex_image_2d = self.host.compressed_tex_image_2d;
+        try_keep_pvrtc_compressed(
+            strategy,
+            internalformat,
             width,
             height,
             border,
-            gles11::RGBA,
-            gles11::UNSIGNED_BYTE,
-            pixels.as_ptr() as *const _,
+            data,
+            |format, data| {
+                log_dbg!("Uploading PVRTC as compressed format {:#x}", format);
+                compressed_tex_image_2d(
+                    target,
+                    level,
+                    format,
+                    width,
+                    height,
+                    border,
+                    data.len().try_into().unwrap(),
+                    data.as_ptr() as *const _,
+                )
+            },
         )
-    };
-    true
+    }
+
+    unsafe fn bound_texture(&self) -> GLuint {
+        let mut texture = 0;
+        (self.host.get_integerv)(gles11::TEXTURE_BINDING_2D, &mut texture);
+        texture as _
+    }
 }
 
 pub struct PalettedTextureFormat {
@@ -250,3 +664,24 @@ impl PalettedTextureFormat {
         }
     }
 }
+
+#[cfg(test)]
+#[test]
+fn test_fixed_vectors_to_float() {
+    let values: Vec<GLfixed> = (0..64)
+        .map(|i: i32| (i - 32).wrapping_mul(0x0123_4567) ^ (i << 3))
+        .collect();
+    for (size, stride) in [(2, 8), (3, 12), (4, 16), (2, 12), (3, 16), (4, 20), (3, 28)] {
+        let count = (values.len() * 4 - size * 4) / stride + 1;
+        let mut dst = vec![0.0; count * size];
+        unsafe { fixed_vectors_to_float(values.as_ptr(), stride, size, count, &mut dst) };
+        for j in 0..count {
+            for k in 0..size {
+                assert_eq!(
+                    dst[j * size + k],
+                    fixed_to_float(values[j * stride / 4 + k])
+                );
+            }
+        }
+    }
+}
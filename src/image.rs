@@ -11,12 +11,38 @@
 //! This module also exposes decompression for Imagination Technologies' PVRTC
 //! format, implementing as a wrapper around their decoder from the PowerVR
 //! SDK.
+//!
+//! The results of decoding can be cached on disk, see [texture_cache].
+
+pub mod texture_cache;
 
 use std::ffi::{c_int, c_uchar, CStr};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+use texture_cache::{Kind, TextureData};
 
 use touchHLE_pvrt_decompress_wrapper::*;
 use touchHLE_stb_image_wrapper::*;
 
+/// Total time spent decoding, in nanoseconds. This includes decoding done on
+/// other threads, so it can exceed the wall-clock time.
+static DECODE_TIME: AtomicU64 = AtomicU64::new(0);
+
+/// Get the total time spent decoding images and textures so far (not counting
+/// texture cache hits).
+pub fn decode_time() -> Duration {
+    Duration::from_nanos(DECODE_TIME.load(Ordering::Relaxed))
+}
+
+fn timed<T>(f: impl FnOnce() -> T) -> T {
+    let start = Instant::now();
+    let res = f();
+    let nanos = start.elapsed().as_nanos().try_into().unwrap_or(u64::MAX);
+    DECODE_TIME.fetch_add(nanos, Ordering::Relaxed);
+    res
+}
+
 pub struct Image {
     pixels: PixelStore,
     dimensions: (u32, u32),
@@ -25,10 +51,35 @@ pub struct Image {
 enum PixelStore {
     StbImage(*mut c_uchar),
     Vec(Vec<u8>),
+    Cached(TextureData),
 }
 
 impl Image {
     pub fn from_bytes(bytes: &[u8]) -> Result<Image, String> {
+        let cache_key = texture_cache::key(Kind::Image, &[], bytes);
+        if let Some((pixels, [width, height])) = cache_key.as_ref().and_then(texture_cache::lookup)
+        {
+            if pixels.len() == width as usize * height as usize * 4 {
+                return Ok(Image {
+                    pixels: PixelStore::Cached(pixels),
+                    dimensions: (width, height),
+                });
+            }
+        }
+
+        let (pixels, width, height) = timed(|| Self::decode_with_stb_image(bytes))?;
+        let image = Image {
+            pixels: PixelStore::StbImage(pixels),
+            dimensions: (width, height),
+        };
+        if let Some(key) = cache_key {
+            texture_cache::insert(&key, [width, height], image.pixels());
+        }
+        Ok(image)
+    }
+
+    /// The uncached part of [Self::from_bytes].
+    fn decode_with_stb_image(bytes: &[u8]) -> Result<(*mut c_uchar, u32, u32), String> {
         let len: c_int = bytes.len().try_into().unwrap();
 
         let mut x: c_int = 0;
@@ -78,10 +129,7 @@ impl Image {
             }
         }
 
-        Ok(Image {
-            pixels: PixelStore::StbImage(pixels),
-            dimensions: (width, height),
-        })
+        Ok((pixels, width, height))
     }
 
     /// TODO: This shouldn't really exist, it's a workaround for `CGImage`
@@ -103,6 +151,7 @@ impl Image {
     pub fn pixels(&self) -> &[u8] {
         match self.pixels {
             PixelStore::Vec(ref vec) => vec,
+            PixelStore::Cached(ref data) => data,
             PixelStore::StbImage(ptr) => unsafe {
                 std::slice::from_raw_parts(
                     ptr,
@@ -115,6 +164,7 @@ impl Image {
     fn pixels_mut(&mut self) -> &mut [u8] {
         match self.pixels {
             PixelStore::Vec(ref mut vec) => vec,
+            PixelStore::Cached(ref mut data) => data,
             PixelStore::StbImage(ptr) => unsafe {
                 std::slice::from_raw_parts_mut(
                     ptr,
@@ -180,7 +230,7 @@ impl Drop for Image {
     fn drop(&mut self) {
         match self.pixels {
             PixelStore::StbImage(ptr) => unsafe { stbi_image_free(ptr.cast()) },
-            PixelStore::Vec(_) => (),
+            PixelStore::Vec(_) | PixelStore::Cached(_) => (),
         }
     }
 }
@@ -196,31 +246,166 @@ pub fn gamma_decode(intensity: f32) -> f32 {
     intensity.powf(2.2)
 }
 
-/// Decodes Imagination Technologies' PVRTC texture compression format to
-/// RGBA (8 bits per channel).
-pub fn decode_pvrtc(pvrtc_data: &[u8], is_2bit: bool, width: u32, height: u32) -> Vec<u32> {
+fn pvrtc_size(is_2bit: bool, width: u32, height: u32) -> usize {
     // This formula is from the IMG_texture_compression_pvrtc extension spec.
-    let expected_size = if is_2bit {
+    if is_2bit {
         (width.max(16) as usize * height.max(8) as usize * 2 + 7) / 8
     } else {
         (width.max(8) as usize * height.max(8) as usize * 4 + 7) / 8
-    };
+    }
+}
+
+/// Decodes Imagination Technologies' PVRTC texture compression format to
+/// RGBA (8 bits per channel).
+pub fn decode_pvrtc(pvrtc_data: &[u8], is_2bit: bool, width: u32, height: u32) -> TextureData {
+    let expected_size = pvrtc_size(is_2bit, width, height);
     assert!(pvrtc_data.len() == expected_size);
 
-    let rgba8_word_count = width as usize * height as usize;
-    let mut rgba8_data = Vec::with_capacity(rgba8_word_count);
-    unsafe {
+    let rgba8_size = width as usize * height as usize * 4;
+    let cache_key = texture_cache::key(
+        Kind::PvrtcToRgba,
+        &[is_2bit.into(), width, height],
+        pvrtc_data,
+    );
+    if let Some((data, _)) = cache_key.as_ref().and_then(texture_cache::lookup) {
+        if data.len() == rgba8_size {
+            return data;
+        }
+    }
+
+    // Unlike the reference decoder, touchHLE_decompress_pvrtc doesn't need
+    // the output to be aligned to 32-bit words.
+    let mut rgba8_data = Vec::with_capacity(rgba8_size);
+    timed(|| unsafe {
         let consumed_size = touchHLE_decompress_pvrtc(
             pvrtc_data.as_ptr() as *const _,
             is_2bit,
             width,
             height,
-            // The interface says `uint8_t *` but the source seems to work with
-            // 32-bit words, so using Vec<u32> seems more appropriate.
-            rgba8_data.as_mut_ptr() as *mut u8,
+            rgba8_data.as_mut_ptr(),
         );
         assert_eq!(consumed_size as usize, expected_size);
-        rgba8_data.set_len(rgba8_word_count);
-    };
-    rgba8_data
+        rgba8_data.set_len(rgba8_size);
+    });
+    if let Some(key) = cache_key {
+        texture_cache::insert(&key, [width, height], &rgba8_data);
+    }
+    TextureData::Owned(rgba8_data)
+}
+
+/// Transcodes Imagination Technologies' PVRTC texture compression format to
+/// BC3 (DXT5) if `with_alpha` is [true], or BC1 (DXT1) otherwise. These are
+/// much more widely supported by desktop GPUs, and the result is 4 or 8 bits
+/// per pixel rather than the 32 bits of [decode_pvrtc].
+pub fn transcode_pvrtc_to_bc(
+    pvrtc_data: &[u8],
+    is_2bit: bool,
+    width: u32,
+    height: u32,
+    with_alpha: bool,
+) -> TextureData {
+    let expected_size = pvrtc_size(is_2bit, width, height);
+    assert!(pvrtc_data.len() == expected_size);
+
+    let bc_size = unsafe { touchHLE_bc_size(width, height, with_alpha) } as usize;
+    let cache_key = texture_cache::key(
+        Kind::PvrtcToBc,
+        &[is_2bit.into(), width, height, with_alpha.into()],
+        pvrtc_data,
+    );
+    if let Some((data, _)) = cache_key.as_ref().and_then(texture_cache::lookup) {
+        if data.len() == bc_size {
+            return data;
+        }
+    }
+
+    let mut bc_data = Vec::with_capacity(bc_size);
+    timed(|| unsafe {
+        let consumed_size = touchHLE_transcode_pvrtc_to_bc(
+            pvrtc_data.as_ptr() as *const _,
+            is_2bit,
+            width,
+            height,
+            with_alpha,
+            bc_data.as_mut_ptr(),
+        );
+        assert_eq!(consumed_size as usize, expected_size);
+        bc_data.set_len(bc_size);
+    });
+    if let Some(key) = cache_key {
+        texture_cache::insert(&key, [width, height], &bc_data);
+    }
+    TextureData::Owned(bc_data)
+}
+
+/// One PVRTC texture or mipmap level for [decode_pvrtc_batch].
+pub struct PvrtcBatchInput<'a> {
+    pub data: &'a [u8],
+    pub is_2bit: bool,
+    pub width: u32,
+    pub height: u32,
+}
+
+/// Like [decode_pvrtc], but decodes several textures (e.g. all the levels of a
+/// mipmap chain) in a single call, using several threads where worthwhile.
+/// Decoding the levels one at a time spends most of its time on the smallest
+/// ones. The levels that weren't cached share a single buffer.
+pub fn decode_pvrtc_batch(inputs: &[PvrtcBatchInput]) -> Vec<TextureData> {
+    let mut results: Vec<Option<TextureData>> = Vec::with_capacity(inputs.len());
+    let mut misses = Vec::new();
+    let mut jobs = Vec::new();
+    for (i, input) in inputs.iter().enumerate() {
+        let expected_size = pvrtc_size(input.is_2bit, input.width, input.height);
+        assert!(input.data.len() == expected_size);
+
+        let rgba8_size = input.width as usize * input.height as usize * 4;
+        // Same key as decode_pvrtc, so the two share cache entries.
+        let cache_key = texture_cache::key(
+            Kind::PvrtcToRgba,
+            &[input.is_2bit.into(), input.width, input.height],
+            input.data,
+        );
+        if let Some((data, _)) = cache_key.as_ref().and_then(texture_cache::lookup) {
+            if data.len() == rgba8_size {
+                results.push(Some(data));
+                continue;
+            }
+        }
+        results.push(None);
+        misses.push((i, cache_key));
+        jobs.push(touchHLE_DecodeJob {
+            data: input.data.as_ptr().cast(),
+            format: if input.is_2bit {
+                FORMAT_PVRTC_2BPP
+            } else {
+                FORMAT_PVRTC_4BPP
+            },
+            width: input.width,
+            height: input.height,
+            output_offset: 0,
+            consumed: 0,
+        });
+    }
+
+    if !jobs.is_empty() {
+        let arena_size = unsafe { touchHLE_batch_layout(jobs.as_mut_ptr(), jobs.len()) };
+        let arena_size: usize = arena_size.try_into().unwrap();
+        let mut arena = Vec::with_capacity(arena_size);
+        timed(|| unsafe {
+            touchHLE_batch_decode(jobs.as_mut_ptr(), jobs.len(), arena.as_mut_ptr());
+            arena.set_len(arena_size);
+        });
+        let arena = Arc::new(arena);
+
+        for (job, (i, cache_key)) in jobs.iter().zip(misses) {
+            assert_eq!(job.consumed as usize, inputs[i].data.len());
+            let start = job.output_offset as usize;
+            let range = start..start + job.width as usize * job.height as usize * 4;
+            if let Some(key) = cache_key {
+                texture_cache::insert(&key, [job.width, job.height], &arena[range.clone()]);
+            }
+            results[i] = Some(TextureData::Shared(arena.clone(), range));
+        }
+    }
+    results.into_iter().map(Option::unwrap).collect()
 }
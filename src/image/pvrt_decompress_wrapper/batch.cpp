@@ -0,0 +1,136 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+// Batch decoding of PVRTC and ETC1 textures, e.g. whole mipmap chains, into a
+// single output buffer. Decoding the levels of a chain one at a time spends
+// most of its time on the tiny levels, which have a fixed cost but produce
+// few pixels, so here the small textures are shared out between threads while
+// the large ones are decoded one at a time with the decoder's own threading.
+
+#include "batch.h"
+#include "../../../vendor/PVRTDecompress/PVRTDecompress.h"
+#include "pvrtc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace touchHLE::batch {
+
+namespace {
+
+const unsigned MAX_THREADS = 8;
+// Below this many pixels in total, starting threads costs more than it saves.
+const std::uint64_t MIN_PIXELS_FOR_THREADS = 64 * 64;
+
+// The ETC decoder's "mode" parameter is unused.
+const std::uint32_t ETC_MODE = 0;
+
+void decode_one(Job &job, std::uint8_t *arena, bool allow_threads) {
+  std::uint8_t *out = arena + job.output_offset;
+  switch (job.format) {
+  case FORMAT_PVRTC_4BPP:
+  case FORMAT_PVRTC_2BPP:
+    job.consumed = pvrtc::decompress(job.data, job.format == FORMAT_PVRTC_2BPP,
+                                     job.width, job.height, out, allow_threads);
+    break;
+  case FORMAT_ETC1:
+    // The decoder only handles partial blocks for textures smaller than one
+    // block.
+    if ((job.width > 4 && job.width % 4 != 0) ||
+        (job.height > 4 && job.height % 4 != 0)) {
+      job.consumed = 0;
+      break;
+    }
+    job.consumed =
+        pvr::PVRTDecompressETC(job.data, job.width, job.height, out, ETC_MODE);
+    break;
+  default:
+    job.consumed = 0;
+    break;
+  }
+}
+
+} // namespace
+
+std::uint32_t input_size(std::uint32_t format, std::uint32_t width,
+                         std::uint32_t height) {
+  // These formulas are from the IMG_texture_compression_pvrtc and
+  // OES_compressed_ETC1_RGB8_texture extension specs.
+  switch (format) {
+  case FORMAT_PVRTC_4BPP:
+    return (std::max(width, 8u) * std::max(height, 8u) * 4 + 7) / 8;
+  case FORMAT_PVRTC_2BPP:
+    return (std::max(width, 16u) * std::max(height, 8u) * 2 + 7) / 8;
+  case FORMAT_ETC1:
+    return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+  default:
+    return 0;
+  }
+}
+
+std::uint64_t layout(Job *jobs, std::size_t count) {
+  std::uint64_t size = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    jobs[i].output_offset = size;
+    size += std::uint64_t(jobs[i].width) * jobs[i].height * 4;
+  }
+  return size;
+}
+
+void decode(Job *jobs, std::size_t count, std::uint8_t *arena) {
+  std::vector<Job *> small;
+  std::uint64_t small_pixels = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    Job &job = jobs[i];
+    bool is_pvrtc =
+        job.format == FORMAT_PVRTC_4BPP || job.format == FORMAT_PVRTC_2BPP;
+    if (is_pvrtc && pvrtc::uses_threads(job.width, job.height)) {
+      decode_one(job, arena, true);
+    } else {
+      small.push_back(&job);
+      small_pixels += std::uint64_t(job.width) * job.height;
+    }
+  }
+  if (small.empty()) {
+    return;
+  }
+
+  unsigned thread_count = 1;
+  if (small_pixels >= MIN_PIXELS_FOR_THREADS) {
+    thread_count = std::min(std::thread::hardware_concurrency(), MAX_THREADS);
+    thread_count = std::max(1u, std::min<unsigned>(thread_count, small.size()));
+  }
+  if (thread_count == 1) {
+    for (Job *job : small) {
+      decode_one(*job, arena, false);
+    }
+    return;
+  }
+
+  // Largest first, so that the threads finish at about the same time.
+  std::sort(small.begin(), small.end(), [](const Job *a, const Job *b) {
+    return std::uint64_t(a->width) * a->height >
+           std::uint64_t(b->width) * b->height;
+  });
+  std::atomic<std::size_t> next{0};
+  auto worker = [&]() {
+    for (std::size_t i = next++; i < small.size(); i = next++) {
+      decode_one(*small[i], arena, false);
+    }
+  };
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count - 1);
+  for (unsigned i = 1; i < thread_count; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+} // namespace touchHLE::batch
@@ -0,0 +1,48 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#ifndef TOUCHHLE_BATCH_H
+#define TOUCHHLE_BATCH_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace touchHLE::batch {
+
+enum Format : std::uint32_t {
+  FORMAT_PVRTC_4BPP = 0,
+  FORMAT_PVRTC_2BPP = 1,
+  FORMAT_ETC1 = 2,
+};
+
+// One texture (or mipmap level) to be decoded to RGBA8888 as part of a batch.
+// Keep in sync with touchHLE_DecodeJob in lib.rs.
+struct Job {
+  // Input, which must be at least the size given by input_size.
+  const void *data;
+  std::uint32_t format;
+  std::uint32_t width;
+  std::uint32_t height;
+  // Set by layout: where the output goes in the arena.
+  std::uint64_t output_offset;
+  // Set by decode: the number of bytes of input that were read.
+  std::uint32_t consumed;
+};
+
+// Size in bytes of the compressed data for a texture.
+std::uint32_t input_size(std::uint32_t format, std::uint32_t width,
+                         std::uint32_t height);
+
+// Assign each job a part of a single output arena. Returns the arena's size.
+std::uint64_t layout(Job *jobs, std::size_t count);
+
+// Decode all the jobs into the arena, using several threads where worthwhile.
+// Jobs that can't be decoded (an unknown format, or ETC1 dimensions that
+// aren't multiples of 4) have consumed set to 0.
+void decode(Job *jobs, std::size_t count, std::uint8_t *arena);
+
+} // namespace touchHLE::batch
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+// Simple BC1 (DXT1) and BC3 (DXT5) encoders, used to transcode PVRTC textures
+// for hosts that can't use them directly. These prefer speed over quality: the
+// color endpoints of each block are the extremes of its colors along their
+// principal axis, with no further refinement, which is good enough for
+// textures that were already lossily compressed.
+
+#include "bc.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+namespace touchHLE::bc {
+
+namespace {
+
+struct Block {
+  // RGBA, with pixels outside the image replaced by the nearest pixel inside.
+  std::uint8_t pixels[16][4];
+};
+
+void fetch_block(const std::uint8_t *rgba, std::uint32_t width,
+                 std::uint32_t height, std::uint32_t block_x,
+                 std::uint32_t block_y, Block &block) {
+  for (std::uint32_t y = 0; y < 4; y++) {
+    std::uint32_t image_y = std::min(block_y * 4 + y, height - 1);
+    for (std::uint32_t x = 0; x < 4; x++) {
+      std::uint32_t image_x = std::min(block_x * 4 + x, width - 1);
+      std::memcpy(block.pixels[y * 4 + x],
+                  rgba + (image_y * width + image_x) * 4, 4);
+    }
+  }
+}
+
+std::uint16_t to_565(const std::uint8_t *color) {
+  return std::uint16_t(((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) |
+                       (color[2] >> 3));
+}
+void from_565(std::uint16_t packed, std::int32_t *color) {
+  std::int32_t r = (packed >> 11) & 0x1f;
+  std::int32_t g = (packed >> 5) & 0x3f;
+  std::int32_t b = packed & 0x1f;
+  color[0] = (r << 3) | (r >> 2);
+  color[1] = (g << 2) | (g >> 4);
+  color[2] = (b << 3) | (b >> 2);
+}
+
+void write_u16(std::uint8_t *out, std::uint16_t value) {
+  out[0] = std::uint8_t(value);
+  out[1] = std::uint8_t(value >> 8);
+}
+
+// Find the colors of the block at either end of its principal axis.
+void find_endpoints(const Block &block, std::uint8_t *max_color,
+                    std::uint8_t *min_color) {
+  float mean[3] = {0, 0, 0};
+  for (const auto &pixel : block.pixels) {
+    for (int c = 0; c < 3; c++) {
+      mean[c] += pixel[c] / 16.0f;
+    }
+  }
+  float cov[3][3] = {};
+  for (const auto &pixel : block.pixels) {
+    float d[3] = {pixel[0] - mean[0], pixel[1] - mean[1], pixel[2] - mean[2]};
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++) {
+        cov[i][j] += d[i] * d[j];
+      }
+    }
+  }
+  // A few steps of power iteration are enough to approximate the principal
+  // eigenvector.
+  float axis[3] = {1, 1, 1};
+  for (int iteration = 0; iteration < 4; iteration++) {
+    float next[3];
+    for (int i = 0; i < 3; i++) {
+      next[i] = cov[i][0] * axis[0] + cov[i][1] * axis[1] + cov[i][2] * axis[2];
+    }
+    float largest = std::max({std::abs(next[0]), std::abs(next[1]),
+                              std::abs(next[2])});
+    if (largest == 0) {
+      break;
+    }
+    for (int i = 0; i < 3; i++) {
+      axis[i] = next[i] / largest;
+    }
+  }
+
+  float min_dot = INFINITY;
+  float max_dot = -INFINITY;
+  const std::uint8_t *min_pixel = block.pixels[0];
+  const std::uint8_t *max_pixel = block.pixels[0];
+  for (const auto &pixel : block.pixels) {
+    float dot = pixel[0] * axis[0] + pixel[1] * axis[1] + pixel[2] * axis[2];
+    if (dot < min_dot) {
+      min_dot = dot;
+      min_pixel = pixel;
+    }
+    if (dot > max_dot) {
+      max_dot = dot;
+      max_pixel = pixel;
+    }
+  }
+  std::memcpy(max_color, max_pixel, 3);
+  std::memcpy(min_color, min_pixel, 3);
+}
+
+// Encode the color part of a block (the whole of a BC1 block, or the second
+// half of a BC3 block), always using the four-color mode.
+void encode_color(const Block &block, std::uint8_t *out) {
+  std::uint8_t max_color[3];
+  std::uint8_t min_color[3];
+  find_endpoints(block, max_color, min_color);
+
+  std::uint16_t color0 = to_565(max_color);
+  std::uint16_t color1 = to_565(min_color);
+  write_u16(out, color0);
+  write_u16(out + 2, color1);
+  if (color0 == color1) {
+    // Every pixel uses color0.
+    std::memset(out + 4, 0, 4);
+    return;
+  }
+  // color0 > color1 selects the four-color mode for BC1. BC3 ignores this.
+  if (color0 < color1) {
+    std::swap(color0, color1);
+    write_u16(out, color0);
+    write_u16(out + 2, color1);
+  }
+
+  std::int32_t palette[4][3];
+  from_565(color0, palette[0]);
+  from_565(color1, palette[1]);
+  for (int c = 0; c < 3; c++) {
+    palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+    palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+  }
+
+  std::uint32_t indices = 0;
+  for (int i = 15; i >= 0; i--) {
+    int best = 0;
+    std::int32_t best_distance = INT32_MAX;
+    for (int p = 0; p < 4; p++) {
+      std::int32_t distance = 0;
+      for (int c = 0; c < 3; c++) {
+        std::int32_t d = std::int32_t(block.pixels[i][c]) - palette[p][c];
+        distance += d * d;
+      }
+      if (distance < best_distance) {
+        best_distance = distance;
+        best = p;
+      }
+    }
+    indices = (indices << 2) | std::uint32_t(best);
+  }
+  for (int i = 0; i < 4; i++) {
+    out[4 + i] = std::uint8_t(indices >> (8 * i));
+  }
+}
+
+// Encode the alpha part of a BC3 block, always using the eight-alpha mode.
+void encode_alpha(const Block &block, std::uint8_t *out) {
+  std::uint8_t min_alpha = 255;
+  std::uint8_t max_alpha = 0;
+  for (const auto &pixel : block.pixels) {
+    min_alpha = std::min(min_alpha, pixel[3]);
+    max_alpha = std::max(max_alpha, pixel[3]);
+  }
+  out[0] = max_alpha;
+  out[1] = min_alpha;
+  if (max_alpha == min_alpha) {
+    std::memset(out + 2, 0, 6);
+    return;
+  }
+
+  std::int32_t palette[8];
+  palette[0] = max_alpha;
+  palette[1] = min_alpha;
+  for (int i = 1; i < 7; i++) {
+    palette[i + 1] = ((7 - i) * max_alpha + i * min_alpha) / 7;
+  }
+
+  std::uint64_t indices = 0;
+  for (int i = 15; i >= 0; i--) {
+    int best = 0;
+    std::int32_t best_distance = INT32_MAX;
+    for (int p = 0; p < 8; p++) {
+      std::int32_t distance = std::abs(block.pixels[i][3] - palette[p]);
+      if (distance < best_distance) {
+        best_distance = distance;
+        best = p;
+      }
+    }
+    indices = (indices << 3) | std::uint64_t(best);
+  }
+  for (int i = 0; i < 6; i++) {
+    out[2 + i] = std::uint8_t(indices >> (8 * i));
+  }
+}
+
+template <bool WithAlpha>
+void encode(const std::uint8_t *rgba, std::uint32_t width,
+            std::uint32_t height, std::uint8_t *out) {
+  const std::uint32_t block_size = WithAlpha ? 16 : 8;
+  const std::uint32_t x_blocks = (width + 3) / 4;
+  const std::uint32_t y_blocks = (height + 3) / 4;
+  Block block;
+  for (std::uint32_t block_y = 0; block_y < y_blocks; block_y++) {
+    for (std::uint32_t block_x = 0; block_x < x_blocks; block_x++) {
+      fetch_block(rgba, width, height, block_x, block_y, block);
+      std::uint8_t *block_out = out + (block_y * x_blocks + block_x) *
+                                          block_size;
+      if (WithAlpha) {
+        encode_alpha(block, block_out);
+        encode_color(block, block_out + 8);
+      } else {
+        encode_color(block, block_out);
+      }
+    }
+  }
+}
+
+} // namespace
+
+std::uint32_t encoded_size(std::uint32_t width, std::uint32_t height,
+                           bool with_alpha) {
+  return ((width + 3) / 4) * ((height + 3) / 4) * (with_alpha ? 16 : 8);
+}
+
+void encode_bc1(const std::uint8_t *rgba, std::uint32_t width,
+                std::uint32_t height, std::uint8_t *out) {
+  encode<false>(rgba, width, height, out);
+}
+
+void encode_bc3(const std::uint8_t *rgba, std::uint32_t width,
+                std::uint32_t height, std::uint8_t *out) {
+  encode<true>(rgba, width, height, out);
+}
+
+} // namespace touchHLE::bc
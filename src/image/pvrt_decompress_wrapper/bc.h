@@ -0,0 +1,27 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#ifndef TOUCHHLE_BC_H
+#define TOUCHHLE_BC_H
+
+#include <cstdint>
+
+namespace touchHLE::bc {
+
+// Size in bytes of a BC1 (without alpha) or BC3 (with alpha) image.
+std::uint32_t encoded_size(std::uint32_t width, std::uint32_t height,
+                           bool with_alpha);
+
+// Encode an RGBA8888 image as BC1, ignoring alpha.
+void encode_bc1(const std::uint8_t *rgba, std::uint32_t width,
+                std::uint32_t height, std::uint8_t *out);
+
+// Encode an RGBA8888 image as BC3.
+void encode_bc3(const std::uint8_t *rgba, std::uint32_t width,
+                std::uint32_t height, std::uint8_t *out);
+
+} // namespace touchHLE::bc
+
+#endif
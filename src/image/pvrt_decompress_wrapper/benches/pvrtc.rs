@@ -0,0 +1,100 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Benchmarks for the PVRTC decoder. Run with
+//! `cargo bench -p touchHLE_pvrt_decompress_wrapper`, optionally followed by
+//! `-- <filter>` to only run benchmarks whose names contain `<filter>`.
+//!
+//! Each result is printed to stdout as a single line of JSON, so the output can
+//! be collected and compared by other tools.
+
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+use touchHLE_pvrt_decompress_wrapper::*;
+
+/// Minimum time to spend measuring each benchmark, after warming up.
+const MEASURE_TIME: Duration = Duration::from_millis(500);
+
+struct Bench {
+    filters: Vec<String>,
+}
+
+impl Bench {
+    fn new() -> Bench {
+        // Cargo passes "--bench", which isn't a filter.
+        let filters = std::env::args()
+            .skip(1)
+            .filter(|arg| !arg.starts_with("--"))
+            .collect();
+        Bench { filters }
+    }
+
+    /// Measure `f`, which processes `pixels` pixels on each iteration.
+    fn run<F: FnMut()>(&self, name: &str, pixels: u64, mut f: F) {
+        if !self.filters.is_empty() && !self.filters.iter().any(|f| name.contains(f)) {
+            return;
+        }
+        f();
+        let mut iterations = 0u64;
+        let start = Instant::now();
+        let mut batch = 1;
+        while start.elapsed() < MEASURE_TIME {
+            for _ in 0..batch {
+                f();
+            }
+            iterations += batch;
+            batch *= 2;
+        }
+        let elapsed = start.elapsed();
+        let ns_per_iteration = elapsed.as_nanos() as f64 / iterations as f64;
+        let megapixels_per_second = (pixels * iterations) as f64 / elapsed.as_secs_f64() / 1e6;
+        println!(
+            "{{\"name\":\"{}\",\"iterations\":{},\"ns_per_iteration\":{:.1},\"throughput\":{:.2},\"unit\":\"MP/s\"}}",
+            name, iterations, ns_per_iteration, megapixels_per_second
+        );
+    }
+}
+
+fn main() {
+    let bench = Bench::new();
+
+    // Arbitrary data is still valid PVRTC data, so a simple PRNG will do.
+    let mut seed: u32 = 1;
+    let mut next_byte = || {
+        seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+        (seed >> 16) as u8
+    };
+
+    for is_2bit in [false, true] {
+        let bits_per_pixel = if is_2bit { 2 } else { 4 };
+        for size in [64u32, 128, 256, 512, 1024, 2048] {
+            let data: Vec<u8> = (0..(size * size * bits_per_pixel / 8))
+                .map(|_| next_byte())
+                .collect();
+            let mut rgba = vec![0u8; (size * size * 4) as usize];
+            let pixels = u64::from(size) * u64::from(size);
+
+            for (variant, decompress) in [
+                (
+                    "",
+                    touchHLE_decompress_pvrtc as unsafe extern "C" fn(_, _, _, _, _) -> _,
+                ),
+                ("_reference", touchHLE_decompress_pvrtc_reference),
+            ] {
+                let name = format!("pvrtc_{}bpp{}/{}x{}", bits_per_pixel, variant, size, size);
+                bench.run(&name, pixels, || unsafe {
+                    decompress(
+                        black_box(data.as_ptr()).cast(),
+                        is_2bit,
+                        size,
+                        size,
+                        rgba.as_mut_ptr(),
+                    );
+                    black_box(&mut rgba);
+                });
+            }
+        }
+    }
+}
@@ -15,9 +15,19 @@ fn main() {
 
     cc::Build::new()
         .file(package_root.join("lib.cpp"))
+        .file(package_root.join("pvrtc.cpp"))
+        .file(package_root.join("bc.cpp"))
+        .file(package_root.join("batch.cpp"))
         .cpp(true)
+        .std("c++17")
         .compile("pvrt_decompress_wrapper");
     rerun_if_changed(&package_root.join("lib.cpp"));
+    rerun_if_changed(&package_root.join("pvrtc.cpp"));
+    rerun_if_changed(&package_root.join("pvrtc.h"));
+    rerun_if_changed(&package_root.join("bc.cpp"));
+    rerun_if_changed(&package_root.join("bc.h"));
+    rerun_if_changed(&package_root.join("batch.cpp"));
+    rerun_if_changed(&package_root.join("batch.h"));
     rerun_if_changed(&workspace_root.join("vendor/PVRTDecompress/PVRTDecompress.cpp"));
     rerun_if_changed(&workspace_root.join("vendor/PVRTDecompress/PVRTDecompress.h"));
 }
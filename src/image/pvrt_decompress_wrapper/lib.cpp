@@ -4,11 +4,64 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 #include "../../../vendor/PVRTDecompress/PVRTDecompress.cpp"
+#include "batch.h"
+#include "bc.h"
+#include "pvrtc.h"
+#include <vector>
 extern "C" {
 uint32_t touchHLE_decompress_pvrtc(const void *pvrtc_data, bool is_2bit,
                                    uint32_t width, uint32_t height,
                                    uint8_t *rgba_data) {
+  return touchHLE::pvrtc::decompress(pvrtc_data, is_2bit, width, height,
+                                     rgba_data);
+}
+// The original implementation, which the output of the above must match.
+uint32_t touchHLE_decompress_pvrtc_reference(const void *pvrtc_data,
+                                             bool is_2bit, uint32_t width,
+                                             uint32_t height,
+                                             uint8_t *rgba_data) {
   return pvr::PVRTDecompressPVRTC(pvrtc_data, is_2bit, width, height,
                                   rgba_data);
 }
+// The decoder that the batch API uses for ETC1, called directly.
+uint32_t touchHLE_decompress_etc1_reference(const void *etc1_data,
+                                            uint32_t width, uint32_t height,
+                                            uint8_t *rgba_data) {
+  return pvr::PVRTDecompressETC(etc1_data, width, height, rgba_data, 0);
+}
+// Size of the output of touchHLE_transcode_pvrtc_to_bc.
+uint32_t touchHLE_bc_size(uint32_t width, uint32_t height, bool with_alpha) {
+  return touchHLE::bc::encoded_size(width, height, with_alpha);
+}
+// Encode an RGBA8888 image as BC3 if with_alpha is true, or BC1 otherwise.
+void touchHLE_encode_bc(const uint8_t *rgba_data, uint32_t width,
+                        uint32_t height, bool with_alpha, uint8_t *bc_data) {
+  if (with_alpha) {
+    touchHLE::bc::encode_bc3(rgba_data, width, height, bc_data);
+  } else {
+    touchHLE::bc::encode_bc1(rgba_data, width, height, bc_data);
+  }
+}
+// Transcode a PVRTC texture to BC3 if with_alpha is true, or BC1 otherwise.
+uint32_t touchHLE_transcode_pvrtc_to_bc(const void *pvrtc_data, bool is_2bit,
+                                        uint32_t width, uint32_t height,
+                                        bool with_alpha, uint8_t *bc_data) {
+  std::vector<uint8_t> rgba(size_t(width) * height * 4);
+  uint32_t consumed = touchHLE::pvrtc::decompress(pvrtc_data, is_2bit, width,
+                                                  height, rgba.data());
+  touchHLE_encode_bc(rgba.data(), width, height, with_alpha, bc_data);
+  return consumed;
+}
+// See batch.h.
+uint32_t touchHLE_batch_input_size(uint32_t format, uint32_t width,
+                                   uint32_t height) {
+  return touchHLE::batch::input_size(format, width, height);
+}
+uint64_t touchHLE_batch_layout(touchHLE::batch::Job *jobs, size_t count) {
+  return touchHLE::batch::layout(jobs, count);
+}
+void touchHLE_batch_decode(touchHLE::batch::Job *jobs, size_t count,
+                           uint8_t *arena) {
+  touchHLE::batch::decode(jobs, count, arena);
+}
 }
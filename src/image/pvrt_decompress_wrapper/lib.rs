@@ -13,7 +13,28 @@
 
 use std::ffi::c_void;
 
-// See build.rs, lib.cpp and ../../../vendor/PVRTDecompress/PVRTDecompress.h
+/// Formats for [touchHLE_DecodeJob]. Keep in sync with batch.h.
+pub const FORMAT_PVRTC_4BPP: u32 = 0;
+pub const FORMAT_PVRTC_2BPP: u32 = 1;
+pub const FORMAT_ETC1: u32 = 2;
+
+/// One texture to be decoded by [touchHLE_batch_decode]. Keep in sync with
+/// `Job` in batch.h.
+#[repr(C)]
+#[derive(Debug)]
+pub struct touchHLE_DecodeJob {
+    pub data: *const c_void,
+    pub format: u32,
+    pub width: u32,
+    pub height: u32,
+    /// Set by [touchHLE_batch_layout].
+    pub output_offset: u64,
+    /// Set by [touchHLE_batch_decode].
+    pub consumed: u32,
+}
+
+// See build.rs, lib.cpp, pvrtc.h, bc.h, batch.h and
+// ../../../vendor/PVRTDecompress/PVRTDecompress.h
 extern "C" {
     pub fn touchHLE_decompress_pvrtc(
         pvrtc_data: *const c_void,
@@ -22,4 +43,423 @@ extern "C" {
         height: u32,
         rgba_data: *mut u8,
     ) -> u32;
+    pub fn touchHLE_decompress_pvrtc_reference(
+        pvrtc_data: *const c_void,
+        is_2bit: bool,
+        width: u32,
+        height: u32,
+        rgba_data: *mut u8,
+    ) -> u32;
+    pub fn touchHLE_decompress_etc1_reference(
+        etc1_data: *const c_void,
+        width: u32,
+        height: u32,
+        rgba_data: *mut u8,
+    ) -> u32;
+    pub fn touchHLE_bc_size(width: u32, height: u32, with_alpha: bool) -> u32;
+    pub fn touchHLE_encode_bc(
+        rgba_data: *const u8,
+        width: u32,
+        height: u32,
+        with_alpha: bool,
+        bc_data: *mut u8,
+    );
+    pub fn touchHLE_transcode_pvrtc_to_bc(
+        pvrtc_data: *const c_void,
+        is_2bit: bool,
+        width: u32,
+        height: u32,
+        with_alpha: bool,
+        bc_data: *mut u8,
+    ) -> u32;
+    pub fn touchHLE_batch_input_size(format: u32, width: u32, height: u32) -> u32;
+    pub fn touchHLE_batch_layout(jobs: *mut touchHLE_DecodeJob, count: usize) -> u64;
+    pub fn touchHLE_batch_decode(jobs: *mut touchHLE_DecodeJob, count: usize, arena: *mut u8);
+}
+
+#[cfg(test)]
+#[test]
+fn test_pvrtc_matches_reference() {
+    // Arbitrary data is still valid PVRTC data, so a simple PRNG will do.
+    let mut seed: u32 = 1;
+    let mut next_byte = || {
+        seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+        (seed >> 16) as u8
+    };
+
+    for is_2bit in [false, true] {
+        for width_log2 in 0..=10 {
+            for height_log2 in 0..=10 {
+                let (width, height) = (1u32 << width_log2, 1u32 << height_log2);
+                // Very small textures are padded to a minimum size.
+                let data_width = width.max(if is_2bit { 16 } else { 8 });
+                let data_height = height.max(8);
+                let bits_per_pixel = if is_2bit { 2 } else { 4 };
+                let data: Vec<u8> = (0..(data_width * data_height * bits_per_pixel / 8))
+                    .map(|_| next_byte())
+                    .collect();
+
+                let mut actual = vec![0u8; (width * height * 4) as usize];
+                let mut expected = vec![0xffu8; (width * height * 4) as usize];
+                let (actual_size, expected_size) = unsafe {
+                    (
+                        touchHLE_decompress_pvrtc(
+                            data.as_ptr().cast(),
+                            is_2bit,
+                            width,
+                            height,
+                            actual.as_mut_ptr(),
+                        ),
+                        touchHLE_decompress_pvrtc_reference(
+                            data.as_ptr().cast(),
+                            is_2bit,
+                            width,
+                            height,
+                            expected.as_mut_ptr(),
+                        ),
+                    )
+                };
+                assert_eq!(actual_size, expected_size);
+                assert!(
+                    actual == expected,
+                    "Mismatch for {}x{} {}bpp",
+                    width,
+                    height,
+                    bits_per_pixel
+                );
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+#[test]
+fn test_batch_matches_single_decodes() {
+    let mut seed: u32 = 2;
+    let mut next_byte = || {
+        seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+        (seed >> 16) as u8
+    };
+
+    // Full mipmap chains for both PVRTC formats, plus some ETC1 levels.
+    let mut levels = Vec::new();
+    for format in [FORMAT_PVRTC_4BPP, FORMAT_PVRTC_2BPP] {
+        for size_log2 in (0..=9).rev() {
+            levels.push((format, 1u32 << size_log2, 1u32 << (size_log2.max(1) - 1)));
+        }
+    }
+    for size in [64, 16, 4, 2, 1] {
+        levels.push((FORMAT_ETC1, size, size));
+    }
+    let inputs: Vec<Vec<u8>> = levels
+        .iter()
+        .map(|&(format, width, height)| {
+            let size = unsafe { touchHLE_batch_input_size(format, width, height) };
+            (0..size).map(|_| next_byte()).collect()
+        })
+        .collect();
+
+    let mut jobs: Vec<touchHLE_DecodeJob> = levels
+        .iter()
+        .zip(inputs.iter())
+        .map(|(&(format, width, height), input)| touchHLE_DecodeJob {
+            data: input.as_ptr().cast(),
+            format,
+            width,
+            height,
+            output_offset: 0,
+            consumed: 0,
+        })
+        .collect();
+    let arena_size = unsafe { touchHLE_batch_layout(jobs.as_mut_ptr(), jobs.len()) };
+    let mut arena = vec![0u8; arena_size as usize];
+    unsafe { touchHLE_batch_decode(jobs.as_mut_ptr(), jobs.len(), arena.as_mut_ptr()) };
+
+    for (job, input) in jobs.iter().zip(inputs.iter()) {
+        assert_eq!(job.consumed as usize, input.len(), "{:?}", job);
+        let size = (job.width * job.height * 4) as usize;
+        let offset = job.output_offset as usize;
+        let actual = &arena[offset..offset + size];
+        if job.format == FORMAT_ETC1 {
+            // ETC1 has no alpha.
+            assert!(actual.chunks(4).all(|pixel| pixel[3] == 0xff));
+        }
+        let mut expected = vec![0u8; size];
+        let consumed = unsafe {
+            if job.format == FORMAT_ETC1 {
+                touchHLE_decompress_etc1_reference(
+                    input.as_ptr().cast(),
+                    job.width,
+                    job.height,
+                    expected.as_mut_ptr(),
+                )
+            } else {
+                touchHLE_decompress_pvrtc_reference(
+                    input.as_ptr().cast(),
+                    job.format == FORMAT_PVRTC_2BPP,
+                    job.width,
+                    job.height,
+                    expected.as_mut_ptr(),
+                )
+            }
+        };
+        assert_eq!(consumed, job.consumed, "{:?}", job);
+        assert!(actual == expected, "Mismatch for {:?}", job);
+    }
+}
+
+/// Decode a BC1 (DXT1) image if `with_alpha` is [false], or BC3 (DXT5)
+/// otherwise, to RGBA. This is only for checking the encoder, so it assumes
+/// the dimensions are multiples of 4.
+#[cfg(test)]
+fn decode_bc(bc_data: &[u8], width: u32, height: u32, with_alpha: bool) -> Vec<u8> {
+    let from_565 = |packed: u16| {
+        let (r, g, b) = ((packed >> 11) & 0x1f, (packed >> 5) & 0x3f, packed & 0x1f);
+        [
+            (r << 3) | (r >> 2),
+            (g << 2) | (g >> 4),
+            (b << 3) | (b >> 2),
+        ]
+        .map(|c| c as u32)
+    };
+    let (width, height) = (width as usize, height as usize);
+    let block_size = if with_alpha { 16 } else { 8 };
+    let mut rgba = vec![0u8; width * height * 4];
+    for (i, block) in bc_data.chunks(block_size).enumerate() {
+        let (block_x, block_y) = (i % (width / 4), i / (width / 4));
+        let (alpha, color) = if with_alpha {
+            (Some(&block[..8]), &block[8..])
+        } else {
+            (None, block)
+        };
+
+        let color0 = u16::from_le_bytes([color[0], color[1]]);
+        let color1 = u16::from_le_bytes([color[2], color[3]]);
+        let (c0, c1) = (from_565(color0), from_565(color1));
+        let mut palette = [[0, 0, 0, 255]; 4];
+        for c in 0..3 {
+            palette[0][c] = c0[c];
+            palette[1][c] = c1[c];
+            // BC3 always uses the four-color mode.
+            if color0 > color1 || with_alpha {
+                palette[2][c] = (2 * c0[c] + c1[c]) / 3;
+                palette[3][c] = (c0[c] + 2 * c1[c]) / 3;
+            } else {
+                palette[2][c] = (c0[c] + c1[c]) / 2;
+                palette[3] = [0, 0, 0, 0];
+            }
+        }
+        let color_indices = u32::from_le_bytes(color[4..8].try_into().unwrap());
+
+        let alpha_palette_and_indices = alpha.map(|alpha| {
+            let (a0, a1) = (u32::from(alpha[0]), u32::from(alpha[1]));
+            let mut palette = [a0, a1, 0, 0, 0, 0, 0, 255];
+            if a0 > a1 {
+                for i in 1..7 {
+                    palette[i + 1] = ((7 - i as u32) * a0 + i as u32 * a1) / 7;
+                }
+            } else {
+                for i in 1..5 {
+                    palette[i + 1] = ((5 - i as u32) * a0 + i as u32 * a1) / 5;
+                }
+                palette[6] = 0;
+            }
+            let mut indices = [0u8; 8];
+            indices[..6].copy_from_slice(&alpha[2..8]);
+            (palette, u64::from_le_bytes(indices))
+        });
+
+        for pixel in 0..16 {
+            let (x, y) = (block_x * 4 + pixel % 4, block_y * 4 + pixel / 4);
+            let mut value = palette[((color_indices >> (pixel * 2)) & 3) as usize];
+            if let Some((palette, indices)) = alpha_palette_and_indices {
+                value[3] = palette[((indices >> (pixel * 3)) & 7) as usize];
+            }
+            let out = &mut rgba[(y * width + x) * 4..][..4];
+            for c in 0..4 {
+                out[c] = value[c] as u8;
+            }
+        }
+    }
+    rgba
+}
+
+#[cfg(test)]
+fn encode_bc(rgba: &[u8], width: u32, height: u32, with_alpha: bool) -> Vec<u8> {
+    let mut bc_data = vec![0u8; unsafe { touchHLE_bc_size(width, height, with_alpha) } as usize];
+    unsafe {
+        touchHLE_encode_bc(
+            rgba.as_ptr(),
+            width,
+            height,
+            with_alpha,
+            bc_data.as_mut_ptr(),
+        )
+    };
+    bc_data
+}
+
+#[cfg(test)]
+#[test]
+fn test_bc_uniform_block() {
+    // 565 can represent this color exactly.
+    let color = [0x84, 0x41, 0x21, 0x80];
+    let rgba = color.repeat(16);
+
+    let bc1 = encode_bc(&rgba, 4, 4, false);
+    assert_eq!(bc1.len(), 8);
+    // Both endpoints are the color, and every pixel uses the first.
+    assert_eq!(bc1[0..2], bc1[2..4]);
+    assert_eq!(bc1[4..8], [0; 4]);
+    let decoded = decode_bc(&bc1, 4, 4, false);
+    assert_eq!(decoded, [0x84, 0x41, 0x21, 0xff].repeat(16));
+
+    let bc3 = encode_bc(&rgba, 4, 4, true);
+    assert_eq!(bc3.len(), 16);
+    assert_eq!(bc3[0..8], [0x80, 0x80, 0, 0, 0, 0, 0, 0]);
+    assert_eq!(bc3[8..16], bc1[..]);
+    assert_eq!(decode_bc(&bc3, 4, 4, true), rgba);
+}
+
+#[cfg(test)]
+#[test]
+fn test_bc_endpoint_order() {
+    let mut seed: u32 = 3;
+    let mut next_byte = || {
+        seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+        (seed >> 16) as u8
+    };
+    let (width, height) = (64, 64);
+    let rgba: Vec<u8> = (0..width * height * 4).map(|_| next_byte()).collect();
+    for with_alpha in [false, true] {
+        let bc_data = encode_bc(&rgba, width, height, with_alpha);
+        let block_size = if with_alpha { 16 } else { 8 };
+        for block in bc_data.chunks(block_size) {
+            let color = &block[block_size - 8..];
+            let color0 = u16::from_le_bytes([color[0], color[1]]);
+            let color1 = u16::from_le_bytes([color[2], color[3]]);
+            // color0 <= color1 would select BC1's three-color mode, which has
+            // a transparent color.
+            assert!(
+                color0 > color1 || (color0 == color1 && color[4..8] == [0; 4]),
+                "{:04x} {:04x}",
+                color0,
+                color1
+            );
+            if with_alpha {
+                assert!(block[0] >= block[1]);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+#[test]
+fn test_bc_round_trip() {
+    // Smooth gradients are what block compression handles well, and what the
+    // textures being transcoded mostly contain. Each block's colors vary in two
+    // directions here, though, and BC1 can only represent colors on a line
+    // between its two endpoints, so some error is unavoidable.
+    let (width, height) = (32u32, 32u32);
+    let mut rgba = Vec::new();
+    for y in 0..height {
+        for x in 0..width {
+            rgba.extend_from_slice(&[
+                (x * 8) as u8,
+                (y * 8) as u8,
+                ((x + y) * 4) as u8,
+                (255 - y * 8) as u8,
+            ]);
+        }
+    }
+    for with_alpha in [false, true] {
+        let bc_data = encode_bc(&rgba, width, height, with_alpha);
+        let decoded = decode_bc(&bc_data, width, height, with_alpha);
+        let mut max_error = [0u8; 4];
+        let mut total_error = [0u32; 4];
+        for (expected, actual) in rgba.chunks(4).zip(decoded.chunks(4)) {
+            for c in 0..4 {
+                let error = expected[c].abs_diff(actual[c]);
+                max_error[c] = max_error[c].max(error);
+                total_error[c] += u32::from(error);
+            }
+            if !with_alpha {
+                assert_eq!(actual[3], 0xff);
+            }
+        }
+        let mean_error = total_error.map(|total| total / (width * height));
+        for c in 0..3 {
+            assert!(
+                max_error[c] <= 16 && mean_error[c] <= 6,
+                "Channel {}: maximum error {}, mean error {}",
+                c,
+                max_error[c],
+                mean_error[c]
+            );
+        }
+        if with_alpha {
+            // There are eight alpha levels per block, and the alpha only
+            // varies in one direction.
+            assert!(max_error[3] <= 2, "Maximum alpha error {}", max_error[3]);
+        }
+    }
+}
+
+#[cfg(test)]
+#[test]
+fn test_pvrtc_to_bc_matches_decode_then_encode() {
+    let mut seed: u32 = 4;
+    let mut next_byte = || {
+        seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+        (seed >> 16) as u8
+    };
+    for is_2bit in [false, true] {
+        for (width, height) in [(128, 64), (16, 16), (8, 8), (4, 4), (2, 1)] {
+            let size = unsafe {
+                touchHLE_batch_input_size(
+                    if is_2bit {
+                        FORMAT_PVRTC_2BPP
+                    } else {
+                        FORMAT_PVRTC_4BPP
+                    },
+                    width,
+                    height,
+                )
+            };
+            let pvrtc_data: Vec<u8> = (0..size).map(|_| next_byte()).collect();
+            let mut rgba = vec![0u8; (width * height * 4) as usize];
+            unsafe {
+                touchHLE_decompress_pvrtc(
+                    pvrtc_data.as_ptr().cast(),
+                    is_2bit,
+                    width,
+                    height,
+                    rgba.as_mut_ptr(),
+                )
+            };
+            for with_alpha in [false, true] {
+                let expected = encode_bc(&rgba, width, height, with_alpha);
+                let mut actual = vec![0u8; expected.len()];
+                let consumed = unsafe {
+                    touchHLE_transcode_pvrtc_to_bc(
+                        pvrtc_data.as_ptr().cast(),
+                        is_2bit,
+                        width,
+                        height,
+                        with_alpha,
+                        actual.as_mut_ptr(),
+                    )
+                };
+                assert_eq!(consumed, size);
+                assert!(
+                    actual == expected,
+                    "Mismatch for {}x{}, 2bpp: {}, alpha: {}",
+                    width,
+                    height,
+                    is_2bit,
+                    with_alpha
+                );
+            }
+        }
+    }
 }
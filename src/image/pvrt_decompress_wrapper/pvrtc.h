@@ -0,0 +1,27 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+#ifndef TOUCHHLE_PVRTC_H
+#define TOUCHHLE_PVRTC_H
+
+#include <cstdint>
+
+namespace touchHLE::pvrtc {
+
+// Decompress a PVRTC texture to RGBA8888. This has the same interface and
+// output as pvr::PVRTDecompressPVRTC, but is faster. Returns the size of the
+// compressed data in bytes. If allow_threads is false, this never starts any
+// threads, which is useful if the caller is decoding several textures in
+// parallel itself.
+std::uint32_t decompress(const void *pvrtc_data, bool is_2bit,
+                         std::uint32_t width, std::uint32_t height,
+                         std::uint8_t *rgba_data, bool allow_threads = true);
+
+// Whether decompress would use several threads for a texture of this size.
+bool uses_threads(std::uint32_t width, std::uint32_t height);
+
+} // namespace touchHLE::pvrtc
+
+#endif
@@ -0,0 +1,476 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Persistent cache of decoded textures (`--texture-cache`).
+//!
+//! Apps decode the same PNG and PVRTC images every time they're launched, and
+//! this can be a large part of their loading times. When the cache is enabled,
+//! the result of decoding (or transcoding) an image is saved to a file in
+//! [paths::TEXTURE_CACHE_DIR], named after a hash of the input data, its
+//! format and its dimensions. The next time the same image is decoded, the
+//! file is memory-mapped instead.
+//!
+//! Each file has a [HEADER_SIZE]-byte header, followed by the decoded data:
+//!
+//! - magic number ([MAGIC])
+//! - format version ([VERSION])
+//! - [Kind] of decoding
+//! - two values describing the output (e.g. width and height)
+//! - reserved
+//! - length of the decoded data (8 bytes)
+//!
+//! All values are little-endian. The total size of the files is kept under a
+//! limit by deleting the least recently used ones.
+
+use crate::paths;
+use std::collections::HashMap;
+use std::ops::{Deref, DerefMut, Range};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+use std::time::SystemTime;
+
+const MAGIC: [u8; 4] = *b"tHTC";
+/// Change this if the meaning of the cached data changes, e.g. if a decoder is
+/// changed such that it produces different results.
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 32;
+/// Inputs smaller than this aren't worth a file of their own.
+const MIN_INPUT_SIZE: usize = 4096;
+
+/// What was done to the input data. This is part of the key.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum Kind {
+    /// [super::Image::from_bytes]
+    Image = 1,
+    /// [super::decode_pvrtc]
+    PvrtcToRgba = 2,
+    /// [super::transcode_pvrtc_to_bc]
+    PvrtcToBc = 3,
+}
+
+/// Result of decoding or transcoding, which is either owned, part of a buffer
+/// shared with other results, or mapped from a cache file.
+pub enum TextureData {
+    Owned(Vec<u8>),
+    /// Used by [super::decode_pvrtc_batch], which decodes several textures
+    /// into one buffer. Writing to it copies the range first.
+    Shared(Arc<Vec<u8>>, Range<usize>),
+    Mapped(Mapping),
+}
+impl Deref for TextureData {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        match self {
+            TextureData::Owned(vec) => vec,
+            TextureData::Shared(buffer, range) => &buffer[range.clone()],
+            TextureData::Mapped(mapping) => mapping,
+        }
+    }
+}
+impl DerefMut for TextureData {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        if let TextureData::Shared(..) = self {
+            *self = TextureData::Owned(self.to_vec());
+        }
+        match self {
+            TextureData::Owned(vec) => vec,
+            TextureData::Shared(..) => unreachable!(),
+            TextureData::Mapped(mapping) => mapping,
+        }
+    }
+}
+
+/// Private, copy-on-write mapping of the data in a cache file. Writes to it
+/// don't affect the file.
+#[cfg(unix)]
+pub struct Mapping {
+    ptr: *mut u8,
+    /// Size of the whole mapping, including the header.
+    size: usize,
+}
+#[cfg(unix)]
+unsafe impl Send for Mapping {}
+#[cfg(unix)]
+impl Mapping {
+    fn new(file: &std::fs::File, size: usize) -> Option<Mapping> {
+        use std::os::fd::AsRawFd;
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                size,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return None;
+        }
+        Some(Mapping {
+            ptr: ptr.cast(),
+            size,
+        })
+    }
+}
+#[cfg(unix)]
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        let res = unsafe { libc::munmap(self.ptr.cast(), self.size) };
+        assert!(res == 0);
+    }
+}
+#[cfg(unix)]
+impl Deref for Mapping {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr.add(HEADER_SIZE), self.size - HEADER_SIZE) }
+    }
+}
+#[cfg(unix)]
+impl DerefMut for Mapping {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        unsafe {
+            std::slice::from_raw_parts_mut(self.ptr.add(HEADER_SIZE), self.size - HEADER_SIZE)
+        }
+    }
+}
+/// On hosts without `mmap`, the file is simply read into memory, which is still
+/// much faster than decoding it again.
+#[cfg(not(unix))]
+pub type Mapping = Vec<u8>;
+
+/// Identifies a cache entry. Get one with [key].
+pub struct Key {
+    kind: Kind,
+    hash: u64,
+}
+
+/// Cache hit/miss statistics, see [stats].
+#[derive(Copy, Clone, Debug, Default)]
+pub struct Stats {
+    pub hits: u64,
+    pub misses: u64,
+    pub evictions: u64,
+    /// Current total size of the cache files.
+    pub size: u64,
+}
+
+struct Entry {
+    size: u64,
+    last_used: SystemTime,
+}
+
+struct TextureCache {
+    dir: PathBuf,
+    size_limit: u64,
+    entries: HashMap<u64, Entry>,
+    stats: Stats,
+}
+
+/// This is global rather than part of the [crate::Environment] because images
+/// are decoded in many places that don't have access to it (e.g. the OpenGL ES
+/// implementations).
+static CACHE: Mutex<Option<TextureCache>> = Mutex::new(None);
+
+/// Enable the cache, limiting the total size of the files to `size_limit`
+/// bytes.
+pub fn init(size_limit: u64) {
+    let dir = paths::user_data_base_path().join(paths::TEXTURE_CACHE_DIR);
+    if let Err(e) = std::fs::create_dir_all(&dir) {
+        log!("Warning: couldn't create texture cache {:?}: {}", dir, e);
+        return;
+    }
+
+    let mut entries = HashMap::new();
+    let mut size = 0;
+    for dir_entry in std::fs::read_dir(&dir).into_iter().flatten().flatten() {
+        let Some(hash) = dir_entry
+            .file_name()
+            .to_str()
+            .and_then(|name| name.strip_suffix(".tex"))
+            .and_then(|hash| u64::from_str_radix(hash, 16).ok())
+        else {
+            continue;
+        };
+        let Ok(metadata) = dir_entry.metadata() else {
+            continue;
+        };
+        let last_used = metadata.modified().unwrap_or(SystemTime::UNIX_EPOCH);
+        size += metadata.len();
+        entries.insert(
+            hash,
+            Entry {
+                size: metadata.len(),
+                last_used,
+            },
+        );
+    }
+    log!(
+        "Texture cache {:?}: {} entries, {} of {} MiB used.",
+        dir,
+        entries.len(),
+        size / (1024 * 1024),
+        size_limit / (1024 * 1024)
+    );
+
+    let mut cache = TextureCache {
+        dir,
+        size_limit,
+        entries,
+        stats: Stats {
+            size,
+            ..Default::default()
+        },
+    };
+    // The limit might have been lowered since the last run.
+    cache.evict(0);
+    *CACHE.lock().unwrap() = Some(cache);
+}
+
+/// Get the current statistics, if the cache is enabled.
+pub fn stats() -> Option<Stats> {
+    CACHE.lock().unwrap().as_ref().map(|cache| cache.stats)
+}
+
+/// Get the key for the result of doing `kind` to `input` with `params` (e.g.
+/// the dimensions), or [None] if the cache is disabled or the input is too
+/// small to be worth caching.
+pub fn key(kind: Kind, params: &[u32], input: &[u8]) -> Option<Key> {
+    if input.len() < MIN_INPUT_SIZE || CACHE.lock().unwrap().is_none() {
+        return None;
+    }
+    Some(Key {
+        kind,
+        hash: hash(kind, params, input),
+    })
+}
+
+fn hash(kind: Kind, params: &[u32], input: &[u8]) -> u64 {
+    let mut hasher = Hasher::new(kind as u64);
+    for &param in params {
+        hasher.write_u64(param.into());
+    }
+    hasher.write_bytes(input);
+    hasher.finish()
+}
+
+/// Look up a cached result. Returns the data and the two values that were
+/// passed to [insert] with it.
+pub fn lookup(key: &Key) -> Option<(TextureData, [u32; 2])> {
+    let mut guard = CACHE.lock().unwrap();
+    let cache = guard.as_mut()?;
+    if !cache.entries.contains_key(&key.hash) {
+        cache.stats.misses += 1;
+        log_dbg!("Miss for {:016x}, {:?}", key.hash, cache.stats);
+        return None;
+    }
+    let path = cache.path_for(key.hash);
+    match read_entry(&path, key.kind) {
+        Ok(result) => {
+            cache.stats.hits += 1;
+            log_dbg!("Hit for {:016x}, {:?}", key.hash, cache.stats);
+            let now = SystemTime::now();
+            cache.entries.get_mut(&key.hash).unwrap().last_used = now;
+            // Keep the least-recently-used order across launches.
+            if let Ok(file) = std::fs::File::options().write(true).open(&path) {
+                let _ = file.set_modified(now);
+            }
+            Some(result)
+        }
+        Err(e) => {
+            log!("Warning: discarding texture cache entry {:?}: {}", path, e);
+            cache.stats.misses += 1;
+            cache.remove(key.hash);
+            None
+        }
+    }
+}
+
+/// Add a result to the cache. `values` are returned by [lookup] along with the
+/// data.
+pub fn insert(key: &Key, values: [u32; 2], data: &[u8]) {
+    let mut guard = CACHE.lock().unwrap();
+    let Some(cache) = guard.as_mut() else {
+        return;
+    };
+    let size = (HEADER_SIZE + data.len()) as u64;
+    if size > cache.size_limit {
+        return;
+    }
+    cache.evict(size);
+
+    let mut header = [0u8; HEADER_SIZE];
+    header[0..4].copy_from_slice(&MAGIC);
+    header[4..8].copy_from_slice(&VERSION.to_le_bytes());
+    header[8..12].copy_from_slice(&(key.kind as u32).to_le_bytes());
+    header[12..16].copy_from_slice(&values[0].to_le_bytes());
+    header[16..20].copy_from_slice(&values[1].to_le_bytes());
+    header[24..32].copy_from_slice(&(data.len() as u64).to_le_bytes());
+
+    // Write to a temporary file first so that a crash can't leave a truncated
+    // entry behind.
+    let path = cache.path_for(key.hash);
+    let temp_path = path.with_extension("tmp");
+    let res = (|| {
+        use std::io::Write;
+        let mut file = std::fs::File::create(&temp_path)?;
+        file.write_all(&header)?;
+        file.write_all(data)?;
+        drop(file);
+        std::fs::rename(&temp_path, &path)
+    })();
+    if let Err(e) = res {
+        log!(
+            "Warning: couldn't write texture cache entry {:?}: {}",
+            path,
+            e
+        );
+        let _ = std::fs::remove_file(&temp_path);
+        return;
+    }
+    cache.entries.insert(
+        key.hash,
+        Entry {
+            size,
+            last_used: SystemTime::now(),
+        },
+    );
+    cache.stats.size += size;
+}
+
+impl TextureCache {
+    fn path_for(&self, hash: u64) -> PathBuf {
+        self.dir.join(format!("{:016x}.tex", hash))
+    }
+
+    fn remove(&mut self, hash: u64) {
+        if let Some(entry) = self.entries.remove(&hash) {
+            self.stats.size -= entry.size;
+            let _ = std::fs::remove_file(self.path_for(hash));
+        }
+    }
+
+    /// Delete the least recently used entries until there is room for
+    /// `new_size` more bytes.
+    fn evict(&mut self, new_size: u64) {
+        if self.stats.size + new_size <= self.size_limit {
+            return;
+        }
+        let mut by_age: Vec<(SystemTime, u64)> = self
+            .entries
+            .iter()
+            .map(|(&hash, entry)| (entry.last_used, hash))
+            .collect();
+        by_age.sort_unstable();
+        for (_, hash) in by_age {
+            if self.stats.size + new_size <= self.size_limit {
+                break;
+            }
+            self.remove(hash);
+            self.stats.evictions += 1;
+        }
+    }
+}
+
+fn read_entry(path: &Path, kind: Kind) -> Result<(TextureData, [u32; 2]), String> {
+    use std::io::Read;
+    let mut file = std::fs::File::open(path).map_err(|e| e.to_string())?;
+    let mut header = [0u8; HEADER_SIZE];
+    file.read_exact(&mut header).map_err(|e| e.to_string())?;
+    let u32_at = |i: usize| u32::from_le_bytes(header[i..i + 4].try_into().unwrap());
+    if header[0..4] != MAGIC || u32_at(4) != VERSION || u32_at(8) != kind as u32 {
+        return Err("wrong format".to_string());
+    }
+    let values = [u32_at(12), u32_at(16)];
+    let data_len = u64::from_le_bytes(header[24..32].try_into().unwrap());
+    let file_len = file.metadata().map_err(|e| e.to_string())?.len();
+    if file_len != HEADER_SIZE as u64 + data_len {
+        return Err("wrong size".to_string());
+    }
+
+    #[cfg(unix)]
+    let data = Mapping::new(&file, file_len as usize).ok_or("couldn't map file")?;
+    #[cfg(not(unix))]
+    let data = {
+        let mut data = Vec::with_capacity(data_len as usize);
+        file.read_to_end(&mut data).map_err(|e| e.to_string())?;
+        data
+    };
+    Ok((TextureData::Mapped(data), values))
+}
+
+/// Fast non-cryptographic hash. This must give the same result on every host
+/// and every run, so [std::hash::DefaultHasher] can't be used.
+struct Hasher {
+    lanes: [u64; 4],
+    len: u64,
+}
+impl Hasher {
+    const MULTIPLIER: u64 = 0x9e37_79b9_7f4a_7c15;
+
+    fn new(seed: u64) -> Hasher {
+        Hasher {
+            lanes: [seed, seed ^ 1, seed ^ 2, seed ^ 3]
+                .map(|lane| lane.wrapping_mul(Self::MULTIPLIER)),
+            len: 0,
+        }
+    }
+
+    fn mix(lane: u64, word: u64) -> u64 {
+        (lane ^ word).wrapping_mul(Self::MULTIPLIER).rotate_left(29)
+    }
+
+    fn write_u64(&mut self, word: u64) {
+        self.lanes[0] = Self::mix(self.lanes[0], word);
+        self.len += 8;
+    }
+
+    fn write_bytes(&mut self, bytes: &[u8]) {
+        // Four independent lanes let the multiplications overlap.
+        let mut chunks = bytes.chunks_exact(32);
+        for chunk in &mut chunks {
+            for (i, lane) in self.lanes.iter_mut().enumerate() {
+                let word = u64::from_le_bytes(chunk[i * 8..i * 8 + 8].try_into().unwrap());
+                *lane = Self::mix(*lane, word);
+            }
+        }
+        let mut rest = [0u8; 32];
+        rest[..chunks.remainder().len()].copy_from_slice(chunks.remainder());
+        for (i, lane) in self.lanes.iter_mut().enumerate() {
+            let word = u64::from_le_bytes(rest[i * 8..i * 8 + 8].try_into().unwrap());
+            *lane = Self::mix(*lane, word);
+        }
+        self.len += bytes.len() as u64;
+    }
+
+    fn finish(&self) -> u64 {
+        let mut hash = self.len;
+        for &lane in &self.lanes {
+            hash = Self::mix(hash, lane);
+        }
+        // Final avalanche, from MurmurHash3.
+        hash ^= hash >> 33;
+        hash = hash.wrapping_mul(0xff51_afd7_ed55_8ccd);
+        hash ^= hash >> 33;
+        hash = hash.wrapping_mul(0xc4ce_b9fe_1a85_ec53);
+        hash ^ (hash >> 33)
+    }
+}
+
+#[cfg(test)]
+#[test]
+fn test_hash_is_sensitive() {
+    let input: Vec<u8> = (0..100u32).map(|i| (i * 7) as u8).collect();
+    let base = hash(Kind::PvrtcToRgba, &[0, 8, 8], &input);
+    // The hash must not change between runs or hosts.
+    assert_eq!(base, 0xac83_84b9_df15_ed5d);
+    assert_ne!(base, hash(Kind::PvrtcToBc, &[0, 8, 8], &input));
+    assert_ne!(base, hash(Kind::PvrtcToRgba, &[1, 8, 8], &input));
+    assert_ne!(base, hash(Kind::PvrtcToRgba, &[0, 8, 8], &input[..99]));
+    let mut changed = input.clone();
+    changed[98] ^= 1;
+    assert_ne!(base, hash(Kind::PvrtcToRgba, &[0, 8, 8], &changed));
+}
@@ -50,6 +50,7 @@ mod objc;
 mod options;
 mod paths;
 mod stack;
+mod trace;
 mod window;
 
 // Environment is used very frequently used and used to be in this module, so
@@ -12,6 +12,7 @@ use crate::Environment;
 use std::io::Write;
 
 pub const EPERM: i32 = 1;
+pub const ESRCH: i32 = 3;
 pub const EBADF: i32 = 9;
 pub const EDEADLK: i32 = 11;
 pub const EBUSY: i32 = 16;
@@ -23,15 +24,16 @@ pub struct State {
     errnos: std::collections::HashMap<crate::ThreadId, MutPtr<i32>>,
 }
 impl State {
-    fn errno_ptr_for_thread(
-        &mut self,
-        mem: &mut crate::mem::Mem,
-        thread: crate::ThreadId,
-    ) -> MutPtr<i32> {
-        *self
-            .errnos
-            .entry(thread)
-            .or_insert_with(|| mem.alloc_and_write(0i32))
+    /// Allocate `errno` for a new thread. This is done when the thread is
+    /// created rather than on first use, so that setting `errno` never
+    /// allocates, which [crate::abi::LeafFunction]s rely on.
+    pub fn init_for_thread(&mut self, mem: &mut crate::mem::Mem, thread: crate::ThreadId) {
+        let ptr = mem.alloc_and_write(0i32);
+        assert!(self.errnos.insert(thread, ptr).is_none());
+    }
+
+    fn errno_ptr_for_thread(&self, thread: crate::ThreadId) -> MutPtr<i32> {
+        self.errnos[&thread]
     }
 
     pub fn set_errno_for_thread(
@@ -40,7 +42,7 @@ impl State {
         thread: crate::ThreadId,
         val: i32,
     ) {
-        let ptr = self.errno_ptr_for_thread(mem, thread);
+        let ptr = self.errno_ptr_for_thread(thread);
         mem.write(ptr, val);
     }
 }
@@ -55,7 +57,7 @@ pub fn set_errno(env: &mut Environment, val: i32) {
 fn __error(env: &mut Environment) -> MutPtr<i32> {
     env.libc_state
         .errno
-        .errno_ptr_for_thread(&mut env.mem, env.current_thread)
+        .errno_ptr_for_thread(env.current_thread)
 }
 
 fn perror(env: &mut Environment, s: ConstPtr<u8>) {
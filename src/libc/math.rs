@@ -5,7 +5,7 @@
  */
 //! `math.h`
 
-use crate::dyld::{export_c_func, FunctionExports};
+use crate::dyld::{export_c_func_leaf, FunctionExports};
 use crate::libc::errno::set_errno;
 use crate::mem::MutPtr;
 use crate::Environment;
@@ -381,71 +381,71 @@ fn fminf(_env: &mut Environment, arg1: f32, arg2: f32) -> f32 {
 }
 
 pub const FUNCTIONS: FunctionExports = &[
-    export_c_func!(abs(_)),
+    export_c_func_leaf!(abs(_)),
     // Trigonometric functions
-    export_c_func!(sin(_)),
-    export_c_func!(sinf(_)),
-    export_c_func!(cos(_)),
-    export_c_func!(cosf(_)),
-    export_c_func!(tan(_)),
-    export_c_func!(tanf(_)),
-    export_c_func!(asin(_)),
-    export_c_func!(asinf(_)),
-    export_c_func!(acos(_)),
-    export_c_func!(acosf(_)),
-    export_c_func!(atan(_)),
-    export_c_func!(atanf(_)),
-    export_c_func!(atan2(_, _)),
-    export_c_func!(atan2f(_, _)),
+    export_c_func_leaf!(sin(_)),
+    export_c_func_leaf!(sinf(_)),
+    export_c_func_leaf!(cos(_)),
+    export_c_func_leaf!(cosf(_)),
+    export_c_func_leaf!(tan(_)),
+    export_c_func_leaf!(tanf(_)),
+    export_c_func_leaf!(asin(_)),
+    export_c_func_leaf!(asinf(_)),
+    export_c_func_leaf!(acos(_)),
+    export_c_func_leaf!(acosf(_)),
+    export_c_func_leaf!(atan(_)),
+    export_c_func_leaf!(atanf(_)),
+    export_c_func_leaf!(atan2(_, _)),
+    export_c_func_leaf!(atan2f(_, _)),
     // Hyperbolic functions
-    export_c_func!(sinh(_)),
-    export_c_func!(sinhf(_)),
-    export_c_func!(cosh(_)),
-    export_c_func!(coshf(_)),
-    export_c_func!(tanh(_)),
-    export_c_func!(tanhf(_)),
-    export_c_func!(asinh(_)),
-    export_c_func!(asinhf(_)),
-    export_c_func!(acosh(_)),
-    export_c_func!(acoshf(_)),
-    export_c_func!(atanh(_)),
-    export_c_func!(atanhf(_)),
+    export_c_func_leaf!(sinh(_)),
+    export_c_func_leaf!(sinhf(_)),
+    export_c_func_leaf!(cosh(_)),
+    export_c_func_leaf!(coshf(_)),
+    export_c_func_leaf!(tanh(_)),
+    export_c_func_leaf!(tanhf(_)),
+    export_c_func_leaf!(asinh(_)),
+    export_c_func_leaf!(asinhf(_)),
+    export_c_func_leaf!(acosh(_)),
+    export_c_func_leaf!(acoshf(_)),
+    export_c_func_leaf!(atanh(_)),
+    export_c_func_leaf!(atanhf(_)),
     // Exponential and logarithmic functions
-    export_c_func!(log(_)),
-    export_c_func!(logf(_)),
-    export_c_func!(log1p(_)),
-    export_c_func!(log1pf(_)),
-    export_c_func!(log2(_)),
-    export_c_func!(log2f(_)),
-    export_c_func!(log10(_)),
-    export_c_func!(log10f(_)),
-    export_c_func!(exp(_)),
-    export_c_func!(expf(_)),
-    export_c_func!(expm1(_)),
-    export_c_func!(expm1f(_)),
-    export_c_func!(exp2(_)),
-    export_c_func!(exp2f(_)),
+    export_c_func_leaf!(log(_)),
+    export_c_func_leaf!(logf(_)),
+    export_c_func_leaf!(log1p(_)),
+    export_c_func_leaf!(log1pf(_)),
+    export_c_func_leaf!(log2(_)),
+    export_c_func_leaf!(log2f(_)),
+    export_c_func_leaf!(log10(_)),
+    export_c_func_leaf!(log10f(_)),
+    export_c_func_leaf!(exp(_)),
+    export_c_func_leaf!(expf(_)),
+    export_c_func_leaf!(expm1(_)),
+    export_c_func_leaf!(expm1f(_)),
+    export_c_func_leaf!(exp2(_)),
+    export_c_func_leaf!(exp2f(_)),
     // Power functions
-    export_c_func!(pow(_, _)),
-    export_c_func!(powf(_, _)),
-    export_c_func!(sqrt(_)),
-    export_c_func!(sqrtf(_)),
+    export_c_func_leaf!(pow(_, _)),
+    export_c_func_leaf!(powf(_, _)),
+    export_c_func_leaf!(sqrt(_)),
+    export_c_func_leaf!(sqrtf(_)),
     // Nearest integer functions
-    export_c_func!(ceil(_)),
-    export_c_func!(ceilf(_)),
-    export_c_func!(floor(_)),
-    export_c_func!(floorf(_)),
-    export_c_func!(round(_)),
-    export_c_func!(roundf(_)),
-    export_c_func!(trunc(_)),
-    export_c_func!(truncf(_)),
-    export_c_func!(modff(_, _)),
+    export_c_func_leaf!(ceil(_)),
+    export_c_func_leaf!(ceilf(_)),
+    export_c_func_leaf!(floor(_)),
+    export_c_func_leaf!(floorf(_)),
+    export_c_func_leaf!(round(_)),
+    export_c_func_leaf!(roundf(_)),
+    export_c_func_leaf!(trunc(_)),
+    export_c_func_leaf!(truncf(_)),
+    export_c_func_leaf!(modff(_, _)),
     // Remainder functions
-    export_c_func!(fmod(_, _)),
-    export_c_func!(fmodf(_, _)),
+    export_c_func_leaf!(fmod(_, _)),
+    export_c_func_leaf!(fmodf(_, _)),
     // Maximum, minimum and positive difference functions
-    export_c_func!(fmax(_, _)),
-    export_c_func!(fmaxf(_, _)),
-    export_c_func!(fmin(_, _)),
-    export_c_func!(fminf(_, _)),
+    export_c_func_leaf!(fmax(_, _)),
+    export_c_func_leaf!(fmaxf(_, _)),
+    export_c_func_leaf!(fmin(_, _)),
+    export_c_func_leaf!(fminf(_, _)),
 ];
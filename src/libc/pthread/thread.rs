@@ -7,9 +7,10 @@
 
 use crate::abi::GuestFunction;
 use crate::dyld::{export_c_func, FunctionExports};
-use crate::libc::errno::{EDEADLK, EINVAL};
+use crate::environment::quantum;
+use crate::libc::errno::{EDEADLK, EINVAL, ESRCH};
 use crate::libc::mach_host::PAGE_SIZE;
-use crate::mem::{self, ConstPtr, ConstVoidPtr, GuestUSize, MutPtr, MutVoidPtr, SafeRead};
+use crate::mem::{self, ConstPtr, GuestUSize, MutPtr, MutVoidPtr, SafeRead};
 use crate::{Environment, ThreadId};
 use std::collections::HashMap;
 
@@ -258,34 +259,68 @@ fn pthread_mach_thread_np(env: &mut Environment, thread: pthread_t) -> mach_port
     host_object.thread_id.try_into().unwrap()
 }
 
+#[allow(non_camel_case_types)]
+#[derive(Copy, Clone, Debug)]
+#[repr(C, packed)]
+pub struct sched_param {
+    sched_priority: i32,
+    _opaque: [u8; 4],
+}
+unsafe impl SafeRead for sched_param {}
+
+const SCHED_OTHER: i32 = 1;
+
 fn pthread_getschedparam(
-    _env: &mut Environment,
+    env: &mut Environment,
     thread: pthread_t,
-    policy: i32,
-    param: MutVoidPtr,
+    policy: MutPtr<i32>,
+    param: MutPtr<sched_param>,
 ) -> i32 {
-    log_dbg!(
-        "TODO: pthread_getschedparam({:?}, {}, {:?})",
-        thread,
-        policy,
-        param
-    );
-    0
+    let Some(host_object) = State::get(env).threads.get(&thread) else {
+        return ESRCH;
+    };
+    let priority = env.threads[host_object.thread_id].quantum.priority;
+    if !policy.is_null() {
+        env.mem.write(policy, SCHED_OTHER);
+    }
+    if !param.is_null() {
+        env.mem.write(
+            param,
+            sched_param {
+                sched_priority: priority,
+                _opaque: [0; 4],
+            },
+        );
+    }
+    0 // success
 }
 
+/// Only the priority is used, as a hint for the scheduler (see
+/// [crate::environment::quantum]). The policy is ignored.
 fn pthread_setschedparam(
-    _env: &mut Environment,
+    env: &mut Environment,
     thread: pthread_t,
     policy: i32,
-    param: ConstVoidPtr,
+    param: ConstPtr<sched_param>,
 ) -> i32 {
+    let Some(host_object) = State::get(env).threads.get(&thread) else {
+        return ESRCH;
+    };
+    let thread_id = host_object.thread_id;
+    let sched_param { sched_priority, .. } = env.mem.read(param);
     log_dbg!(
-        "TODO: pthread_setschedparam({:?}, {}, {:?})",
+        "pthread_setschedparam({:?}, {}, {:?}): thread {} priority {}",
         thread,
         policy,
-        param
+        param,
+        thread_id,
+        sched_priority
     );
-    0
+    if !(quantum::MIN_PRIORITY..=quantum::MAX_PRIORITY).contains(&sched_priority) {
+        return EINVAL;
+    }
+    env.threads[thread_id].quantum.priority = sched_priority;
+    0 // success
 }
 
 pub const FUNCTIONS: FunctionExports = &[
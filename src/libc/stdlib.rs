@@ -224,6 +224,7 @@ fn exit(env: &mut Environment, exit_code: i32) {
     set_errno(env, 0);
 
     echo!("App called exit(), exiting.");
+    env.save_before_exit();
     std::process::exit(exit_code);
 }
 
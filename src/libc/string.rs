@@ -5,7 +5,7 @@
  */
 //! `string.h`
 
-use crate::dyld::{export_c_func, FunctionExports};
+use crate::dyld::{export_c_func, export_c_func_leaf, FunctionExports};
 use crate::mem::{ConstPtr, ConstVoidPtr, GuestUSize, MutPtr, MutVoidPtr, Ptr};
 use crate::Environment;
 use std::cmp::Ordering;
@@ -235,30 +235,31 @@ fn strlcpy(
 }
 
 pub const FUNCTIONS: FunctionExports = &[
-    export_c_func!(strtok(_, _)),
-    export_c_func!(bzero(_, _)),
+    export_c_func_leaf!(strtok(_, _)),
+    export_c_func_leaf!(bzero(_, _)),
     // Functions shared with wchar.rs
-    export_c_func!(memset(_, _, _)),
-    export_c_func!(memcpy(_, _, _)),
-    export_c_func!(memmove(_, _, _)),
-    export_c_func!(memchr(_, _, _)),
-    export_c_func!(memcmp(_, _, _)),
-    export_c_func!(strlen(_)),
-    export_c_func!(strcpy(_, _)),
-    export_c_func!(__strcpy_chk(_, _, _)),
-    export_c_func!(strcat(_, _)),
-    export_c_func!(strcspn(_, _)),
-    export_c_func!(__strcat_chk(_, _, _)),
-    export_c_func!(strncpy(_, _, _)),
-    export_c_func!(strsep(_, _)),
+    export_c_func_leaf!(memset(_, _, _)),
+    export_c_func_leaf!(memcpy(_, _, _)),
+    export_c_func_leaf!(memmove(_, _, _)),
+    export_c_func_leaf!(memchr(_, _, _)),
+    export_c_func_leaf!(memcmp(_, _, _)),
+    export_c_func_leaf!(strlen(_)),
+    export_c_func_leaf!(strcpy(_, _)),
+    export_c_func_leaf!(__strcpy_chk(_, _, _)),
+    export_c_func_leaf!(strcat(_, _)),
+    export_c_func_leaf!(strcspn(_, _)),
+    export_c_func_leaf!(__strcat_chk(_, _, _)),
+    export_c_func_leaf!(strncpy(_, _, _)),
+    export_c_func_leaf!(strsep(_, _)),
+    // Not a leaf: it allocates.
     export_c_func!(strdup(_)),
-    export_c_func!(strcmp(_, _)),
-    export_c_func!(strncmp(_, _, _)),
-    export_c_func!(strcasecmp(_, _)),
-    export_c_func!(strncasecmp(_, _, _)),
-    export_c_func!(strncat(_, _, _)),
-    export_c_func!(strstr(_, _)),
-    export_c_func!(strchr(_, _)),
-    export_c_func!(strrchr(_, _)),
-    export_c_func!(strlcpy(_, _, _)),
+    export_c_func_leaf!(strcmp(_, _)),
+    export_c_func_leaf!(strncmp(_, _, _)),
+    export_c_func_leaf!(strcasecmp(_, _)),
+    export_c_func_leaf!(strncasecmp(_, _, _)),
+    export_c_func_leaf!(strncat(_, _, _)),
+    export_c_func_leaf!(strstr(_, _)),
+    export_c_func_leaf!(strchr(_, _)),
+    export_c_func_leaf!(strrchr(_, _)),
+    export_c_func_leaf!(strlcpy(_, _, _)),
 ];
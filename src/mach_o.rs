@@ -46,11 +46,20 @@ pub struct MachO {
     /// can look things up quickly. Thumb function symbols always have the Thumb
     /// bit set.
     pub exported_symbols: HashMap<String, u32>,
+    /// All named symbols defined by the binary, including ones that aren't
+    /// exported, as addresses without the Thumb bit, sorted by address. See
+    /// [Self::symbolize].
+    pub symbols: Vec<(u32, String)>,
     /// List of addresses and names of external relocations for the dynamic
     /// linker to resolve.
     pub external_relocations: Vec<(u32, String)>,
     /// Address/program counter value for the entry point.
     pub entry_point_pc: Option<u32>,
+    /// MD5 digest of the binary (the relevant slice, for a fat binary). This
+    /// identifies it for caches that persist across launches. It's only
+    /// computed if `hash_content` was set when loading, because hashing a
+    /// large binary takes a noticeable amount of time.
+    pub content_hash: Option<[u8; 16]>,
 }
 
 #[derive(Debug)]
@@ -232,11 +241,12 @@ fn cpu_subtype_to_str(ty: cpu_subtype_t) -> &'static str {
 impl MachO {
     /// Load the all the sections from a Mach-O binary (provided as `bytes`)
     /// into the guest memory (`into_mem`), and return a struct containing
-    /// metadata (e.g. symbols).
+    /// metadata (e.g. symbols). See [Self::content_hash] for `hash_content`.
     pub fn load_from_bytes(
         bytes: &[u8],
         into_mem: &mut Mem,
         name: String,
+        hash_content: bool,
     ) -> Result<MachO, &'static str> {
         log_dbg!("Reading {:?}", name);
 
@@ -265,7 +275,7 @@ impl MachO {
                     }
                 }
                 return if let Some(subslice) = best_subslice {
-                    MachO::load_from_bytes(subslice, into_mem, name)
+                    MachO::load_from_bytes(subslice, into_mem, name, hash_content)
                 } else {
                     Err("No supported architecture in the fat binary")
                 };
@@ -306,6 +316,7 @@ impl MachO {
         // Info used for the result
         let mut dynamic_libraries = Vec::new();
         let mut exported_symbols = HashMap::new();
+        let mut symbols = Vec::new();
         let mut indirect_undef_symbols: Vec<Option<String>> = Vec::new();
         let mut external_relocations: Vec<(u32, String)> = Vec::new();
         let mut entry_point_pc: Option<u32> = None;
@@ -397,6 +408,15 @@ impl MachO {
                             if let Symbol::Debug { .. } = symbol {
                                 continue;
                             }
+                            if let Symbol::Defined {
+                                name: Some(name),
+                                entry,
+                                ..
+                            } = symbol
+                            {
+                                let entry: u32 = entry.try_into().unwrap();
+                                symbols.push((entry & !GuestFunction::THUMB_BIT, name.to_string()));
+                            }
                             if let Symbol::Defined {
                                 name: Some(name),
                                 external: true,
@@ -606,33 +626,58 @@ impl MachO {
             })
             .collect();
 
+        symbols.sort();
+
         Ok(MachO {
             name,
             dynamic_libraries,
             sections,
             exported_symbols,
+            symbols,
             external_relocations,
             entry_point_pc,
+            content_hash: hash_content.then(|| md5::compute(bytes).0),
         })
     }
 
     /// Load the all the sections from a Mach-O binary (from `path`) into the
     /// guest memory (`into_mem`), and return a struct containing metadata
-    /// (e.g. symbols).
+    /// (e.g. symbols). See [Self::content_hash] for `hash_content`.
     pub fn load_from_file<P: AsRef<GuestPath>>(
         path: P,
         fs: &Fs,
         into_mem: &mut Mem,
+        hash_content: bool,
     ) -> Result<MachO, &'static str> {
         let name = path.as_ref().file_name().unwrap().to_string();
         Self::load_from_bytes(
-            &fs.read(path.as_ref())
+            &fs.read_mapped(path.as_ref())
                 .map_err(|_| "Could not read executable file")?,
             into_mem,
             name,
+            hash_content,
         )
     }
 
+    /// Find the name of the function containing an address, if it's in this
+    /// binary. This assumes the function is the nearest symbol before the
+    /// address, which may be wrong if the binary is stripped.
+    pub fn symbolize(&self, addr: u32) -> Option<&str> {
+        let addr = addr & !GuestFunction::THUMB_BIT;
+        let in_binary = self
+            .sections
+            .iter()
+            .any(|section| (section.addr..section.addr + section.size).contains(&addr));
+        if !in_binary {
+            return None;
+        }
+        let idx = self
+            .symbols
+            .partition_point(|&(sym_addr, _)| sym_addr <= addr);
+        let (_, name) = self.symbols.get(idx.checked_sub(1)?)?;
+        Some(name)
+    }
+
     /// Get a section by its name (`&str`) or type ([SectionType]).
     pub fn get_section<P: SectionPredicate>(&self, by: P) -> Option<&Section> {
         self.sections.iter().find(|section| by.test(section))
@@ -17,6 +17,7 @@
 use crate::libc::wchar::wchar_t;
 
 mod allocator;
+mod host_memory;
 
 /// Equivalent of `usize` for guest memory.
 pub type GuestUSize = u32;
@@ -210,7 +211,7 @@ pub struct Mem {
     /// This array is 4GiB in size so that it can cover the entire 32-bit
     /// virtual address space, but it should not use that much physical memory,
     /// assuming that the host OS backs it with lazily-allocated pages and we
-    /// are careful to avoid accessing most of it.
+    /// are careful to avoid accessing most of it. See [host_memory].
     ///
     /// iPhone OS devices only had 128MiB or 256MiB of RAM total, with no swap
     /// space, so less than 6.25% of this array should be used, assuming no
@@ -237,14 +238,17 @@ pub struct Mem {
     /// range.
     null_segment_size: VAddr,
 
+    /// Whether the null segment is also protected on the host, so that direct
+    /// accesses to it fault. This is what makes fastmem safe to use.
+    null_segment_protected: bool,
+
     allocator: allocator::Allocator,
 }
 
 impl Drop for Mem {
     fn drop(&mut self) {
-        let layout = std::alloc::Layout::new::<Bytes>();
         unsafe {
-            std::alloc::dealloc(self.bytes as *mut _, layout);
+            host_memory::release(self.bytes.cast(), std::mem::size_of::<Bytes>());
         }
     }
 }
@@ -265,33 +269,43 @@ impl Mem {
 
     /// Create a fresh instance of guest memory.
     pub fn new() -> Mem {
-        // This will hopefully get the host OS to lazily allocate the memory.
-        let layout = std::alloc::Layout::new::<Bytes>();
-        let bytes = unsafe { std::alloc::alloc_zeroed(layout) as *mut Bytes };
+        let bytes = unsafe { host_memory::reserve(std::mem::size_of::<Bytes>()).cast() };
 
         let allocator = allocator::Allocator::new();
 
         Mem {
             bytes,
             null_segment_size: 0,
+            null_segment_protected: false,
             allocator,
         }
     }
 
     /// Take an existing instance of [Mem], but free and zero all the
-    /// allocations so it's "like new".
+    /// allocations so it's "like new". The memory stays at the same address.
     ///
-    /// Note that, since there is no protection against writing outside an
-    /// allocation, there might be stray bytes preserved in the result.
+    /// Where possible, this replaces all of guest memory with fresh memory
+    /// from the host OS (see [host_memory::reset]), which is fast no matter how
+    /// much was in use and gives it back to the host OS. Otherwise, each
+    /// allocation is zeroed, and since there is no protection against writing
+    /// outside an allocation, there might be stray bytes preserved in the
+    /// result.
     pub fn refurbish(mut mem: Mem) -> Mem {
+        // The null segment is one of the used chunks, so it must be writable
+        // again before zeroing.
+        mem.unprotect_null_segment();
         let Mem {
             bytes: _,
             null_segment_size: _,
+            null_segment_protected: _,
             ref mut allocator,
         } = mem;
         let used_chunks = allocator.reset_and_drain_used_chunks();
-        for allocator::Chunk { base, size } in used_chunks {
-            mem.bytes_mut()[base as usize..][..size.get() as usize].fill(0);
+        let reset = unsafe { host_memory::reset(mem.bytes.cast(), std::mem::size_of::<Bytes>()) };
+        if !reset {
+            for allocator::Chunk { base, size } in used_chunks {
+                mem.bytes_mut()[base as usize..][..size.get() as usize].fill(0);
+            }
         }
         mem.null_segment_size = 0;
         mem
@@ -311,12 +325,53 @@ impl Mem {
         self.allocator
             .reserve(allocator::Chunk::new(0, new_null_segment_size));
         self.null_segment_size = new_null_segment_size;
+
+        // Nothing should ever legitimately access the null segment, so it can
+        // also be protected on the host. This isn't possible everywhere, e.g.
+        // if the host page size is larger than the segment.
+        if new_null_segment_size != 0 {
+            self.null_segment_protected = unsafe {
+                host_memory::protect(
+                    self.bytes.cast(),
+                    new_null_segment_size as usize,
+                    host_memory::Protection::NoAccess,
+                )
+            };
+            log_dbg!(
+                "Null segment ({:#x} bytes) protected on host: {}",
+                new_null_segment_size,
+                self.null_segment_protected
+            );
+        }
+    }
+
+    fn unprotect_null_segment(&mut self) {
+        if !self.null_segment_protected {
+            return;
+        }
+        let res = unsafe {
+            host_memory::protect(
+                self.bytes.cast(),
+                self.null_segment_size as usize,
+                host_memory::Protection::ReadWrite,
+            )
+        };
+        assert!(res);
+        self.null_segment_protected = false;
     }
 
     pub fn null_segment_size(&self) -> VAddr {
         self.null_segment_size
     }
 
+    /// Whether it is safe for the CPU to use fastmem, i.e. to access all of
+    /// guest memory directly and rely on host page faults to catch null
+    /// pointer accesses. If this returns [false], the CPU must use a page table
+    /// that excludes the null segment instead.
+    pub fn supports_fastmem(&self) -> bool {
+        self.null_segment_size == 0 || self.null_segment_protected
+    }
+
     /// Get a pointer to the full 4GiB of memory. This is only for use when
     /// setting up the CPU, never call this otherwise.
     ///
@@ -503,6 +558,14 @@ impl Mem {
 
     /// C-style `memmove`.
     pub fn memmove(&mut self, dest: MutVoidPtr, src: ConstVoidPtr, size: GuestUSize) {
+        // The null segment may be protected on the host, so this check is
+        // needed to get a panic rather than a host crash.
+        if src.to_bits() < self.null_segment_size {
+            Self::null_check_fail(src.to_bits(), size)
+        }
+        if dest.to_bits() < self.null_segment_size {
+            Self::null_check_fail(dest.to_bits(), size)
+        }
         let src = src.to_bits() as usize;
         let dest = dest.to_bits() as usize;
         let size = size as usize;
@@ -536,10 +599,41 @@ impl Mem {
     /// Free an allocation made with one of the `alloc` methods on this type.
     pub fn free(&mut self, ptr: MutVoidPtr) {
         let size = self.allocator.free(ptr.to_bits());
-        self.bytes_at_mut(ptr.cast(), size).fill(0);
+        self.zero_freed(ptr, size);
         log_dbg!("Freed {:?} ({:#x} bytes)", ptr, size);
     }
 
+    /// Size below which [Self::zero_freed] always zeroes memory itself. Giving
+    /// pages back is a system call, and the next write to each page faults, so
+    /// for small chunks it is slower than zeroing them, especially as apps
+    /// often free and reuse small allocations in quick succession.
+    const MIN_DISCARD_SIZE: GuestUSize = 64 * 1024;
+
+    /// Zero a chunk that has just been freed. Where possible, the whole host
+    /// pages in a large chunk are given back to the host OS instead (see
+    /// [host_memory::discard]), so freeing a large allocation is fast and
+    /// reduces memory usage.
+    fn zero_freed(&mut self, ptr: MutVoidPtr, size: GuestUSize) {
+        let bytes = self.bytes_at_mut(ptr.cast(), size);
+        if size < Self::MIN_DISCARD_SIZE {
+            bytes.fill(0);
+            return;
+        }
+        let page_size = host_memory::page_size();
+        let start = bytes.as_mut_ptr() as usize;
+        let end = start + bytes.len();
+        let pages_start = start.next_multiple_of(page_size);
+        let pages_end = end / page_size * page_size;
+        if pages_end > pages_start
+            && unsafe { host_memory::discard(pages_start as *mut u8, pages_end - pages_start) }
+        {
+            bytes[..pages_start - start].fill(0);
+            bytes[pages_end - start..].fill(0);
+        } else {
+            bytes.fill(0);
+        }
+    }
+
     /// Allocate memory large enough for a value of type `T` and write the value
     /// to it. Equivalent to [Self::alloc] + [Self::write].
     pub fn alloc_and_write<T>(&mut self, value: T) -> MutPtr<T>
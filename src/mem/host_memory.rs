@@ -0,0 +1,153 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Host OS virtual memory primitives used to back guest memory.
+//!
+//! On POSIX hosts, guest memory is an anonymous mapping owned by touchHLE, so
+//! that parts of it can be protected. This is used to trap accesses to the null
+//! segment even when the CPU accesses guest memory directly (fastmem). It also
+//! means memory that is no longer needed can be zeroed by giving it back to the
+//! host OS, which is much faster than writing zeroes and reduces memory usage.
+//!
+//! On other hosts, guest memory comes from the Rust allocator and protection is
+//! not available, so [protect] always fails.
+
+/// Access permissions that can be applied to a range of guest memory.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum Protection {
+    NoAccess,
+    ReadWrite,
+}
+
+/// Reserve a zero-initialized, readable and writable region of host memory of
+/// the given size. The host OS is expected to lazily allocate the pages.
+#[cfg(unix)]
+pub unsafe fn reserve(size: usize) -> *mut u8 {
+    let ptr = libc::mmap(
+        std::ptr::null_mut(),
+        size,
+        libc::PROT_READ | libc::PROT_WRITE,
+        map_flags(),
+        -1,
+        0,
+    );
+    assert!(
+        ptr != libc::MAP_FAILED,
+        "Could not reserve {:#x} bytes of host memory for guest memory",
+        size
+    );
+    ptr.cast()
+}
+#[cfg(unix)]
+fn map_flags() -> libc::c_int {
+    // MAP_NORESERVE avoids Linux's overcommit heuristics refusing a 4GiB
+    // mapping on systems with little RAM. Other systems never reserve swap for
+    // anonymous mappings.
+    #[cfg(any(target_os = "linux", target_os = "android"))]
+    let flags = libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_NORESERVE;
+    #[cfg(not(any(target_os = "linux", target_os = "android")))]
+    let flags = libc::MAP_PRIVATE | libc::MAP_ANONYMOUS;
+    flags
+}
+#[cfg(not(unix))]
+pub unsafe fn reserve(size: usize) -> *mut u8 {
+    let layout = std::alloc::Layout::from_size_align(size, 0x1000).unwrap();
+    let ptr = std::alloc::alloc_zeroed(layout);
+    assert!(!ptr.is_null());
+    ptr
+}
+
+/// Release a region obtained from [reserve].
+#[cfg(unix)]
+pub unsafe fn release(ptr: *mut u8, size: usize) {
+    let res = libc::munmap(ptr.cast(), size);
+    assert!(res == 0);
+}
+#[cfg(not(unix))]
+pub unsafe fn release(ptr: *mut u8, size: usize) {
+    let layout = std::alloc::Layout::from_size_align(size, 0x1000).unwrap();
+    std::alloc::dealloc(ptr, layout);
+}
+
+/// The host's page size. Protection can only be changed for whole host pages,
+/// which can be larger than the guest's 4KiB pages (e.g. Apple silicon).
+#[cfg(unix)]
+pub fn page_size() -> usize {
+    let size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) };
+    assert!(size > 0);
+    size as usize
+}
+#[cfg(not(unix))]
+pub fn page_size() -> usize {
+    0x1000
+}
+
+/// Change the protection of a range within a region obtained from [reserve].
+/// Returns [false] if this isn't possible, e.g. because the range is not
+/// aligned to the host's page size, or the host doesn't support it.
+#[cfg(unix)]
+pub unsafe fn protect(ptr: *mut u8, size: usize, protection: Protection) -> bool {
+    let page_size = page_size();
+    if (ptr as usize) % page_size != 0 || size % page_size != 0 {
+        return false;
+    }
+    let prot = match protection {
+        Protection::NoAccess => libc::PROT_NONE,
+        Protection::ReadWrite => libc::PROT_READ | libc::PROT_WRITE,
+    };
+    libc::mprotect(ptr.cast(), size, prot) == 0
+}
+#[cfg(not(unix))]
+pub unsafe fn protect(_ptr: *mut u8, _size: usize, _protection: Protection) -> bool {
+    false
+}
+
+/// Replace a range within a region obtained from [reserve] with fresh
+/// zero-initialized, readable and writable memory, at the same address, giving
+/// the old contents back to the host OS. This takes about the same time
+/// regardless of how much memory was in use. Returns [false] if this isn't
+/// possible, e.g. because the range is not aligned to the host's page size, in
+/// which case the caller must zero the memory itself.
+#[cfg(unix)]
+pub unsafe fn reset(ptr: *mut u8, size: usize) -> bool {
+    let page_size = page_size();
+    if (ptr as usize) % page_size != 0 || size % page_size != 0 {
+        return false;
+    }
+    let res = libc::mmap(
+        ptr.cast(),
+        size,
+        libc::PROT_READ | libc::PROT_WRITE,
+        map_flags() | libc::MAP_FIXED,
+        -1,
+        0,
+    );
+    assert!(res == libc::MAP_FAILED || res == ptr.cast());
+    res != libc::MAP_FAILED
+}
+#[cfg(not(unix))]
+pub unsafe fn reset(_ptr: *mut u8, _size: usize) -> bool {
+    false
+}
+
+/// Zero the host pages in a range within a region obtained from [reserve] by
+/// giving them back to the host OS. Unlike [reset], this leaves their
+/// protection unchanged, so that it's safe to use while the CPU relies on it.
+/// Returns [false] if this isn't possible, in which case the caller must zero
+/// the memory itself.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+pub unsafe fn discard(ptr: *mut u8, size: usize) -> bool {
+    let page_size = page_size();
+    if (ptr as usize) % page_size != 0 || size % page_size != 0 {
+        return false;
+    }
+    // For private anonymous mappings, Linux guarantees that the pages read as
+    // zero afterwards. Other systems' equivalents only do so eventually.
+    libc::madvise(ptr.cast(), size, libc::MADV_DONTNEED) == 0
+}
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+pub unsafe fn discard(_ptr: *mut u8, _size: usize) -> bool {
+    false
+}
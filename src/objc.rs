@@ -24,6 +24,7 @@ use std::collections::HashMap;
 
 mod classes;
 mod messages;
+mod method_cache;
 mod methods;
 mod objects;
 mod properties;
@@ -78,6 +79,9 @@ pub struct ObjC {
     /// Type information isn't part of the `objc_msgSend` ABI, so an alternative
     /// channel is needed.
     message_type_info: Option<(std::any::TypeId, &'static str)>,
+
+    /// Cache of method lookups, shared with the CPU.
+    method_cache: method_cache::MethodCache,
 }
 
 impl ObjC {
@@ -88,8 +92,16 @@ impl ObjC {
             classes: HashMap::new(),
             sync_mutexes: HashMap::new(),
             message_type_info: None,
+            method_cache: method_cache::MethodCache::new(),
         }
     }
+
+    /// Pointer to the method cache table, for
+    /// [crate::cpu::Cpu::set_method_cache]. It remains valid for the lifetime
+    /// of this object.
+    pub fn method_cache_ptr(&self) -> *const std::ffi::c_void {
+        self.method_cache.as_ptr()
+    }
 }
 
 pub const FUNCTIONS: FunctionExports = &[
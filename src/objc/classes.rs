@@ -581,6 +581,7 @@ impl ObjC {
         }
 
         self.classes.insert(name.to_string(), class);
+        self.method_cache.flush();
 
         if is_metaclass {
             metaclass
@@ -629,6 +630,7 @@ impl ObjC {
 
             self.classes.insert(name.to_string(), class);
         }
+        self.method_cache.flush();
 
         // Second pass to ensure no superclass has "grown into" any of its
         // subclasses.
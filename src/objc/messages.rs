@@ -116,7 +116,18 @@ Type mismatch when sending message {} to {:?}!
                     }
                     // We can't create a new stack frame, because that would
                     // interfere with pass-through of stack arguments.
-                    IMP::Guest(guest_imp) => guest_imp.call_without_pushing_stack_frame(env),
+                    IMP::Guest(guest_imp) => {
+                        let guest_imp = *guest_imp;
+                        // Let the CPU skip this lookup next time (see
+                        // method_cache.rs). Supercalls aren't cached because
+                        // they use a different lookup.
+                        if super2.is_none() {
+                            env.objc
+                                .method_cache
+                                .insert(orig_class, selector, guest_imp);
+                        }
+                        guest_imp.call_without_pushing_stack_frame(env)
+                    }
                 }
                 return;
             } else {
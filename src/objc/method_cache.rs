@@ -0,0 +1,76 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Cache of method lookups that is shared with the CPU.
+//!
+//! `objc_msgSend` is the most frequently called host function by far. Looking
+//! up a method means walking the superclass chain with a hash map lookup at
+//! each step, and in any case, calling a host function means halting CPU
+//! execution. To avoid both costs in the common case, the results of lookups
+//! that found a guest method are cached in a direct-mapped table with a plain C
+//! layout. The dynarmic wrapper (`src/cpu/dynarmic_wrapper/lib.cpp`) reads
+//! this table directly when it encounters the SVC for `objc_msgSend`, and on a
+//! hit, it branches straight to the method without halting.
+//!
+//! The cache is flushed entirely whenever a class is registered or methods are
+//! added, which should be rare after startup.
+
+use super::{Class, SEL};
+use crate::abi::GuestFunction;
+
+/// Keep in sync with `METHOD_CACHE_BITS` in lib.cpp.
+const METHOD_CACHE_BITS: u32 = 12;
+const METHOD_CACHE_SIZE: usize = 1 << METHOD_CACHE_BITS;
+
+/// Keep in sync with `MethodCacheEntry` in lib.cpp.
+#[repr(C)]
+#[derive(Copy, Clone, Default)]
+pub struct MethodCacheEntry {
+    /// Class of the receiver (not necessarily the class the method belongs to).
+    /// Zero if the entry is empty.
+    class: u32,
+    sel: u32,
+    /// Guest method implementation, with the Thumb bit set appropriately.
+    imp: u32,
+}
+
+/// Keep in sync with `method_cache_index` in lib.cpp.
+fn method_cache_index(class: u32, sel: u32) -> usize {
+    let hash = (class ^ sel.rotate_left(16)).wrapping_mul(0x9E3779B1);
+    (hash >> (32 - METHOD_CACHE_BITS)) as usize
+}
+
+pub struct MethodCache {
+    entries: Box<[MethodCacheEntry]>,
+}
+
+impl MethodCache {
+    pub fn new() -> MethodCache {
+        MethodCache {
+            entries: vec![MethodCacheEntry::default(); METHOD_CACHE_SIZE].into_boxed_slice(),
+        }
+    }
+
+    /// Pointer to the table for use by the dynarmic wrapper. It remains valid
+    /// for the lifetime of this object.
+    pub fn as_ptr(&self) -> *const std::ffi::c_void {
+        self.entries.as_ptr().cast()
+    }
+
+    /// Record that sending `sel` to an instance of `class` calls `imp`.
+    pub fn insert(&mut self, class: Class, sel: SEL, imp: GuestFunction) {
+        let class = class.to_bits();
+        let sel = sel.to_bits();
+        self.entries[method_cache_index(class, sel)] = MethodCacheEntry {
+            class,
+            sel,
+            imp: imp.addr_with_thumb_bit(),
+        };
+    }
+
+    pub fn flush(&mut self) {
+        self.entries.fill(MethodCacheEntry::default());
+    }
+}
@@ -138,6 +138,8 @@ impl ClassHostObject {
             let sel = objc.register_bin_selector(name, mem);
             self.methods.insert(sel, IMP::Guest(imp));
         }
+
+        objc.method_cache.flush();
     }
 }
 
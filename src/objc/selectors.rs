@@ -65,6 +65,9 @@ impl SEL {
     pub fn is_null(self) -> bool {
         self.0.is_null()
     }
+    pub fn to_bits(self) -> u32 {
+        self.0.to_bits()
+    }
 }
 
 impl ObjC {
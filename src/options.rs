@@ -5,16 +5,22 @@
  */
 //! Parsing and management of user-configurable options, e.g. for input methods.
 
-use crate::gles::GLESImplementation;
+use crate::cpu::JitProfile;
+use crate::gles::{AsyncTextureDecode, GLESImplementation};
 use crate::window::DeviceOrientation;
 use std::collections::HashMap;
 use std::io::{BufRead, BufReader, Read};
 use std::net::{SocketAddr, ToSocketAddrs};
 use std::num::NonZeroU32;
+use std::path::PathBuf;
 
 pub const OPTIONS_HELP: &str =
     include_str!(concat!(env!("CARGO_MANIFEST_DIR"), "/OPTIONS_HELP.txt"));
 
+/// Size limit for `--texture-cache` if none is given. Keep in sync with
+/// OPTIONS_HELP.txt.
+const DEFAULT_TEXTURE_CACHE_SIZE: u64 = 512 * 1024 * 1024;
+
 /// Game controller button for `--button-to-touch=` option.
 #[derive(Copy, Clone, Hash, PartialEq, Eq, Debug)]
 pub enum Button {
@@ -43,7 +49,26 @@ pub struct Options {
     pub button_to_touch: HashMap<Button, (f32, f32)>,
     pub stabilize_virtual_cursor: Option<(f32, f32)>,
     pub gles1_implementation: Option<GLESImplementation>,
+    pub keep_textures_compressed: bool,
+    pub async_texture_decode: Option<AsyncTextureDecode>,
+    /// Size limit in bytes, if enabled.
+    pub texture_cache: Option<u64>,
     pub direct_memory_access: bool,
+    pub fastmem: bool,
+    pub track_code_writes: bool,
+    pub jit_profile: JitProfile,
+    /// Size of the JIT's code cache in bytes, if not the default.
+    pub jit_code_cache: Option<u32>,
+    pub jit_warm_up: bool,
+    pub eager_linking: bool,
+    pub wall_clock_preemption: bool,
+    pub jit_stats: bool,
+    pub profile_path: Option<PathBuf>,
+    pub trace_path: Option<PathBuf>,
+    /// Number of frames for `--benchmark=`.
+    pub benchmark_frames: Option<u32>,
+    pub benchmark_input_path: Option<PathBuf>,
+    pub benchmark_output_path: Option<PathBuf>,
     pub gdb_listen_addrs: Option<Vec<SocketAddr>>,
     pub preferred_languages: Option<Vec<String>>,
     pub headless: bool,
@@ -65,7 +90,23 @@ impl Default for Options {
             button_to_touch: HashMap::new(),
             stabilize_virtual_cursor: None,
             gles1_implementation: None,
+            keep_textures_compressed: false,
+            async_texture_decode: None,
+            texture_cache: None,
             direct_memory_access: true,
+            fastmem: true,
+            track_code_writes: false,
+            jit_profile: JitProfile::Debug,
+            jit_code_cache: None,
+            jit_warm_up: false,
+            eager_linking: false,
+            wall_clock_preemption: false,
+            jit_stats: false,
+            profile_path: None,
+            trace_path: None,
+            benchmark_frames: None,
+            benchmark_input_path: None,
+            benchmark_output_path: None,
             gdb_listen_addrs: None,
             preferred_languages: None,
             headless: false,
@@ -161,8 +202,59 @@ impl Options {
                 GLESImplementation::from_short_name(value)
                     .map_err(|_| "Unrecognized --gles1= value".to_string())?,
             );
+        } else if arg == "--keep-textures-compressed" {
+            self.keep_textures_compressed = true;
+        } else if let Some(value) = arg.strip_prefix("--async-texture-decode=") {
+            self.async_texture_decode = Some(
+                AsyncTextureDecode::from_short_name(value)
+                    .map_err(|_| "Unrecognized --async-texture-decode= value".to_string())?,
+            );
+        } else if arg == "--texture-cache" {
+            self.texture_cache = Some(DEFAULT_TEXTURE_CACHE_SIZE);
+        } else if let Some(value) = arg.strip_prefix("--texture-cache=") {
+            let mib: u64 = value
+                .parse()
+                .map_err(|_| "Invalid value for --texture-cache=".to_string())?;
+            self.texture_cache = Some(mib * 1024 * 1024);
         } else if arg == "--disable-direct-memory-access" {
             self.direct_memory_access = false;
+        } else if arg == "--disable-fastmem" {
+            self.fastmem = false;
+        } else if arg == "--track-code-writes" {
+            self.track_code_writes = true;
+        } else if let Some(value) = arg.strip_prefix("--jit-profile=") {
+            self.jit_profile = JitProfile::from_short_name(value)
+                .map_err(|_| "Unrecognized --jit-profile= value".to_string())?;
+        } else if let Some(value) = arg.strip_prefix("--jit-code-cache=") {
+            let mib: u32 = value
+                .parse()
+                .ok()
+                .filter(|&mib| (1..4096).contains(&mib))
+                .ok_or_else(|| "Invalid value for --jit-code-cache=".to_string())?;
+            self.jit_code_cache = Some(mib * 1024 * 1024);
+        } else if arg == "--jit-warm-up" {
+            self.jit_warm_up = true;
+        } else if arg == "--eager-linking" {
+            self.eager_linking = true;
+        } else if arg == "--wall-clock-preemption" {
+            self.wall_clock_preemption = true;
+        } else if arg == "--jit-stats" {
+            self.jit_stats = true;
+        } else if let Some(value) = arg.strip_prefix("--profile=") {
+            self.profile_path = Some(PathBuf::from(value));
+        } else if let Some(value) = arg.strip_prefix("--trace=") {
+            self.trace_path = Some(PathBuf::from(value));
+        } else if let Some(value) = arg.strip_prefix("--benchmark=") {
+            let frames: u32 = value
+                .parse()
+                .ok()
+                .filter(|&frames| frames >= 2)
+                .ok_or_else(|| "Invalid value for --benchmark=".to_string())?;
+            self.benchmark_frames = Some(frames);
+        } else if let Some(value) = arg.strip_prefix("--benchmark-input=") {
+            self.benchmark_input_path = Some(PathBuf::from(value));
+        } else if let Some(value) = arg.strip_prefix("--benchmark-output=") {
+            self.benchmark_output_path = Some(PathBuf::from(value));
         } else if let Some(address) = arg.strip_prefix("--gdb=") {
             let addrs = address
                 .to_socket_addrs()
@@ -15,8 +15,8 @@
 //!   [USER_OPTIONS_FILE], [WALLPAPER_FILES]. These are ordinary files and are
 //!   found in [user_data_base_path].
 //! * Files that touchHLE will create and modify, and the user may modify if
-//!   they want to: [SANDBOX_DIR]. These are ordinary files and are found in
-//!   [user_data_base_path].
+//!   they want to: [SANDBOX_DIR], [JIT_PROFILES_DIR], [TEXTURE_CACHE_DIR].
+//!   These are ordinary files and are found in [user_data_base_path].
 //!
 //! See also [crate::fs], which provides a virtual filesystem for the guest app
 //! and defines path types.
@@ -88,6 +88,14 @@ pub const WALLPAPER_FILES: &[&str] = &[
 /// the `Documents` directory.
 pub const SANDBOX_DIR: &str = "touchHLE_sandbox";
 
+/// Name of the directory where touchHLE will store JIT warm-up profiles (see
+/// `--jit-warm-up`).
+pub const JIT_PROFILES_DIR: &str = "touchHLE_jit_profiles";
+
+/// Name of the directory where touchHLE will cache decoded textures (see
+/// `--texture-cache`).
+pub const TEXTURE_CACHE_DIR: &str = "touchHLE_texture_cache";
+
 /// Get a platform-specific base path needed for accessing touchHLE's
 /// user-modifiable files. This is empty on platforms other than Android.
 pub fn user_data_base_path() -> &'static Path {
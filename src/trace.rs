@@ -0,0 +1,309 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! Timeline of events (`--trace=`), for diagnosing problems like uneven frame
+//! pacing that aggregate statistics can't explain.
+//!
+//! Events are recorded for:
+//!
+//! - each slice a guest thread runs for (see [crate::environment::quantum]),
+//! - the time a guest thread spends blocked, and why,
+//! - contended mutexes,
+//! - host functions called from the guest (other than leaf functions, which
+//!   are too frequent),
+//! - presenting frames and polling for events.
+//!
+//! The output is in the JSON array variant of the Chrome trace event format,
+//! which can be opened with <https://ui.perfetto.dev/> or `chrome://tracing`.
+//! Each guest thread has its own track, and host events are put on the track
+//! of the guest thread they happened on.
+//!
+//! Recording an event only appends it to a buffer. A background thread writes
+//! the buffer to the file a few times per second, so the file is mostly
+//! complete even if touchHLE exits abruptly. The array format allows the file
+//! to end without a closing bracket for this reason.
+
+use std::borrow::Cow;
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::io::Write as _;
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+/// How often the background thread writes events to the file.
+const FLUSH_INTERVAL: Duration = Duration::from_millis(250);
+/// If the background thread falls this far behind, events are dropped rather
+/// than using ever more memory.
+const MAX_BUFFERED_EVENTS: usize = 1 << 20;
+
+struct Event {
+    /// Chrome trace event phase: `X` for complete events (with a duration),
+    /// `i` for instant events.
+    phase: char,
+    category: &'static str,
+    name: Cow<'static, str>,
+    thread: usize,
+    start: Instant,
+    duration: Option<Duration>,
+    /// JSON object, if there are any arguments.
+    args: Option<String>,
+}
+
+struct Tracer {
+    events: Vec<Event>,
+    dropped: u64,
+    current_thread: usize,
+    /// Threads that are blocked, with when they became blocked and why.
+    blocked: HashMap<usize, (Instant, String)>,
+}
+
+impl Tracer {
+    fn push(&mut self, event: Event) {
+        if self.events.len() < MAX_BUFFERED_EVENTS {
+            self.events.push(event);
+        } else {
+            self.dropped += 1;
+        }
+    }
+}
+
+/// This is checked before doing anything else, so that tracing costs almost
+/// nothing when it's disabled.
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static TRACER: Mutex<Option<Tracer>> = Mutex::new(None);
+
+/// Start tracing, writing the events to the file at `path`.
+pub fn init(path: &Path) {
+    let mut file = match std::fs::File::create(path) {
+        Ok(file) => std::io::BufWriter::new(file),
+        Err(e) => {
+            log!("Warning: couldn't create trace file {:?}: {}", path, e);
+            return;
+        }
+    };
+    let start = Instant::now();
+    *TRACER.lock().unwrap() = Some(Tracer {
+        events: Vec::new(),
+        dropped: 0,
+        current_thread: 0,
+        blocked: HashMap::new(),
+    });
+    ENABLED.store(true, Ordering::Relaxed);
+    log!("Tracing enabled, events will be written to {:?}", path);
+
+    let path = path.to_owned();
+    std::thread::Builder::new()
+        .name("touchHLE trace writer".to_string())
+        .spawn(move || {
+            let mut named_threads = Vec::new();
+            let mut text = String::from("[\n");
+            loop {
+                std::thread::sleep(FLUSH_INTERVAL);
+                let (events, dropped) = {
+                    let mut tracer = TRACER.lock().unwrap();
+                    let tracer = tracer.as_mut().unwrap();
+                    (
+                        std::mem::take(&mut tracer.events),
+                        std::mem::take(&mut tracer.dropped),
+                    )
+                };
+                for event in events {
+                    if !named_threads.contains(&event.thread) {
+                        named_threads.push(event.thread);
+                        write_thread_name(&mut text, event.thread);
+                    }
+                    write_event(&mut text, start, &event);
+                }
+                if dropped != 0 {
+                    let event = Event {
+                        phase: 'i',
+                        category: "trace",
+                        name: format!("{} events dropped", dropped).into(),
+                        thread: 0,
+                        start: Instant::now(),
+                        duration: None,
+                        args: None,
+                    };
+                    write_event(&mut text, start, &event);
+                }
+                if text.is_empty() {
+                    continue;
+                }
+                let res = file.write_all(text.as_bytes()).and_then(|_| file.flush());
+                if let Err(e) = res {
+                    log!("Warning: couldn't write to trace file {:?}: {}", path, e);
+                    ENABLED.store(false, Ordering::Relaxed);
+                    return;
+                }
+                text.clear();
+            }
+        })
+        .unwrap();
+}
+
+fn write_json_string(text: &mut String, string: &str) {
+    text.push('"');
+    for c in string.chars() {
+        match c {
+            '"' => text.push_str("\\\""),
+            '\\' => text.push_str("\\\\"),
+            c if c.is_control() => write!(text, "\\u{:04x}", c as u32).unwrap(),
+            c => text.push(c),
+        }
+    }
+    text.push('"');
+}
+
+fn write_thread_name(text: &mut String, thread: usize) {
+    let name = if thread == 0 {
+        "Main thread".to_string()
+    } else {
+        format!("Thread {}", thread)
+    };
+    write!(
+        text,
+        "{{\"ph\":\"M\",\"pid\":1,\"tid\":{},\"name\":\"thread_name\",\"args\":{{\"name\":",
+        thread
+    )
+    .unwrap();
+    write_json_string(text, &name);
+    text.push_str("}},\n");
+}
+
+fn write_event(text: &mut String, trace_start: Instant, event: &Event) {
+    let micros = |duration: Duration| duration.as_nanos() as f64 / 1000.0;
+    write!(
+        text,
+        "{{\"ph\":\"{}\",\"pid\":1,\"tid\":{},\"cat\":\"{}\",\"ts\":{:.3},\"name\":",
+        event.phase,
+        event.thread,
+        event.category,
+        micros(event.start.saturating_duration_since(trace_start)),
+    )
+    .unwrap();
+    write_json_string(text, &event.name);
+    if let Some(duration) = event.duration {
+        write!(text, ",\"dur\":{:.3}", micros(duration)).unwrap();
+    }
+    if event.phase == 'i' {
+        // Instant events are scoped to their thread.
+        text.push_str(",\"s\":\"t\"");
+    }
+    if let Some(ref args) = event.args {
+        write!(text, ",\"args\":{}", args).unwrap();
+    }
+    text.push_str("},\n");
+}
+
+/// Whether tracing is enabled. Callers can check this to avoid preparing
+/// arguments for events that won't be recorded.
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+fn with_tracer<F: FnOnce(&mut Tracer)>(f: F) {
+    if !enabled() {
+        return;
+    }
+    if let Some(tracer) = TRACER.lock().unwrap().as_mut() {
+        f(tracer);
+    }
+}
+
+/// Set which guest thread later events happened on.
+pub fn set_current_thread(thread: usize) {
+    with_tracer(|tracer| tracer.current_thread = thread);
+}
+
+/// Record an event that has already ended, on a particular guest thread.
+pub fn complete(
+    category: &'static str,
+    name: impl Into<Cow<'static, str>>,
+    thread: usize,
+    start: Instant,
+    args: Option<String>,
+) {
+    with_tracer(|tracer| {
+        tracer.push(Event {
+            phase: 'X',
+            category,
+            name: name.into(),
+            thread,
+            start,
+            duration: Some(start.elapsed()),
+            args,
+        })
+    });
+}
+
+/// Record an event without a duration on the current guest thread. `args`
+/// should be a JSON object, if provided.
+pub fn instant(category: &'static str, name: &'static str, args: Option<String>) {
+    with_tracer(|tracer| {
+        tracer.push(Event {
+            phase: 'i',
+            category,
+            name: name.into(),
+            thread: tracer.current_thread,
+            start: Instant::now(),
+            duration: None,
+            args,
+        })
+    });
+}
+
+/// Note that a guest thread has become blocked, for the reason `reason`. An
+/// event is recorded once it's unblocked.
+pub fn thread_blocked(thread: usize, reason: String) {
+    with_tracer(|tracer| {
+        tracer.blocked.insert(thread, (Instant::now(), reason));
+    });
+}
+
+/// Note that a guest thread is no longer blocked, if it was.
+pub fn thread_unblocked(thread: usize) {
+    with_tracer(|tracer| {
+        if let Some((start, reason)) = tracer.blocked.remove(&thread) {
+            tracer.push(Event {
+                phase: 'X',
+                category: "scheduler",
+                name: format!("blocked: {}", reason).into(),
+                thread,
+                start,
+                duration: Some(start.elapsed()),
+                args: None,
+            });
+        }
+    });
+}
+
+/// Record an event lasting until the returned value is dropped, on the current
+/// guest thread.
+#[must_use]
+pub fn span(category: &'static str, name: &'static str) -> Span {
+    Span(enabled().then(|| (category, name, Instant::now())))
+}
+
+pub struct Span(Option<(&'static str, &'static str, Instant)>);
+impl Drop for Span {
+    fn drop(&mut self) {
+        let Some((category, name, start)) = self.0 else {
+            return;
+        };
+        with_tracer(|tracer| {
+            tracer.push(Event {
+                phase: 'X',
+                category,
+                name: name.into(),
+                thread: tracer.current_thread,
+                start,
+                duration: Some(start.elapsed()),
+                args: None,
+            })
+        });
+    }
+}
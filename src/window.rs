@@ -74,6 +74,8 @@ pub enum FingerId {
     Touch(i64),
     VirtualCursor,
     ButtonToTouch(crate::options::Button),
+    /// Touch input from `--benchmark-input=`.
+    Scripted,
 }
 pub type Coords = (f32, f32);
 
@@ -327,7 +329,7 @@ impl Window {
     /// since we often need to defer actually handling them.
     ///
     /// Since polling can be quite expensive, this function will skip it if it
-    /// was called too recently.
+    /// was called too recently (see [Self::last_polled]).
     pub fn poll_for_events(&mut self, options: &Options) {
         let now = Instant::now();
         // poll roughly twice per frame to try to avoid missing frames sometimes
@@ -335,6 +337,7 @@ impl Window {
             return;
         }
         self.last_polled = now;
+        let _span = crate::trace::span("window", "poll_for_events");
 
         fn transform_input_coords(
             window: &Window,
@@ -667,6 +670,17 @@ impl Window {
         }
     }
 
+    /// When events were last polled by [Self::poll_for_events].
+    pub fn last_polled(&self) -> Instant {
+        self.last_polled
+    }
+
+    /// Add an event to the end of the queue, as if it had been polled. This is
+    /// used for scripted input.
+    pub fn push_event(&mut self, event: Event) {
+        self.event_queue.push_back(event);
+    }
+
     /// Pop an event from the queue (in FIFO order, except for high priority
     /// events)
     pub fn pop_event(&mut self) -> Option<Event> {